@@ -0,0 +1,649 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Measure the pure-CPU paths of SNA (blits, damage tracking, the
+ * trapezoid rasterisers and glyph compositing) without requiring either
+ * an X server or a GPU, reporting the results as JSON so that runs can
+ * be compared by script.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+#include "sna_render.h"
+#include "sna_render_inline.h"
+#include "sna_damage.h"
+#include "sna_trapezoids.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+
+static int results;
+
+static double elapsed(const struct timespec *start,
+		      const struct timespec *end)
+{
+	return 1e-9*(end->tv_nsec - start->tv_nsec) +
+		(end->tv_sec - start->tv_sec);
+}
+
+static void report(const char *name, int width, int height, int bpp,
+		   int count, int threads, int loops,
+		   double t, double rate, const char *unit)
+{
+	printf("%s\n  {\"name\": \"%s\", \"width\": %d, \"height\": %d, "
+	       "\"bpp\": %d, \"count\": %d, \"threads\": %d, \"loops\": %d, "
+	       "\"seconds\": %.6f, \"rate\": %.3f, \"unit\": \"%s\"}",
+	       results++ ? "," : "",
+	       name, width, height, bpp, count, threads, loops,
+	       t, rate, unit);
+}
+
+static void run_boxes(const char *name, memcpy_box_func func,
+		      const void *src, void *dst, int bpp,
+		      int32_t src_stride, int32_t dst_stride,
+		      int width, int height, int max_threads, int loops)
+{
+	BoxRec box;
+	int n, i;
+
+	if (func == NULL)
+		return;
+
+	box.x1 = box.y1 = 0;
+	box.x2 = width;
+	box.y2 = height;
+
+	for (n = 1; n <= max_threads; n++) {
+		struct timespec start, end;
+		double t;
+
+		/* warm up the caches and page tables */
+		sna_memcpy_boxes(n, func, src, dst, bpp,
+				 src_stride, dst_stride,
+				 0, 0, 0, 0, &box, 1);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < loops; i++)
+			sna_memcpy_boxes(n, func, src, dst, bpp,
+					 src_stride, dst_stride,
+					 0, 0, 0, 0, &box, 1);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		t = elapsed(&start, &end);
+		report(name, width, height, bpp, 1, n, loops, t,
+		       (double)loops * width * height * bpp / 8 / t / 1e9,
+		       "GB/s");
+	}
+}
+
+static void run_memmove(void *buf, int bpp, int32_t stride,
+			int width, int height, int loops)
+{
+	uint8_t *up = buf, *down = up + stride;
+	struct timespec start, end;
+	BoxRec box;
+	double t;
+	int i;
+
+	/* scroll by a row at a time, alternating direction, as for CopyArea */
+	box.x1 = 0;
+	box.y1 = 0;
+	box.x2 = width;
+	box.y2 = height - 1;
+
+	memmove_box(down, up, bpp, stride, &box, 0, 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < loops; i++) {
+		if (i & 1)
+			memmove_box(down, up, bpp, stride, &box, 0, 1);
+		else
+			memmove_box(up, down, bpp, stride, &box, 0, -1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	t = elapsed(&start, &end);
+	report("memmove_box", width, height - 1, bpp, 1, 1, loops, t,
+	       (double)loops * width * (height - 1) * bpp / 8 / t / 1e9,
+	       "GB/s");
+}
+
+static void run_xor(const void *src, void *dst, int bpp,
+		    int32_t src_stride, int32_t dst_stride,
+		    int width, int height, int loops)
+{
+	struct timespec start, end;
+	double t;
+	int i;
+
+	memcpy_xor(src, dst, bpp, src_stride, dst_stride,
+		   0, 0, 0, 0, width, height, 0xffffffff, 0xff000000);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < loops; i++)
+		memcpy_xor(src, dst, bpp, src_stride, dst_stride,
+			   0, 0, 0, 0, width, height,
+			   0xffffffff, 0xff000000);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	t = elapsed(&start, &end);
+	report("memcpy_xor", width, height, bpp, 1, 1, loops, t,
+	       (double)loops * width * height * bpp / 8 / t / 1e9,
+	       "GB/s");
+}
+
+static void run_affine(const void *src, void *dst,
+		       int32_t src_stride, int32_t dst_stride,
+		       int width, int height, int loops)
+{
+	struct pixman_f_transform t;
+	struct timespec start, end;
+	double s;
+	int i;
+
+	/* a 2x upscale of the top-left quarter, as for a scaled output */
+	pixman_f_transform_init_scale(&t, 0.5, 0.5);
+
+	affine_blt(src, dst, 32,
+		   0, 0, width, height, src_stride,
+		   0, 0, width, height, dst_stride,
+		   &t);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < loops; i++)
+		affine_blt(src, dst, 32,
+			   0, 0, width, height, src_stride,
+			   0, 0, width, height, dst_stride,
+			   &t);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	s = elapsed(&start, &end);
+	report("affine_blt", width, height, 32, 1, 1, loops, s,
+	       (double)loops * width * height / s / 1e6,
+	       "Mpixels/s");
+}
+
+static void random_boxes(BoxRec *box, int count, int width, int height)
+{
+	while (count--) {
+		int w = 1 + rand() % 64;
+		int h = 1 + rand() % 64;
+
+		box->x1 = rand() % (width - w + 1);
+		box->y1 = rand() % (height - h + 1);
+		box->x2 = box->x1 + w;
+		box->y2 = box->y1 + h;
+		box++;
+	}
+}
+
+static void run_damage(int width, int height, int count, int loops)
+{
+	struct timespec start, end;
+	const BoxRec *boxes;
+	BoxRec *add, *sub;
+	double t_add = 0, t_sub = 0, t_reduce = 0;
+	int i, n = 0;
+
+	add = malloc(2 * count * sizeof(BoxRec));
+	if (add == NULL)
+		return;
+	sub = add + count;
+
+	srand(0);
+	random_boxes(add, count, width, height);
+	random_boxes(sub, count, width, height);
+
+	for (i = 0; i < loops; i++) {
+		struct sna_damage *damage = NULL;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		sna_damage_add_boxes(&damage, add, count, 0, 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t_add += elapsed(&start, &end);
+
+		start = end;
+		sna_damage_subtract_boxes(&damage, sub, count / 2, 0, 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t_sub += elapsed(&start, &end);
+
+		start = end;
+		n += sna_damage_get_boxes(damage, &boxes);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t_reduce += elapsed(&start, &end);
+
+		sna_damage_destroy(&damage);
+	}
+
+	report("damage add_boxes", width, height, 0, count, 1, loops, t_add,
+	       (double)loops * count / t_add / 1e6, "Mboxes/s");
+	report("damage subtract_boxes", width, height, 0, count / 2, 1, loops, t_sub,
+	       (double)loops * (count / 2) / t_sub / 1e6, "Mboxes/s");
+	report("damage reduce", width, height, 0, n / loops, 1, loops, t_reduce,
+	       (double)loops * count / t_reduce / 1e6, "Mboxes/s");
+
+	free(add);
+}
+
+static void random_trapezoids(xTrapezoid *t, int count, int width, int height)
+{
+	while (count--) {
+		int y1 = rand() % height;
+		int y2 = y1 + 1 + rand() % (height - y1);
+		int x1 = rand() % width;
+		int x2 = x1 + rand() % (width - x1 + 1);
+		int skew = rand() % 32 - 16;
+
+		/* sub-pixel coordinates to exercise the edge walkers */
+		t->top = pixman_int_to_fixed(y1) + (rand() & 0xffff);
+		t->bottom = pixman_int_to_fixed(y2);
+		t->left.p1.x = pixman_int_to_fixed(x1) + (rand() & 0xffff);
+		t->left.p1.y = t->top;
+		t->left.p2.x = pixman_int_to_fixed(x1 + skew);
+		t->left.p2.y = t->bottom;
+		t->right.p1.x = pixman_int_to_fixed(x2) + (rand() & 0xffff);
+		t->right.p1.y = t->top;
+		t->right.p2.x = pixman_int_to_fixed(x2 + skew);
+		t->right.p2.y = t->bottom;
+		t++;
+	}
+}
+
+static void run_trapezoids(const char *name,
+			   bool (*mask)(int, const xTrapezoid *,
+					const BoxRec *, uint8_t *, int),
+			   const xTrapezoid *traps, int count,
+			   uint8_t *ptr, int width, int height, int loops)
+{
+	struct timespec start, end;
+	int stride = ALIGN(width, 4);
+	BoxRec extents;
+	double t;
+	int i;
+
+	extents.x1 = extents.y1 = 0;
+	extents.x2 = width;
+	extents.y2 = height;
+
+	memset(ptr, 0, stride * height);
+	if (!mask(count, traps, &extents, ptr, stride))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < loops; i++) {
+		memset(ptr, 0, stride * height);
+		mask(count, traps, &extents, ptr, stride);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	t = elapsed(&start, &end);
+	report(name, width, height, 8, count, 1, loops, t,
+	       (double)loops * count / t / 1e3, "Ktraps/s");
+}
+
+#define GLYPH_WIDTH 9
+#define GLYPH_HEIGHT 15
+#define GLYPH_COLUMNS 80 /* as a terminal */
+#define GLYPH_SET 96
+
+static double time_glyphs(int threads, pixman_image_t *white,
+			  pixman_image_t *mask, uint8_t *ptr, int stride,
+			  int height, const struct sna_glyph_item *items,
+			  int count, int loops)
+{
+	struct timespec start, end;
+	int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < loops; i++) {
+		memset(ptr, 0, stride * height);
+		if (threads > 1) {
+			if (!sna_image_composite_glyphs(threads, PIXMAN_OP_ADD,
+							NULL, 0, 0,
+							white, mask,
+							0, height,
+							items, count))
+				return 0;
+		} else for (n = 0; n < count; n++)
+			pixman_image_composite(PIXMAN_OP_ADD,
+					       items[n].image, NULL, mask,
+					       0, 0, 0, 0,
+					       items[n].x, items[n].y,
+					       items[n].width, items[n].height);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return elapsed(&start, &end);
+}
+
+/* Accumulate lines of text into an a8 mask, as the software glyph paths
+ * do, serially through pixman's glyph cache and in bands across the
+ * thread pool, to find how many glyphs it takes for the threads to win.
+ */
+static void run_glyphs(int max_threads, int loops)
+{
+	static const pixman_color_t opaque = { 0xffff, 0xffff, 0xffff, 0xffff };
+	pixman_image_t *glyph[GLYPH_SET], *white, *mask;
+	struct sna_glyph_item *items;
+	uint8_t *ptr;
+	int count, stride, width, height, i, n;
+
+	width = GLYPH_COLUMNS * GLYPH_WIDTH;
+	stride = ALIGN(width, 4);
+
+	srand(0);
+	for (i = 0; i < GLYPH_SET; i++) {
+		glyph[i] = pixman_image_create_bits(PIXMAN_a8,
+						    GLYPH_WIDTH, GLYPH_HEIGHT,
+						    NULL, 0);
+		if (glyph[i] == NULL) {
+			while (i--)
+				pixman_image_unref(glyph[i]);
+			return;
+		}
+
+		ptr = (uint8_t *)pixman_image_get_data(glyph[i]);
+		for (n = 0; n < pixman_image_get_stride(glyph[i]) * GLYPH_HEIGHT; n++)
+			ptr[n] = rand() & 1 ? rand() : 0;
+	}
+	white = pixman_image_create_solid_fill(&opaque);
+
+	for (count = 16; count <= 4096; count *= 4) {
+		int lines = (count + GLYPH_COLUMNS - 1) / GLYPH_COLUMNS;
+		double t;
+
+		height = lines * (GLYPH_HEIGHT + 1);
+		ptr = malloc(stride * height);
+		items = malloc(count * sizeof(*items));
+		mask = pixman_image_create_bits(PIXMAN_a8, width, height,
+						(uint32_t *)ptr, stride);
+		if (ptr == NULL || items == NULL || mask == NULL)
+			goto next;
+
+		for (n = 0; n < count; n++) {
+			items[n].image = glyph[rand() % GLYPH_SET];
+			items[n].x = (n % GLYPH_COLUMNS) * GLYPH_WIDTH;
+			items[n].y = (n / GLYPH_COLUMNS) * (GLYPH_HEIGHT + 1);
+			items[n].width = GLYPH_WIDTH;
+			items[n].height = GLYPH_HEIGHT;
+			items[n].convert = false;
+		}
+
+		t = time_glyphs(1, white, mask, ptr, stride, height,
+				items, count, loops);
+		report("glyphs serial", width, height, 8, count, 1, loops, t,
+		       (double)loops * count / t / 1e6, "Mglyphs/s");
+
+#if HAS_PIXMAN_GLYPHS
+		{
+			pixman_glyph_cache_t *cache;
+			pixman_glyph_t *pglyphs;
+			struct timespec start, end;
+
+			cache = pixman_glyph_cache_create();
+			pglyphs = malloc(count * sizeof(*pglyphs));
+			if (cache && pglyphs) {
+				pixman_glyph_cache_freeze(cache);
+				for (n = 0; n < count; n++) {
+					const void *g = items[n].image;
+
+					pglyphs[n].x = items[n].x;
+					pglyphs[n].y = items[n].y;
+					pglyphs[n].glyph =
+						pixman_glyph_cache_lookup(cache, (void *)g, NULL);
+					if (pglyphs[n].glyph == NULL)
+						pglyphs[n].glyph =
+							pixman_glyph_cache_insert(cache, (void *)g, NULL,
+										  0, 0, items[n].image);
+				}
+
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				for (i = 0; i < loops; i++) {
+					memset(ptr, 0, stride * height);
+					pixman_composite_glyphs_no_mask(PIXMAN_OP_ADD,
+									white, mask,
+									0, 0, 0, 0,
+									cache, count, pglyphs);
+				}
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				pixman_glyph_cache_thaw(cache);
+
+				t = elapsed(&start, &end);
+				report("glyphs pixman cache", width, height, 8, count, 1, loops, t,
+				       (double)loops * count / t / 1e6, "Mglyphs/s");
+			}
+			free(pglyphs);
+			if (cache)
+				pixman_glyph_cache_destroy(cache);
+		}
+#endif
+
+		for (n = 2; n <= max_threads; n++) {
+			t = time_glyphs(n, white, mask, ptr, stride, height,
+					items, count, loops);
+			if (t == 0)
+				break;
+
+			report("glyphs threaded", width, height, 8, count, n, loops, t,
+			       (double)loops * count / t / 1e6, "Mglyphs/s");
+		}
+
+next:
+		if (mask)
+			pixman_image_unref(mask);
+		free(items);
+		free(ptr);
+	}
+
+	pixman_image_unref(white);
+	for (i = 0; i < GLYPH_SET; i++)
+		pixman_image_unref(glyph[i]);
+}
+
+static volatile uint32_t upload_sink;
+
+static double time_upload(memcpy_box_func func,
+			  const void *src, void *dst, int rows,
+			  const uint32_t *hot, size_t hot_size, int loops)
+{
+	struct timespec start, end;
+	uint32_t sum = 0;
+	size_t j;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < loops; i++) {
+		/* The upload is followed by the client touching its own
+		 * working set again; any of it evicted by the copy has to
+		 * be refetched and is charged to the upload.
+		 */
+		func(src, dst, 32, 4096, 4096, 0, 0, 0, 0, 1024, rows);
+		for (j = 0; j < hot_size / 4; j += 16)
+			sum += hot[j];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	upload_sink = sum;
+
+	return elapsed(&start, &end);
+}
+
+static void run_upload(memcpy_box_func stream, long llc, int loops)
+{
+	size_t hot_size = llc / 2, max = 4 * llc, size;
+	unsigned crossover = 0;
+	uint32_t *hot;
+	void *src, *dst;
+
+	if (max > 128 << 20) /* keep the row count within a uint16_t */
+		max = 128 << 20;
+
+	if (posix_memalign(&src, 4096, max) ||
+	    posix_memalign(&dst, 4096, max) ||
+	    posix_memalign((void **)&hot, 4096, hot_size))
+		return;
+
+	memset(src, 0x5a, max);
+	memset(dst, 0xa5, max);
+	memset(hot, 0x3c, hot_size);
+
+	for (size = 64 << 10; size <= max; size *= 2) {
+		int rows = size / 4096;
+		double t_blt, t_stream;
+
+		time_upload(memcpy_blt, src, dst, rows, hot, hot_size, 1);
+		t_blt = time_upload(memcpy_blt, src, dst, rows,
+				    hot, hot_size, loops);
+		time_upload(stream, src, dst, rows, hot, hot_size, 1);
+		t_stream = time_upload(stream, src, dst, rows,
+				       hot, hot_size, loops);
+
+		report("upload memcpy_blt", 1024, rows, 32, rows, 1, loops,
+		       t_blt, (double)loops * size / t_blt / 1e9, "GB/s");
+		report("upload stream", 1024, rows, 32, rows, 1, loops,
+		       t_stream, (double)loops * size / t_stream / 1e9, "GB/s");
+
+		if (crossover == 0 && t_stream < t_blt)
+			crossover = rows;
+	}
+
+	/* count is the smallest upload, in pages, where streaming won;
+	 * rate is that as a multiple of kgem->half_cpu_cache_pages,
+	 * against which the driver's threshold is set.
+	 */
+	report("upload crossover", 1024, crossover, 32, crossover, 1, loops,
+	       0, (double)crossover / (llc >> 13), "half-llc");
+
+	free(hot);
+	free(dst);
+	free(src);
+}
+
+int main(int argc, char **argv)
+{
+	int width = 3840, height = 2160, bpp = 32, loops = 20;
+	int nbox = 4096, ntrap = 256, trap_size = 256;
+	long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	int tiled_stride, linear_stride, max_threads;
+	struct kgem *kgem;
+	xTrapezoid *traps;
+	void *tiled, *linear;
+	int c;
+
+	while ((c = getopt(argc, argv, "w:h:b:l:n:t:s:c:")) != -1) {
+		switch (c) {
+		case 'w': width = atoi(optarg); break;
+		case 'h': height = atoi(optarg); break;
+		case 'b': bpp = atoi(optarg); break;
+		case 'l': loops = atoi(optarg); break;
+		case 'n': nbox = atoi(optarg); break;
+		case 't': ntrap = atoi(optarg); break;
+		case 's': trap_size = atoi(optarg); break;
+		case 'c': llc = atol(optarg) << 10; break;
+		default:
+			fprintf(stderr, "usage: %s [-w width] [-h height] [-b bpp] [-l loops] [-n boxes] [-t trapezoids] [-s trapezoid extents] [-c cache KiB]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (llc <= 0)
+		llc = 8 << 20;
+	if (width <= 64 || width > INT16_MAX ||
+	    height <= 64 || height > INT16_MAX ||
+	    (bpp != 8 && bpp != 16 && bpp != 32) || loops <= 0 ||
+	    nbox <= 1 || ntrap <= 0 ||
+	    trap_size <= 0 || trap_size > width || trap_size > height) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	/* struct kgem is too large for the stack */
+	kgem = calloc(1, sizeof(*kgem));
+	if (kgem == NULL)
+		return 1;
+
+	kgem->gen = 060;
+	choose_memcpy_tiled_x(kgem, I915_BIT_6_SWIZZLE_NONE, sna_cpu_detect());
+	choose_memcpy_tiled_y(kgem, I915_BIT_6_SWIZZLE_NONE, sna_cpu_detect());
+	choose_memcpy_stream(kgem, sna_cpu_detect());
+	sna_damage_choose_kernels(sna_cpu_detect());
+
+	linear_stride = ALIGN(width * 4, 4);
+	tiled_stride = ALIGN(width * 4, 512);
+	if (posix_memalign(&tiled, 4096, (size_t)tiled_stride * ALIGN(height, 32)) ||
+	    posix_memalign(&linear, 4096, (size_t)linear_stride * height))
+		return 1;
+
+	memset(tiled, 0x5a, (size_t)tiled_stride * ALIGN(height, 32));
+	memset(linear, 0xa5, (size_t)linear_stride * height);
+
+	sna_threads_init(0, false);
+	max_threads = sna_use_threads(width, INT16_MAX, 1);
+
+	printf("[");
+
+	run_boxes("memcpy_blt", memcpy_blt, linear, tiled, bpp,
+		  linear_stride, tiled_stride, width, height, max_threads, loops);
+	run_boxes("memcpy_to_tiled_x", kgem->memcpy_to_tiled_x, linear, tiled, bpp,
+		  linear_stride, tiled_stride, width, height, max_threads, loops);
+	run_boxes("memcpy_from_tiled_x", kgem->memcpy_from_tiled_x, tiled, linear, bpp,
+		  tiled_stride, linear_stride, width, height, max_threads, loops);
+	run_boxes("memcpy_to_tiled_y", kgem->memcpy_to_tiled_y, linear, tiled, bpp,
+		  linear_stride, tiled_stride, width, height, max_threads, loops);
+	run_boxes("memcpy_from_tiled_y", kgem->memcpy_from_tiled_y, tiled, linear, bpp,
+		  tiled_stride, linear_stride, width, height, max_threads, loops);
+
+	run_memmove(linear, bpp, linear_stride, width, height, loops);
+	run_xor(linear, tiled, bpp, linear_stride, tiled_stride,
+		width, height, loops);
+	run_affine(linear, tiled, linear_stride, tiled_stride,
+		   width, height, loops);
+	run_upload(kgem->memcpy_stream, llc, loops);
+
+	run_damage(width, height, nbox, loops);
+
+	traps = malloc(ntrap * sizeof(*traps));
+	if (traps) {
+		srand(0);
+		random_trapezoids(traps, ntrap, trap_size, trap_size);
+
+		run_trapezoids("trapezoids mono", mono_trapezoids_mask,
+			       traps, ntrap, linear, trap_size, trap_size, loops);
+		run_trapezoids("trapezoids imprecise", imprecise_trapezoids_mask,
+			       traps, ntrap, linear, trap_size, trap_size, loops);
+		run_trapezoids("trapezoids precise", precise_trapezoids_mask,
+			       traps, ntrap, linear, trap_size, trap_size, loops);
+		free(traps);
+	}
+
+	run_glyphs(max_threads, loops);
+
+	printf("\n]\n");
+	return 0;
+}
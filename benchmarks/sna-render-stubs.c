@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* The trapezoid rasterisers share their translation units with the
+ * Picture and pixmap plumbing that drives them. cpu-bench only calls the
+ * *_trapezoids_mask() entry points, which never reach that plumbing, so
+ * satisfy the linker with stand-ins that abort if they are ever called.
+ * Anything defined in sna_accel.c must be stubbed here, or the linker
+ * pulls in that object and with it the rest of the driver.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+#include "sna_render.h"
+#include "sna_trapezoids.h"
+#include "fb/fbpict.h"
+
+#include <mipict.h>
+#include <servermd.h>
+
+#include <stdlib.h>
+
+DevPrivateKeyRec sna_pixmap_key;
+DevPrivateKeyRec sna_gc_key;
+DevPrivateKeyRec sna_window_key;
+
+ClientPtr serverClient;
+
+/* Referenced by the RegionNull() and BitsPerPixel() macros */
+BoxRec RegionEmptyBox;
+RegDataRec RegionEmptyData;
+PaddingInfo PixmapWidthPaddingInfo[33];
+
+#define unreachable() abort()
+
+/* X server */
+
+void
+CompositePicture(CARD8 op,
+		 PicturePtr src, PicturePtr mask, PicturePtr dst,
+		 INT16 src_x, INT16 src_y,
+		 INT16 mask_x, INT16 mask_y,
+		 INT16 dst_x, INT16 dst_y,
+		 CARD16 width, CARD16 height)
+{
+	unreachable();
+}
+
+PicturePtr
+CreatePicture(Picture pid, DrawablePtr drawable, PictFormatPtr format,
+	      Mask mask, XID *list, ClientPtr client, int *error)
+{
+	unreachable();
+}
+
+PicturePtr
+CreateSolidPicture(Picture pid, xRenderColor *color, int *error)
+{
+	unreachable();
+}
+
+int
+FreePicture(void *picture, XID pid)
+{
+	unreachable();
+}
+
+PictFormatPtr
+PictureMatchFormat(ScreenPtr screen, int depth, CARD32 format)
+{
+	unreachable();
+}
+
+void
+miPointFixedBounds(int n, xPointFixed *points, BoxPtr bounds)
+{
+	unreachable();
+}
+
+void
+miTriangleBounds(int n, xTriangle *tri, BoxPtr bounds)
+{
+	unreachable();
+}
+
+ScrnInfoPtr
+xf86ScreenToScrn(ScreenPtr screen)
+{
+	unreachable();
+}
+
+/* fb */
+
+void
+fbComposite(CARD8 op,
+	    PicturePtr src, PicturePtr mask, PicturePtr dst,
+	    INT16 src_x, INT16 src_y,
+	    INT16 mask_x, INT16 mask_y,
+	    INT16 dst_x, INT16 dst_y,
+	    CARD16 width, CARD16 height)
+{
+	unreachable();
+}
+
+pixman_image_t *
+image_from_pict(PicturePtr pict, Bool has_clip, int *xoff, int *yoff)
+{
+	unreachable();
+}
+
+void
+free_pixman_pict(PicturePtr pict, pixman_image_t *image)
+{
+	unreachable();
+}
+
+/* SNA acceleration */
+
+void
+sna_composite_fb(CARD8 op,
+		 PicturePtr src, PicturePtr mask, PicturePtr dst,
+		 RegionPtr region,
+		 INT16 src_x, INT16 src_y,
+		 INT16 mask_x, INT16 mask_y,
+		 INT16 dst_x, INT16 dst_y,
+		 CARD16 width, CARD16 height)
+{
+	unreachable();
+}
+
+bool
+sna_compute_composite_extents(BoxPtr extents,
+			      PicturePtr src, PicturePtr mask, PicturePtr dst,
+			      INT16 src_x, INT16 src_y,
+			      INT16 mask_x, INT16 mask_y,
+			      INT16 dst_x, INT16 dst_y,
+			      CARD16 width, CARD16 height)
+{
+	unreachable();
+}
+
+bool
+sna_compute_composite_region(RegionPtr region,
+			     PicturePtr src, PicturePtr mask, PicturePtr dst,
+			     INT16 src_x, INT16 src_y,
+			     INT16 mask_x, INT16 mask_y,
+			     INT16 dst_x, INT16 dst_y,
+			     CARD16 width, CARD16 height)
+{
+	unreachable();
+}
+
+bool
+sna_drawable_move_region_to_cpu(DrawablePtr drawable,
+				RegionPtr region,
+				unsigned flags)
+{
+	unreachable();
+}
+
+bool
+sna_drawable_move_to_cpu(DrawablePtr drawable, unsigned flags)
+{
+	unreachable();
+}
+
+bool
+_sna_pixmap_move_to_cpu(PixmapPtr pixmap, unsigned flags)
+{
+	unreachable();
+}
+
+struct sna_pixmap *
+sna_pixmap_move_to_gpu(PixmapPtr pixmap, unsigned flags)
+{
+	unreachable();
+}
+
+PixmapPtr
+sna_pixmap_create_unattached(ScreenPtr screen,
+			     int width, int height, int depth)
+{
+	unreachable();
+}
+
+PixmapPtr
+sna_pixmap_create_upload(ScreenPtr screen,
+			 int width, int height, int depth,
+			 unsigned flags)
+{
+	unreachable();
+}
+
+void
+sna_pixmap_destroy(PixmapPtr pixmap)
+{
+	unreachable();
+}
+
+uint32_t
+sna_rgba_to_color(uint32_t rgba, uint32_t format)
+{
+	unreachable();
+}
+
+bool
+sna_picture_is_solid(PicturePtr picture, uint32_t *color)
+{
+	unreachable();
+}
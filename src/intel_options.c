@@ -35,6 +35,13 @@ const OptionInfoRec intel_options[] = {
 	{OPTION_VIRTUAL,	"VirtualHeads",	OPTV_INTEGER,	{0},	0},
 	{OPTION_TEAR_FREE,	"TearFree",	OPTV_BOOLEAN,	{0},	0},
 	{OPTION_CRTC_PIXMAPS,	"PerCrtcPixmaps", OPTV_BOOLEAN,	{0},	0},
+	{OPTION_THREADS,	"Threads",	OPTV_INTEGER,	{0},	0},
+	{OPTION_THREAD_AFFINITY, "ThreadAffinity", OPTV_BOOLEAN, {0},	0},
+	{OPTION_PIPELINE_SUBMIT, "PipelineSubmit", OPTV_BOOLEAN, {0},	0},
+	{OPTION_RETIRE_THREAD, "RetireThread", OPTV_BOOLEAN, {0},	0},
+	{OPTION_MAP_CACHE_COUNT, "MapCacheCount", OPTV_INTEGER, {0},	0},
+	{OPTION_MAP_CACHE_SIZE, "MapCacheSize", OPTV_INTEGER, {0},	0},
+	{OPTION_BATCH_STATS, "BatchStats", OPTV_STRING, {0},	0},
 #endif
 #ifdef USE_UXA
 	{OPTION_FALLBACKDEBUG,	"FallbackDebug",OPTV_BOOLEAN,	{0},	0},
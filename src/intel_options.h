@@ -39,6 +39,13 @@ enum intel_options {
 	OPTION_VIRTUAL,
 	OPTION_TEAR_FREE,
 	OPTION_CRTC_PIXMAPS,
+	OPTION_THREADS,
+	OPTION_THREAD_AFFINITY,
+	OPTION_PIPELINE_SUBMIT,
+	OPTION_RETIRE_THREAD,
+	OPTION_MAP_CACHE_COUNT,
+	OPTION_MAP_CACHE_SIZE,
+	OPTION_BATCH_STATS,
 #endif
 #ifdef USE_UXA
 	OPTION_FALLBACKDEBUG,
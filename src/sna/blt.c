@@ -32,6 +32,26 @@
 #include "sna.h"
 #include <pixman.h>
 
+/* With bit-6 swizzling, bit 6 of the address is flipped by the parity
+ * of some combination of address bits 9, 10 and 11. Within an X tile
+ * those are the low three bits of the row, so the swizzle is constant
+ * along a row and all it does is swap the 64 byte halves of each 128 byte
+ * span. Wholly contained 64 byte chunks can therefore still be copied
+ * using full vectors, we just have to compute the row's bit-6 toggle
+ * up front.
+ */
+static force_inline unsigned swizzle_bit6(unsigned bits, unsigned swizzle)
+{
+	return __builtin_parity(bits & swizzle) << 6;
+}
+
+/* Which of the address bits 9, 10 and 11 feed into each swizzle mode */
+#define swizzle_0__bits 0
+#define swizzle_9__bits 1
+#define swizzle_9_10__bits 3
+#define swizzle_9_11__bits 5
+#define swizzle_9_10_11__bits 7
+
 #if defined(sse2)
 #pragma GCC push_options
 #pragma GCC target("sse2,inline-all-stringops,fpmath=sse")
@@ -631,6 +651,357 @@ memcpy_between_tiled_x__swizzle_0__sse2(const void *src, void *dst, int bpp,
 	}
 }
 
+#define memcpy_to_tiled_x__simd(swizzle, simd, copy64) \
+simd static void \
+memcpy_to_tiled_x__##swizzle##__##simd(const void *src, void *dst, int bpp, \
+				      int32_t src_stride, int32_t dst_stride, \
+				      int16_t src_x, int16_t src_y, \
+				      int16_t dst_x, int16_t dst_y, \
+				      uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 512; \
+	const unsigned tile_height = 8; \
+	const unsigned tile_size = 4096; \
+	const unsigned swizzle_width = 64; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned tile_pixels = tile_width / cpp; \
+	const unsigned tile_shift = ffs(tile_pixels) - 1; \
+	const unsigned tile_mask = tile_pixels - 1; \
+	unsigned offset_x; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	if (src_x | src_y) \
+		src = (const uint8_t *)src + src_y * src_stride + src_x * cpp; \
+	width *= cpp; \
+	assert(src_stride >= width); \
+	offset_x = (dst_x & tile_mask) * cpp; \
+	dst = (uint8_t *)dst + (dst_x >> tile_shift) * tile_size; \
+	while (height--) { \
+		const unsigned swz = swizzle_bit6(dst_y, swizzle##__bits); \
+		const uint8_t *src_row = src; \
+		uint8_t *tile_row = dst; \
+		unsigned x = offset_x, w = width; \
+		src = (const uint8_t *)src + src_stride; \
+		tile_row += dst_y / tile_height * dst_stride * tile_height; \
+		tile_row += (dst_y & (tile_height-1)) * tile_width; \
+		dst_y++; \
+		while (w) { \
+			unsigned len; \
+			if (x & (swizzle_width - 1) || w < swizzle_width) { \
+				len = min(swizzle_width - (x & (swizzle_width - 1)), w); \
+				memcpy(tile_row + (x ^ swz), src_row, len); \
+			} else { \
+				unsigned i; \
+				len = min(tile_width - x, w & ~(swizzle_width - 1)); \
+				for (i = 0; i < len; i += swizzle_width) \
+					copy64(assume_aligned(tile_row + ((x + i) ^ swz), swizzle_width), \
+					       src_row + i); \
+			} \
+			src_row += len; \
+			x += len; \
+			w -= len; \
+			if (x == tile_width) { \
+				tile_row += tile_size; \
+				x = 0; \
+			} \
+		} \
+	} \
+}
+
+#define memcpy_from_tiled_x__simd(swizzle, simd, copy64) \
+simd static void \
+memcpy_from_tiled_x__##swizzle##__##simd(const void *src, void *dst, int bpp, \
+					int32_t src_stride, int32_t dst_stride, \
+					int16_t src_x, int16_t src_y, \
+					int16_t dst_x, int16_t dst_y, \
+					uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 512; \
+	const unsigned tile_height = 8; \
+	const unsigned tile_size = 4096; \
+	const unsigned swizzle_width = 64; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned tile_pixels = tile_width / cpp; \
+	const unsigned tile_shift = ffs(tile_pixels) - 1; \
+	const unsigned tile_mask = tile_pixels - 1; \
+	unsigned offset_x; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	if (dst_x | dst_y) \
+		dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp; \
+	width *= cpp; \
+	assert(dst_stride >= width); \
+	offset_x = (src_x & tile_mask) * cpp; \
+	src = (const uint8_t *)src + (src_x >> tile_shift) * tile_size; \
+	while (height--) { \
+		const unsigned swz = swizzle_bit6(src_y, swizzle##__bits); \
+		const uint8_t *tile_row = src; \
+		uint8_t *dst_row = dst; \
+		unsigned x = offset_x, w = width; \
+		dst = (uint8_t *)dst + dst_stride; \
+		tile_row += src_y / tile_height * src_stride * tile_height; \
+		tile_row += (src_y & (tile_height-1)) * tile_width; \
+		src_y++; \
+		while (w) { \
+			unsigned len; \
+			if (x & (swizzle_width - 1) || w < swizzle_width) { \
+				len = min(swizzle_width - (x & (swizzle_width - 1)), w); \
+				memcpy(dst_row, tile_row + (x ^ swz), len); \
+			} else { \
+				unsigned i; \
+				len = min(tile_width - x, w & ~(swizzle_width - 1)); \
+				for (i = 0; i < len; i += swizzle_width) \
+					copy64(dst_row + i, \
+					       assume_aligned(tile_row + ((x + i) ^ swz), swizzle_width)); \
+			} \
+			dst_row += len; \
+			x += len; \
+			w -= len; \
+			if (x == tile_width) { \
+				tile_row += tile_size; \
+				x = 0; \
+			} \
+		} \
+	} \
+}
+
+memcpy_to_tiled_x__simd(swizzle_9, sse2, to_sse64)
+memcpy_from_tiled_x__simd(swizzle_9, sse2, from_sse64u)
+memcpy_to_tiled_x__simd(swizzle_9_10, sse2, to_sse64)
+memcpy_from_tiled_x__simd(swizzle_9_10, sse2, from_sse64u)
+memcpy_to_tiled_x__simd(swizzle_9_11, sse2, to_sse64)
+memcpy_from_tiled_x__simd(swizzle_9_11, sse2, from_sse64u)
+memcpy_to_tiled_x__simd(swizzle_9_10_11, sse2, to_sse64)
+memcpy_from_tiled_x__simd(swizzle_9_10_11, sse2, from_sse64u)
+
+/* Large uploads are written once by the CPU and then only read by the GPU,
+ * so pulling the destination lines into the cache just evicts the working
+ * set of the client. Bypass the cache with non-temporal stores instead.
+ */
+static force_inline void
+stream_sse64(uint8_t *dst, const uint8_t *src)
+{
+	__m128i xmm1, xmm2, xmm3, xmm4;
+
+	assert(((uintptr_t)dst & 15) == 0);
+
+	xmm1 = xmm_load_128u((const __m128i*)src + 0);
+	xmm2 = xmm_load_128u((const __m128i*)src + 1);
+	xmm3 = xmm_load_128u((const __m128i*)src + 2);
+	xmm4 = xmm_load_128u((const __m128i*)src + 3);
+
+	_mm_stream_si128((__m128i*)dst + 0, xmm1);
+	_mm_stream_si128((__m128i*)dst + 1, xmm2);
+	_mm_stream_si128((__m128i*)dst + 2, xmm3);
+	_mm_stream_si128((__m128i*)dst + 3, xmm4);
+}
+
+static void to_stream(uint8_t *dst, const uint8_t *src, unsigned len)
+{
+	unsigned head = -(uintptr_t)dst & 15;
+
+	if (head) {
+		memcpy(dst, src, head);
+		dst += head;
+		src += head;
+		len -= head;
+	}
+
+	while (len >= 64) {
+		stream_sse64(dst, src);
+		dst += 64;
+		src += 64;
+		len -= 64;
+	}
+	while (len >= 16) {
+		_mm_stream_si128((__m128i*)dst,
+				 xmm_load_128u((const __m128i*)src));
+		dst += 16;
+		src += 16;
+		len -= 16;
+	}
+	if (len)
+		memcpy(dst, src, len);
+}
+
+static void
+memcpy_blt__stream__sse2(const void *src, void *dst, int bpp,
+			 int32_t src_stride, int32_t dst_stride,
+			 int16_t src_x, int16_t src_y,
+			 int16_t dst_x, int16_t dst_y,
+			 uint16_t width, uint16_t height)
+{
+	const uint8_t *src_bytes;
+	uint8_t *dst_bytes;
+	unsigned byte_width;
+
+	assert(src);
+	assert(dst);
+	assert(width && height);
+	assert(bpp >= 8);
+
+	DBG(("%s: src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+
+	byte_width = width * bpp / 8;
+	if (byte_width < 64) {
+		memcpy_blt(src, dst, bpp,
+			   src_stride, dst_stride,
+			   src_x, src_y,
+			   dst_x, dst_y,
+			   width, height);
+		return;
+	}
+
+	bpp /= 8;
+	src_bytes = (const uint8_t *)src + src_stride * src_y + src_x * bpp;
+	dst_bytes = (uint8_t *)dst + dst_stride * dst_y + dst_x * bpp;
+
+	if (byte_width == src_stride && byte_width == dst_stride) {
+		byte_width *= height;
+		height = 1;
+	}
+
+	do {
+		to_stream(dst_bytes, src_bytes, byte_width);
+		src_bytes += src_stride;
+		dst_bytes += dst_stride;
+	} while (--height);
+
+	_mm_sfence();
+}
+
+#if defined(avx2)
+#include <immintrin.h>
+
+avx2 static force_inline void
+to_avx64(uint8_t *dst, const uint8_t *src)
+{
+	__m256i ymm1, ymm2;
+
+	assert(((uintptr_t)dst & 31) == 0);
+
+	ymm1 = _mm256_loadu_si256((const __m256i*)src + 0);
+	ymm2 = _mm256_loadu_si256((const __m256i*)src + 1);
+
+	_mm256_store_si256((__m256i*)dst + 0, ymm1);
+	_mm256_store_si256((__m256i*)dst + 1, ymm2);
+}
+
+avx2 static force_inline void
+from_avx64u(uint8_t *dst, const uint8_t *src)
+{
+	__m256i ymm1, ymm2;
+
+	assert(((uintptr_t)src & 31) == 0);
+
+	ymm1 = _mm256_load_si256((const __m256i*)src + 0);
+	ymm2 = _mm256_load_si256((const __m256i*)src + 1);
+
+	_mm256_storeu_si256((__m256i*)dst + 0, ymm1);
+	_mm256_storeu_si256((__m256i*)dst + 1, ymm2);
+}
+
+memcpy_to_tiled_x__simd(swizzle_0, avx2, to_avx64)
+memcpy_from_tiled_x__simd(swizzle_0, avx2, from_avx64u)
+memcpy_to_tiled_x__simd(swizzle_9, avx2, to_avx64)
+memcpy_from_tiled_x__simd(swizzle_9, avx2, from_avx64u)
+memcpy_to_tiled_x__simd(swizzle_9_10, avx2, to_avx64)
+memcpy_from_tiled_x__simd(swizzle_9_10, avx2, from_avx64u)
+memcpy_to_tiled_x__simd(swizzle_9_11, avx2, to_avx64)
+memcpy_from_tiled_x__simd(swizzle_9_11, avx2, from_avx64u)
+memcpy_to_tiled_x__simd(swizzle_9_10_11, avx2, to_avx64)
+memcpy_from_tiled_x__simd(swizzle_9_10_11, avx2, from_avx64u)
+
+avx2 static force_inline void
+stream_avx64(uint8_t *dst, const uint8_t *src)
+{
+	__m256i ymm1, ymm2;
+
+	assert(((uintptr_t)dst & 31) == 0);
+
+	ymm1 = _mm256_loadu_si256((const __m256i*)src + 0);
+	ymm2 = _mm256_loadu_si256((const __m256i*)src + 1);
+
+	_mm256_stream_si256((__m256i*)dst + 0, ymm1);
+	_mm256_stream_si256((__m256i*)dst + 1, ymm2);
+}
+
+avx2 static void
+to_stream__avx2(uint8_t *dst, const uint8_t *src, unsigned len)
+{
+	unsigned head = -(uintptr_t)dst & 31;
+
+	if (head) {
+		memcpy(dst, src, head);
+		dst += head;
+		src += head;
+		len -= head;
+	}
+
+	while (len >= 64) {
+		stream_avx64(dst, src);
+		dst += 64;
+		src += 64;
+		len -= 64;
+	}
+	if (len)
+		memcpy(dst, src, len);
+}
+
+avx2 static void
+memcpy_blt__stream__avx2(const void *src, void *dst, int bpp,
+			 int32_t src_stride, int32_t dst_stride,
+			 int16_t src_x, int16_t src_y,
+			 int16_t dst_x, int16_t dst_y,
+			 uint16_t width, uint16_t height)
+{
+	const uint8_t *src_bytes;
+	uint8_t *dst_bytes;
+	unsigned byte_width;
+
+	assert(src);
+	assert(dst);
+	assert(width && height);
+	assert(bpp >= 8);
+
+	DBG(("%s: src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+
+	byte_width = width * bpp / 8;
+	if (byte_width < 128) {
+		memcpy_blt(src, dst, bpp,
+			   src_stride, dst_stride,
+			   src_x, src_y,
+			   dst_x, dst_y,
+			   width, height);
+		return;
+	}
+
+	bpp /= 8;
+	src_bytes = (const uint8_t *)src + src_stride * src_y + src_x * bpp;
+	dst_bytes = (uint8_t *)dst + dst_stride * dst_y + dst_x * bpp;
+
+	if (byte_width == src_stride && byte_width == dst_stride) {
+		byte_width *= height;
+		height = 1;
+	}
+
+	do {
+		to_stream__avx2(dst_bytes, src_bytes, byte_width);
+		src_bytes += src_stride;
+		dst_bytes += dst_stride;
+	} while (--height);
+
+	_mm_sfence();
+}
+#endif
+
+#undef memcpy_to_tiled_x__simd
+#undef memcpy_from_tiled_x__simd
+
 #pragma GCC push_options
 #endif
 
@@ -1038,6 +1409,142 @@ memcpy_to_tiled_x(swizzle_9_10_11)
 memcpy_from_tiled_x(swizzle_9_10_11)
 #undef swizzle_9_10_11
 
+#undef memcpy_to_tiled_x
+#undef memcpy_from_tiled_x
+
+/* A Y tile is 128 bytes wide and 32 rows high, stored as 8 columns of
+ * 16 byte OWords. Each column is 512 bytes, so address bits 9, 10 and 11
+ * select the column and bit 6 is bit 2 of the row. The swizzle is then
+ * constant along each column, and never splits an OWord.
+ */
+static force_inline void oword_copy(uint8_t *dst, const uint8_t *src)
+{
+	memcpy(dst, src, 16);
+}
+
+#define memcpy_to_tiled_y__func(attr, swizzle, suffix, copy16) \
+attr static void \
+memcpy_to_tiled_y__##swizzle##suffix(const void *src, void *dst, int bpp, \
+				    int32_t src_stride, int32_t dst_stride, \
+				    int16_t src_x, int16_t src_y, \
+				    int16_t dst_x, int16_t dst_y, \
+				    uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 128; \
+	const unsigned tile_height = 32; \
+	const unsigned tile_size = 4096; \
+	const unsigned column_size = 512; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned offset_x = dst_x * cpp; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	assert((dst_stride & (tile_width - 1)) == 0); \
+	if (src_x | src_y) \
+		src = (const uint8_t *)src + src_y * src_stride + src_x * cpp; \
+	width *= cpp; \
+	assert(src_stride >= width); \
+	while (height--) { \
+		const uint8_t *src_row = src; \
+		uint8_t *tile_row = dst; \
+		unsigned x = offset_x, w = width; \
+		src = (const uint8_t *)src + src_stride; \
+		tile_row += dst_y / tile_height * dst_stride * tile_height; \
+		tile_row += (dst_y & (tile_height-1)) * 16; \
+		dst_y++; \
+		while (w) { \
+			const unsigned column = (x & (tile_width - 1)) >> 4; \
+			uint8_t *ptr = tile_row + \
+				(x / tile_width) * tile_size + \
+				column * column_size; \
+			ptr = (uint8_t *)((uintptr_t)ptr ^ swizzle_bit6(column, swizzle##__bits)); \
+			if (x & 15 || w < 16) { \
+				unsigned len = min(16 - (x & 15), w); \
+				memcpy(ptr + (x & 15), src_row, len); \
+				src_row += len; \
+				x += len; \
+				w -= len; \
+			} else { \
+				copy16(assume_aligned(ptr, 16), src_row); \
+				src_row += 16; \
+				x += 16; \
+				w -= 16; \
+			} \
+		} \
+	} \
+}
+
+#define memcpy_from_tiled_y__func(attr, swizzle, suffix, copy16) \
+attr static void \
+memcpy_from_tiled_y__##swizzle##suffix(const void *src, void *dst, int bpp, \
+				      int32_t src_stride, int32_t dst_stride, \
+				      int16_t src_x, int16_t src_y, \
+				      int16_t dst_x, int16_t dst_y, \
+				      uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 128; \
+	const unsigned tile_height = 32; \
+	const unsigned tile_size = 4096; \
+	const unsigned column_size = 512; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned offset_x = src_x * cpp; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	assert((src_stride & (tile_width - 1)) == 0); \
+	if (dst_x | dst_y) \
+		dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp; \
+	width *= cpp; \
+	assert(dst_stride >= width); \
+	while (height--) { \
+		const uint8_t *tile_row = src; \
+		uint8_t *dst_row = dst; \
+		unsigned x = offset_x, w = width; \
+		dst = (uint8_t *)dst + dst_stride; \
+		tile_row += src_y / tile_height * src_stride * tile_height; \
+		tile_row += (src_y & (tile_height-1)) * 16; \
+		src_y++; \
+		while (w) { \
+			const unsigned column = (x & (tile_width - 1)) >> 4; \
+			const uint8_t *ptr = tile_row + \
+				(x / tile_width) * tile_size + \
+				column * column_size; \
+			ptr = (const uint8_t *)((uintptr_t)ptr ^ swizzle_bit6(column, swizzle##__bits)); \
+			if (x & 15 || w < 16) { \
+				unsigned len = min(16 - (x & 15), w); \
+				memcpy(dst_row, ptr + (x & 15), len); \
+				dst_row += len; \
+				x += len; \
+				w -= len; \
+			} else { \
+				copy16(dst_row, assume_aligned(ptr, 16)); \
+				dst_row += 16; \
+				x += 16; \
+				w -= 16; \
+			} \
+		} \
+	} \
+}
+
+memcpy_to_tiled_y__func(fast_memcpy, swizzle_0, , oword_copy)
+memcpy_from_tiled_y__func(fast_memcpy, swizzle_0, , oword_copy)
+memcpy_to_tiled_y__func(fast_memcpy, swizzle_9, , oword_copy)
+memcpy_from_tiled_y__func(fast_memcpy, swizzle_9, , oword_copy)
+memcpy_to_tiled_y__func(fast_memcpy, swizzle_9_11, , oword_copy)
+memcpy_from_tiled_y__func(fast_memcpy, swizzle_9_11, , oword_copy)
+
+#if defined(sse2)
+memcpy_to_tiled_y__func(sse2, swizzle_0, __sse2, to_sse16)
+memcpy_from_tiled_y__func(sse2, swizzle_0, __sse2, from_sse16u)
+memcpy_to_tiled_y__func(sse2, swizzle_9, __sse2, to_sse16)
+memcpy_from_tiled_y__func(sse2, swizzle_9, __sse2, from_sse16u)
+memcpy_to_tiled_y__func(sse2, swizzle_9_11, __sse2, to_sse16)
+memcpy_from_tiled_y__func(sse2, swizzle_9_11, __sse2, from_sse16u)
+#endif
+
+#undef memcpy_to_tiled_y__func
+#undef memcpy_from_tiled_y__func
+
 static fast_memcpy void
 memcpy_to_tiled_x__gen2(const void *src, void *dst, int bpp,
 			int32_t src_stride, int32_t dst_stride,
@@ -1173,8 +1680,16 @@ void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu)
 		DBG(("%s: no swizzling\n", __FUNCTION__));
 #if defined(sse2)
 		if (cpu & SSE2) {
-			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_0__sse2;
-			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_0__sse2;
+#if defined(avx2)
+			if (cpu & AVX2) {
+				kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_0__avx2;
+				kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_0__avx2;
+			} else
+#endif
+			{
+				kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_0__sse2;
+				kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_0__sse2;
+			}
 			kgem->memcpy_between_tiled_x = memcpy_between_tiled_x__swizzle_0__sse2;
 		} else
 #endif
@@ -1186,27 +1701,375 @@ void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu)
 		break;
 	case I915_BIT_6_SWIZZLE_9:
 		DBG(("%s: 6^9 swizzling\n", __FUNCTION__));
-		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9;
-		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9;
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9__avx2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9__avx2;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9;
+		}
 		break;
 	case I915_BIT_6_SWIZZLE_9_10:
 		DBG(("%s: 6^9^10 swizzling\n", __FUNCTION__));
-		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10;
-		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10;
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10__avx2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10__avx2;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10;
+		}
 		break;
 	case I915_BIT_6_SWIZZLE_9_11:
 		DBG(("%s: 6^9^11 swizzling\n", __FUNCTION__));
-		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11;
-		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11;
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11__avx2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11__avx2;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11;
+		}
 		break;
 	case I915_BIT_6_SWIZZLE_9_10_11:
 		DBG(("%s: 6^9^10^11 swizzling\n", __FUNCTION__));
-		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11;
-		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11;
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11__avx2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11__avx2;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11;
+		}
 		break;
 	}
 }
 
+void choose_memcpy_tiled_y(struct kgem *kgem, int swizzling, unsigned cpu)
+{
+	if (kgem->gen < 030) {
+		DBG(("%s: no Y detiling for gen2\n", __FUNCTION__));
+		return;
+	}
+
+	switch (swizzling) {
+	default:
+		DBG(("%s: unknown swizzling, %d\n", __FUNCTION__, swizzling));
+		break;
+	case I915_BIT_6_SWIZZLE_NONE:
+		DBG(("%s: no swizzling\n", __FUNCTION__));
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_0__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_0__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_0;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_0;
+		}
+		break;
+	case I915_BIT_6_SWIZZLE_9:
+		DBG(("%s: 6^9 swizzling\n", __FUNCTION__));
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9;
+		}
+		break;
+	case I915_BIT_6_SWIZZLE_9_11:
+		DBG(("%s: 6^9^11 swizzling\n", __FUNCTION__));
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_11__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_11__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_11;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_11;
+		}
+		break;
+	}
+}
+
+void choose_memcpy_stream(struct kgem *kgem, unsigned cpu)
+{
+	kgem->memcpy_stream = memcpy_blt;
+#if defined(sse2)
+#if defined(avx2)
+	if (cpu & AVX2) {
+		DBG(("%s: using AVX2 streaming stores\n", __FUNCTION__));
+		kgem->memcpy_stream = memcpy_blt__stream__avx2;
+	} else
+#endif
+	if (cpu & SSE2) {
+		DBG(("%s: using SSE2 streaming stores\n", __FUNCTION__));
+		kgem->memcpy_stream = memcpy_blt__stream__sse2;
+	}
+#endif
+}
+
+#if TEST_BLT && HAS_DEBUG_FULL
+struct st_memcpy_tiled {
+	int tile_width, tile_height;
+	int swizzling;
+	memcpy_box_func ref_to, ref_from;
+	memcpy_box_func test_to, test_from;
+};
+
+static void st_fill_random(uint8_t *ptr, int len)
+{
+	uint32_t *p = (uint32_t *)ptr;
+
+	len /= 4;
+	while (len--)
+		*p++ = rand();
+}
+
+/* The address of byte x of row y, computed a byte at a time from the
+ * tiling layout alone, so that it shares nothing with the kernels under
+ * test. An X tile is 8 rows of 512 bytes; a Y tile is 8 columns of 16
+ * byte OWords, each column being 32 rows or 512 bytes. Bit 6 of the
+ * address is then swizzled by the bits selected for the tiling.
+ */
+static unsigned st_tiled_offset(const struct st_memcpy_tiled *test,
+				int stride, int x, int y)
+{
+	unsigned offset;
+
+	offset = y / test->tile_height * stride * test->tile_height;
+	offset += x / test->tile_width * 4096;
+	if (test->tile_height == 8) {
+		offset += (y % 8) * 512 + x % 512;
+	} else {
+		offset += (x % 128) / 16 * 512;
+		offset += (y % 32) * 16 + x % 16;
+	}
+
+	switch (test->swizzling) {
+	case I915_BIT_6_SWIZZLE_9:
+		offset ^= (offset >> 3) & 64;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10:
+		offset ^= ((offset >> 3) ^ (offset >> 4)) & 64;
+		break;
+	case I915_BIT_6_SWIZZLE_9_11:
+		offset ^= ((offset >> 3) ^ (offset >> 5)) & 64;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10_11:
+		offset ^= ((offset >> 3) ^ (offset >> 4) ^ (offset >> 5)) & 64;
+		break;
+	}
+
+	return offset;
+}
+
+static bool st_memcpy_tiled(const struct st_memcpy_tiled *test)
+{
+	static const int bpp[] = { 8, 16, 32 };
+	int cpp, tiled_stride, linear_stride, rows, size;
+	int16_t tile_x, tile_y, linear_x, linear_y;
+	uint16_t width, height;
+	uint8_t *buf, *tiled, *linear, *expected, *result;
+	bool ret = false;
+	int x, y, k;
+
+	cpp = bpp[rand() % ARRAY_SIZE(bpp)] / 8;
+	tiled_stride = test->tile_width * (1 + rand() % 8);
+	rows = test->tile_height * (1 + rand() % 4);
+
+	width = 1 + rand() % (tiled_stride / cpp);
+	height = 1 + rand() % rows;
+	tile_x = rand() % (tiled_stride / cpp - width + 1);
+	tile_y = rand() % (rows - height + 1);
+
+	linear_x = rand() % 64;
+	linear_y = rand() % 4;
+	linear_stride = (linear_x + width) * cpp + rand() % 64;
+
+	size = max(tiled_stride * rows, linear_stride * (linear_y + height));
+	size = ALIGN(size, 4096);
+	if (posix_memalign((void **)&buf, 4096, 4 * size))
+		return false;
+
+	tiled = buf;
+	linear = buf + size;
+	expected = buf + 2 * size;
+	result = buf + 3 * size;
+
+	st_fill_random(tiled, size);
+	st_fill_random(linear, size);
+
+	/* upload: linear -> tiled, checking the scalar and simd kernels */
+	memcpy(expected, tiled, size);
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width * cpp; x++)
+			expected[st_tiled_offset(test, tiled_stride,
+						 tile_x * cpp + x,
+						 tile_y + y)] =
+				linear[(linear_y + y) * linear_stride +
+				       linear_x * cpp + x];
+	for (k = 0; k < 2; k++) {
+		memcpy(result, tiled, size);
+		(k ? test->test_to : test->ref_to)(linear, result, cpp * 8,
+						   linear_stride, tiled_stride,
+						   linear_x, linear_y,
+						   tile_x, tile_y,
+						   width, height);
+		if (memcmp(expected, result, size)) {
+			ERR(("%s: %s upload mismatch, bpp=%d, pitch=%d, (%d, %d) -> (%d, %d), size=%dx%d\n",
+			     __FUNCTION__, k ? "simd" : "scalar",
+			     cpp * 8, tiled_stride,
+			     linear_x, linear_y, tile_x, tile_y, width, height));
+			goto out;
+		}
+	}
+
+	/* download: tiled -> linear */
+	memcpy(expected, linear, size);
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width * cpp; x++)
+			expected[(linear_y + y) * linear_stride +
+				 linear_x * cpp + x] =
+				tiled[st_tiled_offset(test, tiled_stride,
+						      tile_x * cpp + x,
+						      tile_y + y)];
+	for (k = 0; k < 2; k++) {
+		memcpy(result, linear, size);
+		(k ? test->test_from : test->ref_from)(tiled, result, cpp * 8,
+						       tiled_stride, linear_stride,
+						       tile_x, tile_y,
+						       linear_x, linear_y,
+						       width, height);
+		if (memcmp(expected, result, size)) {
+			ERR(("%s: %s download mismatch, bpp=%d, pitch=%d, (%d, %d) -> (%d, %d), size=%dx%d\n",
+			     __FUNCTION__, k ? "simd" : "scalar",
+			     cpp * 8, tiled_stride,
+			     tile_x, tile_y, linear_x, linear_y, width, height));
+			goto out;
+		}
+	}
+
+	ret = true;
+out:
+	free(buf);
+	return ret;
+}
+
+void memcpy_tiled_selftest(void)
+{
+	static const int swizzling[] = {
+		I915_BIT_6_SWIZZLE_NONE,
+		I915_BIT_6_SWIZZLE_9,
+		I915_BIT_6_SWIZZLE_9_10,
+		I915_BIT_6_SWIZZLE_9_11,
+		I915_BIT_6_SWIZZLE_9_10_11,
+	};
+	static const unsigned features[] = { SSE2, SSE2 | AVX2 };
+	unsigned cpu = sna_cpu_detect();
+	struct kgem *ref, *kgem;
+	int i, j, pass;
+
+	/* struct kgem is too large for the stack */
+	ref = calloc(2, sizeof(*ref));
+	if (ref == NULL)
+		return;
+	kgem = ref + 1;
+
+	ref->gen = kgem->gen = 060;
+	for (i = 0; i < ARRAY_SIZE(swizzling); i++) {
+		ref->memcpy_to_tiled_y = NULL;
+		ref->memcpy_from_tiled_y = NULL;
+		choose_memcpy_tiled_x(ref, swizzling[i], 0);
+		choose_memcpy_tiled_y(ref, swizzling[i], 0);
+		for (j = 0; j < ARRAY_SIZE(features); j++) {
+			struct st_memcpy_tiled test[2];
+			int k;
+
+			if ((cpu & features[j]) != features[j])
+				continue;
+
+			kgem->memcpy_to_tiled_y = NULL;
+			kgem->memcpy_from_tiled_y = NULL;
+			choose_memcpy_tiled_x(kgem, swizzling[i], features[j]);
+			choose_memcpy_tiled_y(kgem, swizzling[i], features[j]);
+			DBG(("%s: swizzling=%d, cpu=%x\n",
+			     __FUNCTION__, swizzling[i], features[j]));
+
+			test[0].tile_width = 512;
+			test[0].tile_height = 8;
+			test[0].swizzling = swizzling[i];
+			test[0].ref_to = ref->memcpy_to_tiled_x;
+			test[0].ref_from = ref->memcpy_from_tiled_x;
+			test[0].test_to = kgem->memcpy_to_tiled_x;
+			test[0].test_from = kgem->memcpy_from_tiled_x;
+
+			test[1].tile_width = 128;
+			test[1].tile_height = 32;
+			test[1].swizzling = swizzling[i];
+			test[1].ref_to = ref->memcpy_to_tiled_y;
+			test[1].ref_from = ref->memcpy_from_tiled_y;
+			test[1].test_to = kgem->memcpy_to_tiled_y;
+			test[1].test_from = kgem->memcpy_from_tiled_y;
+
+			for (k = 0; k < ARRAY_SIZE(test); k++) {
+				if (test[k].test_to == NULL ||
+				    test[k].ref_to == NULL)
+					continue;
+
+				for (pass = 0; pass < 1024; pass++) {
+					if (!st_memcpy_tiled(&test[k]))
+						FatalError("%s: failed - %c-tiling, swizzling=%d, cpu=%x\n",
+							   __FUNCTION__, "XY"[k],
+							   swizzling[i], features[j]);
+				}
+			}
+		}
+	}
+
+	free(ref);
+}
+#endif
+
 void
 memmove_box(const void *src, void *dst,
 	    int bpp, int32_t stride,
@@ -40,6 +40,8 @@
 #include <sched.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <xf86drm.h>
 
@@ -123,10 +125,25 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 #define PAGE_ALIGN(x) ALIGN(x, PAGE_SIZE)
 #define NUM_PAGES(x) (((x) + PAGE_SIZE-1) / PAGE_SIZE)
 
-#define MAX_GTT_VMA_CACHE 512
-#define MAX_CPU_VMA_CACHE INT16_MAX
+#define VMA_CACHE_FRACTION 4 /* of vm.max_map_count held by inactive bo */
+#define VMA_CACHE_BYTES_32 (256ull << 20) /* of address space */
+#define VMA_CACHE_BYTES_64 (16ull << 30)
 #define MAP_PRESERVE_TIME 10
 
+#define PRESSURE_PSI_SCALE 5 /* 20% of time stalled on memory releases all */
+#define PRESSURE_MIN_LEVEL 10 /* % trimmed below which we leave the caches be */
+#define PRESSURE_CGROUP_TRIM 75 /* % of the cgroup limit before trimming */
+#define PRESSURE_CGROUP_WARM 50 /* % of the cgroup limit to keep caches warm */
+
+#define STREAM_UPLOAD_FRACTION 2 /* of half the LLC before bypassing it */
+
+#define RETIRE_QUEUE 64 /* outstanding requests tracked per ring, power of two */
+#define RETIRE_WAIT_NS (16*1000*1000) /* recheck for shutdown */
+
+#define KGEM_EXEC_INITIAL 256
+#define KGEM_EXEC_HIGH_WATER 2048 /* execbuffer cost grows with the object count */
+#define KGEM_RELOC_INITIAL 4096
+
 #define MAKE_USER_MAP(ptr) ((void*)((uintptr_t)(ptr) | 1))
 #define IS_USER_MAP(ptr) ((uintptr_t)(ptr) & 1)
 
@@ -240,6 +257,131 @@ static inline int bytes(struct kgem_bo *bo)
 #define bucket(B) (B)->size.pages.bucket
 #define num_pages(B) (B)->size.pages.count
 
+/* The inactive lists are kept in LRU order for expiration, so alongside
+ * them every inactive bo is also filed by its mapping, tiling and size
+ * class. Each power-of-two bucket is split into 1<<CACHE_CLASS_SHIFT
+ * classes, so a lookup only needs to inspect its own class for a fit
+ * and then take the first bo from any larger class.
+ */
+#define MAP_NONE NUM_MAP_TYPES
+
+static inline int cache_class(uint32_t num_pages, int bucket)
+{
+	return bucket << CACHE_CLASS_SHIFT |
+		((num_pages << CACHE_CLASS_SHIFT) >> bucket & ((1 << CACHE_CLASS_SHIFT) - 1));
+}
+
+static inline int cache_map(struct kgem_bo *bo)
+{
+	if (bo->map__gtt || bo->map__wc)
+		return MAP_GTT;
+	if (bo->map__cpu)
+		return MAP_CPU;
+	return MAP_NONE;
+}
+
+static inline void kgem_bo_index(struct kgem *kgem, struct kgem_bo *bo)
+{
+	list_move(&bo->index,
+		  &kgem->index[cache_map(bo)][bo->tiling != I915_TILING_NONE][cache_class(num_pages(bo), bucket(bo))]);
+}
+
+static inline void kgem_munmap(struct kgem *kgem, void *ptr, int size)
+{
+	munmap(ptr, size);
+	kgem->vma_stats.munmap++;
+}
+
+static inline int bo_vma_count(struct kgem_bo *bo)
+{
+	return (bo->map__gtt != NULL) + (bo->map__wc != NULL) + (bo->map__cpu != NULL);
+}
+
+/* The mapping a bo is searched for by, and kept longest, is the one
+ * through which it was last accessed.
+ */
+static inline int vma_cache_type(struct kgem_bo *bo)
+{
+	if (bo->map__cpu && (bo->vma_cpu || !(bo->map__gtt || bo->map__wc)))
+		return MAP_CPU;
+	return MAP_GTT;
+}
+
+static void kgem_bo_vma_cache(struct kgem *kgem, struct kgem_bo *bo)
+{
+	int count = bo_vma_count(bo);
+
+	assert(list_is_empty(&bo->vma));
+	assert(list_is_empty(&bo->vma_lru));
+	if (count == 0)
+		return;
+
+	list_add(&bo->vma, &kgem->vma[vma_cache_type(bo)].inactive[bucket(bo)]);
+	list_add(&bo->vma_lru, &kgem->vma_cache.lru);
+	kgem->vma_cache.count += count;
+	kgem->vma_cache.bytes += (uint64_t)count * bytes(bo);
+}
+
+static void kgem_bo_vma_uncache(struct kgem *kgem, struct kgem_bo *bo)
+{
+	int count;
+
+	if (list_is_empty(&bo->vma))
+		return;
+
+	count = bo_vma_count(bo);
+	assert(count);
+	assert(kgem->vma_cache.count >= count);
+
+	list_del(&bo->vma);
+	list_del(&bo->vma_lru);
+	kgem->vma_cache.count -= count;
+	kgem->vma_cache.bytes -= (uint64_t)count * bytes(bo);
+}
+
+static inline int __gem_ioctl(int fd, unsigned long req, void *arg)
+{
+#if HAS_KGEM_MOCK
+	if (unlikely(fd == kgem_mock_fd))
+		return kgem_mock_ioctl(fd, req, arg);
+#endif
+
+	return ioctl(fd, req, arg);
+}
+
+static struct kgem_pipeline *__kgem_pipelines;
+static void __kgem_pipeline_drain(int fd);
+
+/* Ioctls that do not depend upon the order of execution, and so need not
+ * wait for a pipelined execbuffer to reach the kernel first.
+ */
+static bool gem_ioctl_is_unordered(unsigned long req)
+{
+	if (_IOC_TYPE(req) != DRM_IOCTL_BASE)
+		return false;
+
+	switch ((int)_IOC_NR(req) - DRM_COMMAND_BASE) {
+	case DRM_I915_GETPARAM:
+	case DRM_I915_GEM_CREATE:
+	case DRM_I915_GEM_MMAP:
+	case DRM_I915_GEM_MMAP_GTT:
+	case DRM_I915_GEM_GET_APERTURE:
+	case LOCAL_I915_GEM_USERPTR:
+	case LOCAL_I915_GEM_CREATE2:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline int gem_ioctl(int fd, unsigned long req, void *arg)
+{
+	if (unlikely(__kgem_pipelines) && !gem_ioctl_is_unordered(req))
+		__kgem_pipeline_drain(fd);
+
+	return __gem_ioctl(fd, req, arg);
+}
+
 static int __do_ioctl(int fd, unsigned long req, void *arg)
 {
 	do {
@@ -254,14 +396,14 @@ static int __do_ioctl(int fd, unsigned long req, void *arg)
 			return -err;
 		}
 
-		if (likely(ioctl(fd, req, arg) == 0))
+		if (likely(gem_ioctl(fd, req, arg) == 0))
 			return 0;
 	} while (1);
 }
 
 inline static int do_ioctl(int fd, unsigned long req, void *arg)
 {
-	if (likely(ioctl(fd, req, arg) == 0))
+	if (likely(gem_ioctl(fd, req, arg) == 0))
 		return 0;
 
 	return __do_ioctl(fd, req, arg);
@@ -482,9 +624,11 @@ restart:
 	set_tiling.tiling_mode = tiling;
 	set_tiling.stride = tiling ? stride : 0;
 
-	if (ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling) == 0) {
+	if (gem_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling) == 0) {
 		bo->tiling = set_tiling.tiling_mode;
 		bo->pitch = set_tiling.tiling_mode ? set_tiling.stride : stride;
+		if (!list_is_empty(&bo->index))
+			kgem_bo_index(kgem, bo);
 		DBG(("%s: handle=%d, tiling=%d [%d], pitch=%d [%d]: %d\n",
 		     __FUNCTION__, bo->handle,
 		     bo->tiling, tiling,
@@ -551,7 +695,7 @@ static bool __kgem_throttle(struct kgem *kgem, bool harder)
 	 * and so catch up or detect the hang.
 	 */
 	do {
-		if (ioctl(kgem->fd, DRM_IOCTL_I915_GEM_THROTTLE) == 0) {
+		if (gem_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_THROTTLE, NULL) == 0) {
 			kgem->need_throttle = 0;
 			return false;
 		}
@@ -639,6 +783,7 @@ retry_mmap:
 	 * issue with compositing managers which need to
 	 * frequently flush CPU damage to their GPU bo.
 	 */
+	kgem->vma_stats.miss += ptr != NULL;
 	return bo->map__gtt = ptr;
 }
 
@@ -677,6 +822,7 @@ retry_wc:
 	VG(VALGRIND_MAKE_MEM_DEFINED(wc.addr_ptr, bytes(bo)));
 
 	DBG(("%s: caching CPU(wc) vma for %d\n", __FUNCTION__, bo->handle));
+	kgem->vma_stats.miss++;
 	return bo->map__wc = (void *)(uintptr_t)wc.addr_ptr;
 }
 
@@ -711,6 +857,7 @@ retry:
 	VG(VALGRIND_MAKE_MEM_DEFINED(arg.addr_ptr, bytes(bo)));
 
 	DBG(("%s: caching CPU vma for %d\n", __FUNCTION__, bo->handle));
+	kgem->vma_stats.miss++;
 	return bo->map__cpu = (void *)(uintptr_t)arg.addr_ptr;
 }
 
@@ -1000,6 +1147,8 @@ static struct kgem_bo *__kgem_bo_init(struct kgem_bo *bo,
 	list_init(&bo->request);
 	list_init(&bo->list);
 	list_init(&bo->vma);
+	list_init(&bo->vma_lru);
+	list_init(&bo->index);
 
 	return bo;
 }
@@ -1470,7 +1619,7 @@ static bool gem_set_tiling(int fd, uint32_t handle, int tiling, int stride)
 	set_tiling.tiling_mode = tiling;
 	set_tiling.stride = stride;
 
-	if (ioctl(fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling) == 0)
+	if (gem_ioctl(fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling) == 0)
 		return set_tiling.tiling_mode == tiling;
 
 	return false;
@@ -1515,7 +1664,7 @@ static bool test_can_scanout_y(struct kgem *kgem)
 		f.modifiers[0] = (uint64_t)1 << 56 | 2; /* MOD_Y_TILED */
 		f.pixel_format = 'X' | 'R' << 8 | '2' << 16 | '4' << 24; /* XRGB8888 */
 		f.flags = 1 << 1; /* + modifier */
-		if (drmIoctl(kgem->fd, LOCAL_IOCTL_MODE_ADDFB2, &f) == 0) {
+		if (do_ioctl(kgem->fd, LOCAL_IOCTL_MODE_ADDFB2, &f) == 0) {
 			ret = true;
 			arg.fb_id = f.fb_id;
 		}
@@ -1544,12 +1693,12 @@ static bool test_has_dirtyfb(struct kgem *kgem)
 	if (create.handle == 0)
 		return false;
 
-	if (drmIoctl(kgem->fd, DRM_IOCTL_MODE_ADDFB, &create) == 0) {
+	if (do_ioctl(kgem->fd, DRM_IOCTL_MODE_ADDFB, &create) == 0) {
 		struct drm_mode_fb_dirty_cmd dirty;
 
 		memset(&dirty, 0, sizeof(dirty));
 		dirty.fb_id = create.fb_id;
-		ret = drmIoctl(kgem->fd,
+		ret = do_ioctl(kgem->fd,
 			       DRM_IOCTL_MODE_DIRTYFB,
 			       &dirty) == 0;
 
@@ -1558,7 +1707,7 @@ static bool test_has_dirtyfb(struct kgem *kgem)
 		 * beneficial vs flagging the whole fb as dirty.
 		 */
 
-		drmIoctl(kgem->fd,
+		do_ioctl(kgem->fd,
 			 DRM_IOCTL_MODE_RMFB,
 			 &create.fb_id);
 	}
@@ -1703,6 +1852,23 @@ static void kgem_init_swizzling(struct kgem *kgem)
 		choose_memcpy_tiled_x(kgem,
 				      tiling.swizzle_mode,
 				      __to_sna(kgem)->cpu_features);
+
+	if (!gem_set_tiling(kgem->fd, tiling.handle, I915_TILING_Y, 512))
+		goto out;
+
+	if (do_ioctl(kgem->fd, LOCAL_IOCTL_I915_GEM_GET_TILING, &tiling))
+		goto out;
+
+	DBG(("%s: Y swizzle_mode=%d, phys_swizzle_mode=%d\n",
+	     __FUNCTION__, tiling.swizzle_mode, tiling.phys_swizzle_mode));
+
+	if (kgem->gen < 050 && tiling.phys_swizzle_mode != tiling.swizzle_mode)
+		goto out;
+
+	if (!DBG_NO_DETILING)
+		choose_memcpy_tiled_y(kgem,
+				      tiling.swizzle_mode,
+				      __to_sna(kgem)->cpu_features);
 out:
 	gem_close(kgem->fd, tiling.handle);
 	DBG(("%s: can fence?=%d\n", __FUNCTION__, kgem->can_fence));
@@ -1925,10 +2091,10 @@ static uint64_t get_gtt_size(int fd)
 
 	memset(&p, 0, sizeof(p));
 	p.param = LOCAL_CONTEXT_PARAM_GTT_SIZE;
-	if (drmIoctl(fd, LOCAL_IOCTL_I915_GEM_CONTEXT_GETPARAM, &p) == 0)
+	if (do_ioctl(fd, LOCAL_IOCTL_I915_GEM_CONTEXT_GETPARAM, &p) == 0)
 		aperture.aper_size = p.value;
 	if (aperture.aper_size == 0)
-		(void)drmIoctl(fd, DRM_IOCTL_I915_GEM_GET_APERTURE, &aperture);
+		(void)do_ioctl(fd, DRM_IOCTL_I915_GEM_GET_APERTURE, &aperture);
 	if (aperture.aper_size == 0)
 		aperture.aper_size = 64*1024*1024;
 
@@ -1944,11 +2110,27 @@ static uint64_t get_gtt_size(int fd)
 	return aperture.aper_size;
 }
 
+static unsigned max_map_count(void)
+{
+	unsigned count = 65530; /* DEFAULT_MAX_MAP_COUNT */
+	FILE *file;
+
+	file = fopen("/proc/sys/vm/max_map_count", "r");
+	if (file) {
+		unsigned value;
+		if (fscanf(file, "%u", &value) == 1 && value)
+			count = value;
+		fclose(file);
+	}
+
+	return count;
+}
+
 void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 {
 	size_t totalram;
 	unsigned half_gpu_max;
-	unsigned int i, j;
+	unsigned int i, j, k;
 	uint64_t gtt_size;
 
 	DBG(("%s: fd=%d, gen=%d\n", __FUNCTION__, fd, gen));
@@ -1981,8 +2163,18 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 		for (j = 0; j < ARRAY_SIZE(kgem->vma[i].inactive); j++)
 			list_init(&kgem->vma[i].inactive[j]);
 	}
-	kgem->vma[MAP_GTT].count = -MAX_GTT_VMA_CACHE;
-	kgem->vma[MAP_CPU].count = -MAX_CPU_VMA_CACHE;
+	list_init(&kgem->vma_cache.lru);
+	for (i = 0; i < ARRAY_SIZE(kgem->index); i++) {
+		for (j = 0; j < ARRAY_SIZE(kgem->index[i]); j++)
+			for (k = 0; k < ARRAY_SIZE(kgem->index[i][j]); k++)
+				list_init(&kgem->index[i][j][k]);
+	}
+	kgem->vma_cache.max_count = max_map_count() / VMA_CACHE_FRACTION;
+	kgem->vma_cache.max_bytes =
+		sizeof(void *) == 4 ? VMA_CACHE_BYTES_32 : VMA_CACHE_BYTES_64;
+	DBG(("%s: vma cache budget %u mappings, %lldMiB\n", __FUNCTION__,
+	     kgem->vma_cache.max_count,
+	     (long long)(kgem->vma_cache.max_bytes >> 20)));
 
 	kgem->has_blt = gem_param(kgem, LOCAL_I915_PARAM_HAS_BLT) > 0;
 	DBG(("%s: has BLT ring? %d\n", __FUNCTION__,
@@ -2098,10 +2290,38 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	     kgem->batch_size));
 	kgem_new_batch(kgem);
 
+	/* Every relocation occupies at least one dword of the batch, and
+	 * every object at least one relocation, so the batch itself bounds
+	 * both arrays. Start small, and grow on demand up to the high-water
+	 * marks so that the aperture, rather than a static count, decides
+	 * when to flush.
+	 */
+	kgem->reloc_limit = kgem->batch_size;
+	kgem->exec_limit = MIN(kgem->batch_size, KGEM_EXEC_HIGH_WATER);
+	kgem->max_reloc = MIN(kgem->reloc_limit, KGEM_RELOC_INITIAL);
+	kgem->max_exec = MIN(kgem->exec_limit, KGEM_EXEC_INITIAL);
+	kgem->reloc = malloc(kgem->max_reloc * sizeof(kgem->reloc[0]));
+	kgem->exec = malloc(kgem->max_exec * sizeof(kgem->exec[0]));
+	if (kgem->reloc == NULL || kgem->exec == NULL) {
+		xf86DrvMsg(kgem_get_screen_index(kgem), X_WARNING,
+			   "Unable to allocate execbuffer arrays, disabling acceleration.\n");
+		__kgem_set_wedged(kgem);
+		kgem->max_reloc = kgem->max_exec = 0;
+	}
+	DBG(("%s: exec slots %d (limit %d), relocations %d (limit %d)\n",
+	     __FUNCTION__,
+	     kgem->max_exec, kgem->exec_limit,
+	     kgem->max_reloc, kgem->reloc_limit));
+
 	kgem->half_cpu_cache_pages = cpu_cache_size() >> 13;
 	DBG(("%s: last-level cache size: %d bytes, threshold in pages: %d\n",
 	     __FUNCTION__, cpu_cache_size(), kgem->half_cpu_cache_pages));
 
+	choose_memcpy_stream(kgem, __to_sna(kgem)->cpu_features);
+	kgem->stream_upload_pages = kgem->half_cpu_cache_pages / STREAM_UPLOAD_FRACTION;
+	DBG(("%s: streaming uploads of %d pages or more\n",
+	     __FUNCTION__, kgem->stream_upload_pages));
+
 	kgem->next_request = __kgem_request_alloc(kgem);
 
 	DBG(("%s: cpu bo enabled %d: llc? %d, set-cache-level? %d, userptr? %d\n", __FUNCTION__,
@@ -2465,6 +2685,80 @@ static uint32_t kgem_aligned_height(struct kgem *kgem,
 	return ALIGN(height, tile_height);
 }
 
+static int kgem_grow_size(int size, int need, int limit)
+{
+	while (size < need)
+		size = size ? 2*size : need;
+	return MIN(size, limit);
+}
+
+bool __kgem_check_reloc(struct kgem *kgem, int n)
+{
+	struct drm_i915_gem_relocation_entry *reloc;
+	int need = kgem->nreloc + n + KGEM_RELOC_RESERVED;
+	int size;
+
+	if (need > kgem->reloc_limit) {
+		DBG(("%s: out of relocations (%d + %d / %d)\n",
+		     __FUNCTION__, kgem->nreloc, n, kgem->reloc_limit));
+		kgem->flush_reason = KGEM_FLUSH_RELOC;
+		return false;
+	}
+
+	size = kgem_grow_size(kgem->max_reloc, need, kgem->reloc_limit);
+	reloc = realloc(kgem->reloc, size * sizeof(*reloc));
+	if (reloc == NULL) {
+		kgem->flush_reason = KGEM_FLUSH_RELOC;
+		return false;
+	}
+
+	DBG(("%s: grown from %d to %d relocations\n",
+	     __FUNCTION__, kgem->max_reloc, size));
+	kgem->reloc = reloc;
+	kgem->max_reloc = size;
+	return true;
+}
+
+bool __kgem_check_exec(struct kgem *kgem, int n)
+{
+	struct drm_i915_gem_exec_object2 *exec;
+	struct kgem_bo *bo;
+	int need = kgem->nexec + n + KGEM_EXEC_RESERVED;
+	int size;
+
+	if (need > kgem->exec_limit) {
+		DBG(("%s: out of exec slots (%d + %d / %d)\n",
+		     __FUNCTION__, kgem->nexec, n, kgem->exec_limit));
+		kgem->flush_reason = KGEM_FLUSH_EXEC;
+		return false;
+	}
+
+	size = kgem_grow_size(kgem->max_exec, need, kgem->exec_limit);
+	exec = malloc(size * sizeof(*exec));
+	if (exec == NULL) {
+		kgem->flush_reason = KGEM_FLUSH_EXEC;
+		return false;
+	}
+
+	/* Every bo in the batch points at its slot, so move them too */
+	memcpy(exec, kgem->exec, kgem->nexec * sizeof(*exec));
+	list_for_each_entry(bo, &kgem->next_request->buffers, request) {
+		if (bo->proxy)
+			continue;
+
+		assert(bo->exec >= kgem->exec &&
+		       bo->exec < kgem->exec + kgem->nexec);
+		bo->exec = exec + (bo->exec - kgem->exec);
+	}
+	free(kgem->exec);
+
+	DBG(("%s: grown from %d to %d exec slots\n",
+	     __FUNCTION__, kgem->max_exec, size));
+	kgem->exec = exec;
+	kgem->max_exec = size;
+	return true;
+}
+
 static struct drm_i915_gem_exec_object2 *
 kgem_add_handle(struct kgem *kgem, struct kgem_bo *bo)
 {
@@ -2473,7 +2767,7 @@ kgem_add_handle(struct kgem *kgem, struct kgem_bo *bo)
 	DBG(("%s: handle=%d, index=%d\n",
 	     __FUNCTION__, bo->handle, kgem->nexec));
 
-	assert(kgem->nexec < ARRAY_SIZE(kgem->exec));
+	assert(kgem->nexec < kgem->max_exec);
 	bo->target_handle = kgem->has_handle_lut ? kgem->nexec : bo->handle;
 	exec = memset(&kgem->exec[kgem->nexec++], 0, sizeof(*exec));
 	exec->handle = bo->handle;
@@ -2575,28 +2869,26 @@ static void kgem_bo_free(struct kgem *kgem, struct kgem_bo *bo)
 		bo->map__cpu = NULL;
 	}
 
-	DBG(("%s: releasing %p:%p vma for handle=%d, count=%d\n",
+	DBG(("%s: releasing %p:%p vma for handle=%d, cached=%d, count=%u\n",
 	     __FUNCTION__, bo->map__gtt, bo->map__cpu,
-	     bo->handle, list_is_empty(&bo->vma) ? 0 : kgem->vma[bo->map__gtt == NULL && bo->map__wc == NULL].count));
+	     bo->handle, !list_is_empty(&bo->vma), kgem->vma_cache.count));
 
-	if (!list_is_empty(&bo->vma)) {
-		_list_del(&bo->vma);
-		kgem->vma[bo->map__gtt == NULL && bo->map__wc == NULL].count--;
-	}
+	kgem_bo_vma_uncache(kgem, bo);
 
 	if (bo->map__gtt)
-		munmap(bo->map__gtt, bytes(bo));
+		kgem_munmap(kgem, bo->map__gtt, bytes(bo));
 	if (bo->map__wc) {
 		VG(VALGRIND_MAKE_MEM_NOACCESS(bo->map__wc, bytes(bo)));
-		munmap(bo->map__wc, bytes(bo));
+		kgem_munmap(kgem, bo->map__wc, bytes(bo));
 	}
 	if (bo->map__cpu) {
 		VG(VALGRIND_MAKE_MEM_NOACCESS(MAP(bo->map__cpu), bytes(bo)));
-		munmap(MAP(bo->map__cpu), bytes(bo));
+		kgem_munmap(kgem, MAP(bo->map__cpu), bytes(bo));
 	}
 
 	_list_del(&bo->list);
 	_list_del(&bo->request);
+	_list_del(&bo->index);
 	gem_close(kgem->fd, bo->handle);
 
 	if (!bo->io && !DBG_NO_MALLOC_CACHE) {
@@ -2632,11 +2924,12 @@ inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
 		if (bo->map__gtt) {
 			DBG(("%s: relinquishing large GTT mapping for handle=%d\n",
 			     __FUNCTION__, bo->handle));
-			munmap(bo->map__gtt, bytes(bo));
+			kgem_munmap(kgem, bo->map__gtt, bytes(bo));
 			bo->map__gtt = NULL;
 		}
 
 		list_move(&bo->list, &kgem->large_inactive);
+		kgem_bo_index(kgem, bo);
 	} else {
 		assert(bo->flush == false);
 		assert(list_is_empty(&bo->vma));
@@ -2644,17 +2937,11 @@ inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
 		if (bo->map__gtt && !kgem_bo_can_map(kgem, bo)) {
 			DBG(("%s: relinquishing old GTT mapping for handle=%d\n",
 			     __FUNCTION__, bo->handle));
-			munmap(bo->map__gtt, bytes(bo));
+			kgem_munmap(kgem, bo->map__gtt, bytes(bo));
 			bo->map__gtt = NULL;
 		}
-		if (bo->map__gtt || (bo->map__wc && !bo->tiling)) {
-			list_add(&bo->vma, &kgem->vma[0].inactive[bucket(bo)]);
-			kgem->vma[0].count++;
-		}
-		if (bo->map__cpu && list_is_empty(&bo->vma)) {
-			list_add(&bo->vma, &kgem->vma[1].inactive[bucket(bo)]);
-			kgem->vma[1].count++;
-		}
+		kgem_bo_vma_cache(kgem, bo);
+		kgem_bo_index(kgem, bo);
 	}
 
 	kgem->need_expire = true;
@@ -2684,8 +2971,10 @@ static struct kgem_bo *kgem_bo_replace_io(struct kgem_bo *bo)
 		memcpy(base, bo, sizeof(*base));
 		base->io = false;
 		list_init(&base->list);
+		list_init(&base->index);
 		list_replace(&bo->request, &base->request);
 		list_replace(&bo->vma, &base->vma);
+		list_init(&base->vma_lru);
 		free(bo);
 		bo = base;
 	} else
@@ -2700,14 +2989,11 @@ inline static void kgem_bo_remove_from_inactive(struct kgem *kgem,
 	DBG(("%s: removing handle=%d from inactive\n", __FUNCTION__, bo->handle));
 
 	list_del(&bo->list);
+	list_del(&bo->index);
 	assert(bo->rq == NULL);
 	assert(bo->exec == NULL);
 	assert(!bo->purged);
-	if (!list_is_empty(&bo->vma)) {
-		assert(bo->map__gtt || bo->map__wc || bo->map__cpu);
-		list_del(&bo->vma);
-		kgem->vma[bo->map__gtt == NULL && bo->map__wc == NULL].count--;
-	}
+	kgem_bo_vma_uncache(kgem, bo);
 }
 
 inline static void kgem_bo_remove_from_active(struct kgem *kgem,
@@ -3226,6 +3512,288 @@ static bool __kgem_retire_rq(struct kgem *kgem, struct kgem_request *rq)
 	return retired;
 }
 
+/* Threaded retirement: rather than ask the kernel whether each request
+ * is still busy, a helper thread per ring sleeps in GEM_WAIT upon the
+ * oldest outstanding batch and publishes the seqno of the last request
+ * it has seen complete. As each ring executes its batches in order, the
+ * main thread may then retire everything up to that seqno with a single
+ * atomic load. Only the submission queues are guarded by the mutex, and
+ * it is only taken when committing a request. A thread blocked in the
+ * ioctl cannot be woken by new work, hence each ring has its own so
+ * that a long wait upon one never delays retirement of the other.
+ */
+struct kgem_retirer {
+	struct kgem *kgem;
+	int fd;
+
+	pthread_mutex_t mutex;
+	bool quit;
+
+	struct kgem_retirer_ring {
+		struct kgem_retirer *r;
+		pthread_t thread;
+		pthread_cond_t cond;
+		bool running;
+
+		struct {
+			uint32_t seqno;
+			uint32_t handle;
+		} queue[RETIRE_QUEUE];
+		unsigned head, tail;
+		uint32_t submitted;
+		uint32_t completed; /* written by the thread, read without the lock */
+	} ring[2];
+
+	struct {
+		int ring;
+		uint32_t seqno;
+		uint32_t handle;
+	} deferred;
+
+	unsigned waits, timeouts, overflows;
+};
+
+static bool kgem_retirer_thread_wait(struct kgem_retirer *r,
+				     uint32_t handle, int64_t timeout)
+{
+	struct local_i915_gem_wait {
+		uint32_t handle;
+		uint32_t flags;
+		int64_t timeout;
+	} wait;
+	int err;
+
+	VG_CLEAR(wait);
+	wait.handle = handle;
+	wait.flags = 0;
+	wait.timeout = timeout;
+	do {
+		err = 0;
+		if (__gem_ioctl(r->fd, LOCAL_IOCTL_I915_GEM_WAIT, &wait))
+			err = errno;
+	} while (err == EINTR || err == EAGAIN);
+
+	/* Any error other than a timeout means the handle is idle: either
+	 * the GPU is wedged, or the batch has already been retired and
+	 * its handle closed by the main thread. If the handle has since
+	 * been reused we merely wait for longer than necessary.
+	 */
+	return err != ETIME;
+}
+
+static void *kgem_retirer_thread(void *arg)
+{
+	struct kgem_retirer_ring *ring = arg;
+	struct kgem_retirer *r = ring->r;
+	sigset_t signals;
+
+	/* Disable all signals in the slave threads as X uses them for IO */
+	sigfillset(&signals);
+	sigdelset(&signals, SIGBUS);
+	sigdelset(&signals, SIGSEGV);
+	pthread_sigmask(SIG_SETMASK, &signals, NULL);
+
+	pthread_mutex_lock(&r->mutex);
+	for (;;) {
+		unsigned head;
+		uint32_t seqno, handle;
+		bool idle;
+
+		while (ring->head == ring->tail && !r->quit)
+			pthread_cond_wait(&ring->cond, &r->mutex);
+		if (r->quit)
+			break;
+
+		head = ring->head;
+		seqno = ring->queue[head & (RETIRE_QUEUE - 1)].seqno;
+		handle = ring->queue[head & (RETIRE_QUEUE - 1)].handle;
+		pthread_mutex_unlock(&r->mutex);
+
+		idle = kgem_retirer_thread_wait(r, handle, RETIRE_WAIT_NS);
+
+		pthread_mutex_lock(&r->mutex);
+		r->waits++;
+		if (!idle) {
+			r->timeouts++;
+			continue;
+		}
+
+		__atomic_store_n(&ring->completed, seqno, __ATOMIC_RELEASE);
+		if (ring->head == head) /* unless overtaken by overflow */
+			ring->head++;
+	}
+	pthread_mutex_unlock(&r->mutex);
+
+	return NULL;
+}
+
+static void kgem_retirer_push(struct kgem_retirer *r, int ring,
+			      uint32_t seqno, uint32_t handle)
+{
+	struct kgem_retirer_ring *rr = &r->ring[ring];
+
+	pthread_mutex_lock(&r->mutex);
+	if (rr->tail - rr->head == RETIRE_QUEUE) {
+		/* Completion of the newer request implies the older */
+		rr->head++;
+		r->overflows++;
+	}
+	rr->queue[rr->tail & (RETIRE_QUEUE - 1)].seqno = seqno;
+	rr->queue[rr->tail & (RETIRE_QUEUE - 1)].handle = handle;
+	rr->tail++;
+	pthread_cond_signal(&rr->cond);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void kgem_retirer_queue(struct kgem *kgem, struct kgem_request *rq)
+{
+	struct kgem_retirer *r = kgem->retirer;
+
+	if (r == NULL)
+		return;
+
+	assert(rq->ring < ARRAY_SIZE(r->ring));
+	rq->seqno = ++r->ring[rq->ring].submitted;
+
+	/* The batch is not known to the kernel until the pipeline has
+	 * executed it, and until then GEM_WAIT would report it as idle.
+	 */
+	if (kgem->pipeline_pending) {
+		assert(r->deferred.ring < 0);
+		r->deferred.ring = rq->ring;
+		r->deferred.seqno = rq->seqno;
+		r->deferred.handle = rq->bo->handle;
+		return;
+	}
+
+	kgem_retirer_push(r, rq->ring, rq->seqno, rq->bo->handle);
+}
+
+static void kgem_retirer_release(struct kgem *kgem, bool submitted)
+{
+	struct kgem_retirer *r = kgem->retirer;
+
+	if (r == NULL || r->deferred.ring < 0)
+		return;
+
+	if (submitted)
+		kgem_retirer_push(r, r->deferred.ring,
+				  r->deferred.seqno, r->deferred.handle);
+	r->deferred.ring = -1;
+}
+
+static bool kgem_request_busy(struct kgem *kgem, struct kgem_request *rq)
+{
+	struct kgem_retirer *r = kgem->retirer;
+	uint32_t completed;
+
+	if (r == NULL)
+		return __kgem_busy(kgem, rq->bo->handle);
+
+	if (kgem->wedged)
+		return false;
+
+	assert(rq->ring < ARRAY_SIZE(r->ring));
+	completed = __atomic_load_n(&r->ring[rq->ring].completed,
+				    __ATOMIC_ACQUIRE);
+	DBG(("%s: handle=%d, seqno=%u, completed=%u\n",
+	     __FUNCTION__, rq->bo->handle, rq->seqno, completed));
+	return (int32_t)(rq->seqno - completed) > 0;
+}
+
+static void kgem_retirer_stop(struct kgem_retirer *r)
+{
+	int n;
+
+	pthread_mutex_lock(&r->mutex);
+	r->quit = true;
+	for (n = 0; n < ARRAY_SIZE(r->ring); n++)
+		pthread_cond_broadcast(&r->ring[n].cond);
+	pthread_mutex_unlock(&r->mutex);
+
+	for (n = 0; n < ARRAY_SIZE(r->ring); n++) {
+		if (r->ring[n].running)
+			pthread_join(r->ring[n].thread, NULL);
+		pthread_cond_destroy(&r->ring[n].cond);
+	}
+
+	DBG(("%s: %d waits, %d timeouts, %d overflows\n",
+	     __FUNCTION__, r->waits, r->timeouts, r->overflows));
+
+	pthread_mutex_destroy(&r->mutex);
+	free(r);
+}
+
+bool kgem_retirer_init(struct kgem *kgem)
+{
+	struct kgem_retirer *r;
+	int n;
+
+	if (kgem->retirer)
+		return true;
+
+	if (kgem->wedged)
+		return false;
+
+	/* Outstanding requests would not carry a seqno, so wait for them.
+	 * We are started from ScreenInit, before there is much to wait upon.
+	 */
+	for (n = 0; n < ARRAY_SIZE(kgem->requests); n++) {
+		if (!list_is_empty(&kgem->requests[n])) {
+			struct kgem_request *rq;
+
+			rq = list_last_entry(&kgem->requests[n],
+					     struct kgem_request,
+					     list);
+			kgem_bo_wait(kgem, rq->bo);
+		}
+	}
+	kgem_retire(kgem);
+	for (n = 0; n < ARRAY_SIZE(kgem->requests); n++)
+		if (!list_is_empty(&kgem->requests[n]))
+			return false;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return false;
+
+	r->kgem = kgem;
+	r->fd = kgem->fd;
+	r->deferred.ring = -1;
+	pthread_mutex_init(&r->mutex, NULL);
+	for (n = 0; n < ARRAY_SIZE(r->ring); n++) {
+		r->ring[n].r = r;
+		pthread_cond_init(&r->ring[n].cond, NULL);
+	}
+	for (n = 0; n < ARRAY_SIZE(r->ring); n++) {
+		if (pthread_create(&r->ring[n].thread, NULL,
+				   kgem_retirer_thread, &r->ring[n])) {
+			kgem_retirer_stop(r);
+			return false;
+		}
+		r->ring[n].running = true;
+	}
+
+	kgem->retirer = r;
+
+	DBG(("%s: enabled\n", __FUNCTION__));
+	return true;
+}
+
+void kgem_retirer_fini(struct kgem *kgem)
+{
+	struct kgem_retirer *r = kgem->retirer;
+
+	if (r == NULL)
+		return;
+
+	kgem_pipeline_sync(kgem);
+	kgem_retirer_stop(r);
+
+	/* Any remaining requests fall back to querying the kernel */
+	kgem->retirer = NULL;
+}
+
 static bool kgem_retire__requests_ring(struct kgem *kgem, int ring)
 {
 	bool retired = false;
@@ -3242,7 +3810,7 @@ static bool kgem_retire__requests_ring(struct kgem *kgem, int ring)
 		assert(rq->ring == ring);
 		assert(rq->bo);
 		assert(RQ(rq->bo->rq) == rq);
-		if (__kgem_busy(kgem, rq->bo->handle))
+		if (kgem_request_busy(kgem, rq))
 			break;
 
 		retired |= __kgem_retire_rq(kgem, rq);
@@ -3289,6 +3857,9 @@ bool kgem_retire(struct kgem *kgem)
 
 	DBG(("%s, need_retire?=%d\n", __FUNCTION__, kgem->need_retire));
 
+	/* Complete any pipelined submission before walking the requests */
+	kgem_pipeline_sync(kgem);
+
 	kgem->need_retire = false;
 
 	retired |= kgem_retire__flushing(kgem);
@@ -3313,7 +3884,7 @@ bool __kgem_ring_is_idle(struct kgem *kgem, int ring)
 	if (rq) {
 		struct kgem_request *tmp;
 
-		if (__kgem_busy(kgem, rq->bo->handle)) {
+		if (kgem_request_busy(kgem, rq)) {
 			DBG(("%s: last fence handle=%d still busy\n",
 			     __FUNCTION__, rq->bo->handle));
 			return false;
@@ -3337,7 +3908,7 @@ bool __kgem_ring_is_idle(struct kgem *kgem, int ring)
 	assert(rq->ring == ring);
 	assert(rq->bo);
 	assert(RQ(rq->bo->rq) == rq);
-	if (__kgem_busy(kgem, rq->bo->handle)) {
+	if (kgem_request_busy(kgem, rq)) {
 		DBG(("%s: last requests handle=%d still busy\n",
 		     __FUNCTION__, rq->bo->handle));
 		kgem->fence[ring] = rq;
@@ -3384,18 +3955,333 @@ bool __kgem_retire_requests_upto(struct kgem *kgem, struct kgem_bo *bo)
 	return bo->rq;
 }
 
-#if 0
-static void kgem_commit__check_reloc(struct kgem *kgem)
-{
-	struct kgem_request *rq = kgem->next_request;
-	struct kgem_bo *bo;
-	bool has_64bit = kgem->gen >= 0100;
-	int i;
+/* Pipelined submission: once a batch is complete we hand a private copy
+ * of its execobjects and relocations to a helper thread to perform the
+ * execbuffer, commit the request immediately and carry on building the
+ * next batch. Only one execbuffer is ever in flight, and every ioctl that
+ * may depend upon its execution (see gem_ioctl()) first waits for it to
+ * reach the kernel.
+ */
+struct kgem_pipeline {
+	struct kgem_pipeline *next;
+	struct kgem *kgem;
+	int fd;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool busy, quit;
+	int ret;
 
-	for (i = 0; i < kgem->nreloc; i++) {
-		list_for_each_entry(bo, &rq->buffers, request) {
-			if (bo->target_handle == kgem->reloc[i].target_handle) {
-				uint64_t value = 0;
+	struct drm_i915_gem_execbuffer2 execbuf;
+	struct drm_i915_gem_exec_object2 *exec;
+	struct drm_i915_gem_relocation_entry *reloc;
+	struct kgem_bo **bos;
+	struct kgem_request *rq;
+	int nexec, max_exec, max_reloc;
+
+	unsigned count, stalls;
+};
+
+static void *kgem_pipeline_thread(void *arg)
+{
+	struct kgem_pipeline *p = arg;
+	sigset_t signals;
+
+	/* Disable all signals in the slave threads as X uses them for IO */
+	sigfillset(&signals);
+	sigdelset(&signals, SIGBUS);
+	sigdelset(&signals, SIGSEGV);
+	pthread_sigmask(SIG_SETMASK, &signals, NULL);
+
+	pthread_mutex_lock(&p->mutex);
+	for (;;) {
+		int ret;
+
+		while (!p->busy && !p->quit)
+			pthread_cond_wait(&p->cond, &p->mutex);
+		if (!p->busy)
+			break;
+		pthread_mutex_unlock(&p->mutex);
+
+		do {
+			ret = 0;
+			if (__gem_ioctl(p->fd,
+					DRM_IOCTL_I915_GEM_EXECBUFFER2,
+					&p->execbuf))
+				ret = -errno;
+		} while (ret == -EINTR || ret == -EAGAIN);
+
+		pthread_mutex_lock(&p->mutex);
+		p->ret = ret;
+		p->busy = false;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->mutex);
+
+	return NULL;
+}
+
+bool kgem_pipeline_init(struct kgem *kgem)
+{
+	struct kgem_pipeline *p;
+
+	if (kgem->pipeline)
+		return true;
+
+	if (kgem->wedged)
+		return false;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return false;
+
+	p->kgem = kgem;
+	p->fd = kgem->fd;
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	if (pthread_create(&p->thread, NULL, kgem_pipeline_thread, p)) {
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->mutex);
+		free(p);
+		return false;
+	}
+
+	p->next = __kgem_pipelines;
+	__kgem_pipelines = p;
+	kgem->pipeline = p;
+
+	DBG(("%s: enabled\n", __FUNCTION__));
+	return true;
+}
+
+void kgem_pipeline_fini(struct kgem *kgem)
+{
+	struct kgem_pipeline *p = kgem->pipeline, **prev;
+
+	if (p == NULL)
+		return;
+
+	kgem_pipeline_sync(kgem);
+
+	pthread_mutex_lock(&p->mutex);
+	p->quit = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+	pthread_join(p->thread, NULL);
+
+	for (prev = &__kgem_pipelines; *prev != p; prev = &(*prev)->next)
+		;
+	*prev = p->next;
+
+	DBG(("%s: %d submissions, %d stalls\n",
+	     __FUNCTION__, p->count, p->stalls));
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->mutex);
+	free(p->exec);
+	free(p->reloc);
+	free(p->bos);
+	free(p);
+
+	kgem->pipeline = NULL;
+}
+
+static int do_execbuf(struct kgem *kgem, struct drm_i915_gem_execbuffer2 *execbuf);
+
+/* The helper thread only retries interrupted execbuffers, anything else
+ * is handed back for the same throttle-and-expire recovery as the
+ * synchronous path. The request has already been committed, so whilst
+ * we retry it is hidden from the retire and cleanup done by do_execbuf()
+ * as the kernel has yet to see its batch and would report it idle.
+ *
+ * When we are draining from inside an arbitrary ioctl, the caller may be
+ * walking the request or cache lists, so then we may only throttle (an
+ * ioctl that leaves our lists alone) and try once more.
+ */
+static int kgem_pipeline_retry(struct kgem *kgem, struct kgem_pipeline *p,
+			       bool recover)
+{
+	struct kgem_request *rq = p->rq;
+	bool fence = false;
+	int ret;
+
+	DBG(("%s: ret=%d, retrying, recover? %d\n",
+	     __FUNCTION__, p->ret, recover));
+
+	if (!recover) {
+		__kgem_throttle(kgem, false);
+		return do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2,
+				&p->execbuf);
+	}
+
+	if (rq == kgem->next_request)
+		return do_execbuf(kgem, &p->execbuf);
+
+	assert(rq->ring < ARRAY_SIZE(kgem->requests));
+	assert(rq == list_last_entry(&kgem->requests[rq->ring],
+				     struct kgem_request, list));
+	list_del(&rq->list);
+	if (kgem->fence[rq->ring] == rq) {
+		kgem->fence[rq->ring] = NULL;
+		fence = true;
+	}
+
+	ret = do_execbuf(kgem, &p->execbuf);
+
+	list_add_tail(&rq->list, &kgem->requests[rq->ring]);
+	if (fence || kgem->fence[rq->ring] == NULL)
+		kgem->fence[rq->ring] = rq;
+
+	return ret;
+}
+
+static void __kgem_pipeline_wait(struct kgem *kgem, bool recover)
+{
+	struct kgem_pipeline *p = kgem->pipeline;
+	int n, ret;
+
+	assert(kgem->pipeline_pending);
+	kgem->pipeline_pending = false;
+
+	pthread_mutex_lock(&p->mutex);
+	if (p->busy) {
+		p->stalls++;
+		do
+			pthread_cond_wait(&p->cond, &p->mutex);
+		while (p->busy);
+	}
+	ret = p->ret;
+	pthread_mutex_unlock(&p->mutex);
+
+	DBG(("%s: ret=%d, stalled on %d of %d submissions\n",
+	     __FUNCTION__, ret, p->stalls, p->count));
+
+	if (ret && !kgem->wedged)
+		ret = kgem_pipeline_retry(kgem, p, recover);
+
+	kgem_retirer_release(kgem, ret == 0);
+
+	if (ret == 0) {
+		/* Adopt the kernel's placement for the next batch. Any
+		 * bo still on the request is alive as retiring it
+		 * requires a busy-ioctl, and so must first wait for us,
+		 * or for its seqno to be queued to the retirer above.
+		 */
+		if (kgem->wedged)
+			return;
+
+		for (n = 0; n < p->nexec; n++) {
+			struct kgem_bo *bo = p->bos[n];
+			if (bo && bo->exec == NULL)
+				bo->presumed_offset = p->exec[n].offset;
+		}
+		return;
+	}
+
+	/* The request is already committed, all we can do is give up */
+	if (!kgem->wedged) {
+		xf86DrvMsg(kgem_get_screen_index(kgem), X_ERROR,
+			   "Failed to submit rendering commands (%s), disabling acceleration.\n",
+			   strerror(-ret));
+		__kgem_set_wedged(kgem);
+	}
+}
+
+void __kgem_pipeline_sync(struct kgem *kgem)
+{
+	__kgem_pipeline_wait(kgem, true);
+}
+
+static void __kgem_pipeline_drain(int fd)
+{
+	struct kgem_pipeline *p;
+
+	for (p = __kgem_pipelines; p; p = p->next) {
+		if (p->fd == fd && p->kgem->pipeline_pending)
+			__kgem_pipeline_wait(p->kgem, false);
+	}
+}
+
+static bool kgem_pipeline_submit(struct kgem *kgem,
+				 const struct drm_i915_gem_execbuffer2 *execbuf)
+{
+	struct kgem_pipeline *p = kgem->pipeline;
+	int n;
+
+	if (p == NULL || kgem->next_request == &kgem->static_request)
+		return false;
+
+	kgem_pipeline_sync(kgem);
+	if (kgem->wedged)
+		return false;
+
+	if (kgem->nexec > p->max_exec) {
+		void *exec, *bos;
+
+		exec = realloc(p->exec, kgem->nexec * sizeof(p->exec[0]));
+		if (exec == NULL)
+			return false;
+		p->exec = exec;
+
+		bos = realloc(p->bos, kgem->nexec * sizeof(p->bos[0]));
+		if (bos == NULL)
+			return false;
+		p->bos = bos;
+
+		p->max_exec = kgem->nexec;
+	}
+
+	if (kgem->nreloc > p->max_reloc) {
+		void *reloc;
+
+		reloc = realloc(p->reloc, kgem->nreloc * sizeof(p->reloc[0]));
+		if (reloc == NULL)
+			return false;
+
+		p->reloc = reloc;
+		p->max_reloc = kgem->nreloc;
+	}
+
+	memcpy(p->exec, kgem->exec, kgem->nexec * sizeof(p->exec[0]));
+	memcpy(p->reloc, kgem->reloc, kgem->nreloc * sizeof(p->reloc[0]));
+	memset(p->bos, 0, kgem->nexec * sizeof(p->bos[0]));
+	for (n = 0; n < kgem->nexec; n++) {
+		if (p->exec[n].relocs_ptr == (uintptr_t)kgem->reloc)
+			p->exec[n].relocs_ptr = (uintptr_t)p->reloc;
+	}
+	p->nexec = kgem->nexec;
+
+	p->execbuf = *execbuf;
+	p->execbuf.buffers_ptr = (uintptr_t)p->exec;
+	p->rq = kgem->next_request;
+
+	pthread_mutex_lock(&p->mutex);
+	assert(!p->busy);
+	p->busy = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+
+	kgem->pipeline_pending = true;
+	p->count++;
+
+	DBG(("%s: handed off nexec=%d, nreloc=%d\n",
+	     __FUNCTION__, kgem->nexec, kgem->nreloc));
+	return true;
+}
+
+#if 0
+static void kgem_commit__check_reloc(struct kgem *kgem)
+{
+	struct kgem_request *rq = kgem->next_request;
+	struct kgem_bo *bo;
+	bool has_64bit = kgem->gen >= 0100;
+	int i;
+
+	for (i = 0; i < kgem->nreloc; i++) {
+		list_for_each_entry(bo, &rq->buffers, request) {
+			if (bo->target_handle == kgem->reloc[i].target_handle) {
+				uint64_t value = 0;
 				gem_read(kgem->fd, rq->bo->handle, &value, kgem->reloc[i].offset, has_64bit ? 8 : 4);
 				assert(bo->exec->offset == -1 || value == bo->exec->offset + (int)kgem->reloc[i].delta);
 				break;
@@ -3423,6 +4309,7 @@ static void kgem_commit(struct kgem *kgem)
 {
 	struct kgem_request *rq = kgem->next_request;
 	struct kgem_bo *bo, *next;
+	int idx;
 
 	kgem_commit__check_reloc(kgem);
 
@@ -3438,6 +4325,13 @@ static void kgem_commit(struct kgem *kgem)
 		assert(bo->proxy == NULL || bo->exec == &_kgem_dummy_exec);
 		assert(RQ(bo->rq) == rq || (RQ(bo->proxy->rq) == rq));
 
+		idx = -1;
+		if (kgem->pipeline_pending && bo->proxy == NULL) {
+			idx = bo->exec - kgem->exec;
+			assert(idx >= 0 && idx < kgem->nexec);
+			kgem->pipeline->bos[idx] = bo;
+		}
+
 		bo->presumed_offset = bo->exec->offset;
 		bo->exec = NULL;
 		bo->target_handle = -1;
@@ -3445,6 +4339,8 @@ static void kgem_commit(struct kgem *kgem)
 		if (!bo->refcnt && !bo->reusable) {
 			assert(!bo->snoop);
 			assert(!bo->proxy);
+			if (idx >= 0)
+				kgem->pipeline->bos[idx] = NULL;
 			kgem_bo_free(kgem, bo);
 			continue;
 		}
@@ -3507,9 +4403,11 @@ static void kgem_commit(struct kgem *kgem)
 		assert(rq->bo);
 		list_add_tail(&rq->list, &kgem->requests[rq->ring]);
 		kgem->need_throttle = kgem->need_retire = 1;
+		kgem_retirer_queue(kgem, rq);
 
 		if (kgem->fence[rq->ring] == NULL &&
-		    __kgem_busy(kgem, rq->bo->handle))
+		    (kgem->pipeline_pending ||
+		     kgem_request_busy(kgem, rq)))
 			kgem->fence[rq->ring] = rq;
 	}
 
@@ -4115,6 +5013,86 @@ retry:
 	return ret;
 }
 
+static const char * const kgem_flush_reasons[NUM_KGEM_FLUSH] = {
+	[KGEM_FLUSH_OTHER] = "other",
+	[KGEM_FLUSH_BATCH] = "batch",
+	[KGEM_FLUSH_EXEC] = "exec",
+	[KGEM_FLUSH_RELOC] = "reloc",
+	[KGEM_FLUSH_APERTURE] = "aperture",
+	[KGEM_FLUSH_RING] = "ring",
+	[KGEM_FLUSH_IDLE] = "idle",
+	[KGEM_FLUSH_SYNC] = "sync",
+	[KGEM_FLUSH_SCANOUT] = "scanout",
+	[KGEM_FLUSH_THROTTLE] = "throttle",
+	[KGEM_FLUSH_CLIENT] = "client",
+	[KGEM_FLUSH_BLOCK] = "block",
+};
+
+static inline int kgem_hist_bucket(unsigned long v)
+{
+	return v ? MIN(__fls(v) + 1, KGEM_HIST_BUCKETS - 1) : 0;
+}
+
+static void kgem_account_batch(struct kgem *kgem)
+{
+	struct kgem_batch_stats *stats = &kgem->batch_stats;
+
+	DBG(("%s: reason=%s, dwords=%d, nexec=%d, nreloc=%d, aperture=%d\n",
+	     __FUNCTION__, kgem_flush_reasons[kgem->flush_reason],
+	     kgem->nbatch + kgem->batch_size - kgem->surface,
+	     kgem->nexec, kgem->nreloc, kgem->aperture));
+
+	stats->reason[kgem->flush_reason]++;
+	stats->dwords[kgem_hist_bucket(kgem->nbatch + kgem->batch_size - kgem->surface)]++;
+	stats->exec[kgem_hist_bucket(kgem->nexec)]++;
+	stats->reloc[kgem_hist_bucket(kgem->nreloc)]++;
+	stats->aperture[kgem_hist_bucket(kgem->aperture)]++;
+
+	kgem->flush_reason = KGEM_FLUSH_OTHER;
+}
+
+static void print_histogram(FILE *file, const char *name,
+			    const unsigned long *hist)
+{
+	int n, last;
+
+	for (last = KGEM_HIST_BUCKETS; last && hist[last-1] == 0; last--)
+		;
+
+	fprintf(file, "%s:", name);
+	for (n = 0; n < last; n++)
+		fprintf(file, " %lu", hist[n]);
+	fprintf(file, "\n");
+}
+
+void kgem_print_batch_stats(struct kgem *kgem, FILE *file)
+{
+	const struct kgem_batch_stats *stats = &kgem->batch_stats;
+	unsigned long total = 0;
+	int n;
+
+	for (n = 0; n < NUM_KGEM_FLUSH; n++)
+		total += stats->reason[n];
+
+	fprintf(file, "batches: %lu\n", total);
+	fprintf(file, "flush:");
+	for (n = 0; n < NUM_KGEM_FLUSH; n++)
+		fprintf(file, " %s=%lu", kgem_flush_reasons[n], stats->reason[n]);
+	fprintf(file, "\n");
+
+	/* counts of batches by power-of-two bucket: 0, 1, 2-3, 4-7, ... */
+	print_histogram(file, "dwords", stats->dwords);
+	print_histogram(file, "exec", stats->exec);
+	print_histogram(file, "reloc", stats->reloc);
+	print_histogram(file, "aperture", stats->aperture);
+
+	fprintf(file, "vma: hit=%lu miss=%lu munmap=%lu cached=%u/%u (%lldKiB)\n",
+		kgem->vma_stats.hit, kgem->vma_stats.miss,
+		kgem->vma_stats.munmap,
+		kgem->vma_cache.count, kgem->vma_cache.max_count,
+		(long long)(kgem->vma_cache.bytes >> 10));
+}
+
 void _kgem_submit(struct kgem *kgem)
 {
 	struct kgem_request *rq;
@@ -4128,6 +5106,8 @@ void _kgem_submit(struct kgem *kgem)
 	assert(kgem->nbatch <= KGEM_BATCH_SIZE(kgem));
 	assert(kgem->nbatch <= kgem->surface);
 
+	kgem_account_batch(kgem);
+
 	batch_end = kgem_end_batch(kgem);
 	kgem_sna_flush(kgem);
 
@@ -4138,8 +5118,8 @@ void _kgem_submit(struct kgem *kgem)
 
 	assert(kgem->nbatch <= kgem->batch_size);
 	assert(kgem->nbatch <= kgem->surface);
-	assert(kgem->nreloc <= ARRAY_SIZE(kgem->reloc));
-	assert(kgem->nexec < ARRAY_SIZE(kgem->exec));
+	assert(kgem->nreloc <= kgem->max_reloc);
+	assert(kgem->nexec < kgem->max_exec);
 	assert(kgem->nfence <= kgem->fence_max);
 
 	kgem_finish_buffers(kgem);
@@ -4190,7 +5170,10 @@ void _kgem_submit(struct kgem *kgem)
 			}
 		}
 
-		ret = do_execbuf(kgem, &execbuf);
+		if (DEBUG_SYNC || !kgem_pipeline_submit(kgem, &execbuf))
+			ret = do_execbuf(kgem, &execbuf);
+		else
+			ret = 0;
 	} else
 		ret = -ENOMEM;
 
@@ -4360,6 +5343,49 @@ void kgem_clean_scanout_cache(struct kgem *kgem)
 	}
 }
 
+/* Discard one mapping of an inactive bo. Of a bo mapped both ways, we
+ * first discard the mapping it was not last accessed through, and leave
+ * it at the tail of the LRU to lose the other next.
+ */
+static void kgem_bo_release_vma(struct kgem *kgem, struct kgem_bo *bo)
+{
+	int type;
+
+	assert(bo->rq == NULL);
+	assert(!list_is_empty(&bo->vma));
+
+	type = vma_cache_type(bo);
+	if (bo->map__cpu && (bo->map__gtt || bo->map__wc))
+		type = !type;
+
+	DBG(("%s: discarding inactive %s vma cache for %d\n",
+	     __FUNCTION__, type == MAP_CPU ? "CPU" : "GTT", bo->handle));
+
+	kgem_bo_vma_uncache(kgem, bo);
+	if (type == MAP_CPU) {
+		VG(VALGRIND_MAKE_MEM_NOACCESS(MAP(bo->map__cpu), bytes(bo)));
+		kgem_munmap(kgem, MAP(bo->map__cpu), bytes(bo));
+		bo->map__cpu = NULL;
+	} else {
+		if (bo->map__wc) {
+			VG(VALGRIND_MAKE_MEM_NOACCESS(bo->map__wc, bytes(bo)));
+			kgem_munmap(kgem, bo->map__wc, bytes(bo));
+			bo->map__wc = NULL;
+		}
+		if (bo->map__gtt) {
+			kgem_munmap(kgem, bo->map__gtt, bytes(bo));
+			bo->map__gtt = NULL;
+		}
+	}
+
+	kgem_bo_vma_cache(kgem, bo);
+	if (!list_is_empty(&bo->vma_lru))
+		list_move_tail(&bo->vma_lru, &kgem->vma_cache.lru);
+
+	assert(!list_is_empty(&bo->index));
+	kgem_bo_index(kgem, bo);
+}
+
 void kgem_clean_large_cache(struct kgem *kgem)
 {
 	while (!list_is_empty(&kgem->large_inactive)) {
@@ -4370,17 +5396,201 @@ void kgem_clean_large_cache(struct kgem *kgem)
 	}
 }
 
+static int read_file(const char *path, char *buf, int len)
+{
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret <= 0)
+		return 0;
+
+	buf[ret] = '\0';
+	return ret;
+}
+
+/* Percentage of the tightest cgroup v2 memory limit (memory.high or
+ * memory.max) currently in use by ourselves or any ancestor, or -1 if
+ * we are not limited.
+ */
+static int cgroup_memory_usage(void)
+{
+	char buf[4096], path[4096 + 32], val[64];
+	char *cg, *end;
+	int usage = -1;
+
+	if (!read_file("/proc/self/cgroup", buf, sizeof(buf)))
+		return -1;
+
+	if (strncmp(buf, "0::", 3) == 0)
+		cg = buf + 3;
+	else if ((cg = strstr(buf, "\n0::")))
+		cg += 4;
+	else
+		return -1;
+
+	end = strchr(cg, '\n');
+	if (end)
+		*end = '\0';
+	if (*cg != '/')
+		return -1;
+
+	for (;;) {
+		unsigned long long limit = 0, v;
+
+		/* "max" fails to parse, leaving the level unlimited */
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.high", cg);
+		if (read_file(path, val, sizeof(val)) &&
+		    sscanf(val, "%llu", &v) == 1 && v)
+			limit = v;
+
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", cg);
+		if (read_file(path, val, sizeof(val)) &&
+		    sscanf(val, "%llu", &v) == 1 && v &&
+		    (limit == 0 || v < limit))
+			limit = v;
+
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.current", cg);
+		if (limit &&
+		    read_file(path, val, sizeof(val)) &&
+		    sscanf(val, "%llu", &v) == 1) {
+			int pct = v * 100 / limit;
+			DBG(("%s: %s using %llu of %llu bytes (%d%%)\n",
+			     __FUNCTION__, cg, v, limit, pct));
+			if (pct > usage)
+				usage = pct;
+		}
+
+		end = strrchr(cg, '/');
+		if (end == cg) {
+			if (cg[1] == '\0')
+				break;
+			cg[1] = '\0';
+		} else
+			*end = '\0';
+	}
+
+	return usage;
+}
+
+/* How much of the bo caches to release, as a percentage, judged from
+ * the kernel's memory pressure stall information and from how close
+ * we are to our cgroup limit. *warm is set only when we know that
+ * there is plenty of room to keep the caches around for longer.
+ */
+static int kgem_memory_pressure(bool *warm)
+{
+	char buf[256];
+	float avg10 = -1;
+	int usage, level = 0;
+
+	if (read_file("/proc/pressure/memory", buf, sizeof(buf)) &&
+	    sscanf(buf, "some avg10=%f", &avg10) == 1)
+		level = avg10 * PRESSURE_PSI_SCALE;
+
+	usage = cgroup_memory_usage();
+	if (usage > PRESSURE_CGROUP_TRIM) {
+		int trim = (usage - PRESSURE_CGROUP_TRIM) * 100 / (100 - PRESSURE_CGROUP_TRIM);
+		if (trim > level)
+			level = trim;
+	}
+	if (level > 100)
+		level = 100;
+	if (level < PRESSURE_MIN_LEVEL)
+		level = 0;
+
+	*warm = avg10 == 0 && usage < PRESSURE_CGROUP_WARM;
+
+	DBG(("%s: psi avg10=%.2f, cgroup usage=%d%% -> level=%d%%, warm? %d\n",
+	     __FUNCTION__, avg10, usage, level, *warm));
+	return level;
+}
+
+/* Release the oldest level% of each inactive cache bucket, of the large
+ * and snoop caches and of the remaining inactive vma. The counts are
+ * rounded down so that mild pressure leaves the small buckets alone.
+ */
+static void kgem_trim_caches(struct kgem *kgem, int level)
+{
+	struct kgem_bo *bo;
+	unsigned int i;
+	int count, n, freed = 0, unmapped = 0;
+	long size = 0, total = 0;
+
+	assert(level > 0 && level <= 100);
+
+	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
+		count = 0;
+		list_for_each_entry(bo, &kgem->inactive[i], list)
+			count++, total += bytes(bo);
+
+		for (n = count * level / 100; n--; ) {
+			bo = list_last_entry(&kgem->inactive[i],
+					     struct kgem_bo, list);
+			freed++, size += bytes(bo);
+			kgem_bo_free(kgem, bo);
+		}
+	}
+
+	count = 0;
+	list_for_each_entry(bo, &kgem->large_inactive, list)
+		count++, total += bytes(bo);
+	for (n = count * level / 100; n--; ) {
+		bo = list_last_entry(&kgem->large_inactive,
+				     struct kgem_bo, list);
+		freed++, size += bytes(bo);
+		kgem_bo_free(kgem, bo);
+	}
+
+	count = 0;
+	list_for_each_entry(bo, &kgem->snoop, list)
+		count++, total += bytes(bo);
+	for (n = count * level / 100; n--; ) {
+		bo = list_last_entry(&kgem->snoop, struct kgem_bo, list);
+		freed++, size += bytes(bo);
+		kgem_bo_free(kgem, bo);
+	}
+
+	for (n = kgem->vma_cache.count * level / 100; n--; ) {
+		if (list_is_empty(&kgem->vma_cache.lru))
+			break;
+
+		kgem_bo_release_vma(kgem,
+				    list_last_entry(&kgem->vma_cache.lru,
+						    struct kgem_bo, vma_lru));
+		unmapped++;
+	}
+
+	DBG(("%s: level=%d%%, released %d bo, %ld of %ld cached bytes, and %d vma\n",
+	     __FUNCTION__, level, freed, size, total, unmapped));
+	(void)freed;
+	(void)unmapped;
+	(void)size;
+	(void)total;
+}
+
 bool kgem_expire_cache(struct kgem *kgem)
 {
-	time_t now, expire;
+	time_t now, expire, lifetime;
 	struct kgem_bo *bo;
 	unsigned int size = 0, count = 0;
-	bool idle;
+	bool idle, warm;
 	unsigned int i;
+	int level;
 
 	if (!time(&now))
 		return false;
 
+	DBG(("%s: linear cache hit=%lu, miss=%lu, walk=%lu\n",
+	     __FUNCTION__,
+	     kgem->cache_stats.hit,
+	     kgem->cache_stats.miss,
+	     kgem->cache_stats.walk));
+
 	while (__kgem_freed_bo) {
 		bo = __kgem_freed_bo;
 		__kgem_freed_bo = *(struct kgem_bo **)bo;
@@ -4393,14 +5603,19 @@ bool kgem_expire_cache(struct kgem *kgem)
 		free(rq);
 	}
 
+	level = kgem_memory_pressure(&warm);
+	if (level)
+		kgem_trim_caches(kgem, level);
+
 	kgem_clean_large_cache(kgem);
 	if (__to_sna(kgem)->scrn->vtSema)
 		kgem_clean_scanout_cache(kgem);
+	lifetime = warm ? 2*MAX_INACTIVE_TIME : MAX_INACTIVE_TIME;
 
 	expire = 0;
 	list_for_each_entry(bo, &kgem->snoop, list) {
 		if (bo->delta) {
-			expire = now - MAX_INACTIVE_TIME/2;
+			expire = now - lifetime/2;
 			break;
 		}
 
@@ -4446,7 +5661,7 @@ bool kgem_expire_cache(struct kgem *kgem)
 		idle &= list_is_empty(&kgem->inactive[i]);
 		list_for_each_entry(bo, &kgem->inactive[i], list) {
 			if (bo->delta) {
-				expire = now - MAX_INACTIVE_TIME;
+				expire = now - lifetime;
 				break;
 			}
 
@@ -4571,7 +5786,136 @@ bool kgem_cleanup_cache(struct kgem *kgem)
 }
 
 static struct kgem_bo *
-search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+__search_linear_index(struct kgem *kgem, unsigned int num_pages,
+		      int map, int tiled, int last)
+{
+	struct kgem_bo *bo, *best = NULL;
+	struct list *cache;
+	int class;
+
+	class = cache_class(num_pages, cache_bucket(num_pages));
+	assert(class < last);
+
+	/* Only the bo within our own class may be too small */
+	cache = &kgem->index[map][tiled][class];
+	list_for_each_entry(bo, cache, index) {
+		kgem->cache_stats.walk++;
+
+		if (num_pages > num_pages(bo))
+			continue;
+
+		if (best == NULL || num_pages(bo) < num_pages(best)) {
+			best = bo;
+			if (num_pages(bo) == num_pages)
+				break;
+		}
+	}
+	if (best)
+		return best;
+
+	/* and anything in a larger class will fit */
+	while (++class < last) {
+		cache = &kgem->index[map][tiled][class];
+		if (!list_is_empty(cache)) {
+			kgem->cache_stats.walk++;
+			return list_first_entry(cache, struct kgem_bo, index);
+		}
+	}
+
+	return NULL;
+}
+
+static struct kgem_bo *
+search_linear_index(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+{
+	static const int8_t order[3][NUM_MAP_TYPES + 1] = {
+		{ MAP_NONE, MAP_CPU, MAP_GTT },
+		{ MAP_GTT, MAP_NONE, MAP_CPU },
+		{ MAP_CPU, MAP_NONE, MAP_GTT },
+	};
+	int want, max, last, tiled, n;
+	struct kgem_bo *bo;
+
+	want = 0;
+	if (flags & CREATE_CPU_MAP)
+		want = 2;
+	else if (flags & CREATE_GTT_MAP)
+		want = 1;
+
+	max = ARRAY_SIZE(order[want]);
+	if (want && flags & CREATE_EXACT)
+		max = 1;
+	if (flags & CREATE_CPU_MAP && !kgem->has_llc)
+		max = 1;
+
+	/* Stay within the power-of-two bucket, except for large objects */
+	if (num_pages >= MAX_CACHE_SIZE / PAGE_SIZE)
+		last = NUM_CACHE_CLASSES;
+	else
+		last = (cache_bucket(num_pages) + 1) << CACHE_CLASS_SHIFT;
+
+	DBG(("%s: num_pages=%d, map=%d, classes=[%d, %d)\n",
+	     __FUNCTION__, num_pages, order[want][0],
+	     cache_class(num_pages, cache_bucket(num_pages)), last));
+
+	for (tiled = 0; tiled < 2; tiled++) {
+		for (n = 0; n < max; n++) {
+			/* Only retile a bo if it already has the right mapping */
+			if (tiled && want && n)
+				break;
+
+retry:
+			bo = __search_linear_index(kgem, num_pages,
+						   order[want][n], tiled, last);
+			if (bo == NULL)
+				continue;
+
+			assert(bo->refcnt == 0);
+			assert(bo->reusable);
+			assert(bo->proxy == NULL);
+			assert(bo->rq == NULL);
+			assert(bo->exec == NULL);
+			assert(!bo->scanout);
+			assert(num_pages(bo) >= num_pages);
+
+			if (flags & CREATE_GTT_MAP &&
+			    order[want][n] == MAP_NONE &&
+			    !kgem_bo_can_map(kgem, bo))
+				continue;
+
+			if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
+				kgem_bo_free(kgem, bo);
+				goto retry;
+			}
+
+			if (!kgem_set_tiling(kgem, bo, I915_TILING_NONE, 0)) {
+				kgem_bo_free(kgem, bo);
+				goto retry;
+			}
+
+			kgem_bo_remove_from_inactive(kgem, bo);
+			assert(list_is_empty(&bo->list));
+			assert(list_is_empty(&bo->vma));
+
+			assert(bo->tiling == I915_TILING_NONE);
+			assert(bo->pitch == 0);
+			bo->delta = 0;
+			DBG(("  %s: found handle=%d (num_pages=%d) in linear index [map=%d, tiled=%d]\n",
+			     __FUNCTION__, bo->handle, num_pages(bo),
+			     order[want][n], tiled));
+			assert(bo->domain != DOMAIN_GPU);
+			assert(!bo->needs_flush);
+			assert_tiling(kgem, bo);
+			ASSERT_IDLE(kgem, bo->handle);
+			return bo;
+		}
+	}
+
+	return NULL;
+}
+
+static struct kgem_bo *
+__search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 {
 	struct kgem_bo *bo, *first = NULL;
 	bool use_active = (flags & CREATE_INACTIVE) == 0;
@@ -4586,49 +5930,44 @@ search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 
 	if (num_pages >= MAX_CACHE_SIZE / PAGE_SIZE) {
 		DBG(("%s: searching large buffers\n", __FUNCTION__));
-retry_large:
-		cache = use_active ? &kgem->large : &kgem->large_inactive;
-		list_for_each_entry_safe(bo, first, cache, list) {
-			assert(bo->refcnt == 0);
-			assert(bo->reusable);
-			assert(!bo->scanout);
+		if (use_active) {
+			list_for_each_entry(bo, &kgem->large, list) {
+				kgem->cache_stats.walk++;
 
-			if (num_pages > num_pages(bo))
-				goto discard;
+				assert(bo->refcnt == 0);
+				assert(bo->reusable);
+				assert(!bo->scanout);
 
-			if (bo->tiling != I915_TILING_NONE) {
-				if (use_active && kgem->gen < 040)
-					goto discard;
+				if (num_pages > num_pages(bo))
+					continue;
 
-				if (!kgem_set_tiling(kgem, bo,
-						    I915_TILING_NONE, 0))
-					goto discard;
-			}
-			assert(bo->tiling == I915_TILING_NONE);
-			bo->pitch = 0;
+				if (bo->tiling != I915_TILING_NONE) {
+					if (kgem->gen < 040)
+						continue;
 
-			if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo))
-				goto discard;
+					if (!kgem_set_tiling(kgem, bo,
+							     I915_TILING_NONE, 0))
+						continue;
+				}
+				assert(bo->tiling == I915_TILING_NONE);
+				bo->pitch = 0;
 
-			list_del(&bo->list);
-			if (RQ(bo->rq) == (void *)kgem) {
-				assert(bo->exec == NULL);
-				list_del(&bo->request);
-			}
+				if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo))
+					continue;
 
-			bo->delta = 0;
-			assert_tiling(kgem, bo);
-			return bo;
+				kgem_bo_remove_from_active(kgem, bo);
 
-discard:
-			if (!use_active)
-				kgem_bo_free(kgem, bo);
+				bo->delta = 0;
+				assert_tiling(kgem, bo);
+				return bo;
+			}
 		}
 
-		if (use_active) {
-			use_active = false;
-			goto retry_large;
-		}
+retry_large:
+		bo = search_linear_index(kgem, num_pages,
+					 flags & ~(CREATE_CPU_MAP | CREATE_GTT_MAP));
+		if (bo)
+			return bo;
 
 		if (__kgem_throttle_retire(kgem, flags))
 			goto retry_large;
@@ -4662,72 +6001,23 @@ discard:
 		}
 	}
 
-	if (!use_active && flags & (CREATE_CPU_MAP | CREATE_GTT_MAP)) {
-		int for_cpu = !!(flags & CREATE_CPU_MAP);
-		DBG(("%s: searching for inactive %s map\n",
-		     __FUNCTION__, for_cpu ? "cpu" : "gtt"));
-		cache = &kgem->vma[for_cpu].inactive[cache_bucket(num_pages)];
-		list_for_each_entry(bo, cache, vma) {
-			assert(for_cpu ? !!bo->map__cpu : (bo->map__gtt || bo->map__wc));
-			assert(bucket(bo) == cache_bucket(num_pages));
-			assert(bo->proxy == NULL);
-			assert(bo->rq == NULL);
-			assert(bo->exec == NULL);
-			assert(!bo->scanout);
-
-			if (num_pages > num_pages(bo)) {
-				DBG(("inactive too small: %d < %d\n",
-				     num_pages(bo), num_pages));
-				continue;
-			}
-
-			if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
-				kgem_bo_free(kgem, bo);
-				break;
-			}
-
-			if (!kgem_set_tiling(kgem, bo, I915_TILING_NONE, 0)) {
-				kgem_bo_free(kgem, bo);
-				break;
-			}
-
-			kgem_bo_remove_from_inactive(kgem, bo);
-			assert(list_is_empty(&bo->vma));
-			assert(list_is_empty(&bo->list));
-
-			assert(bo->tiling == I915_TILING_NONE);
-			assert(bo->pitch == 0);
-			bo->delta = 0;
-			DBG(("  %s: found handle=%d (num_pages=%d) in linear vma cache\n",
-			     __FUNCTION__, bo->handle, num_pages(bo)));
-			assert(use_active || bo->domain != DOMAIN_GPU);
-			assert(!bo->needs_flush);
-			assert_tiling(kgem, bo);
-			ASSERT_MAYBE_IDLE(kgem, bo->handle, !use_active);
-			return bo;
-		}
-
-		if (flags & CREATE_EXACT)
-			return NULL;
-
-		if (flags & CREATE_CPU_MAP && !kgem->has_llc)
-			return NULL;
-	}
+	if (!use_active)
+		return search_linear_index(kgem, num_pages, flags);
 
-	cache = use_active ? active(kgem, num_pages, I915_TILING_NONE) : inactive(kgem, num_pages);
+	cache = active(kgem, num_pages, I915_TILING_NONE);
 	list_for_each_entry(bo, cache, list) {
+		kgem->cache_stats.walk++;
+
 		assert(bo->refcnt == 0);
 		assert(bo->reusable);
-		assert(!!bo->rq == !!use_active);
+		assert(bo->rq);
 		assert(bo->proxy == NULL);
 		assert(!bo->scanout);
 
 		if (num_pages > num_pages(bo))
 			continue;
 
-		if (use_active &&
-		    kgem->gen <= 040 &&
-		    bo->tiling != I915_TILING_NONE)
+		if (kgem->gen <= 040 && bo->tiling != I915_TILING_NONE)
 			continue;
 
 		if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
@@ -4778,50 +6068,50 @@ discard:
 			}
 		}
 
-		if (use_active)
-			kgem_bo_remove_from_active(kgem, bo);
-		else
-			kgem_bo_remove_from_inactive(kgem, bo);
+		kgem_bo_remove_from_active(kgem, bo);
 
 		assert(bo->tiling == I915_TILING_NONE);
 		assert(bo->pitch == 0);
 		bo->delta = 0;
-		DBG(("  %s: found handle=%d (num_pages=%d) in linear %s cache\n",
-		     __FUNCTION__, bo->handle, num_pages(bo),
-		     use_active ? "active" : "inactive"));
+		DBG(("  %s: found handle=%d (num_pages=%d) in linear active cache\n",
+		     __FUNCTION__, bo->handle, num_pages(bo)));
 		assert(list_is_empty(&bo->list));
 		assert(list_is_empty(&bo->vma));
-		assert(use_active || bo->domain != DOMAIN_GPU);
-		assert(!bo->needs_flush || use_active);
 		assert_tiling(kgem, bo);
-		ASSERT_MAYBE_IDLE(kgem, bo->handle, !use_active);
 		return bo;
 	}
 
 	if (first) {
 		assert(first->tiling == I915_TILING_NONE);
 
-		if (use_active)
-			kgem_bo_remove_from_active(kgem, first);
-		else
-			kgem_bo_remove_from_inactive(kgem, first);
+		kgem_bo_remove_from_active(kgem, first);
 
 		first->pitch = 0;
 		first->delta = 0;
-		DBG(("  %s: found handle=%d (near-miss) (num_pages=%d) in linear %s cache\n",
-		     __FUNCTION__, first->handle, num_pages(first),
-		     use_active ? "active" : "inactive"));
+		DBG(("  %s: found handle=%d (near-miss) (num_pages=%d) in linear active cache\n",
+		     __FUNCTION__, first->handle, num_pages(first)));
 		assert(list_is_empty(&first->list));
 		assert(list_is_empty(&first->vma));
-		assert(use_active || first->domain != DOMAIN_GPU);
-		assert(!first->needs_flush || use_active);
-		ASSERT_MAYBE_IDLE(kgem, first->handle, !use_active);
 		return first;
 	}
 
 	return NULL;
 }
 
+static struct kgem_bo *
+search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+{
+	struct kgem_bo *bo;
+
+	bo = __search_linear_cache(kgem, num_pages, flags);
+	if (bo)
+		kgem->cache_stats.hit++;
+	else
+		kgem->cache_stats.miss++;
+
+	return bo;
+}
+
 struct kgem_bo *kgem_create_for_name(struct kgem *kgem, uint32_t name)
 {
 	struct drm_gem_open open_arg;
@@ -4922,7 +6212,7 @@ struct kgem_bo *kgem_create_for_prime(struct kgem *kgem, int name, uint32_t size
 	VG_CLEAR(caching);
 	caching.handle = args.handle;
 	caching.caching = kgem->has_llc;
-	(void)drmIoctl(kgem->fd, LOCAL_IOCTL_I915_GEM_GET_CACHING, &caching);
+	(void)do_ioctl(kgem->fd, LOCAL_IOCTL_I915_GEM_GET_CACHING, &caching);
 	DBG(("%s: imported handle=%d has caching %d\n", __FUNCTION__, args.handle, caching.caching));
 	switch (caching.caching) {
 	case 0:
@@ -5343,12 +6633,15 @@ static void set_gpu_tiling(struct kgem *kgem,
 	     __FUNCTION__, bo->handle, tiling, pitch));
 
 	if (tiling_changed(bo, tiling, pitch) && bo->map__gtt) {
-		if (!list_is_empty(&bo->vma)) {
-			list_del(&bo->vma);
-			kgem->vma[0].count--;
-		}
-		munmap(bo->map__gtt, bytes(bo));
+		bool cached = !list_is_empty(&bo->vma);
+
+		kgem_bo_vma_uncache(kgem, bo);
+		kgem_munmap(kgem, bo->map__gtt, bytes(bo));
 		bo->map__gtt = NULL;
+		if (cached) {
+			kgem_bo_vma_cache(kgem, bo);
+			kgem_bo_index(kgem, bo);
+		}
 	}
 
 	bo->tiling = tiling;
@@ -5597,6 +6890,7 @@ large_inactive:
 			}
 
 			list_del(&bo->list);
+			list_del(&bo->index);
 
 			assert(bo->domain != DOMAIN_GPU);
 			bo->unique_id = kgem_get_unique_id(kgem);
@@ -6181,7 +7475,12 @@ void kgem_scanout_flush(struct kgem *kgem, struct kgem_bo *bo)
 	if (!bo->needs_flush && !bo->gtt_dirty)
 		return;
 
-	kgem_bo_submit(kgem, bo);
+	if (bo->exec) {
+		assert(bo->refcnt);
+		kgem->flush_reason = KGEM_FLUSH_SCANOUT;
+		_kgem_submit(kgem);
+	}
+	kgem_pipeline_sync(kgem);
 
 	/* If the kernel fails to emit the flush, then it will be forced when
 	 * we assume direct access. And as the usual failure is EIO, we do
@@ -6195,7 +7494,7 @@ void kgem_scanout_flush(struct kgem *kgem, struct kgem_bo *bo)
 		struct drm_mode_fb_dirty_cmd cmd;
 		memset(&cmd, 0, sizeof(cmd));
 		cmd.fb_id = bo->delta;
-		(void)drmIoctl(kgem->fd, DRM_IOCTL_MODE_DIRTYFB, &cmd);
+		(void)do_ioctl(kgem->fd, DRM_IOCTL_MODE_DIRTYFB, &cmd);
 	}
 
 	/* Whatever actually happens, we can regard the GTT write domain
@@ -6261,6 +7560,7 @@ static bool aperture_check(struct kgem *kgem, unsigned num_pages)
 	struct drm_i915_gem_get_aperture aperture;
 	int reserve;
 
+	kgem->flush_reason = KGEM_FLUSH_APERTURE;
 	if (kgem->aperture)
 		return false;
 
@@ -6285,7 +7585,11 @@ static bool aperture_check(struct kgem *kgem, unsigned num_pages)
 	     (long)num_pages * PAGE_SIZE,
 	     (long)aperture.aper_available_size));
 
-	return num_pages <= aperture.aper_available_size / PAGE_SIZE;
+	if (num_pages > aperture.aper_available_size / PAGE_SIZE)
+		return false;
+
+	kgem->flush_reason = KGEM_FLUSH_OTHER;
+	return true;
 }
 
 static inline bool kgem_flush(struct kgem *kgem, bool flush)
@@ -6342,11 +7646,8 @@ bool kgem_check_bo(struct kgem *kgem, ...)
 	if (!num_pages)
 		return true;
 
-	if (kgem->nexec + num_exec >= KGEM_EXEC_SIZE(kgem)) {
-		DBG(("%s: out of exec slots (%d + %d / %d)\n", __FUNCTION__,
-		     kgem->nexec, num_exec, KGEM_EXEC_SIZE(kgem)));
+	if (!kgem_check_exec(kgem, num_exec + 1))
 		return false;
-	}
 
 	if (num_pages + kgem->aperture > kgem->aperture_high) {
 		DBG(("%s: final aperture usage (%d + %d) is greater than high water mark (%d)\n",
@@ -6407,7 +7708,7 @@ bool kgem_check_bo_fenced(struct kgem *kgem, struct kgem_bo *bo)
 		return true;
 	}
 
-	if (kgem->nexec >= KGEM_EXEC_SIZE(kgem) - 1)
+	if (!kgem_check_exec(kgem, 2))
 		return false;
 
 	if (needs_batch_flush(kgem, bo))
@@ -6543,7 +7844,7 @@ bool kgem_check_many_bo_fenced(struct kgem *kgem, ...)
 	if (num_pages == 0)
 		return true;
 
-	if (kgem->nexec + num_exec >= KGEM_EXEC_SIZE(kgem))
+	if (!kgem_check_exec(kgem, num_exec + 1))
 		return false;
 
 	if (num_pages + kgem->aperture > kgem->aperture_high - kgem->aperture_fenced) {
@@ -6622,7 +7923,7 @@ uint32_t kgem_add_reloc(struct kgem *kgem,
 	assert((read_write_domain & 0x7fff) == 0 || bo != NULL);
 
 	index = kgem->nreloc++;
-	assert(index < ARRAY_SIZE(kgem->reloc));
+	assert(index < kgem->max_reloc);
 	kgem->reloc[index].offset = pos * sizeof(kgem->batch[0]);
 	if (bo) {
 		assert(kgem->mode != KGEM_NONE);
@@ -6705,7 +8006,7 @@ uint64_t kgem_add_reloc64(struct kgem *kgem,
 	assert((read_write_domain & 0x7fff) == 0 || bo != NULL);
 
 	index = kgem->nreloc++;
-	assert(index < ARRAY_SIZE(kgem->reloc));
+	assert(index < kgem->max_reloc);
 	kgem->reloc[index].offset = pos * sizeof(kgem->batch[0]);
 	if (bo) {
 		assert(kgem->mode != KGEM_NONE);
@@ -6765,13 +8066,14 @@ uint64_t kgem_add_reloc64(struct kgem *kgem,
 	return delta;
 }
 
-static void kgem_trim_vma_cache(struct kgem *kgem, int type, int bucket)
+static void kgem_trim_vma_cache(struct kgem *kgem)
 {
-	int i, j;
-
-	DBG(("%s: type=%d, count=%d (bucket: %d)\n",
-	     __FUNCTION__, type, kgem->vma[type].count, bucket));
-	if (kgem->vma[type].count <= 0)
+	DBG(("%s: count=%u/%u, bytes=%lld/%lld\n", __FUNCTION__,
+	     kgem->vma_cache.count, kgem->vma_cache.max_count,
+	     (long long)kgem->vma_cache.bytes,
+	     (long long)kgem->vma_cache.max_bytes));
+	if (kgem->vma_cache.count <= kgem->vma_cache.max_count &&
+	    kgem->vma_cache.bytes <= kgem->vma_cache.max_bytes)
 	       return;
 
 	if (kgem->need_purge)
@@ -6782,45 +8084,15 @@ static void kgem_trim_vma_cache(struct kgem *kgem, int type, int bucket)
 	 * mappings. In order to be fair and not hog the cache,
 	 * and more importantly not to exhaust that limit and to
 	 * start failing mappings, we keep our own number of open
-	 * vma to within a conservative value.
+	 * vma to within a conservative value. On 32-bit, it is
+	 * the address space that runs out first.
 	 */
-	i = 0;
-	while (kgem->vma[type].count > 0) {
-		struct kgem_bo *bo = NULL;
-
-		for (j = 0;
-		     bo == NULL && j < ARRAY_SIZE(kgem->vma[type].inactive);
-		     j++) {
-			struct list *head = &kgem->vma[type].inactive[i++%ARRAY_SIZE(kgem->vma[type].inactive)];
-			if (!list_is_empty(head))
-				bo = list_last_entry(head, struct kgem_bo, vma);
-		}
-		if (bo == NULL)
-			break;
-
-		DBG(("%s: discarding inactive %s vma cache for %d\n",
-		     __FUNCTION__, type ? "CPU" : "GTT", bo->handle));
-
-		assert(bo->rq == NULL);
-		if (type) {
-			VG(VALGRIND_MAKE_MEM_NOACCESS(MAP(bo->map__cpu), bytes(bo)));
-			munmap(MAP(bo->map__cpu), bytes(bo));
-			bo->map__cpu = NULL;
-		} else {
-			if (bo->map__wc) {
-				VG(VALGRIND_MAKE_MEM_NOACCESS(bo->map__wc, bytes(bo)));
-				munmap(bo->map__wc, bytes(bo));
-				bo->map__wc = NULL;
-			}
-			if (bo->map__gtt) {
-				munmap(bo->map__gtt, bytes(bo));
-				bo->map__gtt = NULL;
-			}
-		}
-
-		list_del(&bo->vma);
-		kgem->vma[type].count--;
-	}
+	while ((kgem->vma_cache.count > kgem->vma_cache.max_count ||
+		kgem->vma_cache.bytes > kgem->vma_cache.max_bytes) &&
+	       !list_is_empty(&kgem->vma_cache.lru))
+		kgem_bo_release_vma(kgem,
+				    list_last_entry(&kgem->vma_cache.lru,
+						    struct kgem_bo, vma_lru));
 }
 
 static void *__kgem_bo_map__gtt_or_wc(struct kgem *kgem, struct kgem_bo *bo)
@@ -6832,19 +8104,24 @@ static void *__kgem_bo_map__gtt_or_wc(struct kgem *kgem, struct kgem_bo *bo)
 	assert(bo->proxy == NULL);
 	assert(!bo->snoop);
 
-	kgem_trim_vma_cache(kgem, MAP_GTT, bucket(bo));
-
+	bo->vma_cpu = false;
 	if (bo->tiling || !kgem->has_wc_mmap) {
 		assert(kgem->gen != 021 || bo->tiling != I915_TILING_Y);
 		warn_unless(num_pages(bo) <= kgem->aperture_mappable / 2);
 
 		ptr = bo->map__gtt;
-		if (ptr == NULL)
+		if (ptr == NULL) {
+			kgem_trim_vma_cache(kgem);
 			ptr = __kgem_bo_map__gtt(kgem, bo);
+		} else
+			kgem->vma_stats.hit++;
 	} else {
 		ptr = bo->map__wc;
-		if (ptr == NULL)
+		if (ptr == NULL) {
+			kgem_trim_vma_cache(kgem);
 			ptr = __kgem_bo_map__wc(kgem, bo);
+		} else
+			kgem->vma_stats.hit++;
 	}
 
 	return ptr;
@@ -6943,12 +8220,15 @@ void *kgem_bo_map__wc(struct kgem *kgem, struct kgem_bo *bo)
 	assert_tiling(kgem, bo);
 	assert(!bo->purged || bo->reusable);
 
-	if (bo->map__wc)
+	bo->vma_cpu = false;
+	if (bo->map__wc) {
+		kgem->vma_stats.hit++;
 		return bo->map__wc;
+	}
 	if (!kgem->has_wc_mmap)
 		return NULL;
 
-	kgem_trim_vma_cache(kgem, MAP_GTT, bucket(bo));
+	kgem_trim_vma_cache(kgem);
 	return __kgem_bo_map__wc(kgem, bo);
 }
 
@@ -6961,11 +8241,13 @@ void *kgem_bo_map__cpu(struct kgem *kgem, struct kgem_bo *bo)
 	assert(bo->proxy == NULL);
 	assert_tiling(kgem, bo);
 
-	if (bo->map__cpu)
+	bo->vma_cpu = true;
+	if (bo->map__cpu) {
+		kgem->vma_stats.hit++;
 		return MAP(bo->map__cpu);
+	}
 
-	kgem_trim_vma_cache(kgem, MAP_CPU, bucket(bo));
-
+	kgem_trim_vma_cache(kgem);
 	return __kgem_bo_map__cpu(kgem, bo);
 }
 
@@ -7324,7 +8606,9 @@ init_buffer_from_bo(struct kgem_buffer *bo, struct kgem_bo *old)
 	else
 		list_init(&bo->base.request);
 	list_replace(&old->vma, &bo->base.vma);
+	list_init(&bo->base.vma_lru);
 	list_init(&bo->base.list);
+	list_init(&bo->base.index);
 	free(old);
 
 	assert(bo->base.tiling == I915_TILING_NONE);
@@ -7939,6 +9223,7 @@ struct kgem_bo *kgem_upload_source_image(struct kgem *kgem,
 {
 	int width  = box->x2 - box->x1;
 	int height = box->y2 - box->y1;
+	memcpy_box_func upload;
 	struct kgem_bo *bo;
 	void *dst;
 
@@ -7965,11 +9250,12 @@ struct kgem_bo *kgem_upload_source_image(struct kgem *kgem,
 		return NULL;
 	}
 
-	memcpy_blt(data, dst, bpp,
-		   stride, bo->pitch,
-		   box->x1, box->y1,
-		   0, 0,
-		   width, height);
+	upload = memcpy_upload(kgem, height * bo->pitch);
+	upload(data, dst, bpp,
+	       stride, bo->pitch,
+	       box->x1, box->y1,
+	       0, 0,
+	       width, height);
 
 	sigtrap_put();
 	return bo;
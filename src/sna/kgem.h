@@ -31,6 +31,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdio.h>
 
 #include <i915_drm.h>
 
@@ -52,6 +53,8 @@ struct kgem_bo {
 	struct list list;
 	struct list request;
 	struct list vma;
+	struct list vma_lru;
+	struct list index;
 
 	void *map__cpu;
 	void *map__gtt;
@@ -78,6 +81,8 @@ struct kgem_bo {
 			uint32_t bucket:5;
 #define NUM_CACHE_BUCKETS 16
 #define MAX_CACHE_SIZE (1 << (NUM_CACHE_BUCKETS+12))
+#define CACHE_CLASS_SHIFT 2
+#define NUM_CACHE_CLASSES (32 << CACHE_CLASS_SHIFT)
 		} pages;
 		uint32_t bytes;
 	} size;
@@ -94,6 +99,7 @@ struct kgem_bo {
 	uint32_t scanout : 1;
 	uint32_t prime : 1;
 	uint32_t purged : 1;
+	uint32_t vma_cpu : 1; /* last mapped through the CPU */
 };
 #define DOMAIN_NONE 0
 #define DOMAIN_CPU 1
@@ -105,6 +111,7 @@ struct kgem_request {
 	struct kgem_bo *bo;
 	struct list buffers;
 	unsigned ring;
+	uint32_t seqno;
 };
 
 enum {
@@ -133,6 +140,8 @@ struct kgem {
 	uint16_t nreloc__self;
 	uint16_t nfence;
 	uint16_t batch_size;
+	uint16_t max_exec, exec_limit;
+	uint16_t max_reloc, reloc_limit;
 
 	uint32_t *batch;
 
@@ -159,10 +168,50 @@ struct kgem {
 	struct kgem_request *next_request;
 	struct kgem_request static_request;
 
+	/* inactive bo with a cached mmap, by preferred mapping and bucket */
 	struct {
 		struct list inactive[NUM_CACHE_BUCKETS];
-		int16_t count;
 	} vma[NUM_MAP_TYPES];
+	/* and the same bo, most recently used first */
+	struct {
+		struct list lru;
+		unsigned count, max_count;
+		uint64_t bytes, max_bytes;
+	} vma_cache;
+	struct {
+		unsigned long hit, miss, munmap;
+	} vma_stats;
+
+	/* inactive and large_inactive, by [mapping][tiled][size class] */
+	struct list index[NUM_MAP_TYPES + 1][2][NUM_CACHE_CLASSES];
+	struct {
+		unsigned long hit, miss, walk;
+	} cache_stats;
+
+	/* why the batch is being flushed, charged to the next submission */
+	enum kgem_flush_reason {
+		KGEM_FLUSH_OTHER = 0,
+		KGEM_FLUSH_BATCH,
+		KGEM_FLUSH_EXEC,
+		KGEM_FLUSH_RELOC,
+		KGEM_FLUSH_APERTURE,
+		KGEM_FLUSH_RING,
+		KGEM_FLUSH_IDLE,
+		KGEM_FLUSH_SYNC,
+		KGEM_FLUSH_SCANOUT,
+		KGEM_FLUSH_THROTTLE,
+		KGEM_FLUSH_CLIENT,
+		KGEM_FLUSH_BLOCK,
+		NUM_KGEM_FLUSH
+	} flush_reason;
+#define KGEM_HIST_BUCKETS 20 /* log2: 0, 1, 2-3, 4-7, ... */
+	struct kgem_batch_stats {
+		unsigned long reason[NUM_KGEM_FLUSH];
+		unsigned long dwords[KGEM_HIST_BUCKETS];
+		unsigned long exec[KGEM_HIST_BUCKETS];
+		unsigned long reloc[KGEM_HIST_BUCKETS];
+		unsigned long aperture[KGEM_HIST_BUCKETS]; /* pages */
+	} batch_stats;
 
 	uint32_t bcs_state;
 
@@ -180,6 +229,7 @@ struct kgem {
 	uint32_t needs_reservation:1;
 	uint32_t scanout_busy:1;
 	uint32_t busy:1;
+	uint32_t pipeline_pending:1;
 
 	uint32_t has_create2 :1;
 	uint32_t has_userptr :1;
@@ -208,6 +258,7 @@ struct kgem {
 
 	uint16_t fence_max;
 	uint16_t half_cpu_cache_pages;
+	uint16_t stream_upload_pages;
 	uint32_t aperture_total, aperture_high, aperture_low, aperture_mappable, aperture_fenceable;
 	uint32_t aperture, aperture_fenced, aperture_max_fence;
 	uint32_t max_upload_tile_size, max_copy_tile_size;
@@ -222,12 +273,17 @@ struct kgem {
 	memcpy_box_func memcpy_to_tiled_x;
 	memcpy_box_func memcpy_from_tiled_x;
 	memcpy_box_func memcpy_between_tiled_x;
+	memcpy_box_func memcpy_to_tiled_y;
+	memcpy_box_func memcpy_from_tiled_y;
+	memcpy_box_func memcpy_stream;
 
 	struct kgem_bo *batch_bo;
+	struct kgem_pipeline *pipeline;
+	struct kgem_retirer *retirer;
 
 	uint16_t reloc__self[256];
-	struct drm_i915_gem_exec_object2 exec[384] page_aligned;
-	struct drm_i915_gem_relocation_entry reloc[8192] page_aligned;
+	struct drm_i915_gem_exec_object2 *exec;
+	struct drm_i915_gem_relocation_entry *reloc;
 
 #ifdef DEBUG_MEMORY
 	struct {
@@ -248,8 +304,8 @@ struct kgem {
 #endif
 
 #define KGEM_BATCH_SIZE(K) ((K)->batch_size-KGEM_BATCH_RESERVED)
-#define KGEM_EXEC_SIZE(K) (int)(ARRAY_SIZE((K)->exec)-KGEM_EXEC_RESERVED)
-#define KGEM_RELOC_SIZE(K) (int)(ARRAY_SIZE((K)->reloc)-KGEM_RELOC_RESERVED)
+#define KGEM_EXEC_SIZE(K) (int)((K)->max_exec-KGEM_EXEC_RESERVED)
+#define KGEM_RELOC_SIZE(K) (int)((K)->max_reloc-KGEM_RELOC_RESERVED)
 
 void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen);
 void kgem_reset(struct kgem *kgem);
@@ -383,13 +439,39 @@ static inline void kgem_submit(struct kgem *kgem)
 		_kgem_submit(kgem);
 }
 
+static inline void kgem_submit__reason(struct kgem *kgem,
+				       enum kgem_flush_reason reason)
+{
+	if (kgem->nbatch) {
+		kgem->flush_reason = reason;
+		_kgem_submit(kgem);
+	}
+}
+
+void kgem_print_batch_stats(struct kgem *kgem, FILE *file);
+
+bool kgem_pipeline_init(struct kgem *kgem);
+void kgem_pipeline_fini(struct kgem *kgem);
+void __kgem_pipeline_sync(struct kgem *kgem);
+static inline void kgem_pipeline_sync(struct kgem *kgem)
+{
+	if (kgem->pipeline_pending)
+		__kgem_pipeline_sync(kgem);
+}
+
+bool kgem_retirer_init(struct kgem *kgem);
+void kgem_retirer_fini(struct kgem *kgem);
+
 static inline void kgem_bo_submit(struct kgem *kgem, struct kgem_bo *bo)
 {
-	if (bo->exec == NULL)
-		return;
+	if (bo->exec) {
+		assert(bo->refcnt);
+		kgem->flush_reason = KGEM_FLUSH_SYNC;
+		_kgem_submit(kgem);
+	}
 
-	assert(bo->refcnt);
-	_kgem_submit(kgem);
+	/* and make sure the kernel has seen it before anyone else looks */
+	kgem_pipeline_sync(kgem);
 }
 
 void kgem_scanout_flush(struct kgem *kgem, struct kgem_bo *bo);
@@ -412,6 +494,17 @@ static inline void kgem_bo_destroy(struct kgem *kgem, struct kgem_bo *bo)
 
 void kgem_clear_dirty(struct kgem *kgem);
 
+static inline void __kgem_context_switch(struct kgem *kgem, int mode)
+{
+	enum kgem_flush_reason reason = kgem->flush_reason;
+
+	/* Any submission by the backend is due to the change of ring */
+	kgem->flush_reason = KGEM_FLUSH_RING;
+	kgem->context_switch(kgem, mode);
+	if (kgem->flush_reason == KGEM_FLUSH_RING)
+		kgem->flush_reason = reason;
+}
+
 static inline void kgem_set_mode(struct kgem *kgem,
 				 enum kgem_mode mode,
 				 struct kgem_bo *bo)
@@ -424,13 +517,14 @@ static inline void kgem_set_mode(struct kgem *kgem,
 
 	if (kgem->nreloc && bo->rq == NULL && kgem_ring_is_idle(kgem, kgem->ring)) {
 		DBG(("%s: flushing before new bo\n", __FUNCTION__));
+		kgem->flush_reason = KGEM_FLUSH_IDLE;
 		_kgem_submit(kgem);
 	}
 
 	if (kgem->mode == mode)
 		return;
 
-	kgem->context_switch(kgem, mode);
+	__kgem_context_switch(kgem, mode);
 	kgem->mode = mode;
 }
 
@@ -455,19 +549,47 @@ static inline bool kgem_check_batch(struct kgem *kgem, int num_dwords)
 	assert(num_dwords > 0);
 	assert(kgem->nbatch < kgem->surface);
 	assert(kgem->surface <= kgem->batch_size);
-	return likely(kgem->nbatch + num_dwords + KGEM_BATCH_RESERVED <= kgem->surface);
+	if (likely(kgem->nbatch + num_dwords + KGEM_BATCH_RESERVED <= kgem->surface))
+		return true;
+
+	kgem->flush_reason = KGEM_FLUSH_BATCH;
+	return false;
 }
 
+bool __kgem_check_reloc(struct kgem *kgem, int n);
+bool __kgem_check_exec(struct kgem *kgem, int n);
+
 static inline bool kgem_check_reloc(struct kgem *kgem, int n)
 {
 	assert(kgem->nreloc <= KGEM_RELOC_SIZE(kgem));
-	return likely(kgem->nreloc + n <= KGEM_RELOC_SIZE(kgem));
+	if (likely(kgem->nreloc + n <= KGEM_RELOC_SIZE(kgem)))
+		return true;
+
+	return __kgem_check_reloc(kgem, n);
+}
+
+/* The number of relocations still available in this batch, having first
+ * grown the array towards n more (within reloc_limit) if it is short.
+ */
+static inline int kgem_reloc_space(struct kgem *kgem, int n)
+{
+	int avail = kgem->reloc_limit - KGEM_RELOC_RESERVED - kgem->nreloc;
+
+	if (n > avail)
+		n = avail;
+	if (kgem->nreloc + n > KGEM_RELOC_SIZE(kgem))
+		__kgem_check_reloc(kgem, n);
+
+	return KGEM_RELOC_SIZE(kgem) - kgem->nreloc;
 }
 
 static inline bool kgem_check_exec(struct kgem *kgem, int n)
 {
 	assert(kgem->nexec <= KGEM_EXEC_SIZE(kgem));
-	return likely(kgem->nexec + n <= KGEM_EXEC_SIZE(kgem));
+	if (likely(kgem->nexec + n <= KGEM_EXEC_SIZE(kgem)))
+		return true;
+
+	return __kgem_check_exec(kgem, n);
 }
 
 static inline bool kgem_check_reloc_and_exec(struct kgem *kgem, int n)
@@ -479,8 +601,12 @@ static inline bool kgem_check_batch_with_surfaces(struct kgem *kgem,
 						  int num_dwords,
 						  int num_surfaces)
 {
-	return (int)(kgem->nbatch + num_dwords + KGEM_BATCH_RESERVED) <= (int)(kgem->surface - num_surfaces*8) &&
-		kgem_check_reloc(kgem, num_surfaces) &&
+	if ((int)(kgem->nbatch + num_dwords + KGEM_BATCH_RESERVED) > (int)(kgem->surface - num_surfaces*8)) {
+		kgem->flush_reason = KGEM_FLUSH_BATCH;
+		return false;
+	}
+
+	return kgem_check_reloc(kgem, num_surfaces) &&
 		kgem_check_exec(kgem, num_surfaces);
 }
 
@@ -901,6 +1027,71 @@ memcpy_from_tiled_x(struct kgem *kgem,
 					 width, height);
 }
 
+static inline void
+memcpy_to_tiled_y(struct kgem *kgem,
+		  const void *src, void *dst, int bpp,
+		  int32_t src_stride, int32_t dst_stride,
+		  int16_t src_x, int16_t src_y,
+		  int16_t dst_x, int16_t dst_y,
+		  uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_to_tiled_y);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_to_tiled_y(src, dst, bpp,
+				       src_stride, dst_stride,
+				       src_x, src_y,
+				       dst_x, dst_y,
+				       width, height);
+}
+
+static inline void
+memcpy_from_tiled_y(struct kgem *kgem,
+		    const void *src, void *dst, int bpp,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_from_tiled_y);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_from_tiled_y(src, dst, bpp,
+					 src_stride, dst_stride,
+					 src_x, src_y,
+					 dst_x, dst_y,
+					 width, height);
+}
+
 void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu);
+void choose_memcpy_tiled_y(struct kgem *kgem, int swizzling, unsigned cpu);
+void choose_memcpy_stream(struct kgem *kgem, unsigned cpu);
+
+#if HAS_DEBUG_FULL && TEST_BLT
+void memcpy_tiled_selftest(void);
+#else
+static inline void memcpy_tiled_selftest(void) {}
+#endif
+
+#if HAS_KGEM_MOCK
+/* Userspace stand-in for the i915 GEM ioctls, see kgem_mock.c. Pass the
+ * fd returned by kgem_mock_open() to kgem_init() to run without a GPU.
+ */
+extern int kgem_mock_fd;
+int kgem_mock_open(unsigned gen, unsigned latency_us);
+void kgem_mock_close(int fd);
+void kgem_mock_set_submit_latency(unsigned us);
+int kgem_mock_ioctl(int fd, unsigned long request, void *arg);
+#endif
+
+#if HAS_KGEM_MOCK && HAS_DEBUG_FULL && TEST_KGEM
+void kgem_mock_selftest(void);
+#else
+static inline void kgem_mock_selftest(void) {}
+#endif
 
 #endif /* KGEM_H */
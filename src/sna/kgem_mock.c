@@ -0,0 +1,1085 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* A userspace stand-in for the i915 GEM interface, so that kgem can be
+ * exercised and profiled on machines without an Intel GPU.
+ *
+ * The device fd handed to kgem_init() is a single sparse memfd, and every
+ * object is given its own page-aligned range within it. That range doubles
+ * as the object's GTT offset, so the plain mmap(kgem->fd, offset) used for
+ * GTT maps works unmodified, and the CPU, WC and GTT views of an object are
+ * all coherent. There is no fencing or swizzling: tiled objects are stored
+ * linearly behind every view.
+ *
+ * Execbuffer applies the relocations and then marks every object busy for
+ * the configured latency, after which the request is considered retired.
+ * The ioctl itself can also be made to take a fixed time, standing in for
+ * the kernel's cost of validating and queuing the request.
+ *
+ * The mock is only built on request (--enable-kgem-mock), independently of
+ * the debug level so that it can be used to profile an optimised build, and
+ * a production driver never pays for the extra check in the ioctl path.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+#include "sna_reg.h"
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#if HAS_KGEM_MOCK
+
+#define LOCAL_I915_PARAM_HAS_BLT		11
+#define LOCAL_I915_PARAM_HAS_RELAXED_FENCING	12
+#define LOCAL_I915_PARAM_HAS_RELAXED_DELTA	15
+#define LOCAL_I915_PARAM_HAS_LLC		17
+#define LOCAL_I915_PARAM_HAS_NO_RELOC		25
+#define LOCAL_I915_PARAM_HAS_HANDLE_LUT		26
+#define LOCAL_I915_PARAM_MMAP_VERSION		30
+#define LOCAL_I915_PARAM_MMAP_GTT_COHERENT	52
+
+#define LOCAL_I915_EXEC_HANDLE_LUT		(1<<12)
+
+#define LOCAL_I915_GEM_WAIT		0x2c
+#define LOCAL_I915_GEM_SET_CACHING	0x2f
+#define LOCAL_I915_GEM_GET_CACHING	0x30
+#define LOCAL_I915_GEM_USERPTR		0x33
+#define LOCAL_I915_GEM_CONTEXT_GETPARAM	0x34
+
+struct local_i915_gem_wait {
+	uint32_t handle;
+	uint32_t flags;
+	int64_t timeout;
+};
+
+struct local_i915_gem_caching {
+	uint32_t handle;
+	uint32_t caching;
+};
+
+struct local_i915_gem_userptr {
+	uint64_t user_ptr;
+	uint64_t user_size;
+	uint32_t flags;
+	uint32_t handle;
+};
+
+struct local_i915_gem_context_param {
+	uint32_t context;
+	uint32_t size;
+	uint64_t param;
+#define LOCAL_CONTEXT_PARAM_GTT_SIZE	0x3
+	uint64_t value;
+};
+
+struct local_i915_gem_mmap2 {
+	uint32_t handle;
+	uint32_t pad;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t addr_ptr;
+	uint64_t flags;
+};
+
+struct local_i915_gem_get_tiling_v2 {
+	uint32_t handle;
+	uint32_t tiling_mode;
+	uint32_t swizzle_mode;
+	uint32_t phys_swizzle_mode;
+};
+
+#define MOCK_GTT_SIZE (1ull << 32)
+
+struct mock_bo {
+	uint64_t offset;
+	uint64_t size;
+	void *userptr;
+	int64_t busy_until;
+	uint32_t busy;
+	uint32_t tiling;
+	uint32_t stride;
+	uint32_t caching;
+	uint32_t next_free;
+	bool used;
+};
+
+static struct kgem_mock {
+	pthread_mutex_t lock;
+	unsigned gen;
+	int64_t latency;
+	unsigned submit_us;
+
+	uint64_t size;
+	struct mock_bo *bo;
+	uint32_t num_bo, max_bo;
+	uint32_t free_bo;
+} mock = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+int kgem_mock_fd = -1;
+
+static int64_t mock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int mock_memfd(void)
+{
+	char name[] = "/tmp/i915-mock-XXXXXX";
+	int fd;
+
+#ifdef __NR_memfd_create
+	fd = syscall(__NR_memfd_create, "i915-mock", 1 /* MFD_CLOEXEC */);
+	if (fd != -1)
+		return fd;
+#endif
+
+	fd = mkstemp(name);
+	if (fd != -1) {
+		unlink(name);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	return fd;
+}
+
+static struct mock_bo *mock_lookup(uint32_t handle)
+{
+	if (handle == 0 || handle > mock.num_bo)
+		return NULL;
+
+	if (!mock.bo[handle - 1].used)
+		return NULL;
+
+	return &mock.bo[handle - 1];
+}
+
+static uint32_t mock_alloc(uint64_t size, void *userptr)
+{
+	struct mock_bo *bo;
+	uint32_t handle;
+
+	if (mock.free_bo) {
+		handle = mock.free_bo;
+		mock.free_bo = mock.bo[handle - 1].next_free;
+	} else {
+		if (mock.num_bo == mock.max_bo) {
+			uint32_t max = mock.max_bo ? 2 * mock.max_bo : 256;
+			void *new = realloc(mock.bo, max * sizeof(*mock.bo));
+			if (new == NULL)
+				return 0;
+
+			mock.bo = new;
+			mock.max_bo = max;
+		}
+		handle = ++mock.num_bo;
+	}
+
+	bo = &mock.bo[handle - 1];
+	memset(bo, 0, sizeof(*bo));
+	bo->used = true;
+	bo->size = size;
+	bo->userptr = userptr;
+	bo->caching = userptr ? 1 : mock.gen >= 060;
+	if (userptr == NULL) {
+		/* Sparse and never reused, so every object has a unique
+		 * offset (and GTT address) for as long as we run.
+		 */
+		bo->offset = mock.size;
+		if (ftruncate(kgem_mock_fd, mock.size + size)) {
+			bo->used = false;
+			bo->next_free = mock.free_bo;
+			mock.free_bo = handle;
+			return 0;
+		}
+		mock.size += size;
+	}
+
+	DBG(("%s: handle=%d, size=%lld, offset=%llx, userptr=%p\n",
+	     __FUNCTION__, handle, (long long)size,
+	     (long long)bo->offset, userptr));
+	return handle;
+}
+
+static void mock_free(uint32_t handle)
+{
+	struct mock_bo *bo = &mock.bo[handle - 1];
+
+	DBG(("%s: handle=%d\n", __FUNCTION__, handle));
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	/* Give the pages back, any stale mmaps now read zeroes */
+	if (bo->userptr == NULL)
+		(void)fallocate(kgem_mock_fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				bo->offset, bo->size);
+#endif
+
+	bo->used = false;
+	bo->next_free = mock.free_bo;
+	mock.free_bo = handle;
+}
+
+/* Called with the lock held, which is dropped whilst we sleep so that
+ * other threads may continue to submit and query; any mock_bo pointers
+ * must be looked up afresh afterwards.
+ */
+static void mock_wait(struct mock_bo *bo)
+{
+	int64_t delay = bo->busy_until - mock_now();
+
+	if (delay > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = delay / 1000000000;
+		ts.tv_nsec = delay % 1000000000;
+
+		pthread_mutex_unlock(&mock.lock);
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+		pthread_mutex_lock(&mock.lock);
+	}
+}
+
+static bool mock_is_busy(struct mock_bo *bo)
+{
+	if (bo->busy && bo->busy_until <= mock_now())
+		bo->busy = 0;
+
+	return bo->busy;
+}
+
+static int mock_rw(struct mock_bo *bo, uint64_t offset, uint64_t size,
+		   void *data, bool write)
+{
+	ssize_t ret;
+
+	if (offset > bo->size || size > bo->size - offset)
+		return EINVAL;
+
+	if (bo->userptr) {
+		if (write)
+			memcpy((char *)bo->userptr + offset, data, size);
+		else
+			memcpy(data, (char *)bo->userptr + offset, size);
+		return 0;
+	}
+
+	offset += bo->offset;
+	while (size) {
+		if (write)
+			ret = pwrite(kgem_mock_fd, data, size, offset);
+		else
+			ret = pread(kgem_mock_fd, data, size, offset);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return ret < 0 ? errno : EFAULT;
+		}
+
+		data = (char *)data + ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static uint64_t mock_address(struct mock_bo *bo)
+{
+	uint64_t addr;
+
+	/* Keep 0 free so that it can never match an unknown presumed offset */
+	addr = bo->userptr ? (uintptr_t)bo->userptr : bo->offset + PAGE_SIZE;
+	if (mock.gen < 0100)
+		addr &= 0xfffff000;
+	return addr;
+}
+
+static int mock_execbuffer2(struct drm_i915_gem_execbuffer2 *execbuf)
+{
+	struct drm_i915_gem_exec_object2 *exec;
+	struct mock_bo **bo;
+	int64_t busy_until;
+	uint32_t busy;
+	unsigned n, i;
+	int err = 0;
+
+	if (execbuf->buffer_count == 0)
+		return EINVAL;
+
+	exec = (struct drm_i915_gem_exec_object2 *)(uintptr_t)execbuf->buffers_ptr;
+	if (exec == NULL)
+		return EFAULT;
+
+	bo = malloc(execbuf->buffer_count * sizeof(*bo));
+	if (bo == NULL)
+		return ENOMEM;
+
+	for (n = 0; n < execbuf->buffer_count; n++) {
+		bo[n] = mock_lookup(exec[n].handle);
+		if (bo[n] == NULL) {
+			err = ENOENT;
+			goto out;
+		}
+	}
+
+	for (n = 0; n < execbuf->buffer_count; n++) {
+		const struct drm_i915_gem_relocation_entry *reloc =
+			(struct drm_i915_gem_relocation_entry *)(uintptr_t)exec[n].relocs_ptr;
+
+		for (i = 0; i < exec[n].relocation_count; i++) {
+			struct mock_bo *target;
+			uint64_t addr;
+
+			if (execbuf->flags & LOCAL_I915_EXEC_HANDLE_LUT) {
+				if (reloc[i].target_handle >= execbuf->buffer_count) {
+					err = ENOENT;
+					goto out;
+				}
+				target = bo[reloc[i].target_handle];
+			} else {
+				target = mock_lookup(reloc[i].target_handle);
+				if (target == NULL) {
+					err = ENOENT;
+					goto out;
+				}
+			}
+
+			addr = mock_address(target);
+			if (reloc[i].presumed_offset == addr)
+				continue;
+
+			addr += (int32_t)reloc[i].delta;
+			err = mock_rw(bo[n], reloc[i].offset,
+				      mock.gen >= 0100 ? 8 : 4, &addr, true);
+			if (err)
+				goto out;
+		}
+	}
+
+	/* Report the (fixed) placement back, and keep every object
+	 * busy on the requested ring until the simulated latency expires.
+	 */
+	busy = 1 << (16 + ((execbuf->flags & I915_EXEC_RING_MASK) == I915_EXEC_BLT ? 2 : 0));
+	busy_until = mock_now() + mock.latency;
+	for (n = 0; n < execbuf->buffer_count; n++) {
+		exec[n].offset = mock_address(bo[n]);
+		if (mock.latency) {
+			bo[n]->busy = busy;
+			bo[n]->busy_until = busy_until;
+		}
+	}
+
+out:
+	free(bo);
+	return err;
+}
+
+static int mock_getparam(drm_i915_getparam_t *gp)
+{
+	int v;
+
+	switch (gp->param) {
+	case I915_PARAM_NUM_FENCES_AVAIL: v = 32; break;
+	case LOCAL_I915_PARAM_HAS_BLT: v = mock.gen >= 060; break;
+	case LOCAL_I915_PARAM_HAS_RELAXED_FENCING: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_RELAXED_DELTA: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_LLC: v = mock.gen >= 060; break;
+	case LOCAL_I915_PARAM_HAS_NO_RELOC: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_HANDLE_LUT: v = 1; break;
+	case LOCAL_I915_PARAM_MMAP_VERSION: v = 1; break;
+	case LOCAL_I915_PARAM_MMAP_GTT_COHERENT: v = 1; break;
+	default: return EINVAL;
+	}
+
+	*gp->value = v;
+	return 0;
+}
+
+static int mock_mmap(struct local_i915_gem_mmap2 *arg)
+{
+	struct mock_bo *bo;
+	void *ptr;
+
+	bo = mock_lookup(arg->handle);
+	if (bo == NULL)
+		return ENOENT;
+
+	if (bo->userptr)
+		return EINVAL;
+
+	if (arg->offset > bo->size || arg->size > bo->size - arg->offset)
+		return EINVAL;
+
+	ptr = mmap(0, arg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   kgem_mock_fd, bo->offset + arg->offset);
+	if (ptr == MAP_FAILED)
+		return errno;
+
+	arg->addr_ptr = (uintptr_t)ptr;
+	return 0;
+}
+
+static int mock_wait_ioctl(struct local_i915_gem_wait *wait)
+{
+	struct mock_bo *bo;
+	int64_t delay;
+
+	bo = mock_lookup(wait->handle);
+	if (bo == NULL)
+		return ENOENT;
+
+	if (!mock_is_busy(bo))
+		return 0;
+
+	delay = bo->busy_until - mock_now();
+	if (wait->timeout >= 0 && wait->timeout < delay) {
+		wait->timeout = 0;
+		return ETIME;
+	}
+
+	mock_wait(bo);
+	if (wait->timeout > 0)
+		wait->timeout = MAX(wait->timeout - delay, 0);
+	return 0;
+}
+
+static int mock_ioctl(unsigned long request, void *arg)
+{
+	struct mock_bo *bo;
+
+	switch (_IOC_NR(request)) {
+	case _IOC_NR(DRM_IOCTL_GEM_CLOSE):
+		{
+			struct drm_gem_close *gem_close = arg;
+
+			if (mock_lookup(gem_close->handle) == NULL)
+				return EINVAL;
+
+			mock_free(gem_close->handle);
+			return 0;
+		}
+
+	case DRM_COMMAND_BASE + DRM_I915_GETPARAM:
+		return mock_getparam(arg);
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_CREATE:
+		{
+			struct drm_i915_gem_create *create = arg;
+
+			if (create->size == 0)
+				return EINVAL;
+
+			create->handle = mock_alloc(ALIGN(create->size, PAGE_SIZE), NULL);
+			return create->handle ? 0 : ENOMEM;
+		}
+
+	case DRM_COMMAND_BASE + LOCAL_I915_GEM_USERPTR:
+		{
+			struct local_i915_gem_userptr *userptr = arg;
+
+			if ((userptr->user_ptr | userptr->user_size) & (PAGE_SIZE - 1) ||
+			    userptr->user_size == 0)
+				return EINVAL;
+
+			userptr->handle = mock_alloc(userptr->user_size,
+						     (void *)(uintptr_t)userptr->user_ptr);
+			return userptr->handle ? 0 : ENOMEM;
+		}
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_PREAD:
+	case DRM_COMMAND_BASE + DRM_I915_GEM_PWRITE:
+		{
+			struct drm_i915_gem_pwrite *rw = arg;
+
+			bo = mock_lookup(rw->handle);
+			if (bo == NULL)
+				return ENOENT;
+
+			mock_wait(bo);
+			bo = mock_lookup(rw->handle);
+			if (bo == NULL)
+				return ENOENT;
+
+			return mock_rw(bo, rw->offset, rw->size,
+				       (void *)(uintptr_t)rw->data_ptr,
+				       _IOC_NR(request) == DRM_COMMAND_BASE + DRM_I915_GEM_PWRITE);
+		}
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_MMAP:
+		{
+			struct local_i915_gem_mmap2 *map = arg;
+			struct local_i915_gem_mmap2 tmp;
+			int err;
+
+			/* v1 lacks the trailing flags, which we ignore anyway */
+			memcpy(&tmp, map, offsetof(struct local_i915_gem_mmap2, flags));
+			err = mock_mmap(&tmp);
+			map->addr_ptr = tmp.addr_ptr;
+			return err;
+		}
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_MMAP_GTT:
+		{
+			struct drm_i915_gem_mmap_gtt *gtt = arg;
+
+			bo = mock_lookup(gtt->handle);
+			if (bo == NULL)
+				return ENOENT;
+
+			if (bo->userptr)
+				return EINVAL;
+
+			gtt->offset = bo->offset;
+			return 0;
+		}
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_SET_TILING:
+		{
+			struct drm_i915_gem_set_tiling *tiling = arg;
+
+			bo = mock_lookup(tiling->handle);
+			if (bo == NULL)
+				return ENOENT;
+
+			if (tiling->tiling_mode > I915_TILING_Y ||
+			    (bo->userptr && tiling->tiling_mode))
+				return EINVAL;
+
+			bo->tiling = tiling->tiling_mode;
+			bo->stride = tiling->tiling_mode ? tiling->stride : 0;
+			tiling->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+			return 0;
+		}
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_GET_TILING:
+		{
+			struct local_i915_gem_get_tiling_v2 *tiling = arg;
+
+			bo = mock_lookup(tiling->handle);
+			if (bo == NULL)
+				return ENOENT;
+
+			tiling->tiling_mode = bo->tiling;
+			tiling->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+			if (_IOC_SIZE(request) >= sizeof(*tiling))
+				tiling->phys_swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+			return 0;
+		}
+
+	case DRM_COMMAND_BASE + LOCAL_I915_GEM_SET_CACHING:
+	case DRM_COMMAND_BASE + LOCAL_I915_GEM_GET_CACHING:
+		{
+			struct local_i915_gem_caching *caching = arg;
+
+			bo = mock_lookup(caching->handle);
+			if (bo == NULL)
+				return ENOENT;
+
+			if (_IOC_NR(request) == DRM_COMMAND_BASE + LOCAL_I915_GEM_GET_CACHING)
+				caching->caching = bo->caching;
+			else if (bo->userptr)
+				return EINVAL;
+			else
+				bo->caching = caching->caching;
+			return 0;
+		}
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_MADVISE:
+		{
+			struct drm_i915_gem_madvise *madv = arg;
+
+			if (mock_lookup(madv->handle) == NULL)
+				return ENOENT;
+
+			/* We never reap, so the pages are always retained */
+			madv->retained = 1;
+			return 0;
+		}
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_BUSY:
+		{
+			struct drm_i915_gem_busy *busy = arg;
+
+			bo = mock_lookup(busy->handle);
+			if (bo == NULL)
+				return ENOENT;
+
+			busy->busy = mock_is_busy(bo) ? bo->busy : 0;
+			return 0;
+		}
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_SET_DOMAIN:
+		{
+			struct drm_i915_gem_set_domain *domain = arg;
+
+			bo = mock_lookup(domain->handle);
+			if (bo == NULL)
+				return ENOENT;
+
+			mock_wait(bo);
+			return 0;
+		}
+
+	case DRM_COMMAND_BASE + LOCAL_I915_GEM_WAIT:
+		return mock_wait_ioctl(arg);
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_THROTTLE:
+		return 0;
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_EXECBUFFER2:
+		return mock_execbuffer2(arg);
+
+	case DRM_COMMAND_BASE + DRM_I915_GEM_GET_APERTURE:
+		{
+			struct drm_i915_gem_get_aperture *aperture = arg;
+
+			aperture->aper_size = MOCK_GTT_SIZE;
+			aperture->aper_available_size = MOCK_GTT_SIZE;
+			return 0;
+		}
+
+	case DRM_COMMAND_BASE + LOCAL_I915_GEM_CONTEXT_GETPARAM:
+		{
+			struct local_i915_gem_context_param *p = arg;
+
+			/* This number was also used by the never-merged create2 */
+			if (_IOC_SIZE(request) != sizeof(*p))
+				return ENOTTY;
+
+			if (p->param != LOCAL_CONTEXT_PARAM_GTT_SIZE)
+				return EINVAL;
+
+			p->value = MOCK_GTT_SIZE;
+			return 0;
+		}
+
+	default:
+		/* No display, no pinning, no sharing */
+		DBG(("%s: unhandled ioctl %lx\n", __FUNCTION__, request));
+		if (_IOC_NR(request) >= DRM_COMMAND_BASE &&
+		    _IOC_NR(request) < DRM_COMMAND_END)
+			return ENOTTY;
+		return ENODEV;
+	}
+}
+
+int kgem_mock_ioctl(int fd, unsigned long request, void *arg)
+{
+	int err;
+
+	assert(fd == kgem_mock_fd);
+
+	if (request == DRM_IOCTL_I915_GEM_EXECBUFFER2 && mock.submit_us)
+		usleep(mock.submit_us);
+
+	pthread_mutex_lock(&mock.lock);
+	err = mock_ioctl(request, arg);
+	pthread_mutex_unlock(&mock.lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int kgem_mock_open(unsigned gen, unsigned latency_us)
+{
+	int fd;
+
+	if (kgem_mock_fd != -1)
+		return -1;
+
+	fd = mock_memfd();
+	if (fd == -1)
+		return -1;
+
+	mock.gen = gen;
+	mock.latency = (int64_t)latency_us * 1000;
+	mock.submit_us = 0;
+	mock.size = 0;
+	mock.num_bo = 0;
+	mock.free_bo = 0;
+
+	DBG(("%s: fd=%d, gen=%d, latency=%dus\n",
+	     __FUNCTION__, fd, gen, latency_us));
+	return kgem_mock_fd = fd;
+}
+
+void kgem_mock_set_submit_latency(unsigned us)
+{
+	mock.submit_us = us;
+}
+
+void kgem_mock_close(int fd)
+{
+	assert(fd == kgem_mock_fd);
+
+	close(fd);
+	kgem_mock_fd = -1;
+
+	free(mock.bo);
+	mock.bo = NULL;
+	mock.max_bo = 0;
+}
+
+#if HAS_DEBUG_FULL && TEST_KGEM
+static void st_kgem_mock_emit(struct kgem *kgem,
+			      struct kgem_bo *dst,
+			      struct kgem_bo *src)
+{
+	kgem_set_mode(kgem, KGEM_BLT, dst);
+	kgem->batch[kgem->nbatch++] = MI_NOOP;
+	if (kgem->gen >= 0100) {
+		*(uint64_t *)(kgem->batch + kgem->nbatch) =
+			kgem_add_reloc64(kgem, kgem->nbatch, dst,
+					 I915_GEM_DOMAIN_RENDER << 16 |
+					 I915_GEM_DOMAIN_RENDER |
+					 KGEM_RELOC_FENCED,
+					 0);
+		kgem->nbatch += 2;
+	} else {
+		kgem->batch[kgem->nbatch] =
+			kgem_add_reloc(kgem, kgem->nbatch, dst,
+				       I915_GEM_DOMAIN_RENDER << 16 |
+				       I915_GEM_DOMAIN_RENDER |
+				       KGEM_RELOC_FENCED,
+				       0);
+		kgem->nbatch++;
+	}
+	kgem->batch[kgem->nbatch] =
+		kgem_add_reloc(kgem, kgem->nbatch, src,
+			       I915_GEM_DOMAIN_RENDER << 16, 0);
+	kgem->nbatch++;
+	kgem->batch[kgem->nbatch++] = MI_NOOP;
+}
+
+static void st_kgem_mock(unsigned gen, unsigned latency)
+{
+	struct sna *sna;
+	struct kgem *kgem;
+	static const int fit[3][2] = {
+		/* cached, then requested -> expected num_pages */
+		{ 41, 41 }, { 50, 43 }, { 45, 42 },
+	};
+	static const int best[3] = { 41, 45, 50 };
+	struct kgem_bo *bo, *batch_bo, *cached[3], *many[320];
+	unsigned long hit;
+	int64_t elapsed[2];
+	uint32_t *ptr, *gtt;
+	int fd, n, pass;
+
+	fd = kgem_mock_open(gen, latency);
+	if (fd == -1)
+		FatalError("%s: unable to create mock device\n", __FUNCTION__);
+
+	/* struct sna (and its embedded kgem) is too large for the stack */
+	sna = calloc(1, sizeof(*sna));
+	if (sna == NULL)
+		FatalError("%s: out of memory\n", __FUNCTION__);
+
+	sna->cpu_features = sna_cpu_detect();
+	kgem = &sna->kgem;
+	kgem_init(kgem, fd, NULL, gen);
+	no_render_init(sna);
+	if (kgem->wedged)
+		FatalError("%s: kgem wedged on the mock device\n", __FUNCTION__);
+
+	/* The CPU and GTT views must be coherent */
+	bo = kgem_create_linear(kgem, 64 * 1024, CREATE_INACTIVE);
+	ptr = kgem_bo_map__cpu(kgem, bo);
+	gtt = kgem_bo_map__gtt(kgem, bo);
+	if (ptr == NULL || gtt == NULL)
+		FatalError("%s: unable to map bo\n", __FUNCTION__);
+
+	kgem_bo_sync__cpu(kgem, bo);
+	for (n = 0; n < 16 * 1024; n++)
+		ptr[n] = n;
+	for (n = 0; n < 16 * 1024; n++)
+		if (gtt[n] != (uint32_t)n)
+			FatalError("%s: GTT/CPU mismatch at %d\n", __FUNCTION__, n);
+
+	/* A batch referencing the bo must be relocated and then retire */
+	batch_bo = kgem_create_linear(kgem, 4096, 0);
+	st_kgem_mock_emit(kgem, bo, batch_bo);
+	_kgem_submit(kgem);
+	if (kgem->wedged)
+		FatalError("%s: execbuffer failed\n", __FUNCTION__);
+
+	if (latency && !__kgem_busy(kgem, bo->handle))
+		FatalError("%s: bo idle immediately after submission\n", __FUNCTION__);
+
+	kgem_bo_sync__cpu(kgem, bo);
+	if (__kgem_busy(kgem, bo->handle))
+		FatalError("%s: bo still busy after sync\n", __FUNCTION__);
+
+	kgem_retire(kgem);
+	if (bo->rq)
+		FatalError("%s: request not retired\n", __FUNCTION__);
+
+	kgem_bo_destroy(kgem, batch_bo);
+	kgem_bo_destroy(kgem, bo);
+
+	/* And the bo cache must serve repeated allocations */
+	for (n = 0; n < 1024; n++) {
+		bo = kgem_create_2d(kgem, 256 + (n & 63), 256, 32,
+				    n & 1 ? I915_TILING_X : I915_TILING_NONE,
+				    0);
+		if (bo == NULL)
+			FatalError("%s: failed to allocate 2d bo\n", __FUNCTION__);
+		kgem_bo_destroy(kgem, bo);
+	}
+
+	/* The linear cache must pick the best fit, not the first */
+	for (n = 0; n < 3; n++)
+		cached[n] = kgem_create_linear(kgem, fit[n][0] * PAGE_SIZE,
+					       CREATE_INACTIVE);
+	for (n = 0; n < 3; n++)
+		kgem_bo_destroy(kgem, cached[n]);
+	hit = kgem->cache_stats.hit;
+	for (n = 0; n < 3; n++) {
+		cached[n] = kgem_create_linear(kgem, fit[n][1] * PAGE_SIZE,
+					       CREATE_INACTIVE);
+		if (cached[n] == NULL ||
+		    kgem_bo_size(cached[n]) != best[n] * PAGE_SIZE)
+			FatalError("%s: linear cache returned %d bytes for %d pages, expected %d\n",
+				   __FUNCTION__,
+				   cached[n] ? kgem_bo_size(cached[n]) : 0,
+				   fit[n][1], best[n]);
+	}
+	if (kgem->cache_stats.hit - hit != 3)
+		FatalError("%s: linear cache missed\n", __FUNCTION__);
+	for (n = 0; n < 3; n++)
+		kgem_bo_destroy(kgem, cached[n]);
+
+	/* The vma cache must keep within its budget by discarding the
+	 * least recently used mappings, and of a bo mapped both ways
+	 * first discard the mapping it was not last accessed through.
+	 */
+	bo = kgem_create_linear(kgem, 4 * PAGE_SIZE, CREATE_INACTIVE);
+	for (n = 0; n < 3; n++) {
+		cached[n] = kgem_create_linear(kgem, (n + 1) * PAGE_SIZE,
+					       CREATE_INACTIVE);
+		if (n == 1) {
+			ptr = kgem_bo_map__cpu(kgem, cached[n]);
+			gtt = kgem_bo_map__gtt(kgem, cached[n]);
+		} else {
+			gtt = kgem_bo_map__gtt(kgem, cached[n]);
+			ptr = kgem_bo_map__cpu(kgem, cached[n]);
+		}
+		if (ptr == NULL || gtt == NULL)
+			FatalError("%s: unable to map bo\n", __FUNCTION__);
+	}
+	hit = kgem->vma_stats.hit;
+	if (kgem_bo_map__cpu(kgem, cached[0]) == NULL ||
+	    kgem->vma_stats.hit != hit + 1)
+		FatalError("%s: cached CPU mapping not reused\n", __FUNCTION__);
+	for (n = 0; n < 3; n++)
+		kgem_bo_destroy(kgem, cached[n]);
+
+	n = kgem->vma_cache.max_count;
+	hit = kgem->vma_stats.munmap;
+	kgem->vma_cache.max_count = 5;
+	if (kgem_bo_map__cpu(kgem, bo) == NULL)
+		FatalError("%s: unable to map bo\n", __FUNCTION__);
+	if (kgem->vma_cache.count > 5 || kgem->vma_stats.munmap == hit)
+		FatalError("%s: vma cache exceeded its budget, %d mappings\n",
+			   __FUNCTION__, kgem->vma_cache.count);
+	if (cached[0]->map__cpu == NULL ||
+	    cached[0]->map__gtt || cached[0]->map__wc)
+		FatalError("%s: kept the stale GTT mapping of the oldest bo\n",
+			   __FUNCTION__);
+	if (cached[1]->map__cpu == NULL ||
+	    (cached[1]->map__gtt == NULL && cached[1]->map__wc == NULL) ||
+	    cached[2]->map__cpu == NULL)
+		FatalError("%s: discarded a recently used mapping\n",
+			   __FUNCTION__);
+	kgem->vma_cache.max_count = n;
+	kgem_bo_destroy(kgem, bo);
+
+	/* A batch referencing more objects than the initial exec array
+	 * must grow the array rather than be flushed.
+	 */
+	for (n = 0; n < ARRAY_SIZE(many); n++)
+		many[n] = kgem_create_linear(kgem, 4096, CREATE_INACTIVE);
+	kgem_set_mode(kgem, KGEM_BLT, many[0]);
+	for (n = 0; n < ARRAY_SIZE(many); n++) {
+		if (!kgem_check_batch(kgem, 2) ||
+		    !kgem_check_reloc_and_exec(kgem, 1))
+			FatalError("%s: batch full after %d objects\n",
+				   __FUNCTION__, n);
+
+		if (kgem->gen >= 0100) {
+			*(uint64_t *)(kgem->batch + kgem->nbatch) =
+				kgem_add_reloc64(kgem, kgem->nbatch, many[n],
+						 I915_GEM_DOMAIN_RENDER << 16,
+						 0);
+			kgem->nbatch += 2;
+		} else {
+			kgem->batch[kgem->nbatch] =
+				kgem_add_reloc(kgem, kgem->nbatch, many[n],
+					       I915_GEM_DOMAIN_RENDER << 16,
+					       0);
+			kgem->nbatch++;
+		}
+	}
+	if (kgem->nexec != ARRAY_SIZE(many))
+		FatalError("%s: batch flushed with %d of %d objects\n",
+			   __FUNCTION__, kgem->nexec, (int)ARRAY_SIZE(many));
+	hit = kgem->batch_stats.reason[KGEM_FLUSH_OTHER];
+	_kgem_submit(kgem);
+	if (kgem->wedged)
+		FatalError("%s: execbuffer of grown batch failed\n",
+			   __FUNCTION__);
+	if (kgem->batch_stats.reason[KGEM_FLUSH_OTHER] != hit + 1)
+		FatalError("%s: submission not accounted\n", __FUNCTION__);
+	kgem_bo_sync__cpu(kgem, many[0]);
+	kgem_retire(kgem);
+	for (n = 0; n < ARRAY_SIZE(many); n++) {
+		if (many[n]->rq)
+			FatalError("%s: request not retired\n", __FUNCTION__);
+		kgem_bo_destroy(kgem, many[n]);
+	}
+
+	/* Pipelined submission must produce the same results as the
+	 * synchronous path, whilst hiding the cost of the execbuffer
+	 * behind the construction of the next batch.
+	 */
+	kgem_mock_set_submit_latency(500);
+	for (pass = 0; pass < 2; pass++) {
+		if (pass && !kgem_pipeline_init(kgem))
+			FatalError("%s: unable to start the submission thread\n",
+				   __FUNCTION__);
+
+		bo = kgem_create_linear(kgem, 4096, 0);
+		batch_bo = kgem_create_linear(kgem, 4096, 0);
+		elapsed[pass] = mock_now();
+		for (n = 0; n < 16; n++) {
+			st_kgem_mock_emit(kgem, bo, batch_bo);
+			_kgem_submit(kgem);
+			usleep(500); /* building the next batch */
+		}
+		kgem_bo_sync__cpu(kgem, bo);
+		elapsed[pass] = mock_now() - elapsed[pass];
+
+		if (kgem->wedged)
+			FatalError("%s: %s execbuffer failed\n",
+				   __FUNCTION__, pass ? "pipelined" : "synchronous");
+		if (kgem->pipeline_pending)
+			FatalError("%s: submission still pending after sync\n",
+				   __FUNCTION__);
+		if (__kgem_busy(kgem, bo->handle))
+			FatalError("%s: bo still busy after sync\n", __FUNCTION__);
+
+		kgem_retire(kgem);
+		if (bo->rq || batch_bo->rq)
+			FatalError("%s: request not retired\n", __FUNCTION__);
+
+		kgem_bo_destroy(kgem, batch_bo);
+		kgem_bo_destroy(kgem, bo);
+	}
+	kgem_pipeline_fini(kgem);
+	kgem_mock_set_submit_latency(0);
+	DBG(("%s: 16 batches took %lldus synchronously, %lldus pipelined\n",
+	     __FUNCTION__,
+	     (long long)elapsed[0] / 1000, (long long)elapsed[1] / 1000));
+
+	/* Threaded retirement must agree with the kernel as to when each
+	 * request completes, without the main thread having to ask, and
+	 * must not see a pipelined batch before it reaches the kernel.
+	 */
+	if (!kgem_retirer_init(kgem))
+		FatalError("%s: unable to start the retirement thread\n",
+			   __FUNCTION__);
+	for (pass = 0; pass < 2; pass++) {
+		int64_t start;
+
+		if (pass && !kgem_pipeline_init(kgem))
+			FatalError("%s: unable to start the submission thread\n",
+				   __FUNCTION__);
+
+		bo = kgem_create_linear(kgem, 4096, 0);
+		batch_bo = kgem_create_linear(kgem, 4096, 0);
+		for (n = 0; n < 4; n++) {
+			st_kgem_mock_emit(kgem, bo, batch_bo);
+			_kgem_submit(kgem);
+		}
+		kgem_pipeline_sync(kgem);
+		if (kgem->wedged)
+			FatalError("%s: execbuffer failed\n", __FUNCTION__);
+
+		if (latency && kgem_ring_is_idle(kgem, KGEM_BLT))
+			FatalError("%s: ring idle immediately after submission\n",
+				   __FUNCTION__);
+
+		start = mock_now();
+		while (!kgem_ring_is_idle(kgem, KGEM_BLT)) {
+			if (mock_now() - start > 1000*1000*1000)
+				FatalError("%s: requests never retired\n",
+					   __FUNCTION__);
+			usleep(100);
+		}
+		if (__kgem_busy(kgem, bo->handle))
+			FatalError("%s: retired whilst still busy\n",
+				   __FUNCTION__);
+		if (bo->rq || batch_bo->rq)
+			FatalError("%s: request not retired\n", __FUNCTION__);
+
+		kgem_bo_destroy(kgem, batch_bo);
+		kgem_bo_destroy(kgem, bo);
+	}
+	kgem_pipeline_fini(kgem);
+	kgem_retirer_fini(kgem);
+
+	kgem_cleanup_cache(kgem);
+	free(sna);
+	kgem_mock_close(fd);
+}
+
+void kgem_mock_selftest(void)
+{
+	st_kgem_mock(060, 0);
+	st_kgem_mock(070, 10000);
+	st_kgem_mock(0100, 0);
+	st_kgem_mock(0100, 10000);
+}
+#endif
+
+#endif /* HAS_KGEM_MOCK */
@@ -95,6 +95,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define TEST_IO (TEST_ALL || 0)
 #define TEST_KGEM (TEST_ALL || 0)
 #define TEST_RENDER (TEST_ALL || 0)
+#define TEST_TRAPEZOIDS (TEST_ALL || 0)
 
 #include "intel_driver.h"
 #include "intel_list.h"
@@ -168,7 +169,9 @@ struct sna_pixmap {
 struct sna_glyph {
 	PicturePtr atlas;
 	struct sna_coordinate coordinate;
-	uint16_t size, pos;
+	uint16_t size;
+	uint16_t referenced;
+	uint32_t pos;
 	pixman_image_t *image;
 };
 
@@ -289,10 +292,39 @@ struct sna {
 	bool needs_shm_flush;
 	bool needs_dri_flush;
 
+	struct {
+		struct list segments;
+		struct list attached;
+		unsigned count;
+		unsigned long size;
+		RESTYPE type;
+		const char *miss;
+		unsigned long miss_len;
+	} shm;
+
 	struct timeval timer_tv;
 	uint32_t timer_expire[NUM_TIMERS];
 	uint16_t timer_active;
 
+	struct {
+		const char *path;
+		uint32_t next;
+		int serial;
+	} batch_stats;
+
+	struct {
+		DamagePtr damage;
+		PixmapPtr pixmap;
+		unsigned long serial;
+		BoxRec box;
+		unsigned hits;
+		bool wanted;
+		bool dirty;
+		struct kgem_bo *bo;
+		void *ptr;
+		uint32_t src;
+	} readback;
+
 	int vblank_interval;
 
 	struct list flush_pixmaps;
@@ -1153,6 +1185,12 @@ void sna_composite_trapezoids(CARD8 op,
 			      INT16 xSrc, INT16 ySrc,
 			      int ntrap, xTrapezoid *traps);
 void sna_add_traps(PicturePtr picture, INT16 x, INT16 y, int n, xTrap *t);
+void sna_trapezoids_choose_kernels(unsigned cpu);
+#if HAS_DEBUG_FULL && TEST_TRAPEZOIDS
+void sna_trapezoids_selftest(void);
+#else
+static inline void sna_trapezoids_selftest(void) {}
+#endif
 
 void sna_composite_triangles(CARD8 op,
 			     PicturePtr src,
@@ -1194,6 +1232,7 @@ void sna_glyphs__shared(CARD8 op,
 			INT16 src_x, INT16 src_y,
 			int nlist, GlyphListPtr list, GlyphPtr *glyphs);
 void sna_glyph_unrealize(ScreenPtr screen, GlyphPtr glyph);
+void sna_glyphs_print_stats(struct sna *sna, FILE *file);
 void sna_glyphs_close(struct sna *sna);
 
 void sna_read_boxes(struct sna *sna, PixmapPtr dst, struct kgem_bo *src_bo,
@@ -1238,6 +1277,19 @@ memcpy_blt(const void *src, void *dst, int bpp,
 	   int16_t dst_x, int16_t dst_y,
 	   uint16_t width, uint16_t height);
 
+static inline memcpy_box_func
+memcpy_upload(struct kgem *kgem, unsigned long bytes)
+{
+	/* Only bypass the cache once the upload would evict a good
+	 * fraction of it; the GPU never reads back through the CPU cache.
+	 */
+	if (kgem->stream_upload_pages &&
+	    bytes >> 12 >= kgem->stream_upload_pages)
+		return kgem->memcpy_stream;
+
+	return memcpy_blt;
+}
+
 void
 affine_blt(const void *src, void *dst, int bpp,
 	   int16_t src_x, int16_t src_y,
@@ -1343,12 +1395,29 @@ static inline void sna_acpi_wakeup(struct sna *sna, void *read_mask)
 }
 void sna_acpi_fini(struct sna *sna);
 
-void sna_threads_init(void);
+struct sna_threads_info {
+	int threads;
+	int cpus, cores;
+	int quota;
+	bool pinned;
+};
+
+void sna_threads_init(int num_threads, bool pin);
+void sna_threads_get_info(struct sna_threads_info *info);
 int sna_use_threads (int width, int height, int threshold);
 void sna_threads_run(int id, void (*func)(void *arg), void *arg);
 void sna_threads_trap(int sig);
 void sna_threads_wait(void);
 void sna_threads_kill(void);
+void *sna_scratch_alloc(size_t size);
+void sna_scratch_free(void *ptr);
+void sna_threads_parallel_for(int count,
+			      void (*func)(void *arg, int n),
+			      void *arg);
+void sna_threads_for_each_box(const BoxRec *extents,
+			      int tile_width, int tile_height,
+			      void (*func)(void *arg, const BoxRec *box),
+			      void *arg);
 
 void sna_image_composite(pixman_op_t        op,
 			 pixman_image_t    *src,
@@ -1363,6 +1432,30 @@ void sna_image_composite(pixman_op_t        op,
 			 uint16_t           width,
 			 uint16_t           height);
 
+void sna_memcpy_boxes(int num_threads, memcpy_box_func func,
+		      const void *src, void *dst, int bpp,
+		      int32_t src_stride, int32_t dst_stride,
+		      int16_t src_dx, int16_t src_dy,
+		      int16_t dst_dx, int16_t dst_dy,
+		      const BoxRec *box, int n);
+
+struct sna_glyph_item {
+	pixman_image_t *image;
+	int16_t x, y;
+	uint16_t width, height;
+	bool convert;
+};
+
+bool sna_image_composite_glyphs(int num_threads,
+				pixman_op_t op,
+				pixman_image_t *src,
+				int16_t src_x, int16_t src_y,
+				pixman_image_t *white,
+				pixman_image_t *dst,
+				int y1, int y2,
+				const struct sna_glyph_item *items,
+				int count);
+
 extern jmp_buf sigjmp[4];
 extern volatile sig_atomic_t sigtrap;
 
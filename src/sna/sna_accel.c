@@ -49,12 +49,14 @@
 #include <mipict.h>
 #endif
 #include <shmint.h>
+#include <dixstruct.h>
 
 #include <X11/extensions/damageproto.h>
 
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #ifdef HAVE_VALGRIND
@@ -77,6 +79,12 @@
 #define USE_CPU_BO 1
 #define USE_USERPTR_UPLOADS 1
 #define USE_USERPTR_DOWNLOADS 1
+#define SHM_SEGMENT_CACHE 8
+#define SHM_SEGMENT_MIN_UPLOAD (256 << 10)
+#define MAX_SHM_SEGMENT_MAP (1ul << 30) /* pinned across all cached segments */
+#define USE_ASYNC_READBACK 1
+#define READBACK_PREDICT 3 /* identical GetImage in a row before prefetching */
+#define READBACK_MIN_SIZE (64 << 10)
 #define USE_COW 1
 #define UNDO 1
 
@@ -1029,6 +1037,233 @@ fallback:
 	return pixmap;
 }
 
+/* MIT-SHM segments are wrapped as a single userptr bo upon first use and
+ * kept until the client detaches, so that the ShmPutImage of a video
+ * frame or screenshot becomes a plain blit straight out of the client's
+ * memory. We learn of the detach by attaching our own resource to the
+ * segment XID, which FreeResource() then releases alongside the ShmSeg.
+ */
+struct sna_shm_segment {
+	struct list link;
+	struct sna *sna;
+	struct kgem_bo *bo;
+	const char *addr;
+	unsigned long size;
+	XID id;
+};
+
+/* Every segment attached by any client, as reported to us through the
+ * ResourceStateCallback, so that finding the segment behind an image is
+ * a walk over the few segments in use rather than a search through the
+ * resources of every client.
+ */
+struct sna_shm_attached {
+	struct list link;
+	ShmDescPtr desc;
+	XID id;
+};
+
+static void
+sna_shm_resource_callback(CallbackListPtr *list,
+			  pointer user_data, pointer call_data)
+{
+	ResourceStateInfoRec *info = call_data;
+	struct sna *sna = user_data;
+	struct sna_shm_attached *shm;
+
+	if (info->type != ShmSegType)
+		return;
+
+	switch (info->state) {
+	case ResourceStateAdding:
+		shm = malloc(sizeof(*shm));
+		if (shm == NULL)
+			return;
+
+		DBG(("%s: attached seg=%lx\n", __FUNCTION__, (long)info->id));
+		shm->desc = info->value;
+		shm->id = info->id;
+		list_add(&shm->link, &sna->shm.attached);
+
+		/* The new segment may cover our last miss */
+		sna->shm.miss = NULL;
+		break;
+
+	case ResourceStateFreeing:
+		list_for_each_entry(shm, &sna->shm.attached, link) {
+			if (shm->id == info->id) {
+				DBG(("%s: detached seg=%lx\n",
+				     __FUNCTION__, (long)info->id));
+				list_del(&shm->link);
+				free(shm);
+				break;
+			}
+		}
+		break;
+	}
+}
+
+static int
+sna_shm_segment_gone(pointer data, XID id)
+{
+	struct sna_shm_segment *seg = data;
+	struct sna *sna = seg->sna;
+
+	DBG(("%s: seg=%lx, handle=%d\n",
+	     __FUNCTION__, (long)id, seg->bo->handle));
+
+	/* The segment is about to be unmapped, the GPU must be done with it */
+	if (seg->bo->rq)
+		kgem_bo_sync__cpu(&sna->kgem, seg->bo);
+	kgem_bo_destroy(&sna->kgem, seg->bo);
+
+	list_del(&seg->link);
+	sna->shm.count--;
+	sna->shm.size -= seg->size;
+	sna_shm_watch_flush(sna, -1);
+	free(seg);
+
+	return Success;
+}
+
+static struct sna_shm_segment *
+sna_shm_segment_create(struct sna *sna, const char *ptr, unsigned long len)
+{
+	struct sna_shm_attached *shm;
+	struct sna_shm_segment *seg;
+	unsigned long max;
+
+	if (sna->shm.type == 0)
+		return NULL;
+
+	list_for_each_entry(shm, &sna->shm.attached, link) {
+		if (ptr >= shm->desc->addr &&
+		    ptr + len <= shm->desc->addr + shm->desc->size)
+			goto found;
+	}
+
+	DBG(("%s: %p is not within any SHM segment\n", __FUNCTION__, ptr));
+	sna->shm.miss = ptr;
+	sna->shm.miss_len = len;
+	return NULL;
+
+found:
+	/* Each segment is pinned in its entirety, so limit how much of the
+	 * clients' memory we hold at any time, and keep each userptr
+	 * within the reach of a single CPU bo.
+	 */
+	max = MAX_SHM_SEGMENT_MAP;
+	if (max > sna->kgem.max_cpu_size)
+		max = sna->kgem.max_cpu_size;
+	if (shm->desc->size > max) {
+		DBG(("%s: segment too large to map, %ld bytes\n",
+		     __FUNCTION__, shm->desc->size));
+		sna->shm.miss = shm->desc->addr;
+		sna->shm.miss_len = shm->desc->size;
+		return NULL;
+	}
+
+	while (sna->shm.count == SHM_SEGMENT_CACHE ||
+	       (sna->shm.count && sna->shm.size + shm->desc->size > max)) {
+		seg = list_last_entry(&sna->shm.segments,
+				      struct sna_shm_segment, link);
+		DBG(("%s: evicting seg=%lx\n", __FUNCTION__, (long)seg->id));
+		FreeResourceByType(seg->id, sna->shm.type, FALSE);
+	}
+
+	seg = malloc(sizeof(*seg));
+	if (seg == NULL)
+		return NULL;
+
+	seg->bo = kgem_create_map(&sna->kgem,
+				  shm->desc->addr, shm->desc->size,
+				  true);
+	if (seg->bo == NULL) {
+		free(seg);
+		return NULL;
+	}
+	kgem_bo_mark_unreusable(seg->bo);
+
+	seg->sna = sna;
+	seg->addr = shm->desc->addr;
+	seg->size = shm->desc->size;
+	seg->id = shm->id;
+	if (!AddResource(seg->id, sna->shm.type, seg)) {
+		kgem_bo_destroy(&sna->kgem, seg->bo);
+		free(seg);
+		return NULL;
+	}
+
+	list_add(&seg->link, &sna->shm.segments);
+	sna->shm.count++;
+	sna->shm.size += seg->size;
+	sna_shm_watch_flush(sna, 1);
+
+	DBG(("%s: seg=%lx, addr=%p, size=%ld, handle=%d\n",
+	     __FUNCTION__, (long)seg->id, seg->addr, seg->size,
+	     seg->bo->handle));
+	return seg;
+}
+
+/* Returns a proxy into the client's SHM segment covering [ptr, ptr+len),
+ * with the sub-page offset of the image carried by the proxy delta. The
+ * caller must not wait upon it; the segment is instead synchronised in
+ * sna_accel_flush() before any ShmCompletion reaches the client.
+ */
+static struct kgem_bo *
+sna_shm_segment_map(struct sna *sna, const void *ptr, unsigned long len)
+{
+	struct sna_shm_segment *seg;
+	struct kgem_bo *bo;
+
+	if (!USE_USERPTR_UPLOADS || !sna->kgem.has_userptr)
+		return NULL;
+
+	list_for_each_entry(seg, &sna->shm.segments, link) {
+		if ((const char *)ptr >= seg->addr &&
+		    (const char *)ptr + len <= seg->addr + seg->size) {
+			list_move(&seg->link, &sna->shm.segments);
+			goto found;
+		}
+	}
+
+	/* Large PutImage requests from clients not using MIT-SHM all
+	 * land here, so remember the last image we failed to find.
+	 */
+	if ((const char *)ptr >= sna->shm.miss &&
+	    (const char *)ptr + len <= sna->shm.miss + sna->shm.miss_len)
+		return NULL;
+
+	seg = sna_shm_segment_create(sna, ptr, len);
+	if (seg == NULL)
+		return NULL;
+
+found:
+	bo = kgem_create_proxy(&sna->kgem, seg->bo,
+			       (const char *)ptr - seg->addr, len);
+	if (bo == NULL)
+		return NULL;
+
+	DBG(("%s: seg=%lx, offset=%ld, len=%ld\n",
+	     __FUNCTION__, (long)seg->id,
+	     (long)((const char *)ptr - seg->addr), len));
+	sna->needs_shm_flush = true;
+	return bo;
+}
+
+static void sna_shm_segments_sync(struct sna *sna)
+{
+	struct sna_shm_segment *seg;
+
+	list_for_each_entry(seg, &sna->shm.segments, link) {
+		if (seg->bo->rq == NULL)
+			continue;
+
+		DBG(("%s: syncing seg=%lx\n", __FUNCTION__, (long)seg->id));
+		kgem_bo_sync__cpu(&sna->kgem, seg->bo);
+	}
+}
+
 PixmapPtr
 sna_pixmap_create_unattached(ScreenPtr screen,
 			     int width, int height, int depth)
@@ -5054,46 +5289,30 @@ done:
 	return true;
 }
 
+static bool cpu_damage_blocks_blt(PixmapPtr pixmap,
+				  struct sna_pixmap *priv,
+				  const RegionRec *region)
+{
+	return priv->cpu_damage &&
+		(DAMAGE_IS_ALL(priv->cpu_damage) ||
+		 sna_damage_contains_box__no_reduce(priv->cpu_damage,
+						    &region->extents)) &&
+		!box_inplace(pixmap, &region->extents);
+}
+
 static bool
-try_upload__blt(PixmapPtr pixmap, RegionRec *region,
-		int x, int y, int w, int  h, char *bits, int stride)
+upload__blt(PixmapPtr pixmap, RegionRec *region,
+	    int x, int y, int w, int h, struct kgem_bo *src_bo)
 {
 	struct sna *sna = to_sna_from_pixmap(pixmap);
-	struct sna_pixmap *priv;
-	struct kgem_bo *src_bo;
+	struct sna_pixmap *priv = sna_pixmap(pixmap);
 	bool ok;
 
-	if (!sna->kgem.has_userptr || !USE_USERPTR_UPLOADS)
-		return false;
-
-	priv = sna_pixmap(pixmap);
-	assert(priv);
-	assert(priv->gpu_bo);
-	assert(priv->gpu_bo->proxy == NULL);
-
-	if (priv->cpu_damage &&
-	    (DAMAGE_IS_ALL(priv->cpu_damage) ||
-	     sna_damage_contains_box__no_reduce(priv->cpu_damage,
-						&region->extents)) &&
-	    !box_inplace(pixmap, &region->extents)) {
-		DBG(("%s: no, damage on CPU and too small\n", __FUNCTION__));
-		return false;
-	}
-
-	src_bo = kgem_create_map(&sna->kgem, bits, stride * h, true);
-	if (src_bo == NULL)
-		return false;
-
-	src_bo->pitch = stride;
-	kgem_bo_mark_unreusable(src_bo);
-
 	if (!sna_pixmap_move_area_to_gpu(pixmap, &region->extents,
-					 MOVE_WRITE | MOVE_ASYNC_HINT | (region->data ? MOVE_READ : 0))) {
-		kgem_bo_destroy(&sna->kgem, src_bo);
+					 MOVE_WRITE | MOVE_ASYNC_HINT | (region->data ? MOVE_READ : 0)))
 		return false;
-	}
 
-	DBG(("%s: upload(%d, %d, %d, %d) x %d through a temporary map\n",
+	DBG(("%s: upload(%d, %d, %d, %d) x %d through a map\n",
 	     __FUNCTION__, x, y, w, h, region_num_rects(region)));
 
 	if (sigtrap_get() == 0) {
@@ -5107,10 +5326,6 @@ try_upload__blt(PixmapPtr pixmap, RegionRec *region,
 	} else
 		ok = false;
 
-	kgem_bo_sync__cpu(&sna->kgem, src_bo);
-	assert(src_bo->rq == NULL);
-	kgem_bo_destroy(&sna->kgem, src_bo);
-
 	if (!ok) {
 		DBG(("%s: copy failed!\n", __FUNCTION__));
 		return false;
@@ -5140,6 +5355,77 @@ try_upload__blt(PixmapPtr pixmap, RegionRec *region,
 	return true;
 }
 
+static bool
+try_upload__shm(PixmapPtr pixmap, RegionRec *region,
+		int x, int y, int w, int  h, char *bits, int stride)
+{
+	struct sna *sna = to_sna_from_pixmap(pixmap);
+	struct sna_pixmap *priv;
+	struct kgem_bo *src_bo;
+	bool ok;
+
+	priv = sna_pixmap(pixmap);
+	assert(priv);
+	if (priv->gpu_bo == NULL || priv->gpu_bo->proxy)
+		return false;
+
+	if (stride * h < SHM_SEGMENT_MIN_UPLOAD)
+		return false;
+
+	if (cpu_damage_blocks_blt(pixmap, priv, region)) {
+		DBG(("%s: no, damage on CPU and too small\n", __FUNCTION__));
+		return false;
+	}
+
+	src_bo = sna_shm_segment_map(sna, bits, stride * h);
+	if (src_bo == NULL)
+		return false;
+
+	src_bo->pitch = stride;
+	ok = upload__blt(pixmap, region, x, y, w, h, src_bo);
+	kgem_bo_destroy(&sna->kgem, src_bo);
+
+	return ok;
+}
+
+static bool
+try_upload__blt(PixmapPtr pixmap, RegionRec *region,
+		int x, int y, int w, int  h, char *bits, int stride)
+{
+	struct sna *sna = to_sna_from_pixmap(pixmap);
+	struct sna_pixmap *priv;
+	struct kgem_bo *src_bo;
+	bool ok;
+
+	if (!sna->kgem.has_userptr || !USE_USERPTR_UPLOADS)
+		return false;
+
+	priv = sna_pixmap(pixmap);
+	assert(priv);
+	assert(priv->gpu_bo);
+	assert(priv->gpu_bo->proxy == NULL);
+
+	if (cpu_damage_blocks_blt(pixmap, priv, region)) {
+		DBG(("%s: no, damage on CPU and too small\n", __FUNCTION__));
+		return false;
+	}
+
+	src_bo = kgem_create_map(&sna->kgem, bits, stride * h, true);
+	if (src_bo == NULL)
+		return false;
+
+	src_bo->pitch = stride;
+	kgem_bo_mark_unreusable(src_bo);
+
+	ok = upload__blt(pixmap, region, x, y, w, h, src_bo);
+
+	kgem_bo_sync__cpu(&sna->kgem, src_bo);
+	assert(src_bo->rq == NULL);
+	kgem_bo_destroy(&sna->kgem, src_bo);
+
+	return ok;
+}
+
 static bool ignore_cpu_damage(struct sna *sna, struct sna_pixmap *priv, const RegionRec *region)
 {
 	if (region_subsumes_pixmap(region, priv->pixmap))
@@ -5174,6 +5460,10 @@ try_upload__fast(PixmapPtr pixmap, RegionRec *region,
 	if (priv == NULL)
 		return false;
 
+	/* Blit straight out of the client's SHM segment if we can */
+	if (try_upload__shm(pixmap, region, x, y, w, h, bits, stride))
+		return true;
+
 	if (ignore_cpu_damage(sna, priv, region)) {
 		DBG(("%s: ignore existing cpu damage (if any)\n", __FUNCTION__));
 		if (try_upload__inplace(pixmap, region, x, y, w, h, bits, stride))
@@ -6763,6 +7053,37 @@ discard_cow:
 				return;
 		}
 
+		if (src_priv == NULL &&
+		    (region->extents.x2 - region->extents.x1) *
+		    (region->extents.y2 - region->extents.y1) *
+		    src_pixmap->drawable.bitsPerPixel >= 8 * SHM_SEGMENT_MIN_UPLOAD) {
+			struct kgem_bo *src_bo;
+
+			assert(src_pixmap->devKind);
+			src_bo = sna_shm_segment_map(sna,
+						     src_pixmap->devPrivate.ptr,
+						     src_pixmap->devKind * src_pixmap->drawable.height);
+			if (src_bo) {
+				bool ok;
+
+				DBG(("%s: copy straight out of the SHM segment\n",
+				     __FUNCTION__));
+
+				src_bo->pitch = src_pixmap->devKind;
+				ok = sna->render.copy_boxes(sna, alu,
+							    &src_pixmap->drawable, src_bo, src_dx, src_dy,
+							    &dst_pixmap->drawable, bo, 0, 0,
+							    box, n, small_copy(region) | COPY_LAST);
+				kgem_bo_destroy(&sna->kgem, src_bo);
+
+				if (ok) {
+					if (damage)
+						sna_damage_add_to_pixmap(damage, region, dst_pixmap);
+					return;
+				}
+			}
+		}
+
 		if (USE_USERPTR_UPLOADS &&
 		    sna->kgem.has_userptr &&
 		    (alu != GXcopy ||
@@ -16998,6 +17319,201 @@ static int sna_create_gc(GCPtr gc)
 	return true;
 }
 
+/* Screen recorders, VNC servers and intel-virtual-output read back the
+ * same area of the same drawable over and over again. Once we have seen
+ * the same GetImage repeated, watch the drawable for damage and queue
+ * the blit of the next frame into a snoopable buffer just before we
+ * go to sleep, after the damage events have been flushed to the client.
+ * By the time the client asks for the frame, the read is usually from
+ * an already retired buffer rather than a round trip through the GPU.
+ */
+static void sna_readback_damage(DamagePtr damage, RegionPtr region, void *closure)
+{
+	struct sna *sna = closure;
+	const BoxRec *box = &sna->readback.box;
+
+	if (region->extents.x1 < box->x2 && region->extents.x2 > box->x1 &&
+	    region->extents.y1 < box->y2 && region->extents.y2 > box->y1)
+		sna->readback.dirty = true;
+}
+
+static void sna_readback_damage_destroy(DamagePtr damage, void *closure)
+{
+	struct sna *sna = closure;
+
+	DBG(("%s: pixmap=%ld\n", __FUNCTION__,
+	     sna->readback.pixmap ? sna->readback.pixmap->drawable.serialNumber : 0));
+
+	if (sna->readback.bo) {
+		kgem_bo_destroy(&sna->kgem, sna->readback.bo);
+		sna->readback.bo = NULL;
+	}
+	sna->readback.damage = NULL;
+	sna->readback.pixmap = NULL;
+	sna->readback.serial = 0;
+}
+
+static void sna_readback_disarm(struct sna *sna)
+{
+	if (sna->readback.damage == NULL)
+		return;
+
+	DBG(("%s: pixmap=%ld\n", __FUNCTION__,
+	     sna->readback.pixmap->drawable.serialNumber));
+
+	DamageUnregister(&sna->readback.pixmap->drawable, sna->readback.damage);
+	DamageDestroy(sna->readback.damage);
+	assert(sna->readback.damage == NULL);
+}
+
+static void sna_readback_predict(struct sna *sna, PixmapPtr pixmap,
+				 const BoxRec *box)
+{
+	struct sna_pixmap *priv;
+
+	if (!USE_ASYNC_READBACK)
+		return;
+
+	if (sna->readback.serial == pixmap->drawable.serialNumber &&
+	    box_equal(&sna->readback.box, box)) {
+		sna->readback.wanted = true;
+		if (++sna->readback.hits < READBACK_PREDICT ||
+		    sna->readback.damage)
+			return;
+
+		priv = sna_pixmap(pixmap);
+		if (priv == NULL || priv->gpu_bo == NULL ||
+		    priv->pinned & (PIN_DRI2 | PIN_DRI3 | PIN_PRIME))
+			return;
+
+		sna->readback.damage =
+			DamageCreate(sna_readback_damage,
+				     sna_readback_damage_destroy,
+				     DamageReportRawRegion,
+				     FALSE, pixmap->drawable.pScreen, sna);
+		if (sna->readback.damage == NULL)
+			return;
+
+		DBG(("%s: predicting readback of pixmap=%ld (%d, %d), (%d, %d)\n",
+		     __FUNCTION__, pixmap->drawable.serialNumber,
+		     box->x1, box->y1, box->x2, box->y2));
+		DamageRegister(&pixmap->drawable, sna->readback.damage);
+		sna->readback.pixmap = pixmap;
+		sna->readback.dirty = true;
+		return;
+	}
+
+	sna_readback_disarm(sna);
+
+	if ((box->x2 - box->x1) * (box->y2 - box->y1) *
+	    pixmap->drawable.bitsPerPixel < 8 * READBACK_MIN_SIZE) {
+		sna->readback.serial = 0;
+		return;
+	}
+
+	sna->readback.serial = pixmap->drawable.serialNumber;
+	sna->readback.box = *box;
+	sna->readback.hits = 1;
+	sna->readback.wanted = false;
+}
+
+static void sna_readback_prefetch(struct sna *sna)
+{
+	PixmapPtr pixmap = sna->readback.pixmap;
+	const BoxRec *box = &sna->readback.box;
+	struct sna_pixmap *priv;
+	struct kgem_bo *bo;
+	DrawableRec tmp;
+	void *ptr;
+
+	if (pixmap == NULL || !sna->readback.dirty || !sna->readback.wanted)
+		return;
+
+	priv = sna_pixmap(pixmap);
+	if (priv == NULL || priv->gpu_bo == NULL ||
+	    priv->move_to_gpu || priv->clear)
+		return;
+
+	if (!DAMAGE_IS_ALL(priv->gpu_damage) &&
+	    !sna_damage_contains_box__no_reduce(priv->gpu_damage, box))
+		return;
+
+	if (sna->readback.bo) {
+		kgem_bo_destroy(&sna->kgem, sna->readback.bo);
+		sna->readback.bo = NULL;
+	}
+
+	tmp.width  = box->x2 - box->x1;
+	tmp.height = box->y2 - box->y1;
+	tmp.depth  = pixmap->drawable.depth;
+	tmp.bitsPerPixel = pixmap->drawable.bitsPerPixel;
+
+	bo = kgem_create_buffer_2d(&sna->kgem,
+				   tmp.width, tmp.height, tmp.bitsPerPixel,
+				   KGEM_BUFFER_LAST, &ptr);
+	if (bo == NULL)
+		return;
+
+	if (!sna->render.copy_boxes(sna, GXcopy,
+				    &pixmap->drawable, priv->gpu_bo, 0, 0,
+				    &tmp, bo, -box->x1, -box->y1,
+				    box, 1, COPY_LAST)) {
+		kgem_bo_destroy(&sna->kgem, bo);
+		return;
+	}
+	kgem_bo_submit(&sna->kgem, bo);
+
+	DBG(("%s: queued readback of pixmap=%ld, handle=%d\n",
+	     __FUNCTION__, pixmap->drawable.serialNumber, priv->gpu_bo->handle));
+	sna->readback.bo = bo;
+	sna->readback.ptr = ptr;
+	sna->readback.src = priv->gpu_bo->unique_id;
+	sna->readback.dirty = false;
+	sna->readback.wanted = false;
+}
+
+static bool
+sna_get_image__prefetched(PixmapPtr pixmap,
+			  RegionPtr region,
+			  char *dst)
+{
+	struct sna_pixmap *priv = sna_pixmap(pixmap);
+	struct sna *sna = to_sna_from_pixmap(pixmap);
+	const BoxRec *box = &sna->readback.box;
+
+	if (sna->readback.bo == NULL ||
+	    sna->readback.pixmap != pixmap ||
+	    sna->readback.dirty ||
+	    !box_equal(box, &region->extents))
+		return false;
+
+	assert(priv && priv->gpu_bo);
+	if (priv->gpu_bo->unique_id != sna->readback.src || priv->move_to_gpu)
+		return false;
+
+	DBG(("%s: pixmap=%ld, busy? %d\n", __FUNCTION__,
+	     pixmap->drawable.serialNumber,
+	     __kgem_bo_is_busy(&sna->kgem, sna->readback.bo)));
+
+	kgem_bo_submit(&sna->kgem, sna->readback.bo);
+	kgem_buffer_read_sync(&sna->kgem, sna->readback.bo);
+
+	if (sigtrap_get())
+		return false;
+
+	memcpy_blt(sna->readback.ptr, dst,
+		   pixmap->drawable.bitsPerPixel,
+		   sna->readback.bo->pitch,
+		   PixmapBytePad(box->x2 - box->x1, pixmap->drawable.depth),
+		   0, 0,
+		   0, 0,
+		   box->x2 - box->x1,
+		   box->y2 - box->y1);
+
+	sigtrap_put();
+	return true;
+}
+
 static bool
 sna_get_image__inplace(PixmapPtr pixmap,
 		       RegionPtr region,
@@ -17208,6 +17724,9 @@ sna_get_image__fast(PixmapPtr pixmap,
 						&region->extents))
 		return false;
 
+	if (sna_get_image__prefetched(pixmap, region, dst))
+		return true;
+
 	if (sna_get_image__inplace(pixmap, region, dst, flags, true))
 		return true;
 
@@ -17257,6 +17776,9 @@ sna_get_image(DrawablePtr drawable,
 		region.extents.y2 = region.extents.y1 + h;
 		region.data = NULL;
 
+		sna_readback_predict(to_sna_from_pixmap(pixmap),
+				     pixmap, &region.extents);
+
 		if (sna_get_image__fast(pixmap, &region, dst, flags))
 			goto apply_planemask;
 
@@ -17435,8 +17957,12 @@ void sna_accel_flush(struct sna *sna)
 		(void)ret;
 	}
 
+	/* and wait for the GPU to finish reading from any SHM segments */
+	sna_shm_segments_sync(sna);
+
 	if (sna->kgem.flush)
-		kgem_submit(&sna->kgem);
+		kgem_submit__reason(&sna->kgem, KGEM_FLUSH_CLIENT);
+	kgem_pipeline_sync(&sna->kgem);
 }
 
 static void
@@ -17832,7 +18358,7 @@ static void sna_accel_throttle(struct sna *sna)
 	DBG(("%s (time=%ld)\n", __FUNCTION__, (long)TIME));
 
 	if (sna->kgem.need_throttle) {
-		kgem_submit(&sna->kgem);
+		kgem_submit__reason(&sna->kgem, KGEM_FLUSH_THROTTLE);
 		kgem_throttle(&sna->kgem);
 	}
 
@@ -17892,6 +18418,80 @@ static void sna_accel_debug_memory(struct sna *sna)
 static void sna_accel_debug_memory(struct sna *sna) { }
 #endif
 
+#define BATCH_STATS_INTERVAL (60 * 1000)
+#define BATCH_STATS_ROTATE (1024 * 1024)
+
+static volatile sig_atomic_t sna_batch_stats_serial;
+
+static void sna_batch_stats_signal(int sig)
+{
+	sna_batch_stats_serial++;
+	(void)sig;
+}
+
+/* The signal is process wide, so it is shared by every screen that wants
+ * statistics: install it for the first and restore the original handler
+ * after the last, whatever order the screens are closed in.
+ */
+static OsSigHandlerPtr sna_batch_stats_prev;
+static int sna_batch_stats_users;
+
+static void sna_batch_stats_get(void)
+{
+	if (sna_batch_stats_users++ == 0)
+		sna_batch_stats_prev =
+			OsSignal(SIGUSR2, sna_batch_stats_signal);
+}
+
+static void sna_batch_stats_put(void)
+{
+	assert(sna_batch_stats_users > 0);
+	if (--sna_batch_stats_users == 0)
+		OsSignal(SIGUSR2, sna_batch_stats_prev);
+}
+
+static bool sna_accel_do_batch_stats(struct sna *sna)
+{
+	if (sna->batch_stats.path == NULL)
+		return false;
+
+	if (sna->batch_stats.serial != sna_batch_stats_serial) {
+		sna->batch_stats.serial = sna_batch_stats_serial;
+		return true;
+	}
+
+	if ((int32_t)(sna->batch_stats.next - TIME) <= 0) {
+		sna->batch_stats.next = TIME + BATCH_STATS_INTERVAL;
+		return true;
+	}
+
+	return false;
+}
+
+static void sna_accel_batch_stats(struct sna *sna)
+{
+	const char *path = sna->batch_stats.path;
+	struct stat st;
+	FILE *file;
+
+	if (stat(path, &st) == 0 && st.st_size > BATCH_STATS_ROTATE) {
+		char old[1024];
+
+		if (snprintf(old, sizeof(old), "%s.1", path) < (int)sizeof(old))
+			(void)rename(path, old);
+	}
+
+	file = fopen(path, "a");
+	if (file == NULL)
+		return;
+
+	fprintf(file, "screen %d, time %u\n",
+		sna->scrn->scrnIndex, (unsigned)GetTimeInMillis());
+	kgem_print_batch_stats(&sna->kgem, file);
+	sna_glyphs_print_stats(sna, file);
+	fclose(file);
+}
+
 static ShmFuncs shm_funcs = { sna_pixmap_create_shm, NULL };
 
 static PixmapPtr
@@ -18165,12 +18765,51 @@ bool sna_accel_init(ScreenPtr screen, struct sna *sna)
 	list_init(&sna->flush_pixmaps);
 	list_init(&sna->active_pixmaps);
 
+	list_init(&sna->shm.segments);
+	list_init(&sna->shm.attached);
+	sna->shm.count = 0;
+	sna->shm.size = 0;
+	sna->shm.miss = NULL;
+	sna->shm.type = 0;
+	if (sna->kgem.has_userptr) {
+		sna->shm.type = CreateNewResourceType(sna_shm_segment_gone,
+						      "SNA ShmSeg");
+		if (sna->shm.type &&
+		    !AddCallback(&ResourceStateCallback,
+				 sna_shm_resource_callback, sna))
+			sna->shm.type = 0;
+	}
+
 	SetNotifyFd(sna->kgem.fd, sna_accel_notify, X_NOTIFY_READ, sna);
 
 #ifdef DEBUG_MEMORY
 	sna->timer_expire[DEBUG_MEMORY_TIMER] = GetTimeInMillis()+ 10 * 1000;
 #endif
 
+	sna->batch_stats.path =
+		xf86GetOptValString(sna->Options, OPTION_BATCH_STATS);
+	if (sna->batch_stats.path) {
+		sna->batch_stats.next = GetTimeInMillis() + BATCH_STATS_INTERVAL;
+		sna->batch_stats.serial = sna_batch_stats_serial;
+		sna_batch_stats_get();
+		xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+			   "Writing batch statistics to %s every minute and upon SIGUSR2\n",
+			   sna->batch_stats.path);
+	}
+
+	/* The helper threads are stopped by sna_accel_close() on every
+	 * server generation, so restart them here for each new screen.
+	 */
+	if (xf86ReturnOptValBool(sna->Options, OPTION_PIPELINE_SUBMIT, FALSE) &&
+	    kgem_pipeline_init(&sna->kgem))
+		xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+			   "Pipelining batch submission on a helper thread\n");
+
+	if (xf86ReturnOptValBool(sna->Options, OPTION_RETIRE_THREAD, FALSE) &&
+	    kgem_retirer_init(&sna->kgem))
+		xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+			   "Waiting for request completion on helper threads\n");
+
 	screen->defColormap = FakeClientID(0);
 	/* let CreateDefColormap do whatever it wants for pixels */
 	screen->blackPixel = screen->whitePixel = (Pixel) 0;
@@ -18380,11 +19019,36 @@ void sna_accel_close(struct sna *sna)
 
 	sna_pixmap_expire(sna);
 
+	if (sna->batch_stats.path) {
+		sna_batch_stats_put();
+		sna->batch_stats.path = NULL;
+	}
+
+	sna_readback_disarm(sna);
+	while (!list_is_empty(&sna->shm.segments)) {
+		struct sna_shm_segment *seg =
+			list_first_entry(&sna->shm.segments,
+					 struct sna_shm_segment, link);
+		FreeResourceByType(seg->id, sna->shm.type, FALSE);
+	}
+	if (sna->shm.type)
+		DeleteCallback(&ResourceStateCallback,
+			       sna_shm_resource_callback, sna);
+	while (!list_is_empty(&sna->shm.attached)) {
+		struct sna_shm_attached *shm =
+			list_first_entry(&sna->shm.attached,
+					 struct sna_shm_attached, link);
+		list_del(&shm->link);
+		free(shm);
+	}
+
 	DeleteCallback(&FlushCallback, sna_shm_flush_callback, sna);
 	DeleteCallback(&FlushCallback, sna_flush_callback, sna);
 	DeleteCallback(&EventCallback, sna_event_callback, sna);
 	RemoveNotifyFd(sna->kgem.fd);
 
+	kgem_pipeline_fini(&sna->kgem);
+	kgem_retirer_fini(&sna->kgem);
 	kgem_cleanup_cache(&sna->kgem);
 }
 
@@ -18403,6 +19067,7 @@ void sna_accel_block(struct sna *sna, struct timeval **tv)
 	    (sna->kgem.scanout_busy ||
 	     kgem_ring_is_idle(&sna->kgem, sna->kgem.ring))) {
 		DBG(("%s: GPU idle, flushing\n", __FUNCTION__));
+		sna->kgem.flush_reason = KGEM_FLUSH_BLOCK;
 		_kgem_submit(&sna->kgem);
 	}
 
@@ -18429,6 +19094,15 @@ restart:
 	if (sna_accel_do_debug_memory(sna))
 		sna_accel_debug_memory(sna);
 
+	if (sna_accel_do_batch_stats(sna))
+		sna_accel_batch_stats(sna);
+
+	/* Queue the next predicted GetImage now the damage has been sent */
+	sna_readback_prefetch(sna);
+
+	/* Everything we have submitted must reach the kernel before sleeping */
+	kgem_pipeline_sync(&sna->kgem);
+
 	if (sna->watch_shm_flush == 1) {
 		DBG(("%s: removing shm watchers\n", __FUNCTION__));
 		DeleteCallback(&FlushCallback, sna_shm_flush_callback, sna);
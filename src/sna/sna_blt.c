@@ -1656,7 +1656,7 @@ static void blt_composite_copy_boxes__thread(struct sna *sna,
 			rem = kgem_batch_space(kgem);
 			if (8*nbox_this_time > rem)
 				nbox_this_time = rem / 8;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc)/2;
 			DBG(("%s: emitting %d boxes out of %d (batch space %d)\n",
 			     __FUNCTION__, nbox_this_time, nbox, rem));
@@ -1713,7 +1713,7 @@ static void blt_composite_copy_boxes__thread(struct sna *sna,
 			rem = kgem_batch_space(kgem);
 			if (8*nbox_this_time > rem)
 				nbox_this_time = rem / 8;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc)/2;
 			DBG(("%s: emitting %d boxes out of %d (batch space %d)\n",
 			     __FUNCTION__, nbox_this_time, nbox, rem));
@@ -1794,7 +1794,7 @@ static void blt_composite_copy_boxes__thread64(struct sna *sna,
 			rem = kgem_batch_space(kgem);
 			if (10*nbox_this_time > rem)
 				nbox_this_time = rem / 10;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc)/2;
 			DBG(("%s: emitting %d boxes out of %d (batch space %d)\n",
 			     __FUNCTION__, nbox_this_time, nbox, rem));
@@ -1853,7 +1853,7 @@ static void blt_composite_copy_boxes__thread64(struct sna *sna,
 			rem = kgem_batch_space(kgem);
 			if (10*nbox_this_time > rem)
 				nbox_this_time = rem / 10;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc)/2;
 			DBG(("%s: emitting %d boxes out of %d (batch space %d)\n",
 			     __FUNCTION__, nbox_this_time, nbox, rem));
@@ -3769,7 +3769,7 @@ bool sna_blt_copy_boxes(struct sna *sna, uint8_t alu,
 				rem = kgem_batch_space(kgem);
 				if (10*nbox_this_time > rem)
 					nbox_this_time = rem / 10;
-				if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+				if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 					nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc)/2;
 				DBG(("%s: emitting %d boxes out of %d (batch space %d)\n",
 				     __FUNCTION__, nbox_this_time, nbox, rem));
@@ -3829,7 +3829,7 @@ bool sna_blt_copy_boxes(struct sna *sna, uint8_t alu,
 				rem = kgem_batch_space(kgem);
 				if (8*nbox_this_time > rem)
 					nbox_this_time = rem / 8;
-				if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+				if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 					nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc)/2;
 				DBG(("%s: emitting %d boxes out of %d (batch space %d)\n",
 				     __FUNCTION__, nbox_this_time, nbox, rem));
@@ -3889,7 +3889,7 @@ bool sna_blt_copy_boxes(struct sna *sna, uint8_t alu,
 				rem = kgem_batch_space(kgem);
 				if (10*nbox_this_time > rem)
 					nbox_this_time = rem / 10;
-				if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+				if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 					nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc)/2;
 				DBG(("%s: emitting %d boxes out of %d (batch space %d)\n",
 				     __FUNCTION__, nbox_this_time, nbox, rem));
@@ -3949,7 +3949,7 @@ bool sna_blt_copy_boxes(struct sna *sna, uint8_t alu,
 				rem = kgem_batch_space(kgem);
 				if (8*nbox_this_time > rem)
 					nbox_this_time = rem / 8;
-				if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+				if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 					nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc)/2;
 				DBG(("%s: emitting %d boxes out of %d (batch space %d)\n",
 				     __FUNCTION__, nbox_this_time, nbox, rem));
@@ -46,6 +46,13 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *
  * Furthermore, we can track whether the whole pixmap is damaged and so
  * cheapy discard no-ops.
+ *
+ * Finally, if a batch grows too large (thousands of scattered glyphs or
+ * terminal cells) even the O(n.lgn) reduction is too costly, and so we
+ * switch to accumulating the added boxes into a coarse grid of 16x16
+ * tiles instead. Each tile is either empty, full or carries a 1bpp mask
+ * of its pixels, so the damage is still exact. The grid is only converted
+ * back into a region when somebody needs the precise list of boxes.
  */
 
 struct sna_damage_box {
@@ -189,6 +196,7 @@ static struct sna_damage *_sna_damage_create(void)
 			return NULL;
 	}
 	reset_embedded_box(damage);
+	damage->tiles = NULL;
 	damage->mode = DAMAGE_ADD;
 	pixman_region_init(&damage->region);
 	reset_extents(damage);
@@ -210,6 +218,975 @@ static void free_list(struct list *head)
 	}
 }
 
+/*
+ * Batch kernels over arrays of boxes. A BoxRec is four int16, so two
+ * boxes fit into an SSE2 register and four into an AVX2 register, and
+ * computing the extents, translating, clipping or testing a whole array
+ * is then a few instructions per register rather than a handful of
+ * branches per box. The variants are picked by sna_damage_choose_kernels().
+ */
+
+static void boxes_extents__generic(const BoxRec *box, int n, BoxRec *extents)
+{
+	*extents = *box;
+	while (--n) {
+		box++;
+		if (extents->x1 > box->x1)
+			extents->x1 = box->x1;
+		if (extents->x2 < box->x2)
+			extents->x2 = box->x2;
+		if (extents->y1 > box->y1)
+			extents->y1 = box->y1;
+		if (extents->y2 < box->y2)
+			extents->y2 = box->y2;
+	}
+}
+
+static void boxes_translate__generic(const BoxRec *src, BoxRec *dst, int n,
+				     int16_t dx, int16_t dy)
+{
+	while (n--) {
+		dst->x1 = src->x1 + dx;
+		dst->x2 = src->x2 + dx;
+		dst->y1 = src->y1 + dy;
+		dst->y2 = src->y2 + dy;
+		src++, dst++;
+	}
+}
+
+/* Clip the boxes in place, discarding those left empty */
+static int boxes_clip__generic(BoxRec *box, int n, const BoxRec *clip)
+{
+	int i, count = 0;
+
+	for (i = 0; i < n; i++) {
+		BoxRec b = box[i];
+
+		if (b.x1 < clip->x1)
+			b.x1 = clip->x1;
+		if (b.x2 > clip->x2)
+			b.x2 = clip->x2;
+		if (b.y1 < clip->y1)
+			b.y1 = clip->y1;
+		if (b.y2 > clip->y2)
+			b.y2 = clip->y2;
+
+		if (b.x2 > b.x1 && b.y2 > b.y1)
+			box[count++] = b;
+	}
+
+	return count;
+}
+
+static void rectangles_extents__generic(const xRectangle *r, int n,
+					BoxRec *extents)
+{
+	extents->x1 = r->x;
+	extents->x2 = r->x + r->width;
+	extents->y1 = r->y;
+	extents->y2 = r->y + r->height;
+	while (--n) {
+		r++;
+		if (extents->x1 > r->x)
+			extents->x1 = r->x;
+		if (extents->x2 < (int16_t)(r->x + r->width))
+			extents->x2 = r->x + r->width;
+		if (extents->y1 > r->y)
+			extents->y1 = r->y;
+		if (extents->y2 < (int16_t)(r->y + r->height))
+			extents->y2 = r->y + r->height;
+	}
+}
+
+static void rectangles_to_boxes__generic(const xRectangle *r, BoxRec *box,
+					 int n, int16_t dx, int16_t dy)
+{
+	while (n--) {
+		box->x1 = r->x + dx;
+		box->x2 = box->x1 + r->width;
+		box->y1 = r->y + dy;
+		box->y2 = box->y1 + r->height;
+		r++, box++;
+	}
+}
+
+static bool box_contains(const BoxRec *a, const BoxRec *b)
+{
+	if (b->x1 < a->x1 || b->x2 > a->x2)
+		return false;
+
+	if (b->y1 < a->y1 || b->y2 > a->y2)
+		return false;
+
+	return true;
+}
+
+static bool box_overlaps(const BoxRec *a, const BoxRec *b)
+{
+	return (a->x1 < b->x2 && a->x2 > b->x1 &&
+		a->y1 < b->y2 && a->y2 > b->y1);
+}
+
+static bool boxes_contain__generic(const BoxRec *b, int n, const BoxRec *box)
+{
+	while (n--) {
+		if (box_contains(b++, box))
+			return true;
+	}
+
+	return false;
+}
+
+static bool boxes_overlap__generic(const BoxRec *b, int n, const BoxRec *box)
+{
+	while (n--) {
+		if (box_overlaps(b++, box))
+			return true;
+	}
+
+	return false;
+}
+
+#if defined(sse2)
+#pragma GCC push_options
+#pragma GCC target("sse2,fpmath=sse")
+#include <emmintrin.h>
+
+static force_inline __m128i box_load(const BoxRec *box)
+{
+	__m128i v = _mm_loadl_epi64((const __m128i *)box);
+	return _mm_unpacklo_epi64(v, v);
+}
+
+static force_inline void box_store(BoxRec *box, __m128i v)
+{
+	_mm_storel_epi64((__m128i *)box, v);
+}
+
+/* x1, y1 from the minimum and x2, y2 from the maximum */
+static force_inline void box_store_extents(BoxRec *box, __m128i lo, __m128i hi)
+{
+	lo = _mm_min_epi16(lo, _mm_srli_si128(lo, 8));
+	hi = _mm_max_epi16(hi, _mm_srli_si128(hi, 8));
+	box_store(box, _mm_unpacklo_epi32(lo, _mm_srli_si128(hi, 4)));
+}
+
+/* (x, y, w, h) -> (x, y, x + w, y + h), two rectangles at a time */
+static force_inline __m128i rectangles_to_boxes__xmm(__m128i v)
+{
+	const __m128i wh = _mm_set_epi16(-1, -1, 0, 0, -1, -1, 0, 0);
+	__m128i xy;
+
+	xy = _mm_shufflelo_epi16(v, _MM_SHUFFLE(1, 0, 1, 0));
+	xy = _mm_shufflehi_epi16(xy, _MM_SHUFFLE(1, 0, 1, 0));
+	return _mm_add_epi16(xy, _mm_and_si128(v, wh));
+}
+
+static force_inline __m128i rectangle_load(const xRectangle *r)
+{
+	__m128i v = _mm_loadl_epi64((const __m128i *)r);
+	return _mm_unpacklo_epi64(v, v);
+}
+
+static force_inline __m128i box_delta(int16_t dx, int16_t dy)
+{
+	return _mm_set_epi16(dy, dx, dy, dx, dy, dx, dy, dx);
+}
+
+sse2 static void boxes_extents__sse2(const BoxRec *box, int n, BoxRec *extents)
+{
+	__m128i lo, hi;
+
+	lo = hi = box_load(box);
+	box++, n--;
+	while (n >= 2) {
+		__m128i v = _mm_loadu_si128((const __m128i *)box);
+		lo = _mm_min_epi16(lo, v);
+		hi = _mm_max_epi16(hi, v);
+		box += 2, n -= 2;
+	}
+	if (n) {
+		__m128i v = box_load(box);
+		lo = _mm_min_epi16(lo, v);
+		hi = _mm_max_epi16(hi, v);
+	}
+
+	box_store_extents(extents, lo, hi);
+}
+
+sse2 static void boxes_translate__sse2(const BoxRec *src, BoxRec *dst, int n,
+				       int16_t dx, int16_t dy)
+{
+	const __m128i d = box_delta(dx, dy);
+
+	while (n >= 2) {
+		__m128i v = _mm_loadu_si128((const __m128i *)src);
+		_mm_storeu_si128((__m128i *)dst, _mm_add_epi16(v, d));
+		src += 2, dst += 2, n -= 2;
+	}
+	if (n)
+		box_store(dst, _mm_add_epi16(box_load(src), d));
+}
+
+sse2 static int boxes_clip__sse2(BoxRec *box, int n, const BoxRec *clip)
+{
+	const __m128i c = box_load(clip);
+	const __m128i lo = _mm_set_epi16(0, 0, -1, -1, 0, 0, -1, -1);
+	__m128i c_min, c_max;
+	int i, count = 0;
+
+	/* max() against (x1, y1, MINSHORT, MINSHORT), min() against
+	 * (MAXSHORT, MAXSHORT, x2, y2).
+	 */
+	c_min = _mm_or_si128(_mm_and_si128(lo, c),
+			     _mm_andnot_si128(lo, _mm_set1_epi16(MINSHORT)));
+	c_max = _mm_or_si128(_mm_andnot_si128(lo, c),
+			     _mm_and_si128(lo, _mm_set1_epi16(MAXSHORT)));
+
+	for (i = 0; i < n; i += 2) {
+		__m128i v;
+		int mask;
+
+		if (i + 1 < n)
+			v = _mm_loadu_si128((const __m128i *)&box[i]);
+		else
+			v = box_load(&box[i]);
+
+		v = _mm_min_epi16(_mm_max_epi16(v, c_min), c_max);
+
+		/* x2 > x1 && y2 > y1 for each box */
+		mask = _mm_movemask_epi8(_mm_cmpgt_epi16(_mm_srli_epi64(v, 32), v));
+		if ((mask & 0x000f) == 0x000f)
+			box_store(&box[count++], v);
+		if (i + 1 < n && (mask & 0x0f00) == 0x0f00)
+			box_store(&box[count++], _mm_srli_si128(v, 8));
+	}
+
+	return count;
+}
+
+sse2 static void rectangles_extents__sse2(const xRectangle *r, int n,
+					  BoxRec *extents)
+{
+	__m128i lo, hi;
+
+	lo = hi = rectangles_to_boxes__xmm(rectangle_load(r));
+	r++, n--;
+	while (n >= 2) {
+		__m128i v = rectangles_to_boxes__xmm(_mm_loadu_si128((const __m128i *)r));
+		lo = _mm_min_epi16(lo, v);
+		hi = _mm_max_epi16(hi, v);
+		r += 2, n -= 2;
+	}
+	if (n) {
+		__m128i v = rectangles_to_boxes__xmm(rectangle_load(r));
+		lo = _mm_min_epi16(lo, v);
+		hi = _mm_max_epi16(hi, v);
+	}
+
+	box_store_extents(extents, lo, hi);
+}
+
+sse2 static void rectangles_to_boxes__sse2(const xRectangle *r, BoxRec *box,
+					   int n, int16_t dx, int16_t dy)
+{
+	const __m128i d = box_delta(dx, dy);
+
+	while (n >= 2) {
+		__m128i v = _mm_loadu_si128((const __m128i *)r);
+		v = _mm_add_epi16(rectangles_to_boxes__xmm(v), d);
+		_mm_storeu_si128((__m128i *)box, v);
+		r += 2, box += 2, n -= 2;
+	}
+	if (n)
+		box_store(box, _mm_add_epi16(rectangles_to_boxes__xmm(rectangle_load(r)), d));
+}
+
+sse2 static bool boxes_contain__sse2(const BoxRec *b, int n, const BoxRec *box)
+{
+	const __m128i q = box_load(box);
+	const __m128i lo = _mm_set_epi16(0, 0, -1, -1, 0, 0, -1, -1);
+
+	while (n > 0) {
+		__m128i v, fail;
+		int mask;
+
+		/* A trailing single box is tested twice */
+		v = n >= 2 ? _mm_loadu_si128((const __m128i *)b) : box_load(b);
+
+		/* fails if b.x1 > box.x1 or b.x2 < box.x2 (and for y) */
+		fail = _mm_or_si128(_mm_and_si128(lo, _mm_cmpgt_epi16(v, q)),
+				    _mm_andnot_si128(lo, _mm_cmpgt_epi16(q, v)));
+		mask = _mm_movemask_epi8(fail);
+		if ((mask & 0x00ff) == 0 || (mask & 0xff00) == 0)
+			return true;
+
+		b += 2, n -= 2;
+	}
+
+	return false;
+}
+
+sse2 static bool boxes_overlap__sse2(const BoxRec *b, int n, const BoxRec *box)
+{
+	const __m128i q = _mm_shuffle_epi32(box_load(box), _MM_SHUFFLE(2, 3, 0, 1));
+	const __m128i lo = _mm_set_epi16(0, 0, -1, -1, 0, 0, -1, -1);
+
+	while (n > 0) {
+		__m128i v, pass;
+		int mask;
+
+		v = n >= 2 ? _mm_loadu_si128((const __m128i *)b) : box_load(b);
+
+		/* b.x1 < box.x2 and b.x2 > box.x1 (and for y) */
+		pass = _mm_or_si128(_mm_and_si128(lo, _mm_cmpgt_epi16(q, v)),
+				    _mm_andnot_si128(lo, _mm_cmpgt_epi16(v, q)));
+		mask = _mm_movemask_epi8(pass);
+		if ((mask & 0x00ff) == 0x00ff || (mask & 0xff00) == 0xff00)
+			return true;
+
+		b += 2, n -= 2;
+	}
+
+	return false;
+}
+
+#if defined(avx2)
+#include <immintrin.h>
+
+avx2 static force_inline __m256i rectangles_to_boxes__ymm(__m256i v)
+{
+	const __m256i wh = _mm256_set_epi16(-1, -1, 0, 0, -1, -1, 0, 0,
+					    -1, -1, 0, 0, -1, -1, 0, 0);
+	__m256i xy;
+
+	xy = _mm256_shufflelo_epi16(v, _MM_SHUFFLE(1, 0, 1, 0));
+	xy = _mm256_shufflehi_epi16(xy, _MM_SHUFFLE(1, 0, 1, 0));
+	return _mm256_add_epi16(xy, _mm256_and_si256(v, wh));
+}
+
+avx2 static void boxes_extents__avx2(const BoxRec *box, int n, BoxRec *extents)
+{
+	__m256i lo, hi;
+	__m128i lo128, hi128;
+
+	if (n < 8) {
+		boxes_extents__sse2(box, n, extents);
+		return;
+	}
+
+	lo = hi = _mm256_loadu_si256((const __m256i *)box);
+	box += 4, n -= 4;
+	while (n >= 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)box);
+		lo = _mm256_min_epi16(lo, v);
+		hi = _mm256_max_epi16(hi, v);
+		box += 4, n -= 4;
+	}
+
+	lo128 = _mm_min_epi16(_mm256_castsi256_si128(lo),
+			      _mm256_extracti128_si256(lo, 1));
+	hi128 = _mm_max_epi16(_mm256_castsi256_si128(hi),
+			      _mm256_extracti128_si256(hi, 1));
+	while (n--) {
+		__m128i v = box_load(box++);
+		lo128 = _mm_min_epi16(lo128, v);
+		hi128 = _mm_max_epi16(hi128, v);
+	}
+
+	box_store_extents(extents, lo128, hi128);
+}
+
+avx2 static void boxes_translate__avx2(const BoxRec *src, BoxRec *dst, int n,
+				       int16_t dx, int16_t dy)
+{
+	const __m256i d = _mm256_set_epi16(dy, dx, dy, dx, dy, dx, dy, dx,
+					   dy, dx, dy, dx, dy, dx, dy, dx);
+
+	while (n >= 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)src);
+		_mm256_storeu_si256((__m256i *)dst, _mm256_add_epi16(v, d));
+		src += 4, dst += 4, n -= 4;
+	}
+	if (n)
+		boxes_translate__sse2(src, dst, n, dx, dy);
+}
+
+avx2 static void rectangles_extents__avx2(const xRectangle *r, int n,
+					  BoxRec *extents)
+{
+	__m256i lo, hi;
+	__m128i lo128, hi128;
+
+	if (n < 8) {
+		rectangles_extents__sse2(r, n, extents);
+		return;
+	}
+
+	lo = hi = rectangles_to_boxes__ymm(_mm256_loadu_si256((const __m256i *)r));
+	r += 4, n -= 4;
+	while (n >= 4) {
+		__m256i v = rectangles_to_boxes__ymm(_mm256_loadu_si256((const __m256i *)r));
+		lo = _mm256_min_epi16(lo, v);
+		hi = _mm256_max_epi16(hi, v);
+		r += 4, n -= 4;
+	}
+
+	lo128 = _mm_min_epi16(_mm256_castsi256_si128(lo),
+			      _mm256_extracti128_si256(lo, 1));
+	hi128 = _mm_max_epi16(_mm256_castsi256_si128(hi),
+			      _mm256_extracti128_si256(hi, 1));
+	while (n--) {
+		__m128i v = rectangles_to_boxes__xmm(rectangle_load(r++));
+		lo128 = _mm_min_epi16(lo128, v);
+		hi128 = _mm_max_epi16(hi128, v);
+	}
+
+	box_store_extents(extents, lo128, hi128);
+}
+
+avx2 static void rectangles_to_boxes__avx2(const xRectangle *r, BoxRec *box,
+					   int n, int16_t dx, int16_t dy)
+{
+	const __m256i d = _mm256_set_epi16(dy, dx, dy, dx, dy, dx, dy, dx,
+					   dy, dx, dy, dx, dy, dx, dy, dx);
+
+	while (n >= 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)r);
+		v = _mm256_add_epi16(rectangles_to_boxes__ymm(v), d);
+		_mm256_storeu_si256((__m256i *)box, v);
+		r += 4, box += 4, n -= 4;
+	}
+	if (n)
+		rectangles_to_boxes__sse2(r, box, n, dx, dy);
+}
+#endif
+
+#pragma GCC pop_options
+#endif
+
+static struct damage_kernels {
+	void (*extents)(const BoxRec *box, int n, BoxRec *extents);
+	void (*translate)(const BoxRec *src, BoxRec *dst, int n,
+			  int16_t dx, int16_t dy);
+	int (*clip)(BoxRec *box, int n, const BoxRec *clip);
+	void (*rectangles_extents)(const xRectangle *r, int n, BoxRec *extents);
+	void (*rectangles_to_boxes)(const xRectangle *r, BoxRec *box, int n,
+				    int16_t dx, int16_t dy);
+	bool (*contain)(const BoxRec *b, int n, const BoxRec *box);
+	bool (*overlap)(const BoxRec *b, int n, const BoxRec *box);
+} kernels = {
+	boxes_extents__generic,
+	boxes_translate__generic,
+	boxes_clip__generic,
+	rectangles_extents__generic,
+	rectangles_to_boxes__generic,
+	boxes_contain__generic,
+	boxes_overlap__generic,
+};
+
+static void choose_kernels(struct damage_kernels *k, unsigned cpu)
+{
+	k->extents = boxes_extents__generic;
+	k->translate = boxes_translate__generic;
+	k->clip = boxes_clip__generic;
+	k->rectangles_extents = rectangles_extents__generic;
+	k->rectangles_to_boxes = rectangles_to_boxes__generic;
+	k->contain = boxes_contain__generic;
+	k->overlap = boxes_overlap__generic;
+
+#if defined(sse2)
+	if (cpu & SSE2) {
+		k->extents = boxes_extents__sse2;
+		k->translate = boxes_translate__sse2;
+		k->clip = boxes_clip__sse2;
+		k->rectangles_extents = rectangles_extents__sse2;
+		k->rectangles_to_boxes = rectangles_to_boxes__sse2;
+		k->contain = boxes_contain__sse2;
+		k->overlap = boxes_overlap__sse2;
+	}
+#endif
+#if defined(avx2)
+	if ((cpu & (SSE2 | AVX2)) == (SSE2 | AVX2)) {
+		k->extents = boxes_extents__avx2;
+		k->translate = boxes_translate__avx2;
+		k->rectangles_extents = rectangles_extents__avx2;
+		k->rectangles_to_boxes = rectangles_to_boxes__avx2;
+	}
+#endif
+}
+
+void sna_damage_choose_kernels(unsigned cpu)
+{
+	choose_kernels(&kernels, cpu);
+}
+
+#define DAMAGE_TILE_SHIFT 4
+#define DAMAGE_TILE_SIZE (1 << DAMAGE_TILE_SHIFT)
+#define DAMAGE_TILE_MASK (DAMAGE_TILE_SIZE - 1)
+#define DAMAGE_TILES_THRESHOLD 512
+#define DAMAGE_TILES_MAX (1 << 18)
+
+#define TILE_EMPTY 0
+#define TILE_FULL 1
+
+struct sna_damage_tiles {
+	int x, y; /* origin of the grid in pixels */
+	int width, height; /* size of the grid in tiles */
+	uint32_t *tile; /* TILE_EMPTY, TILE_FULL or 2 + index into mask[] */
+	struct sna_damage_tile_mask {
+		uint16_t row[DAMAGE_TILE_SIZE];
+	} *mask;
+	int num_masks, max_masks;
+};
+
+static void tiles_destroy(struct sna_damage_tiles *t)
+{
+	free(t->tile);
+	free(t->mask);
+	free(t);
+}
+
+/* Ensure the grid covers the extents, growing it if required */
+static bool tiles_cover(struct sna_damage_tiles *t, const BoxRec *extents)
+{
+	int x1, y1, x2, y2, width, height, ty;
+	uint32_t *tile;
+
+	if (extents->x1 >= t->x && extents->y1 >= t->y &&
+	    extents->x2 <= t->x + (t->width << DAMAGE_TILE_SHIFT) &&
+	    extents->y2 <= t->y + (t->height << DAMAGE_TILE_SHIFT))
+		return true;
+
+	x1 = extents->x1 & ~DAMAGE_TILE_MASK;
+	y1 = extents->y1 & ~DAMAGE_TILE_MASK;
+	x2 = ALIGN(extents->x2, DAMAGE_TILE_SIZE);
+	y2 = ALIGN(extents->y2, DAMAGE_TILE_SIZE);
+	if (t->tile) {
+		if (x1 > t->x)
+			x1 = t->x;
+		if (y1 > t->y)
+			y1 = t->y;
+		if (x2 < t->x + (t->width << DAMAGE_TILE_SHIFT))
+			x2 = t->x + (t->width << DAMAGE_TILE_SHIFT);
+		if (y2 < t->y + (t->height << DAMAGE_TILE_SHIFT))
+			y2 = t->y + (t->height << DAMAGE_TILE_SHIFT);
+	}
+
+	width = (x2 - x1) >> DAMAGE_TILE_SHIFT;
+	height = (y2 - y1) >> DAMAGE_TILE_SHIFT;
+	DBG(("%s: grid (%d, %d) x (%d, %d) tiles\n",
+	     __FUNCTION__, x1, y1, width, height));
+	if (width * height > DAMAGE_TILES_MAX)
+		return false;
+
+	tile = calloc(width * height, sizeof(uint32_t));
+	if (tile == NULL)
+		return false;
+
+	if (t->tile) {
+		int dx = (t->x - x1) >> DAMAGE_TILE_SHIFT;
+		int dy = (t->y - y1) >> DAMAGE_TILE_SHIFT;
+
+		for (ty = 0; ty < t->height; ty++)
+			memcpy(tile + (ty + dy) * width + dx,
+			       t->tile + ty * t->width,
+			       t->width * sizeof(uint32_t));
+		free(t->tile);
+	}
+
+	t->tile = tile;
+	t->x = x1;
+	t->y = y1;
+	t->width = width;
+	t->height = height;
+	return true;
+}
+
+static int tiles_alloc_mask(struct sna_damage_tiles *t)
+{
+	if (t->num_masks == t->max_masks) {
+		int size = t->max_masks ? 2 * t->max_masks : 64;
+		void *mask;
+
+		mask = realloc(t->mask, size * sizeof(*t->mask));
+		if (mask == NULL)
+			return -1;
+
+		t->mask = mask;
+		t->max_masks = size;
+	}
+
+	memset(&t->mask[t->num_masks], 0, sizeof(*t->mask));
+	return t->num_masks++;
+}
+
+static inline uint16_t tile_span(int x1, int x2)
+{
+	return (0xffff << x1) & (0xffff >> (DAMAGE_TILE_SIZE - x2));
+}
+
+static inline unsigned tile_row(const struct sna_damage_tiles *t,
+				uint32_t tile, int row)
+{
+	if (tile == TILE_EMPTY)
+		return 0;
+	if (tile == TILE_FULL)
+		return 0xffff;
+	return t->mask[tile - 2].row[row];
+}
+
+static bool tiles_add_box(struct sna_damage_tiles *t, const BoxRec *box)
+{
+	int x1 = box->x1 - t->x, x2 = box->x2 - t->x;
+	int y1 = box->y1 - t->y, y2 = box->y2 - t->y;
+	int tx, ty;
+
+	if (x2 <= x1 || y2 <= y1)
+		return true;
+
+	if (x1 < 0 || x2 > t->width << DAMAGE_TILE_SHIFT ||
+	    y1 < 0 || y2 > t->height << DAMAGE_TILE_SHIFT)
+		return false;
+
+	for (ty = y1 >> DAMAGE_TILE_SHIFT; ty <= (y2 - 1) >> DAMAGE_TILE_SHIFT; ty++) {
+		int ry1 = y1 - (ty << DAMAGE_TILE_SHIFT);
+		int ry2 = y2 - (ty << DAMAGE_TILE_SHIFT);
+		uint32_t *row = t->tile + ty * t->width;
+
+		if (ry1 < 0)
+			ry1 = 0;
+		if (ry2 > DAMAGE_TILE_SIZE)
+			ry2 = DAMAGE_TILE_SIZE;
+
+		for (tx = x1 >> DAMAGE_TILE_SHIFT; tx <= (x2 - 1) >> DAMAGE_TILE_SHIFT; tx++) {
+			int rx1 = x1 - (tx << DAMAGE_TILE_SHIFT);
+			int rx2 = x2 - (tx << DAMAGE_TILE_SHIFT);
+			struct sna_damage_tile_mask *mask;
+			uint16_t bits, full;
+			int r;
+
+			if (row[tx] == TILE_FULL)
+				continue;
+
+			if (rx1 < 0)
+				rx1 = 0;
+			if (rx2 > DAMAGE_TILE_SIZE)
+				rx2 = DAMAGE_TILE_SIZE;
+
+			if ((rx1 | ry1) == 0 &&
+			    (rx2 & ry2) == DAMAGE_TILE_SIZE) {
+				row[tx] = TILE_FULL;
+				continue;
+			}
+
+			if (row[tx] == TILE_EMPTY) {
+				int idx = tiles_alloc_mask(t);
+				if (idx < 0)
+					return false;
+				row[tx] = idx + 2;
+			}
+
+			mask = &t->mask[row[tx] - 2];
+			bits = tile_span(rx1, rx2);
+			full = 0xffff;
+			for (r = 0; r < DAMAGE_TILE_SIZE; r++) {
+				if (r >= ry1 && r < ry2)
+					mask->row[r] |= bits;
+				full &= mask->row[r];
+			}
+			if (full == 0xffff)
+				row[tx] = TILE_FULL;
+		}
+	}
+
+	return true;
+}
+
+static int tiles_contains_box(const struct sna_damage_tiles *t,
+			      const BoxRec *box)
+{
+	int x1 = box->x1 - t->x, x2 = box->x2 - t->x;
+	int y1 = box->y1 - t->y, y2 = box->y2 - t->y;
+	bool in = false, out = false;
+	int tx, ty;
+
+	if (x1 < 0 || y1 < 0 ||
+	    x2 > t->width << DAMAGE_TILE_SHIFT ||
+	    y2 > t->height << DAMAGE_TILE_SHIFT) {
+		out = true;
+		if (x1 < 0)
+			x1 = 0;
+		if (y1 < 0)
+			y1 = 0;
+		if (x2 > t->width << DAMAGE_TILE_SHIFT)
+			x2 = t->width << DAMAGE_TILE_SHIFT;
+		if (y2 > t->height << DAMAGE_TILE_SHIFT)
+			y2 = t->height << DAMAGE_TILE_SHIFT;
+		if (x2 <= x1 || y2 <= y1)
+			return PIXMAN_REGION_OUT;
+	}
+
+	for (ty = y1 >> DAMAGE_TILE_SHIFT; ty <= (y2 - 1) >> DAMAGE_TILE_SHIFT; ty++) {
+		int ry1 = y1 - (ty << DAMAGE_TILE_SHIFT);
+		int ry2 = y2 - (ty << DAMAGE_TILE_SHIFT);
+		const uint32_t *row = t->tile + ty * t->width;
+
+		if (ry1 < 0)
+			ry1 = 0;
+		if (ry2 > DAMAGE_TILE_SIZE)
+			ry2 = DAMAGE_TILE_SIZE;
+
+		for (tx = x1 >> DAMAGE_TILE_SHIFT; tx <= (x2 - 1) >> DAMAGE_TILE_SHIFT; tx++) {
+			int rx1 = x1 - (tx << DAMAGE_TILE_SHIFT);
+			int rx2 = x2 - (tx << DAMAGE_TILE_SHIFT);
+			uint16_t bits;
+			int r;
+
+			if (row[tx] == TILE_FULL) {
+				in = true;
+			} else if (row[tx] == TILE_EMPTY) {
+				out = true;
+			} else {
+				if (rx1 < 0)
+					rx1 = 0;
+				if (rx2 > DAMAGE_TILE_SIZE)
+					rx2 = DAMAGE_TILE_SIZE;
+
+				bits = tile_span(rx1, rx2);
+				for (r = ry1; r < ry2; r++) {
+					uint16_t v = t->mask[row[tx] - 2].row[r] & bits;
+					if (v)
+						in = true;
+					if (v != bits)
+						out = true;
+				}
+			}
+
+			if (in && out)
+				return PIXMAN_REGION_PART;
+		}
+	}
+
+	return in ? PIXMAN_REGION_IN : PIXMAN_REGION_OUT;
+}
+
+struct tiles_boxes {
+	BoxRec *box;
+	int num, size;
+};
+
+static bool tiles_emit(struct tiles_boxes *b, int x1, int x2, int y1, int y2)
+{
+	if (b->num == b->size) {
+		int size = b->size ? 2 * b->size : 256;
+		BoxRec *box;
+
+		box = realloc(b->box, size * sizeof(BoxRec));
+		if (box == NULL)
+			return false;
+
+		b->box = box;
+		b->size = size;
+	}
+
+	b->box[b->num].x1 = x1;
+	b->box[b->num].x2 = x2;
+	b->box[b->num].y1 = y1;
+	b->box[b->num].y2 = y2;
+	b->num++;
+	return true;
+}
+
+/* Convert the grid into y-x banded boxes, merging identical rows */
+static bool tiles_to_boxes(const struct sna_damage_tiles *t,
+			   struct tiles_boxes *b)
+{
+	int band = 0, band_count = 0, band_y2 = INT_MIN;
+	int tx, ty, r, i;
+
+	b->box = NULL;
+	b->num = b->size = 0;
+
+	for (ty = 0; ty < t->height; ty++) {
+		const uint32_t *row = t->tile + ty * t->width;
+		bool any = false, partial = false;
+		int rows;
+
+		for (tx = 0; tx < t->width; tx++) {
+			any |= row[tx] != TILE_EMPTY;
+			partial |= row[tx] > TILE_FULL;
+		}
+		if (!any)
+			continue;
+
+		/* Without any partial tiles, all 16 rows are identical */
+		rows = partial ? DAMAGE_TILE_SIZE : 1;
+		for (r = 0; r < rows; r++) {
+			int y1 = t->y + (ty << DAMAGE_TILE_SHIFT) + r;
+			int y2 = partial ? y1 + 1 : y1 + DAMAGE_TILE_SIZE;
+			int start = b->num, x = INT_MIN;
+
+			for (tx = 0; tx < t->width; tx++) {
+				unsigned bits = tile_row(t, row[tx], r);
+				int x0 = t->x + (tx << DAMAGE_TILE_SHIFT);
+
+				if (bits == 0xffff) {
+					if (x == INT_MIN)
+						x = x0;
+				} else if (bits == 0) {
+					if (x != INT_MIN) {
+						if (!tiles_emit(b, x, x0, y1, y2))
+							return false;
+						x = INT_MIN;
+					}
+				} else for (i = 0; i < DAMAGE_TILE_SIZE; i++) {
+					if (bits & (1 << i)) {
+						if (x == INT_MIN)
+							x = x0 + i;
+					} else if (x != INT_MIN) {
+						if (!tiles_emit(b, x, x0 + i, y1, y2))
+							return false;
+						x = INT_MIN;
+					}
+				}
+			}
+			if (x != INT_MIN &&
+			    !tiles_emit(b, x, t->x + (t->width << DAMAGE_TILE_SHIFT), y1, y2))
+				return false;
+
+			if (b->num == start)
+				continue;
+
+			if (band_y2 == y1 && b->num - start == band_count) {
+				for (i = 0; i < band_count; i++) {
+					if (b->box[band + i].x1 != b->box[start + i].x1 ||
+					    b->box[band + i].x2 != b->box[start + i].x2)
+						break;
+				}
+				if (i == band_count) {
+					for (i = 0; i < band_count; i++)
+						b->box[band + i].y2 = y2;
+					b->num = start;
+					band_y2 = y2;
+					continue;
+				}
+			}
+
+			band = start;
+			band_count = b->num - start;
+			band_y2 = y2;
+		}
+	}
+
+	return true;
+}
+
+static void tiles_union_region(const struct sna_damage_tiles *t,
+			       pixman_region16_t *region)
+{
+	struct tiles_boxes b;
+
+	if (tiles_to_boxes(t, &b) && b.num) {
+		pixman_region16_t tmp;
+
+		DBG(("%s: converted %d masks into %d boxes\n",
+		     __FUNCTION__, t->num_masks, b.num));
+
+		pixman_region_init_rects(&tmp, b.box, b.num);
+		pixman_region_union(region, region, &tmp);
+		pixman_region_fini(&tmp);
+	}
+
+	free(b.box);
+}
+
+static int damage_pending(struct sna_damage *damage)
+{
+	struct sna_damage_box *iter;
+	int count;
+
+	count = damage->embedded_box.size;
+	list_for_each_entry(iter, &damage->embedded_box.list, list)
+		count += iter->size;
+
+	return count - damage->remain;
+}
+
+static bool tiles_add_boxes(struct sna_damage_tiles *t,
+			    const BoxRec *box, int n)
+{
+	while (n--)
+		if (!tiles_add_box(t, box++))
+			return false;
+
+	return true;
+}
+
+/* Move the pending boxes over into a new grid */
+static bool __sna_damage_tiles_init(struct sna_damage *damage)
+{
+	struct sna_damage_tiles *t;
+	struct sna_damage_box *iter;
+	int n;
+
+	DBG(("%s: switching to tiles for %d boxes\n",
+	     __FUNCTION__, damage_pending(damage)));
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return false;
+
+	if (!tiles_cover(t, &damage->extents))
+		goto err;
+
+	n = damage->embedded_box.size;
+	if (list_is_empty(&damage->embedded_box.list))
+		n -= damage->remain;
+	if (!tiles_add_boxes(t, damage->embedded_box.box, n))
+		goto err;
+
+	list_for_each_entry(iter, &damage->embedded_box.list, list) {
+		n = iter->size;
+		if (iter == last_box(damage))
+			n -= damage->remain;
+		if (!tiles_add_boxes(t, (BoxRec *)(iter + 1), n))
+			goto err;
+	}
+
+	free_list(&damage->embedded_box.list);
+	reset_embedded_box(damage);
+	damage->dirty = true;
+	damage->tiles = t;
+	return true;
+
+err:
+	tiles_destroy(t);
+	return false;
+}
+
+static void __sna_damage_reduce(struct sna_damage *damage);
+
+/* Decide whether the next batch of boxes should be added to the grid */
+static bool damage_use_tiles(struct sna_damage *damage)
+{
+	if (damage->tiles == NULL) {
+		if (damage->mode != DAMAGE_ADD ||
+		    damage_pending(damage) < DAMAGE_TILES_THRESHOLD)
+			return false;
+
+		return __sna_damage_tiles_init(damage);
+	}
+
+	assert(damage->mode == DAMAGE_ADD);
+	if (tiles_cover(damage->tiles, &damage->extents))
+		return true;
+
+	/* The grid would be too large, fall back to boxes */
+	__sna_damage_reduce(damage);
+	return false;
+}
+
 static void __sna_damage_reduce(struct sna_damage *damage)
 {
 	int n, nboxes;
@@ -222,6 +1199,21 @@ static void __sna_damage_reduce(struct sna_damage *damage)
 
 	DBG(("    reduce: before region.n=%d\n", region_num_rects(region)));
 
+	if (damage->tiles) {
+		assert(damage->mode == DAMAGE_ADD);
+		assert(damage_pending(damage) == 0);
+
+		tiles_union_region(damage->tiles, region);
+		tiles_destroy(damage->tiles);
+		damage->tiles = NULL;
+
+		if (pixman_region_not_empty(region))
+			damage->extents = region->extents;
+		else
+			reset_extents(damage);
+		goto done;
+	}
+
 	nboxes = damage->embedded_box.size;
 	list_for_each_entry(iter, &damage->embedded_box.list, list)
 		nboxes += iter->size;
@@ -372,6 +1364,13 @@ _sna_damage_create_elt(struct sna_damage *damage,
 	     __FUNCTION__, damage->remain, count));
 	assert(count);
 
+	if (damage_use_tiles(damage)) {
+		if (tiles_add_boxes(damage->tiles, boxes, count))
+			return damage;
+
+		__sna_damage_reduce(damage);
+	}
+
 restart:
 	n = count;
 	if (n > damage->remain)
@@ -414,6 +1413,23 @@ restart:
 	return damage;
 }
 
+/* In SUBTRACT mode only the part of each box that lies within the
+ * extents can remove anything, so clip the queued boxes to the extents
+ * and discard those that miss entirely.
+ */
+static void damage_append_boxes(struct sna_damage *damage,
+				const BoxRec *boxes, int n,
+				int16_t dx, int16_t dy)
+{
+	kernels.translate(boxes, damage->box, n, dx, dy);
+	if (damage->mode == DAMAGE_SUBTRACT)
+		n = kernels.clip(damage->box, n, &damage->extents);
+
+	damage->box += n;
+	damage->remain -= n;
+	damage->dirty = true;
+}
+
 static struct sna_damage *
 _sna_damage_create_elt_from_boxes(struct sna_damage *damage,
 				  const BoxRec *boxes, int count,
@@ -424,25 +1440,37 @@ _sna_damage_create_elt_from_boxes(struct sna_damage *damage,
 	DBG(("    %s: prev=(remain %d)\n", __FUNCTION__, damage->remain));
 	assert(count);
 
+	if (damage_use_tiles(damage)) {
+		for (i = 0; i < count; i++) {
+			BoxRec b;
+
+			b.x1 = boxes[i].x1 + dx;
+			b.x2 = boxes[i].x2 + dx;
+			b.y1 = boxes[i].y1 + dy;
+			b.y2 = boxes[i].y2 + dy;
+			if (!tiles_add_box(damage->tiles, &b))
+				break;
+		}
+		if (i == count)
+			return damage;
+
+		__sna_damage_reduce(damage);
+	}
+
 restart:
 	n = count;
 	if (n > damage->remain)
 		n = damage->remain;
 	if (n) {
-		for (i = 0; i < n; i++) {
-			damage->box[i].x1 = boxes[i].x1 + dx;
-			damage->box[i].x2 = boxes[i].x2 + dx;
-			damage->box[i].y1 = boxes[i].y1 + dy;
-			damage->box[i].y2 = boxes[i].y2 + dy;
-		}
-		damage->box += n;
-		damage->remain -= n;
-		damage->dirty = true;
+		damage_append_boxes(damage, boxes, n, dx, dy);
 
 		count -= n;
 		boxes += n;
 		if (count == 0)
 			return damage;
+
+		if (damage->remain)
+			goto restart;
 	}
 
 	DBG(("    %s(): new elt\n", __FUNCTION__));
@@ -462,15 +1490,7 @@ restart:
 		goto restart;
 	}
 
-	for (i = 0; i < count; i++) {
-		damage->box[i].x1 = boxes[i].x1 + dx;
-		damage->box[i].x2 = boxes[i].x2 + dx;
-		damage->box[i].y1 = boxes[i].y1 + dy;
-		damage->box[i].y2 = boxes[i].y2 + dy;
-	}
-	damage->box += count;
-	damage->remain -= count;
-	damage->dirty = true;
+	damage_append_boxes(damage, boxes, count, dx, dy);
 	assert(damage->remain >= 0);
 
 	return damage;
@@ -487,17 +1507,29 @@ _sna_damage_create_elt_from_rectangles(struct sna_damage *damage,
 	     __FUNCTION__, damage->remain, count));
 	assert(count);
 
+	if (damage_use_tiles(damage)) {
+		for (i = 0; i < count; i++) {
+			BoxRec b;
+
+			b.x1 = r[i].x + dx;
+			b.x2 = b.x1 + r[i].width;
+			b.y1 = r[i].y + dy;
+			b.y2 = b.y1 + r[i].height;
+			if (!tiles_add_box(damage->tiles, &b))
+				break;
+		}
+		if (i == count)
+			return damage;
+
+		__sna_damage_reduce(damage);
+	}
+
 restart:
 	n = count;
 	if (n > damage->remain)
 		n = damage->remain;
 	if (n) {
-		for (i = 0; i < n; i++) {
-			damage->box[i].x1 = r[i].x + dx;
-			damage->box[i].x2 = damage->box[i].x1 + r[i].width;
-			damage->box[i].y1 = r[i].y + dy;
-			damage->box[i].y2 = damage->box[i].y1 + r[i].height;
-		}
+		kernels.rectangles_to_boxes(r, damage->box, n, dx, dy);
 		damage->box += n;
 		damage->remain -= n;
 		damage->dirty = true;
@@ -525,12 +1557,7 @@ restart:
 		goto restart;
 	}
 
-	for (i = 0; i < count; i++) {
-		damage->box[i].x1 = r[i].x + dx;
-		damage->box[i].x2 = damage->box[i].x1 + r[i].width;
-		damage->box[i].y1 = r[i].y + dy;
-		damage->box[i].y2 = damage->box[i].y1 + r[i].height;
-	}
+	kernels.rectangles_to_boxes(r, damage->box, count, dx, dy);
 	damage->box += count;
 	damage->remain -= count;
 	damage->dirty = true;
@@ -550,6 +1577,23 @@ _sna_damage_create_elt_from_points(struct sna_damage *damage,
 	     __FUNCTION__, damage->remain, count));
 	assert(count);
 
+	if (damage_use_tiles(damage)) {
+		for (i = 0; i < count; i++) {
+			BoxRec b;
+
+			b.x1 = p[i].x + dx;
+			b.x2 = b.x1 + 1;
+			b.y1 = p[i].y + dy;
+			b.y2 = b.y1 + 1;
+			if (!tiles_add_box(damage->tiles, &b))
+				break;
+		}
+		if (i == count)
+			return damage;
+
+		__sna_damage_reduce(damage);
+	}
+
 restart:
 	n = count;
 	if (n > damage->remain)
@@ -766,19 +1810,9 @@ __sna_damage_add_boxes(struct sna_damage *damage,
 		break;
 	}
 
-	assert(box[0].x2 > box[0].x1 && box[0].y2 > box[0].y1);
-	extents = box[0];
-	for (i = 1; i < n; i++) {
+	for (i = 0; i < n; i++)
 		assert(box[i].x2 > box[i].x1 && box[i].y2 > box[i].y1);
-		if (extents.x1 > box[i].x1)
-			extents.x1 = box[i].x1;
-		if (extents.x2 < box[i].x2)
-			extents.x2 = box[i].x2;
-		if (extents.y1 > box[i].y1)
-			extents.y1 = box[i].y1;
-		if (extents.y2 < box[i].y2)
-			extents.y2 = box[i].y2;
-	}
+	kernels.extents(box, n, &extents);
 
 	assert(extents.y2 > extents.y1 && extents.x2 > extents.x1);
 
@@ -839,22 +1873,9 @@ __sna_damage_add_rectangles(struct sna_damage *damage,
 
 	assert(n);
 
-	assert(r[0].width && r[0].height);
-	extents.x1 = r[0].x;
-	extents.x2 = r[0].x + r[0].width;
-	extents.y1 = r[0].y;
-	extents.y2 = r[0].y + r[0].height;
-	for (i = 1; i < n; i++) {
+	for (i = 0; i < n; i++)
 		assert(r[i].width && r[i].height);
-		if (extents.x1 > r[i].x)
-			extents.x1 = r[i].x;
-		if (extents.x2 < r[i].x + r[i].width)
-			extents.x2 = r[i].x + r[i].width;
-		if (extents.y1 > r[i].y)
-			extents.y1 = r[i].y;
-		if (extents.y2 < r[i].y + r[i].height)
-			extents.y2 = r[i].y + r[i].height;
-	}
+	kernels.rectangles_extents(r, n, &extents);
 
 	assert(extents.y2 > extents.y1 && extents.x2 > extents.x1);
 
@@ -1039,6 +2060,10 @@ struct sna_damage *__sna_damage_all(struct sna_damage *damage,
 		pixman_region_fini(&damage->region);
 		free_list(&damage->embedded_box.list);
 		reset_embedded_box(damage);
+		if (damage->tiles) {
+			tiles_destroy(damage->tiles);
+			damage->tiles = NULL;
+		}
 	} else {
 		damage = _sna_damage_create();
 		if (damage == NULL)
@@ -1085,15 +2110,15 @@ struct sna_damage *_sna_damage_is_all(struct sna_damage *damage,
 	return __sna_damage_all(damage, width, height);
 }
 
-static bool box_contains(const BoxRec *a, const BoxRec *b)
+/* An empty region is only the final answer once the queued boxes
+ * (or tiles) have been added to it.
+ */
+static bool damage_is_empty(const struct sna_damage *damage)
 {
-	if (b->x1 < a->x1 || b->x2 > a->x2)
+	if (damage->dirty && damage->mode == DAMAGE_ADD)
 		return false;
 
-	if (b->y1 < a->y1 || b->y2 > a->y2)
-		return false;
-
-	return true;
+	return RegionNil(&damage->region);
 }
 
 static struct sna_damage *__sna_damage_subtract(struct sna_damage *damage,
@@ -1102,7 +2127,7 @@ static struct sna_damage *__sna_damage_subtract(struct sna_damage *damage,
 	if (damage == NULL)
 		return NULL;
 
-	if (RegionNil(&damage->region)) {
+	if (damage_is_empty(damage)) {
 no_damage:
 		__sna_damage_destroy(damage);
 		return NULL;
@@ -1195,7 +2220,7 @@ inline static struct sna_damage *__sna_damage_subtract_box(struct sna_damage *da
 	if (damage == NULL)
 		return NULL;
 
-	if (RegionNil(&damage->region)) {
+	if (damage_is_empty(damage)) {
 		__sna_damage_destroy(damage);
 		return NULL;
 	}
@@ -1267,26 +2292,16 @@ static struct sna_damage *__sna_damage_subtract_boxes(struct sna_damage *damage,
 	if (damage == NULL)
 		return NULL;
 
-	if (RegionNil(&damage->region)) {
+	if (damage_is_empty(damage)) {
 		__sna_damage_destroy(damage);
 		return NULL;
 	}
 
 	assert(n);
 
-	assert(box[0].x2 > box[0].x1 && box[0].y2 > box[0].y1);
-	extents = box[0];
-	for (i = 1; i < n; i++) {
+	for (i = 0; i < n; i++)
 		assert(box[i].x2 > box[i].x1 && box[i].y2 > box[i].y1);
-		if (extents.x1 > box[i].x1)
-			extents.x1 = box[i].x1;
-		if (extents.x2 < box[i].x2)
-			extents.x2 = box[i].x2;
-		if (extents.y1 > box[i].y1)
-			extents.y1 = box[i].y1;
-		if (extents.y2 < box[i].y2)
-			extents.y2 = box[i].y2;
-	}
+	kernels.extents(box, n, &extents);
 
 	assert(extents.y2 > extents.y1 && extents.x2 > extents.x1);
 
@@ -1346,8 +2361,7 @@ static int __sna_damage_contains_box(struct sna_damage **_damage,
 				     const BoxRec *box)
 {
 	struct sna_damage *damage = *_damage;
-	const BoxRec *b;
-	int n, count, ret;
+	int count, ret;
 
 	if (damage->mode == DAMAGE_ALL)
 		return PIXMAN_REGION_IN;
@@ -1363,15 +2377,21 @@ static int __sna_damage_contains_box(struct sna_damage **_damage,
 		if (ret == PIXMAN_REGION_IN)
 			return ret;
 
+		if (damage->tiles) {
+			int tiles = tiles_contains_box(damage->tiles, box);
+			if (tiles == PIXMAN_REGION_IN)
+				return tiles;
+			if (tiles == PIXMAN_REGION_OUT &&
+			    ret == PIXMAN_REGION_OUT)
+				return ret;
+		}
+
 		count = damage->embedded_box.size;
 		if (list_is_empty(&damage->embedded_box.list))
 			count -= damage->remain;
 
-		b = damage->embedded_box.box;
-		for (n = 0; n < count; n++) {
-			if (box_contains(&b[n], box))
-				return PIXMAN_REGION_IN;
-		}
+		if (kernels.contain(damage->embedded_box.box, count, box))
+			return PIXMAN_REGION_IN;
 	} else {
 		if (ret == PIXMAN_REGION_OUT)
 			return ret;
@@ -1380,11 +2400,8 @@ static int __sna_damage_contains_box(struct sna_damage **_damage,
 		if (list_is_empty(&damage->embedded_box.list))
 			count -= damage->remain;
 
-		b = damage->embedded_box.box;
-		for (n = 0; n < count; n++) {
-			if (box_contains(&b[n], box))
-				return PIXMAN_REGION_OUT;
-		}
+		if (kernels.contain(damage->embedded_box.box, count, box))
+			return PIXMAN_REGION_OUT;
 	}
 
 	__sna_damage_reduce(damage);
@@ -1425,17 +2442,10 @@ int _sna_damage_contains_box(struct sna_damage **damage,
 }
 #endif
 
-static bool box_overlaps(const BoxRec *a, const BoxRec *b)
-{
-	return (a->x1 < b->x2 && a->x2 > b->x1 &&
-		a->y1 < b->y2 && a->y2 > b->y1);
-}
-
 bool _sna_damage_contains_box__no_reduce(const struct sna_damage *damage,
 					 const BoxRec *box)
 {
 	int n, count;
-	const BoxRec *b;
 
 	assert(damage && damage->mode != DAMAGE_ALL);
 	if (!box_contains(&damage->extents, box))
@@ -1449,17 +2459,14 @@ bool _sna_damage_contains_box__no_reduce(const struct sna_damage *damage,
 		if (n == PIXMAN_REGION_IN)
 			return true;
 
+		if (damage->tiles)
+			return tiles_contains_box(damage->tiles, box) == PIXMAN_REGION_IN;
+
 		count = damage->embedded_box.size;
 		if (list_is_empty(&damage->embedded_box.list))
 			count -= damage->remain;
 
-		b = damage->embedded_box.box;
-		for (n = 0; n < count; n++) {
-			if (box_contains(&b[n], box))
-				return true;
-		}
-
-		return false;
+		return kernels.contain(damage->embedded_box.box, count, box);
 	} else {
 		if (n != PIXMAN_REGION_IN)
 			return false;
@@ -1468,13 +2475,7 @@ bool _sna_damage_contains_box__no_reduce(const struct sna_damage *damage,
 			return false;
 
 		count = damage->embedded_box.size - damage->remain;
-		b = damage->embedded_box.box;
-		for (n = 0; n < count; n++) {
-			if (box_overlaps(&b[n], box))
-				return false;
-		}
-
-		return true;
+		return !kernels.overlap(damage->embedded_box.box, count, box);
 	}
 }
 
@@ -1603,6 +2604,10 @@ struct sna_damage *_sna_damage_combine(struct sna_damage *l,
 void __sna_damage_destroy(struct sna_damage *damage)
 {
 	free_list(&damage->embedded_box.list);
+	if (damage->tiles) {
+		tiles_destroy(damage->tiles);
+		damage->tiles = NULL;
+	}
 
 	pixman_region_fini(&damage->region);
 	*(void **)damage = __freed_damage;
@@ -1689,6 +2694,41 @@ static void st_damage_add_box(struct sna_damage_selftest *test,
 	pixman_region_union(region, region, &r);
 }
 
+static void st_damage_add_boxes(struct sna_damage_selftest *test,
+				struct sna_damage **damage,
+				pixman_region16_t *region)
+{
+	pixman_region16_t tmp;
+	BoxRec box[1024];
+	int dx, dy, n, count;
+
+	dx = rand() % 8;
+	dy = rand() % 8;
+	if (dx >= test->width)
+		dx = 0;
+	if (dy >= test->height)
+		dy = 0;
+
+	/* Lots of small boxes, such as glyphs, to exercise the tiles */
+	count = 1 + rand() % ARRAY_SIZE(box);
+	for (n = 0; n < count; n++) {
+		int w = test->width - dx, h = test->height - dy;
+
+		box[n].x1 = rand() % w;
+		box[n].y1 = rand() % h;
+		box[n].x2 = box[n].x1 + 1 + rand() % MIN(24, w - box[n].x1);
+		box[n].y2 = box[n].y1 + 1 + rand() % MIN(24, h - box[n].y1);
+	}
+
+	if (!DAMAGE_IS_ALL(*damage))
+		sna_damage_add_boxes(damage, box, count, dx, dy);
+
+	pixman_region_init_rects(&tmp, box, count);
+	pixman_region_translate(&tmp, dx, dy);
+	pixman_region_union(region, region, &tmp);
+	pixman_region_fini(&tmp);
+}
+
 static void st_damage_subtract(struct sna_damage_selftest *test,
 			       struct sna_damage **damage,
 			       pixman_region16_t *region)
@@ -1714,6 +2754,27 @@ static void st_damage_subtract_box(struct sna_damage_selftest *test,
 	pixman_region_subtract(region, region, &r);
 }
 
+static void st_damage_subtract_boxes(struct sna_damage_selftest *test,
+				     struct sna_damage **damage,
+				     pixman_region16_t *region)
+{
+	BoxRec box[64];
+	int n, count;
+
+	/* Not confined to the damage extents, so exercising the clipping */
+	count = 1 + rand() % ARRAY_SIZE(box);
+	for (n = 0; n < count; n++) {
+		RegionRec r;
+
+		st_damage_init_random_box(test, &box[n]);
+		r.extents = box[n];
+		r.data = NULL;
+		pixman_region_subtract(region, region, &r);
+	}
+
+	sna_damage_subtract_boxes(damage, box, count, 0, 0);
+}
+
 static void st_damage_all(struct sna_damage_selftest *test,
 			  struct sna_damage **damage,
 			  pixman_region16_t *region)
@@ -1723,7 +2784,7 @@ static void st_damage_all(struct sna_damage_selftest *test,
 	pixman_region_init_rect(&tmp, 0, 0, test->width, test->height);
 
 	if (!DAMAGE_IS_ALL(*damage))
-		sna_damage_all(damage, test->width, test->height);
+		*damage = _sna_damage_all(*damage, test->width, test->height);
 	pixman_region_union(region, region, &tmp);
 }
 
@@ -1732,7 +2793,8 @@ static bool st_check_equal(struct sna_damage_selftest *test,
 			   pixman_region16_t *region)
 {
 	int d_num, r_num;
-	BoxPtr d_boxes, r_boxes;
+	const BoxRec *d_boxes;
+	BoxPtr r_boxes;
 
 	d_num = *damage ? sna_damage_get_boxes(*damage, &d_boxes) : 0;
 	r_boxes = pixman_region_rectangles(region, &r_num);
@@ -1752,6 +2814,83 @@ static bool st_check_equal(struct sna_damage_selftest *test,
 	return true;
 }
 
+static void st_random_boxes(BoxRec *box, int n)
+{
+	while (n--) {
+		box->x1 = rand() % 4096 - 2048;
+		box->y1 = rand() % 4096 - 2048;
+		box->x2 = box->x1 + rand() % 512;
+		box->y2 = box->y1 + rand() % 512;
+		box++;
+	}
+}
+
+static void st_damage_kernels(void)
+{
+	struct damage_kernels ref, k;
+	int pass;
+
+	choose_kernels(&ref, 0);
+	choose_kernels(&k, sna_cpu_detect());
+
+	for (pass = 0; pass < 65536; pass++) {
+		BoxRec box[67], a[67], b[67], e, f, clip;
+		xRectangle r[67];
+		int16_t dx, dy;
+		int n, i, x, y;
+
+		n = 1 + rand() % ARRAY_SIZE(box);
+		st_random_boxes(box, n);
+		for (i = 0; i < n; i++) {
+			r[i].x = box[i].x1;
+			r[i].y = box[i].y1;
+			r[i].width = box[i].x2 - box[i].x1;
+			r[i].height = box[i].y2 - box[i].y1;
+		}
+		dx = rand() % 512 - 256;
+		dy = rand() % 512 - 256;
+
+		ref.extents(box, n, &e);
+		k.extents(box, n, &f);
+		if (memcmp(&e, &f, sizeof(e)))
+			FatalError("%s: extents mismatch, n=%d\n", __FUNCTION__, n);
+
+		ref.rectangles_extents(r, n, &e);
+		k.rectangles_extents(r, n, &f);
+		if (memcmp(&e, &f, sizeof(e)))
+			FatalError("%s: rectangles extents mismatch, n=%d\n", __FUNCTION__, n);
+
+		ref.translate(box, a, n, dx, dy);
+		k.translate(box, b, n, dx, dy);
+		if (memcmp(a, b, n*sizeof(BoxRec)))
+			FatalError("%s: translate mismatch, n=%d\n", __FUNCTION__, n);
+
+		ref.rectangles_to_boxes(r, a, n, dx, dy);
+		k.rectangles_to_boxes(r, b, n, dx, dy);
+		if (memcmp(a, b, n*sizeof(BoxRec)))
+			FatalError("%s: rectangles mismatch, n=%d\n", __FUNCTION__, n);
+
+		st_random_boxes(&clip, 1);
+		memcpy(a, box, n*sizeof(BoxRec));
+		memcpy(b, box, n*sizeof(BoxRec));
+		x = ref.clip(a, n, &clip);
+		y = k.clip(b, n, &clip);
+		if (x != y || memcmp(a, b, x*sizeof(BoxRec)))
+			FatalError("%s: clip mismatch, n=%d\n", __FUNCTION__, n);
+
+		if (rand() & 1) {
+			e = box[rand() % n];
+			e.x1 += rand() % 3;
+			e.y2 -= rand() % 3;
+		} else
+			st_random_boxes(&e, 1);
+		if (ref.contain(box, n, &e) != k.contain(box, n, &e))
+			FatalError("%s: contain mismatch, n=%d\n", __FUNCTION__, n);
+		if (ref.overlap(box, n, &e) != k.overlap(box, n, &e))
+			FatalError("%s: overlap mismatch, n=%d\n", __FUNCTION__, n);
+	}
+}
+
 void sna_damage_selftest(void)
 {
 	void (*const op[])(struct sna_damage_selftest *test,
@@ -1759,8 +2898,10 @@ void sna_damage_selftest(void)
 			   pixman_region16_t *region) = {
 		st_damage_add,
 		st_damage_add_box,
+		st_damage_add_boxes,
 		st_damage_subtract,
 		st_damage_subtract_box,
+		st_damage_subtract_boxes,
 		st_damage_all
 	};
 	bool (*const check[])(struct sna_damage_selftest *test,
@@ -1773,6 +2914,8 @@ void sna_damage_selftest(void)
 	char damage_buf[1000];
 	int pass;
 
+	st_damage_kernels();
+
 	for (pass = 0; pass < 16384; pass++) {
 		struct sna_damage_selftest test;
 		struct sna_damage *damage;
@@ -1814,6 +2957,11 @@ void _sna_damage_debug_get_region(struct sna_damage *damage, RegionRec *r)
 	if (!damage->dirty)
 		return;
 
+	if (damage->tiles) {
+		tiles_union_region(damage->tiles, r);
+		return;
+	}
+
 	nboxes = damage->embedded_box.size;
 	list_for_each_entry(iter, &damage->embedded_box.list, list)
 		nboxes += iter->size;
@@ -15,6 +15,7 @@ struct sna_damage {
 	} mode;
 	int remain, dirty;
 	BoxPtr box;
+	struct sna_damage_tiles *tiles;
 	struct {
 		struct list list;
 		int size;
@@ -330,6 +331,8 @@ static inline void sna_damage_destroy(struct sna_damage **damage)
 
 void _sna_damage_debug_get_region(struct sna_damage *damage, RegionRec *r);
 
+void sna_damage_choose_kernels(unsigned cpu);
+
 #if HAS_DEBUG_FULL && TEST_DAMAGE
 void sna_damage_selftest(void);
 #else
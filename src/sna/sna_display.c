@@ -1547,6 +1547,7 @@ sna_crtc_apply(xf86CrtcPtr crtc)
 	if (!rotation_set(sna, &sna_crtc->primary, sna_crtc->rotation)) {
 		memset(&arg, 0, sizeof(arg));
 		arg.crtc_id = __sna_crtc_id(sna_crtc);
+		kgem_pipeline_sync(&sna->kgem);
 		(void)drmIoctl(sna->kgem.fd, DRM_IOCTL_MODE_SETCRTC, &arg);
 	}
 
@@ -1630,6 +1631,7 @@ sna_crtc_apply(xf86CrtcPtr crtc)
 	     output_count, output_count ? output_ids[0] : 0));
 
 	ret = 0;
+	kgem_pipeline_sync(&sna->kgem);
 	if (unlikely(drmIoctl(sna->kgem.fd, DRM_IOCTL_MODE_SETCRTC, &arg))) {
 		ret = errno;
 		goto unblock;
@@ -2197,6 +2199,7 @@ sna_crtc_disable(xf86CrtcPtr crtc, bool force)
 
 	memset(&arg, 0, sizeof(arg));
 	arg.crtc_id = __sna_crtc_id(sna_crtc);
+	kgem_pipeline_sync(&sna->kgem);
 	(void)drmIoctl(sna->kgem.fd, DRM_IOCTL_MODE_SETCRTC, &arg);
 
 	__sna_crtc_disable(sna, sna_crtc);
@@ -5386,6 +5389,7 @@ sna_output_add(struct sna *sna, unsigned id, unsigned serial)
 					struct drm_mode_crtc arg = {
 						.crtc_id = __sna_crtc_id(to_sna_crtc(output->crtc)),
 					};
+					kgem_pipeline_sync(&sna->kgem);
 					drmIoctl(sna->kgem.fd, DRM_IOCTL_MODE_SETCRTC, &arg);
 					output->crtc = NULL;
 				}
@@ -7079,6 +7083,7 @@ sna_crtc_flip(struct sna *sna, struct sna_crtc *crtc, struct kgem_bo *bo, int x,
 	     arg.fb_id,
 	     output_count, output_count ? output_ids[0] : 0));
 
+	kgem_pipeline_sync(&sna->kgem);
 	if (drmIoctl(sna->kgem.fd, DRM_IOCTL_MODE_SETCRTC, &arg))
 		return false;
 
@@ -7247,6 +7252,7 @@ update_scanout:
 retry_flip:
 		DBG(("%s: crtc %d id=%d, pipe=%d  --> fb %d\n",
 		     __FUNCTION__, i, __sna_crtc_id(crtc), __sna_crtc_pipe(crtc), arg.fb_id));
+		kgem_pipeline_sync(&sna->kgem);
 		if (drmIoctl(sna->kgem.fd, DRM_IOCTL_MODE_PAGE_FLIP, &arg)) {
 			ERR(("%s: pageflip failed with err=%d\n", __FUNCTION__, errno));
 
@@ -8742,6 +8748,8 @@ sna_crtc_hide_planes(struct sna *sna, struct sna_crtc *crtc)
 	if (crtc->primary.id == 0)
 		return false;
 
+	kgem_pipeline_sync(&sna->kgem);
+
 	memset(&s, 0, sizeof(s));
 	s.plane_id = crtc->primary.id;
 	if (drmIoctl(sna->kgem.fd, LOCAL_IOCTL_MODE_SETPLANE, &s))
@@ -9459,6 +9467,7 @@ void sna_mode_redisplay(struct sna *sna)
 				arg.flags = DRM_MODE_PAGE_FLIP_EVENT;
 				arg.reserved = 0;
 
+				kgem_pipeline_sync(&sna->kgem);
 				if (drmIoctl(sna->kgem.fd, DRM_IOCTL_MODE_PAGE_FLIP, &arg)) {
 					if (sna_crtc_flip(sna, sna_crtc, bo, 0, 0)) {
 						DBG(("%s: removing handle=%d [active_scanout=%d] from scanout, installing handle=%d [active_scanout=%d]\n",
@@ -9661,6 +9670,7 @@ fixup_flip:
 				continue;
 			}
 
+			kgem_pipeline_sync(&sna->kgem);
 			if (drmIoctl(sna->kgem.fd, DRM_IOCTL_MODE_PAGE_FLIP, &arg)) {
 				ERR(("%s: flip [fb=%d] on crtc %d [%d, pipe=%d] failed - %d\n",
 				     __FUNCTION__, arg.fb_id, i, __sna_crtc_id(crtc), __sna_crtc_pipe(crtc), errno));
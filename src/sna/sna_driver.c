@@ -369,6 +369,9 @@ static Bool sna_save_screen(ScreenPtr screen, int mode)
 static void sna_selftest(void)
 {
 	sna_damage_selftest();
+	sna_trapezoids_selftest();
+	memcpy_tiled_selftest();
+	kgem_mock_selftest();
 }
 
 static bool has_vsync(struct sna *sna)
@@ -469,6 +472,55 @@ static bool enable_tear_free(struct sna *sna)
 	return ENABLE_TEAR_FREE;
 }
 
+static void setup_vma_cache(struct sna *sna)
+{
+	bool set = false;
+	int value;
+
+	if (xf86GetOptValInteger(sna->Options, OPTION_MAP_CACHE_COUNT, &value) &&
+	    value >= 0) {
+		sna->kgem.vma_cache.max_count = value;
+		set = true;
+	}
+	if (xf86GetOptValInteger(sna->Options, OPTION_MAP_CACHE_SIZE, &value) &&
+	    value >= 0) {
+		sna->kgem.vma_cache.max_bytes = (uint64_t)value << 20;
+		set = true;
+	}
+
+	if (set)
+		xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+			   "Caching up to %u mappings, %lluMiB, of idle buffers\n",
+			   sna->kgem.vma_cache.max_count,
+			   (unsigned long long)(sna->kgem.vma_cache.max_bytes >> 20));
+}
+
+static void setup_threads(struct sna *sna)
+{
+	struct sna_threads_info info;
+	MessageType from = X_PROBED;
+	int num_threads = 0;
+	Bool pin = FALSE;
+
+	if (xf86GetOptValInteger(sna->Options, OPTION_THREADS, &num_threads))
+		from = X_CONFIG;
+	xf86GetOptValBool(sna->Options, OPTION_THREAD_AFFINITY, &pin);
+
+	sna_threads_init(num_threads, pin);
+	sna_threads_get_info(&info);
+
+	if (info.quota)
+		xf86DrvMsg(sna->scrn->scrnIndex, from,
+			   "Using %d threads for CPU rendering%s (%d cpus, %d cores, cgroup quota of %d cpus)\n",
+			   info.threads, info.pinned ? ", pinned to cores sharing the LLC" : "",
+			   info.cpus, info.cores, info.quota);
+	else
+		xf86DrvMsg(sna->scrn->scrnIndex, from,
+			   "Using %d threads for CPU rendering%s (%d cpus, %d cores)\n",
+			   info.threads, info.pinned ? ", pinned to cores sharing the LLC" : "",
+			   info.cpus, info.cores);
+}
+
 static bool setup_tear_free(struct sna *sna)
 {
 	MessageType from;
@@ -557,6 +609,8 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int probe)
 		sna->scrn = scrn;
 
 		sna->cpu_features = sna_cpu_detect();
+		sna_damage_choose_kernels(sna->cpu_features);
+		sna_trapezoids_choose_kernels(sna->cpu_features);
 		sna->acpi.fd = sna_acpi_open();
 	}
 	sna = to_sna(scrn);
@@ -656,6 +710,10 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int probe)
 		sna->flags |= SNA_FORCE_SHADOW;
 	}
 
+	setup_threads(sna);
+
+	setup_vma_cache(sna);
+
 	if (!sna_mode_pre_init(scrn, sna)) {
 		xf86DrvMsg(scrn->scrnIndex, X_ERROR,
 			   "No outputs and no modes.\n");
@@ -1481,8 +1539,6 @@ Bool sna_init_scrn(ScrnInfoPtr scrn, int entity_num)
 	xf86SetEntityInstanceForScreen(scrn, entity_num,
 				       xf86GetNumEntityInstances(entity_num)-1);
 
-	sna_threads_init();
-
 	return TRUE;
 }
 
@@ -69,6 +69,10 @@
 
 #define FALLBACK 0
 #define NO_GLYPH_CACHE 0
+#define NO_GLYPH_CACHE_GROW 0
+#define NO_GLYPH_LARGE_CACHE 0
+#define NO_GLYPH_RUN_CACHE 0
+#define NO_GLYPH_THREADS 0
 #define NO_GLYPHS_TO_DST 0
 #define FORCE_GLYPHS_TO_DST 0
 #define NO_GLYPHS_VIA_MASK 0
@@ -77,11 +81,23 @@
 #define DISCARD_MASK 0 /* -1 = never, 1 = always */
 
 #define CACHE_PICTURE_SIZE 1024
+#define CACHE_PICTURE_MAX_SIZE 4096
+#define CACHE_GROW_EVICTIONS 4 /* grow once 1/4 of the cache has been evicted */
 #define GLYPH_MIN_SIZE 8
 #define GLYPH_MAX_SIZE 64
-#define GLYPH_CACHE_SIZE (CACHE_PICTURE_SIZE * CACHE_PICTURE_SIZE / (GLYPH_MIN_SIZE * GLYPH_MIN_SIZE))
+
+#define LARGE_CACHE_PICTURE_SIZE 2048
+#define GLYPH_LARGE_MAX_SIZE 256
+#define GLYPH_LARGE_CACHE_SIZE 1024
+#define GLYPH_SHELF_ALIGN 16
+
+#define GLYPH_RUN_CACHE_SIZE 64
+#define GLYPH_RUN_MAX_GLYPHS 256
 
 #define N_STACK_GLYPHS 512
+#define GLYPH_THREAD_THRESHOLD 32
+#define GLYPH_THREAD_MIN_GLYPHS 256 /* see cpu-bench, "glyphs" */
+#define GLYPH_THREAD_MIN_AREA (64 << 10) /* pixels covered by the glyphs */
 #define NO_ATLAS ((PicturePtr)-1)
 #define GLYPH_TOLERANCE 3
 
@@ -150,6 +166,56 @@ static bool op_is_bounded(uint8_t op)
 	}
 }
 
+/* Each cache is a square atlas divided into GLYPH_MIN_SIZE cells, which
+ * are numbered along a Z-order curve. A glyph occupies an aligned run of
+ * cells forming a square of its (power-of-two) size, and the first N
+ * cells always cover the same top-left corner of the atlas however large
+ * it grows.
+ */
+static inline unsigned glyph_cache_slots(const struct sna_glyph_cache *cache)
+{
+	unsigned n = cache->size / GLYPH_MIN_SIZE;
+	return n * n;
+}
+
+static inline int glyph_pos_to_coordinate(uint32_t pos)
+{
+	pos &= 0x55555555;
+	pos = (pos | pos >> 1) & 0x33333333;
+	pos = (pos | pos >> 2) & 0x0f0f0f0f;
+	pos = (pos | pos >> 4) & 0x00ff00ff;
+	pos = (pos | pos >> 8) & 0x0000ffff;
+	return pos * GLYPH_MIN_SIZE;
+}
+
+static inline void glyph_layout_changed(struct sna_render *render)
+{
+	/* 0 is reserved for an invalid glyph run recording */
+	if (++render->glyph_generation == 0)
+		render->glyph_generation = 1;
+}
+
+static inline void glyph_touch(struct sna_render *render, struct sna_glyph *p)
+{
+	render->glyph_stats.lookup++;
+	p->referenced = 1;
+}
+
+void sna_glyphs_print_stats(struct sna *sna, FILE *file)
+{
+	const struct sna_render *render = &sna->render;
+	unsigned long lookup = render->glyph_stats.lookup;
+	unsigned long miss = render->glyph_stats.miss;
+
+	fprintf(file, "glyphs: hit=%lu miss=%lu evict=%lu grow=%lu atlas=%dx%d,%dx%d large=%d,%d runs: hit=%lu miss=%lu\n",
+		lookup > miss ? lookup - miss : 0, miss,
+		render->glyph_stats.evict, render->glyph_stats.grow,
+		render->glyph[0].size, render->glyph[0].size,
+		render->glyph[1].size, render->glyph[1].size,
+		render->large[0].count, render->large[1].count,
+		render->glyph_stats.run_hit, render->glyph_stats.run_miss);
+}
+
 void sna_glyphs_close(struct sna *sna)
 {
 	struct sna_render *render = &sna->render;
@@ -167,6 +233,24 @@ void sna_glyphs_close(struct sna *sna)
 	}
 	memset(render->glyph, 0, sizeof(render->glyph));
 
+	for (i = 0; i < ARRAY_SIZE(render->large); i++) {
+		struct sna_glyph_atlas *atlas = &render->large[i];
+
+		if (atlas->picture)
+			FreePicture(atlas->picture, 0);
+
+		free(atlas->glyphs);
+		free(atlas->shelf);
+	}
+	memset(render->large, 0, sizeof(render->large));
+
+	if (render->glyph_run) {
+		for (i = 0; i < GLYPH_RUN_CACHE_SIZE; i++)
+			free(render->glyph_run[i]);
+		free(render->glyph_run);
+		render->glyph_run = NULL;
+	}
+
 	if (render->white_image) {
 		pixman_image_unref(render->white_image);
 		render->white_image = NULL;
@@ -177,6 +261,45 @@ void sna_glyphs_close(struct sna *sna)
 	}
 }
 
+static PicturePtr
+glyph_cache_picture(ScreenPtr screen, PictFormatPtr format, int size)
+{
+	struct sna_pixmap *priv;
+	PixmapPtr pixmap;
+	PicturePtr picture = NULL;
+	CARD32 component_alpha;
+	int error;
+
+	/* Now allocate the pixmap and picture */
+	pixmap = screen->CreatePixmap(screen, size, size, format->depth,
+				      SNA_CREATE_SCRATCH);
+	if (!pixmap) {
+		DBG(("%s: failed to allocate pixmap for Glyph cache\n",
+		     __FUNCTION__));
+		return NULL;
+	}
+
+	priv = sna_pixmap(pixmap);
+	if (priv != NULL) {
+		/* Prevent the cache from ever being paged out */
+		assert(priv->gpu_bo);
+		priv->pinned = PIN_SCANOUT;
+
+		component_alpha = NeedsComponent(format->format);
+		picture = CreatePicture(0, &pixmap->drawable, format,
+					CPComponentAlpha, &component_alpha,
+					serverClient, &error);
+	}
+
+	screen->DestroyPixmap(pixmap);
+	if (!picture)
+		return NULL;
+
+	ValidatePicture(picture);
+	assert(picture->pDrawable == &pixmap->drawable);
+	return picture;
+}
+
 /* All caches for a single format share a single pixmap for glyph storage,
  * allowing mixing glyphs of different sizes without paying a penalty
  * for switching between source pixmaps. (Note that for a size of font
@@ -225,58 +348,33 @@ bool sna_glyphs_create(struct sna *sna)
 
 	for (i = 0; i < ARRAY_SIZE(formats); i++) {
 		struct sna_glyph_cache *cache = &sna->render.glyph[i];
-		struct sna_pixmap *priv;
-		PixmapPtr pixmap;
-		PicturePtr picture = NULL;
+		PicturePtr picture;
 		PictFormatPtr pPictFormat;
-		CARD32 component_alpha;
 		int depth = PIXMAN_FORMAT_DEPTH(formats[i]);
 
 		pPictFormat = PictureMatchFormat(screen, depth, formats[i]);
 		if (!pPictFormat)
 			goto bail;
 
-		/* Now allocate the pixmap and picture */
-		pixmap = screen->CreatePixmap(screen,
-					      CACHE_PICTURE_SIZE,
-					      CACHE_PICTURE_SIZE,
-					      depth,
-					      SNA_CREATE_SCRATCH);
-		if (!pixmap) {
-			DBG(("%s: failed to allocate pixmap for Glyph cache\n",
-			     __FUNCTION__));
-			goto bail;
-		}
-
-		priv = sna_pixmap(pixmap);
-		if (priv != NULL) {
-			/* Prevent the cache from ever being paged out */
-			assert(priv->gpu_bo);
-			priv->pinned = PIN_SCANOUT;
-
-			component_alpha = NeedsComponent(pPictFormat->format);
-			picture = CreatePicture(0, &pixmap->drawable, pPictFormat,
-						CPComponentAlpha, &component_alpha,
-						serverClient, &error);
-		}
-
-		screen->DestroyPixmap(pixmap);
+		picture = glyph_cache_picture(screen, pPictFormat,
+					      CACHE_PICTURE_SIZE);
 		if (!picture)
 			goto bail;
 
-		ValidatePicture(picture);
-		assert(picture->pDrawable == &pixmap->drawable);
-
-		cache->count = cache->evict = 0;
+		cache->count = cache->evict = cache->evicted = 0;
 		cache->picture = picture;
+		cache->size = CACHE_PICTURE_SIZE;
 		cache->glyphs = calloc(sizeof(struct sna_glyph *),
-				       GLYPH_CACHE_SIZE);
+				       glyph_cache_slots(cache));
 		if (!cache->glyphs)
 			goto bail;
-
-		cache->evict = rand() % GLYPH_CACHE_SIZE;
 	}
 
+	/* The run cache is optional, just a shortcut for repeated strings */
+	sna->render.glyph_run = calloc(GLYPH_RUN_CACHE_SIZE,
+				       sizeof(struct sna_glyph_run *));
+	sna->render.glyph_generation = 1;
+
 	sna->render.white_picture =
 		CreateSolidPicture(0, (xRenderColor *)&white, &error);
 	if (sna->render.white_picture == NULL)
@@ -290,7 +388,7 @@ bail:
 }
 
 static void
-glyph_cache_upload(struct sna_glyph_cache *cache,
+glyph_cache_upload(PicturePtr cache,
 		   GlyphPtr glyph, PicturePtr glyph_picture,
 		   int16_t x, int16_t y)
 {
@@ -300,7 +398,7 @@ glyph_cache_upload(struct sna_glyph_cache *cache,
 	     glyph_picture->pDrawable->width,
 	     glyph_picture->pDrawable->height));
 	sna_composite(PictOpSrc,
-		      glyph_picture, 0, cache->picture,
+		      glyph_picture, 0, cache,
 		      0, 0,
 		      0, 0,
 		      x, y,
@@ -357,7 +455,6 @@ glyph_extents(int nlist,
 	extents->y2 = y2 < MAXSHORT ? y2 : MAXSHORT;
 }
 
-#if HAS_DEBUG_FULL
 static int
 glyph_count(int nlist,
 	    GlyphListPtr list)
@@ -369,7 +466,6 @@ glyph_count(int nlist,
 	}
 	return count;
 }
-#endif
 
 static inline unsigned int
 glyph_size_to_count(int size)
@@ -390,6 +486,416 @@ glyph_size_to_mask(int size)
 	return glyph_count_to_mask(glyph_size_to_count(size));
 }
 
+static struct sna_glyph *
+glyph_cache_cover(struct sna_glyph_cache *cache, int pos, int size)
+{
+	int s;
+
+	/* Is the block at pos occupied by a single glyph at least as large? */
+	for (s = size; s <= GLYPH_MAX_SIZE; s *= 2) {
+		struct sna_glyph *p = cache->glyphs[pos & glyph_size_to_mask(s)];
+		if (p != NULL)
+			return p->size >= s ? p : NULL;
+	}
+
+	return NULL;
+}
+
+static void
+glyph_cache_discard(struct sna_render *render,
+		    struct sna_glyph_cache *cache,
+		    int pos)
+{
+	struct sna_glyph *p = cache->glyphs[pos];
+
+	DBG(("%s: evicting glyph at pos %d, size %d\n",
+	     __FUNCTION__, pos, p->size));
+	cache->glyphs[pos] = NULL;
+	p->atlas = NULL;
+
+	render->glyph_stats.evict++;
+	glyph_layout_changed(render);
+	cache->evicted++;
+}
+
+/* Second-chance (clock) replacement: the hand sweeps over the cache a
+ * block at a time, sparing any block containing a glyph used since the
+ * hand last passed it. After a full revolution every reference bit has
+ * been cleared, so the sweep is bounded.
+ */
+static int
+glyph_cache_evict(struct sna_render *render,
+		  struct sna_glyph_cache *cache,
+		  int size)
+{
+	unsigned slots = glyph_cache_slots(cache);
+	int count = glyph_size_to_count(size);
+	int n, pos, i;
+
+	for (n = slots / count; n >= 0; n--) {
+		struct sna_glyph *p;
+		bool referenced;
+
+		pos = cache->evict & glyph_count_to_mask(count);
+		cache->evict = (pos + count) & (slots - 1);
+
+		p = glyph_cache_cover(cache, pos, size);
+		if (p != NULL) {
+			pos = p->pos >> 1;
+			if (p->referenced && n) {
+				p->referenced = 0;
+				cache->evict = (pos + glyph_size_to_count(p->size)) & (slots - 1);
+				continue;
+			}
+
+			glyph_cache_discard(render, cache, pos);
+			return pos;
+		}
+
+		referenced = false;
+		for (i = 0; i < count; i++) {
+			p = cache->glyphs[pos + i];
+			if (p != NULL && p->referenced) {
+				p->referenced = 0;
+				referenced = true;
+			}
+		}
+		if (referenced && n)
+			continue;
+
+		for (i = 0; i < count; i++) {
+			if (cache->glyphs[pos + i])
+				glyph_cache_discard(render, cache, pos + i);
+		}
+		return pos;
+	}
+
+	assert(0);
+	return pos;
+}
+
+/* Once the working set no longer fits and we start thrashing, double the
+ * atlas (the Z-order layout keeps every cached glyph at the same
+ * coordinates) and copy the old contents across.
+ */
+static bool
+glyph_cache_grow(ScreenPtr screen,
+		 struct sna_render *render,
+		 struct sna_glyph_cache *cache)
+{
+	struct sna *sna = to_sna_from_screen(screen);
+	PicturePtr old = cache->picture, picture;
+	struct sna_glyph **glyphs;
+	unsigned slots, i;
+	int size;
+
+	if (NO_GLYPH_CACHE_GROW)
+		return false;
+
+	size = 2 * cache->size;
+	if (size > CACHE_PICTURE_MAX_SIZE || size > render->max_3d_size)
+		return false;
+
+	if ((uint64_t)size * size * PICT_FORMAT_BPP(old->format) / 8 >
+	    sna->kgem.max_gpu_size)
+		return false;
+
+	DBG(("%s: growing glyph cache %d from %d to %d after %d evictions\n",
+	     __FUNCTION__, PICT_FORMAT_RGB(old->format) != 0,
+	     cache->size, size, cache->evicted));
+
+	picture = glyph_cache_picture(screen, old->pFormat, size);
+	if (!picture)
+		return false;
+
+	slots = glyph_cache_slots(cache);
+	glyphs = realloc(cache->glyphs, 4 * slots * sizeof(*glyphs));
+	if (glyphs == NULL) {
+		FreePicture(picture, 0);
+		return false;
+	}
+	memset(glyphs + slots, 0, 3 * slots * sizeof(*glyphs));
+	cache->glyphs = glyphs;
+
+	sna_composite(PictOpSrc,
+		      old, 0, picture,
+		      0, 0,
+		      0, 0,
+		      0, 0,
+		      cache->size, cache->size);
+
+	for (i = 0; i < slots; i++) {
+		if (glyphs[i])
+			glyphs[i]->atlas = picture;
+	}
+
+	FreePicture(old, 0);
+	cache->picture = picture;
+	cache->size = size;
+	cache->evicted = 0;
+
+	render->glyph_stats.grow++;
+	glyph_layout_changed(render);
+	return true;
+}
+
+/* Glyphs too large for the power-of-two cells are packed into a second
+ * atlas per format using horizontal shelves of quantised height. A new
+ * glyph goes onto the shortest open shelf that fits it without wasting
+ * too much height, or else opens a new shelf beneath the last. Once the
+ * atlas is full, a whole shelf is recycled using the same second-chance
+ * clock as the small caches.
+ */
+static bool
+glyph_atlas_init(ScreenPtr screen,
+		 struct sna_render *render,
+		 struct sna_glyph_atlas *atlas,
+		 PictFormatPtr format)
+{
+	struct sna *sna = to_sna_from_screen(screen);
+	int size = LARGE_CACHE_PICTURE_SIZE;
+
+	while (size > render->max_3d_size ||
+	       (uint64_t)size * size * PICT_FORMAT_BPP(format->format) / 8 >
+	       sna->kgem.max_gpu_size)
+		size /= 2;
+	if (size < 2 * GLYPH_LARGE_MAX_SIZE)
+		return false;
+
+	DBG(("%s: creating %dx%d large glyph atlas, format %08x\n",
+	     __FUNCTION__, size, size, (int)format->format));
+
+	atlas->glyphs = calloc(GLYPH_LARGE_CACHE_SIZE, sizeof(struct sna_glyph *));
+	atlas->shelf = calloc(size / GLYPH_SHELF_ALIGN, sizeof(struct sna_glyph_shelf));
+	if (atlas->glyphs == NULL || atlas->shelf == NULL)
+		goto err;
+
+	atlas->picture = glyph_cache_picture(screen, format, size);
+	if (atlas->picture == NULL)
+		goto err;
+
+	atlas->size = size;
+	atlas->count = atlas->nshelf = atlas->evict = 0;
+	return true;
+
+err:
+	free(atlas->glyphs);
+	free(atlas->shelf);
+	atlas->glyphs = NULL;
+	atlas->shelf = NULL;
+	return false;
+}
+
+static void
+glyph_atlas_remove(struct sna_glyph_atlas *atlas, struct sna_glyph *p)
+{
+	unsigned i = p->pos >> 1;
+
+	assert(i < atlas->count);
+	assert(atlas->glyphs[i] == p);
+
+	if (i != --atlas->count) {
+		struct sna_glyph *q = atlas->glyphs[atlas->count];
+		atlas->glyphs[i] = q;
+		q->pos = i << 1 | (q->pos & 1);
+	}
+	atlas->glyphs[atlas->count] = NULL;
+	p->atlas = NULL;
+}
+
+static void
+glyph_atlas_flush(struct sna_render *render, struct sna_glyph_atlas *atlas)
+{
+	DBG(("%s: discarding %d glyphs\n", __FUNCTION__, atlas->count));
+
+	while (atlas->count) {
+		struct sna_glyph *p = atlas->glyphs[--atlas->count];
+		atlas->glyphs[atlas->count] = NULL;
+		p->atlas = NULL;
+		render->glyph_stats.evict++;
+	}
+	atlas->nshelf = atlas->evict = 0;
+	glyph_layout_changed(render);
+}
+
+static int
+glyph_atlas_shelf_index(const struct sna_glyph_atlas *atlas, int y)
+{
+	int lo = 0, hi = atlas->nshelf - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (atlas->shelf[mid].y <= y)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	assert(atlas->shelf[lo].y == y);
+	return lo;
+}
+
+static struct sna_glyph_shelf *
+glyph_atlas_find_shelf(struct sna_glyph_atlas *atlas, int w, int h)
+{
+	struct sna_glyph_shelf *shelf, *best = NULL;
+	int i, y;
+
+	for (i = 0; i < atlas->nshelf; i++) {
+		shelf = &atlas->shelf[i];
+		if (shelf->height < h || shelf->x + w > atlas->size)
+			continue;
+
+		if (shelf->height > ALIGN(h + h / 2, GLYPH_SHELF_ALIGN))
+			continue;
+
+		if (best == NULL || shelf->height < best->height)
+			best = shelf;
+	}
+	if (best)
+		return best;
+
+	y = 0;
+	if (atlas->nshelf) {
+		shelf = &atlas->shelf[atlas->nshelf - 1];
+		y = shelf->y + shelf->height;
+	}
+
+	h = ALIGN(h, GLYPH_SHELF_ALIGN);
+	if (y + h > atlas->size)
+		return NULL;
+
+	DBG(("%s: opening shelf %d at y=%d, height %d\n",
+	     __FUNCTION__, atlas->nshelf, y, h));
+	assert(atlas->nshelf < atlas->size / GLYPH_SHELF_ALIGN);
+	shelf = &atlas->shelf[atlas->nshelf++];
+	shelf->y = y;
+	shelf->height = h;
+	shelf->x = 0;
+	return shelf;
+}
+
+static struct sna_glyph_shelf *
+glyph_atlas_evict_shelf(struct sna_render *render,
+			struct sna_glyph_atlas *atlas,
+			int h)
+{
+	enum { REFERENCED = 1, PASSED = 2 };
+	uint8_t flags[LARGE_CACHE_PICTURE_SIZE / GLYPH_SHELF_ALIGN];
+	struct sna_glyph_shelf *victim = NULL;
+	int i, k, n;
+
+	if (atlas->nshelf == 0)
+		return NULL;
+
+	memset(flags, 0, atlas->nshelf);
+	for (i = 0; i < atlas->count; i++) {
+		struct sna_glyph *p = atlas->glyphs[i];
+		if (p->referenced)
+			flags[glyph_atlas_shelf_index(atlas, p->coordinate.y)] |= REFERENCED;
+	}
+
+	for (n = 2 * atlas->nshelf; n--; ) {
+		k = atlas->evict % atlas->nshelf;
+		atlas->evict = (k + 1) % atlas->nshelf;
+
+		if (atlas->shelf[k].height < h)
+			continue;
+
+		if (flags[k] == REFERENCED) {
+			flags[k] |= PASSED;
+			continue;
+		}
+
+		victim = &atlas->shelf[k];
+		break;
+	}
+	if (victim == NULL)
+		return NULL;
+
+	DBG(("%s: recycling shelf %d at y=%d, height %d\n",
+	     __FUNCTION__, (int)(victim - atlas->shelf),
+	     victim->y, victim->height));
+
+	for (i = 0; i < atlas->count; ) {
+		struct sna_glyph *p = atlas->glyphs[i];
+
+		k = glyph_atlas_shelf_index(atlas, p->coordinate.y);
+		if (&atlas->shelf[k] == victim) {
+			glyph_atlas_remove(atlas, p);
+			render->glyph_stats.evict++;
+			continue;
+		}
+
+		if (flags[k] & PASSED)
+			p->referenced = 0;
+		i++;
+	}
+
+	victim->x = 0;
+	glyph_layout_changed(render);
+	return victim;
+}
+
+static bool
+glyph_cache_large(ScreenPtr screen,
+		  struct sna_render *render,
+		  GlyphPtr glyph,
+		  PicturePtr glyph_picture)
+{
+	int fmt = PICT_FORMAT_RGB(glyph_picture->format) != 0;
+	struct sna_glyph_atlas *atlas = &render->large[fmt];
+	int w = glyph->info.width, h = glyph->info.height;
+	struct sna_glyph_shelf *shelf;
+	struct sna_glyph *p;
+
+	if (NO_GLYPH_LARGE_CACHE ||
+	    w > GLYPH_LARGE_MAX_SIZE ||
+	    h > GLYPH_LARGE_MAX_SIZE)
+		return false;
+
+	if (atlas->picture == NULL) {
+		if (render->glyph[fmt].picture == NULL)
+			return false;
+
+		if (!glyph_atlas_init(screen, render, atlas,
+				      render->glyph[fmt].picture->pFormat))
+			return false;
+	}
+
+	if (atlas->count == GLYPH_LARGE_CACHE_SIZE)
+		glyph_atlas_flush(render, atlas);
+
+	shelf = glyph_atlas_find_shelf(atlas, w, h);
+	if (shelf == NULL)
+		shelf = glyph_atlas_evict_shelf(render, atlas, h);
+	if (shelf == NULL) {
+		glyph_atlas_flush(render, atlas);
+		shelf = glyph_atlas_find_shelf(atlas, w, h);
+		if (shelf == NULL)
+			return false;
+	}
+	assert(shelf->x + w <= atlas->size);
+	assert(shelf->height >= h);
+
+	p = sna_glyph(glyph);
+	DBG(("%s(%d): adding %dx%d glyph to large atlas %d, pos %d at (%d, %d)\n",
+	     __FUNCTION__, screen->myNum, w, h, fmt,
+	     atlas->count, shelf->x, shelf->y));
+	p->atlas = atlas->picture;
+	p->size = MAX(w, h);
+	p->referenced = 0;
+	p->pos = atlas->count << 1 | fmt;
+	p->coordinate.x = shelf->x;
+	p->coordinate.y = shelf->y;
+	atlas->glyphs[atlas->count++] = p;
+	shelf->x += w;
+
+	glyph_cache_upload(atlas->picture, glyph, glyph_picture,
+			   p->coordinate.x, p->coordinate.y);
+	return true;
+}
+
 static int
 glyph_cache(ScreenPtr screen,
 	    struct sna_render *render,
@@ -408,10 +914,18 @@ glyph_cache(ScreenPtr screen,
 		return false;
 	}
 
+	render->glyph_stats.miss++;
+
 	if (NO_GLYPH_CACHE ||
 	    glyph->info.width > GLYPH_MAX_SIZE ||
 	    glyph->info.height > GLYPH_MAX_SIZE) {
-		PixmapPtr pixmap = (PixmapPtr)glyph_picture->pDrawable;
+		PixmapPtr pixmap;
+
+		if (!NO_GLYPH_CACHE &&
+		    glyph_cache_large(screen, render, glyph, glyph_picture))
+			return true;
+
+		pixmap = (PixmapPtr)glyph_picture->pDrawable;
 		assert(glyph_picture->pDrawable->type == DRAWABLE_PIXMAP);
 		if (pixmap->drawable.depth >= 8) {
 			pixmap->usage_hint = 0;
@@ -433,39 +947,14 @@ glyph_cache(ScreenPtr screen,
 	s = glyph_size_to_count(size);
 	mask = glyph_count_to_mask(s);
 	pos = (cache->count + s - 1) & mask;
-	if (pos < GLYPH_CACHE_SIZE) {
+	if (pos >= glyph_cache_slots(cache) &&
+	    cache->evicted >= glyph_cache_slots(cache) / CACHE_GROW_EVICTIONS &&
+	    glyph_cache_grow(screen, render, cache))
+		pos = (cache->count + s - 1) & mask;
+	if (pos < glyph_cache_slots(cache))
 		cache->count = pos + s;
-	} else {
-		p = NULL;
-		for (s = size; s <= GLYPH_MAX_SIZE; s *= 2) {
-			int i = cache->evict & glyph_size_to_mask(s);
-			p = cache->glyphs[i];
-			if (p == NULL)
-				continue;
-
-			if (p->size >= s) {
-				cache->glyphs[i] = NULL;
-				p->atlas = NULL;
-				pos = i;
-			} else
-				p = NULL;
-			break;
-		}
-		if (p == NULL) {
-			int count = glyph_size_to_count(size);
-			pos = cache->evict & glyph_count_to_mask(count);
-			for (s = 0; s < count; s++) {
-				p = cache->glyphs[pos + s];
-				if (p != NULL) {
-					p->atlas =NULL;
-					cache->glyphs[pos + s] = NULL;
-				}
-			}
-		}
-
-		/* And pick a new eviction position */
-		cache->evict = rand() % GLYPH_CACHE_SIZE;
-	}
+	else
+		pos = glyph_cache_evict(render, cache, size);
 	assert(cache->glyphs[pos] == NULL);
 
 	p = sna_glyph(glyph);
@@ -475,24 +964,219 @@ glyph_cache(ScreenPtr screen,
 	cache->glyphs[pos] = p;
 	p->atlas = cache->picture;
 	p->size = size;
+	p->referenced = 0;
 	p->pos = pos << 1 | (PICT_FORMAT_RGB(glyph_picture->format) != 0);
-	s = pos / ((GLYPH_MAX_SIZE / GLYPH_MIN_SIZE) * (GLYPH_MAX_SIZE / GLYPH_MIN_SIZE));
-	p->coordinate.x = s % (CACHE_PICTURE_SIZE / GLYPH_MAX_SIZE) * GLYPH_MAX_SIZE;
-	p->coordinate.y = (s / (CACHE_PICTURE_SIZE / GLYPH_MAX_SIZE)) * GLYPH_MAX_SIZE;
-	for (s = GLYPH_MIN_SIZE; s < GLYPH_MAX_SIZE; s *= 2) {
-		if (pos & 1)
-			p->coordinate.x += s;
-		if (pos & 2)
-			p->coordinate.y += s;
-		pos >>= 2;
-	}
-
-	glyph_cache_upload(cache, glyph, glyph_picture,
+	p->coordinate.x = glyph_pos_to_coordinate(pos);
+	p->coordinate.y = glyph_pos_to_coordinate(pos >> 1);
+	assert(p->coordinate.x + size <= cache->size);
+	assert(p->coordinate.y + size <= cache->size);
+
+	glyph_cache_upload(cache->picture, glyph, glyph_picture,
 			   p->coordinate.x, p->coordinate.y);
 
 	return true;
 }
 
+/* A small cache of recently drawn glyph runs, keyed on the glyph pointers
+ * and the list offsets and formats. Terminals, clocks and panels redraw
+ * the same strings over and over, and for those we can skip recomputing
+ * the extents and overlap checks. Once a run has been drawn with every
+ * glyph resident, we also keep the list of atlas rectangles so the next
+ * unclipped draw is just a replay of those rectangles. Any change to the
+ * atlas layout (an eviction or a grow) bumps glyph_generation and
+ * invalidates every recorded replay.
+ */
+struct sna_glyph_run {
+	uint32_t hash;
+	uint32_t generation;
+	int nlist, count, nrect;
+	BoxRec extents;
+	PictFormatPtr format;
+	bool has_format;
+	GlyphListRec *list;
+	GlyphPtr *glyphs;
+	struct sna_glyph_rect {
+		struct sna_glyph *glyph;
+		PicturePtr atlas;
+		struct sna_coordinate coordinate;
+		int16_t x, y;
+		uint16_t width, height;
+	} *rect;
+};
+
+static void glyph_runs_flush(struct sna_render *render)
+{
+	int i;
+
+	if (render->glyph_run == NULL)
+		return;
+
+	for (i = 0; i < GLYPH_RUN_CACHE_SIZE; i++) {
+		free(render->glyph_run[i]);
+		render->glyph_run[i] = NULL;
+	}
+}
+
+static inline uint32_t glyph_run_hash(uint32_t hash, uintptr_t v)
+{
+	hash ^= v;
+	hash *= 0x01000193;
+	if (sizeof(v) > 4) {
+		hash ^= (uint64_t)v >> 32;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static bool
+glyph_run_matches(const struct sna_glyph_run *run, uint32_t hash,
+		  int nlist, GlyphListPtr list, GlyphPtr *glyphs, int count)
+{
+	int i;
+
+	if (run->hash != hash || run->nlist != nlist || run->count != count)
+		return false;
+
+	for (i = 0; i < nlist; i++) {
+		if (run->list[i].xOff != list[i].xOff ||
+		    run->list[i].yOff != list[i].yOff ||
+		    run->list[i].len != list[i].len ||
+		    run->list[i].format != list[i].format)
+			return false;
+	}
+
+	return memcmp(run->glyphs, glyphs, count * sizeof(GlyphPtr)) == 0;
+}
+
+static struct sna_glyph_run *
+glyph_run_lookup(struct sna_render *render,
+		 int nlist, GlyphListPtr list, GlyphPtr *glyphs)
+{
+	struct sna_glyph_run *run, **slot;
+	uint32_t hash = 0x811c9dc5;
+	int count, i;
+
+	if (NO_GLYPH_RUN_CACHE || render->glyph_run == NULL)
+		return NULL;
+
+	count = 0;
+	for (i = 0; i < nlist; i++) {
+		count += list[i].len;
+		hash = glyph_run_hash(hash, (uint16_t)list[i].xOff << 16 | (uint16_t)list[i].yOff);
+		hash = glyph_run_hash(hash, (uintptr_t)list[i].format);
+	}
+	if (count > GLYPH_RUN_MAX_GLYPHS)
+		return NULL;
+
+	for (i = 0; i < count; i++)
+		hash = glyph_run_hash(hash, (uintptr_t)glyphs[i]);
+
+	slot = &render->glyph_run[hash % GLYPH_RUN_CACHE_SIZE];
+	run = *slot;
+	if (run && glyph_run_matches(run, hash, nlist, list, glyphs, count)) {
+		DBG(("%s: hit, %d glyphs in %d lists, replay? %d\n",
+		     __FUNCTION__, count, nlist,
+		     run->generation == render->glyph_generation));
+		render->glyph_stats.run_hit++;
+		return run;
+	}
+
+	render->glyph_stats.run_miss++;
+	free(run);
+	*slot = NULL;
+
+	run = malloc(sizeof(*run) +
+		     nlist * sizeof(GlyphListRec) +
+		     count * (sizeof(GlyphPtr) + sizeof(struct sna_glyph_rect)));
+	if (run == NULL)
+		return NULL;
+
+	run->rect = (struct sna_glyph_rect *)(run + 1);
+	run->list = (GlyphListRec *)(run->rect + count);
+	run->glyphs = (GlyphPtr *)(run->list + nlist);
+	memcpy(run->list, list, nlist * sizeof(GlyphListRec));
+	memcpy(run->glyphs, glyphs, count * sizeof(GlyphPtr));
+
+	run->hash = hash;
+	run->nlist = nlist;
+	run->count = count;
+	run->nrect = 0;
+	run->generation = 0;
+	run->has_format = false;
+	glyph_extents(nlist, list, glyphs, &run->extents);
+
+	DBG(("%s: miss, %d glyphs in %d lists, extents (%d, %d), (%d, %d)\n",
+	     __FUNCTION__, count, nlist,
+	     run->extents.x1, run->extents.y1,
+	     run->extents.x2, run->extents.y2));
+
+	*slot = run;
+	return run;
+}
+
+static inline void
+run_extents(const struct sna_glyph_run *run,
+	    int nlist, GlyphListPtr list, GlyphPtr *glyphs,
+	    BoxPtr extents)
+{
+	if (run)
+		*extents = run->extents;
+	else
+		glyph_extents(nlist, list, glyphs, extents);
+}
+
+static inline bool
+glyph_run_can_replay(struct sna_render *render,
+		     const struct sna_glyph_run *run)
+{
+	return run && run->generation == render->glyph_generation;
+}
+
+/* Returns the generation that a recording must survive to be valid, or 0 */
+static inline uint32_t
+glyph_run_record_begin(struct sna_render *render, struct sna_glyph_run *run)
+{
+	if (run == NULL)
+		return 0;
+
+	run->generation = 0;
+	run->nrect = 0;
+	return render->glyph_generation;
+}
+
+static inline void
+glyph_run_record(struct sna_glyph_run *run,
+		 struct sna_glyph *p, GlyphPtr glyph,
+		 int16_t x, int16_t y) /* pen position relative to the run */
+{
+	struct sna_glyph_rect *r;
+
+	assert(run->nrect < run->count);
+	r = &run->rect[run->nrect++];
+	r->glyph = p;
+	r->atlas = p->atlas;
+	r->coordinate = p->coordinate;
+	r->x = x - glyph->info.x;
+	r->y = y - glyph->info.y;
+	r->width = glyph->info.width;
+	r->height = glyph->info.height;
+}
+
+static inline void
+glyph_run_record_end(struct sna_render *render,
+		     struct sna_glyph_run *run,
+		     uint32_t generation)
+{
+	/* Only keep the recording if nothing moved whilst we drew; the
+	 * generation is cleared by any glyph we failed to cache, as its
+	 * replay would otherwise silently drop that glyph.
+	 */
+	if (generation && generation == render->glyph_generation) {
+		DBG(("%s: recorded %d rectangles\n", __FUNCTION__, run->nrect));
+		run->generation = generation;
+	}
+}
+
 static void apply_damage(struct sna_composite_op *op,
 			 const struct sna_composite_rectangles *r)
 {
@@ -546,7 +1230,8 @@ static inline bool region_matches_pixmap(const RegionRec *r, PixmapPtr pixmap)
 		r->extents.y2 - r->extents.y1 >= pixmap->drawable.height);
 }
 
-static inline bool clipped_glyphs(PicturePtr dst, int nlist, GlyphListPtr list, GlyphPtr *glyphs)
+static inline bool clipped_glyphs(PicturePtr dst, struct sna_glyph_run *run,
+				  int nlist, GlyphListPtr list, GlyphPtr *glyphs)
 {
 	BoxRec box;
 
@@ -565,7 +1250,7 @@ static inline bool clipped_glyphs(PicturePtr dst, int nlist, GlyphListPtr list,
 		return false;
 	}
 
-	glyph_extents(nlist, list, glyphs, &box);
+	run_extents(run, nlist, list, glyphs, &box);
 
 	box.x1 += dst->pDrawable->x;
 	box.x2 += dst->pDrawable->x;
@@ -583,18 +1268,73 @@ static inline bool clipped_glyphs(PicturePtr dst, int nlist, GlyphListPtr list,
 						&box) != PIXMAN_REGION_IN;
 }
 
+static bool
+glyph_run_to_dst(struct sna *sna,
+		 struct sna_glyph_run *run,
+		 CARD8 op,
+		 PicturePtr src,
+		 PicturePtr dst,
+		 int16_t src_x, int16_t src_y)
+{
+	struct sna_composite_op tmp;
+	PicturePtr glyph_atlas = NO_ATLAS;
+	int16_t x = dst->pDrawable->x;
+	int16_t y = dst->pDrawable->y;
+	int i;
+
+	DBG(("%s: replaying %d glyphs\n", __FUNCTION__, run->nrect));
+
+	memset(&tmp, 0, sizeof(tmp));
+	for (i = 0; i < run->nrect; i++) {
+		const struct sna_glyph_rect *g = &run->rect[i];
+		struct sna_composite_rectangles r;
+
+		if (unlikely(g->atlas != glyph_atlas)) {
+			if (glyph_atlas != NO_ATLAS)
+				tmp.done(sna, &tmp);
+
+			if (!sna->render.composite(sna,
+						   op, src, g->atlas, dst,
+						   0, 0, 0, 0, 0, 0,
+						   0, 0,
+						   COMPOSITE_PARTIAL, &tmp))
+				return false;
+
+			glyph_atlas = g->atlas;
+		}
+		glyph_touch(&sna->render, g->glyph);
+
+		r.dst.x = x + g->x;
+		r.dst.y = y + g->y;
+		r.src.x = r.dst.x + src_x;
+		r.src.y = r.dst.y + src_y;
+		r.mask = g->coordinate;
+		r.width = g->width;
+		r.height = g->height;
+
+		tmp.blt(sna, &tmp, &r);
+		apply_damage_clipped_to_dst(&tmp, &r, dst->pDrawable);
+	}
+	if (glyph_atlas != NO_ATLAS)
+		tmp.done(sna, &tmp);
+
+	return true;
+}
+
 flatten static bool
 glyphs_to_dst(struct sna *sna,
 	      CARD8 op,
 	      PicturePtr src,
 	      PicturePtr dst,
 	      INT16 src_x, INT16 src_y,
+	      struct sna_glyph_run *run,
 	      int nlist, GlyphListPtr list, GlyphPtr *glyphs)
 {
 	struct sna_composite_op tmp;
 	ScreenPtr screen = dst->pDrawable->pScreen;
 	PicturePtr glyph_atlas;
 	const BoxRec *rects;
+	uint32_t record;
 	int nrect;
 	int16_t x, y;
 
@@ -607,7 +1347,7 @@ glyphs_to_dst(struct sna *sna,
 	     __FUNCTION__, op, src_x, src_y, nlist,
 	     list->xOff, list->yOff, dst->pDrawable->x, dst->pDrawable->y));
 
-	if (clipped_glyphs(dst, nlist, list, glyphs)) {
+	if (clipped_glyphs(dst, run, nlist, list, glyphs)) {
 		rects = region_rects(dst->pCompositeClip);
 		nrect = region_num_rects(dst->pCompositeClip);
 	} else
@@ -618,6 +1358,12 @@ glyphs_to_dst(struct sna *sna,
 	src_x -= list->xOff + x;
 	src_y -= list->yOff + y;
 
+	record = 0;
+	if (!glyph_run_can_replay(&sna->render, run))
+		record = glyph_run_record_begin(&sna->render, run);
+	else if (nrect == 0)
+		return glyph_run_to_dst(sna, run, op, src, dst, src_x, src_y);
+
 	glyph_atlas = NO_ATLAS;
 	while (nlist--) {
 		int n = list->len;
@@ -639,8 +1385,10 @@ glyphs_to_dst(struct sna *sna,
 				}
 
 				if (p->atlas == NULL &&
-				    !glyph_cache(screen, &sna->render, glyph))
+				    !glyph_cache(screen, &sna->render, glyph)) {
+					record = 0;
 					goto next_glyph;
+				}
 
 				if (!sna->render.composite(sna,
 							   op, src, p->atlas, dst,
@@ -651,6 +1399,11 @@ glyphs_to_dst(struct sna *sna,
 
 				glyph_atlas = p->atlas;
 			}
+			glyph_touch(&sna->render, p);
+			if (record)
+				glyph_run_record(run, p, glyph,
+						 x - dst->pDrawable->x,
+						 y - dst->pDrawable->y);
 
 			if (nrect) {
 				int xi = x - glyph->info.x;
@@ -733,6 +1486,7 @@ next_glyph:
 	if (glyph_atlas != NO_ATLAS)
 		tmp.done(sna, &tmp);
 
+	glyph_run_record_end(&sna->render, run, record);
 	return true;
 }
 
@@ -742,11 +1496,13 @@ glyphs0_to_dst(struct sna *sna,
 	       PicturePtr src,
 	       PicturePtr dst,
 	       INT16 src_x, INT16 src_y,
+	       struct sna_glyph_run *run,
 	       int nlist, GlyphListPtr list, GlyphPtr *glyphs)
 {
 	struct sna_composite_op tmp;
 	ScreenPtr screen = dst->pDrawable->pScreen;
 	PicturePtr glyph_atlas = NO_ATLAS;
+	uint32_t record;
 	int x, y;
 
 	if (NO_GLYPHS_TO_DST)
@@ -763,7 +1519,11 @@ glyphs0_to_dst(struct sna *sna,
 	src_x -= list->xOff + x;
 	src_y -= list->yOff + y;
 
-	if (clipped_glyphs(dst, nlist, list, glyphs)) {
+	record = 0;
+	if (!glyph_run_can_replay(&sna->render, run))
+		record = glyph_run_record_begin(&sna->render, run);
+
+	if (clipped_glyphs(dst, run, nlist, list, glyphs)) {
 		const BoxRec *rects = region_rects(dst->pCompositeClip);
 		int nrect = region_num_rects(dst->pCompositeClip);
 		if (nrect == 0)
@@ -788,8 +1548,10 @@ glyphs0_to_dst(struct sna *sna,
 					}
 
 					if (unlikely(p->atlas == NULL)) {
-						if (!glyph_cache(screen, &sna->render, glyph))
+						if (!glyph_cache(screen, &sna->render, glyph)) {
+							record = 0;
 							goto next_glyph_N;
+						}
 					}
 
 					if (!sna->render.composite(sna,
@@ -801,6 +1563,11 @@ glyphs0_to_dst(struct sna *sna,
 
 					glyph_atlas = p->atlas;
 				}
+				glyph_touch(&sna->render, p);
+				if (record)
+					glyph_run_record(run, p, glyph,
+							 x - dst->pDrawable->x,
+							 y - dst->pDrawable->y);
 
 				xi = x - glyph->info.x;
 				yi = y - glyph->info.y;
@@ -861,6 +1628,8 @@ next_glyph_N:
 			}
 			list++;
 		}
+	} else if (glyph_run_can_replay(&sna->render, run)) {
+		return glyph_run_to_dst(sna, run, op, src, dst, src_x, src_y);
 	} else while (nlist--) {
 		int n = list->len;
 		x += list->xOff;
@@ -880,8 +1649,10 @@ next_glyph_N:
 				}
 
 				if (unlikely(p->atlas == NULL)) {
-					if (!glyph_cache(screen, &sna->render, glyph))
+					if (!glyph_cache(screen, &sna->render, glyph)) {
+						record = 0;
 						goto next_glyph_0;
+					}
 				}
 
 				if (!sna->render.composite(sna,
@@ -893,6 +1664,11 @@ next_glyph_N:
 
 				glyph_atlas = p->atlas;
 			}
+			glyph_touch(&sna->render, p);
+			if (record)
+				glyph_run_record(run, p, glyph,
+						 x - dst->pDrawable->x,
+						 y - dst->pDrawable->y);
 
 			r.dst.x = x - glyph->info.x;
 			r.dst.y = y - glyph->info.y;
@@ -918,6 +1694,7 @@ next_glyph_0:
 	if (glyph_atlas != NO_ATLAS)
 		tmp.done(sna, &tmp);
 
+	glyph_run_record_end(&sna->render, run, record);
 	return true;
 }
 
@@ -973,6 +1750,7 @@ glyphs_slow(struct sna *sna,
 				if (!glyph_cache(screen, &sna->render, glyph))
 					goto next_glyph;
 			}
+			glyph_touch(&sna->render, p);
 
 			DBG(("%s: glyph=(%d, %d)x(%d, %d), src=(%d, %d), mask=(%d, %d)\n",
 			     __FUNCTION__,
@@ -1095,6 +1873,128 @@ sna_glyph_get_image(GlyphPtr g, ScreenPtr s)
 	return image;
 }
 
+/* Software glyph compositing in parallel. The glyphs are first resolved
+ * to their pixman images and positions on the main thread, then handed
+ * to sna_image_composite_glyphs() to be composited in horizontal bands.
+ */
+static int
+glyph_items(ScreenPtr screen, PictFormatPtr format,
+	    int16_t x, int16_t y, const BoxRec *clip,
+	    int nlist, GlyphListPtr list, GlyphPtr *glyphs,
+	    struct sna_glyph_item *items)
+{
+	int count = 0;
+
+	while (nlist--) {
+		int n = list->len;
+		x += list->xOff;
+		y += list->yOff;
+		while (n--) {
+			GlyphPtr g = *glyphs++;
+			struct sna_glyph_item *item = &items[count];
+
+			if (!glyph_valid(g))
+				goto next;
+
+			item->x = x - g->info.x;
+			item->y = y - g->info.y;
+			if (item->x >= clip->x2 || item->y >= clip->y2 ||
+			    item->x + g->info.width  <= clip->x1 ||
+			    item->y + g->info.height <= clip->y1)
+				goto next;
+
+			item->image = sna_glyph_get_image(g, screen);
+			if (item->image == NULL)
+				goto next;
+
+			item->width = g->info.width;
+			item->height = g->info.height;
+			item->convert = list->format != format;
+			count++;
+next:
+			x += g->info.xOff;
+			y += g->info.yOff;
+		}
+		list++;
+	}
+
+	return count;
+}
+
+/* Every glyph sliced across a band boundary costs another composite
+ * setup, and the serial path enjoys pixman's glyph cache, so only
+ * spread runs carrying enough glyphs and coverage to repay the split.
+ */
+static bool
+glyph_items_use_threads(const struct sna_glyph_item *items, int count)
+{
+	unsigned long area = 0;
+	int i;
+
+	if (count < GLYPH_THREAD_MIN_GLYPHS)
+		return false;
+
+	for (i = 0; i < count; i++)
+		area += items[i].width * items[i].height;
+
+	DBG(("%s: %d glyphs covering %lu pixels\n",
+	     __FUNCTION__, count, area));
+	return area >= GLYPH_THREAD_MIN_AREA;
+}
+
+/* Accumulate the glyphs into the mask image using all threads; returns
+ * false if the caller should use the serial path instead.
+ */
+static bool
+glyphs_to_mask_threaded(struct sna *sna, ScreenPtr screen,
+			pixman_image_t *mask_image, PictFormatPtr format,
+			int16_t x, int16_t y, int16_t width, int16_t height,
+			int nlist, GlyphListPtr list, GlyphPtr *glyphs)
+{
+	struct sna_glyph_item stack_items[N_STACK_GLYPHS], *items = stack_items;
+	BoxRec clip;
+	int num_threads, count;
+	bool ret = false;
+
+	if (NO_GLYPH_THREADS)
+		return false;
+
+	num_threads = sna_use_threads(width, height, GLYPH_THREAD_THRESHOLD);
+	if (num_threads <= 1)
+		return false;
+
+	count = glyph_count(nlist, list);
+	if (count < GLYPH_THREAD_MIN_GLYPHS)
+		return false;
+
+	if (count > N_STACK_GLYPHS) {
+		items = malloc(count * sizeof(*items));
+		if (items == NULL)
+			return false;
+	}
+
+	clip.x1 = clip.y1 = 0;
+	clip.x2 = width;
+	clip.y2 = height;
+	count = glyph_items(screen, format, x, y, &clip,
+			    nlist, list, glyphs, items);
+	if (glyph_items_use_threads(items, count)) {
+		DBG(("%s: using %d threads for %d glyphs into %dx%d mask\n",
+		     __FUNCTION__, num_threads, count, width, height));
+
+		ret = sna_image_composite_glyphs(num_threads, PIXMAN_OP_ADD,
+						 NULL, 0, 0,
+						 sna->render.white_image,
+						 mask_image,
+						 0, height,
+						 items, count);
+	}
+
+	if (items != stack_items)
+		free(items);
+	return ret;
+}
+
 static inline bool use_small_mask(struct sna *sna, int16_t width, int16_t height, int depth)
 {
 	if (depth < 8)
@@ -1109,6 +2009,63 @@ static inline bool use_small_mask(struct sna *sna, int16_t width, int16_t height
 	return too_large(sna, width, height);
 }
 
+static bool
+glyph_run_to_mask(struct sna *sna,
+		  struct sna_glyph_run *run,
+		  PicturePtr mask,
+		  int16_t x, int16_t y)
+{
+	struct sna_composite_op tmp;
+	PicturePtr glyph_atlas = NO_ATLAS;
+	int i;
+
+	DBG(("%s: replaying %d glyphs\n", __FUNCTION__, run->nrect));
+
+	for (i = 0; i < run->nrect; i++) {
+		const struct sna_glyph_rect *g = &run->rect[i];
+		struct sna_composite_rectangles r;
+
+		if (unlikely(g->atlas != glyph_atlas)) {
+			bool ok;
+
+			if (glyph_atlas != NO_ATLAS)
+				tmp.done(sna, &tmp);
+
+			memset(&tmp, 0, sizeof(tmp));
+			if (g->atlas->format == mask->format ||
+			    alphaless(g->atlas->format) == mask->format) {
+				ok = sna->render.composite(sna, PictOpAdd,
+							   g->atlas, NULL, mask,
+							   0, 0, 0, 0, 0, 0,
+							   0, 0,
+							   COMPOSITE_PARTIAL, &tmp);
+			} else {
+				ok = sna->render.composite(sna, PictOpAdd,
+							   sna->render.white_picture, g->atlas, mask,
+							   0, 0, 0, 0, 0, 0,
+							   0, 0,
+							   COMPOSITE_PARTIAL, &tmp);
+			}
+			if (!ok)
+				return false;
+
+			glyph_atlas = g->atlas;
+		}
+		glyph_touch(&sna->render, g->glyph);
+
+		r.mask = r.src = g->coordinate;
+		r.dst.x = x + g->x;
+		r.dst.y = y + g->y;
+		r.width = g->width;
+		r.height = g->height;
+		tmp.blt(sna, &tmp, &r);
+	}
+	if (glyph_atlas != NO_ATLAS)
+		tmp.done(sna, &tmp);
+
+	return true;
+}
+
 flatten static bool
 glyphs_via_mask(struct sna *sna,
 		CARD8 op,
@@ -1116,6 +2073,7 @@ glyphs_via_mask(struct sna *sna,
 		PicturePtr dst,
 		PictFormatPtr format,
 		INT16 src_x, INT16 src_y,
+		struct sna_glyph_run *run,
 		int nlist, GlyphListPtr list, GlyphPtr *glyphs)
 {
 	ScreenPtr screen = dst->pDrawable->pScreen;
@@ -1134,7 +2092,7 @@ glyphs_via_mask(struct sna *sna,
 	     __FUNCTION__, op, src_x, src_y, nlist,
 	     list->xOff, list->yOff, dst->pDrawable->x, dst->pDrawable->y));
 
-	glyph_extents(nlist, list, glyphs, &box);
+	run_extents(run, nlist, list, glyphs, &box);
 	if (box.x2 <= box.x1 || box.y2 <= box.y1)
 		return true;
 
@@ -1192,6 +2150,12 @@ use_small_mask:
 		}
 
 		memset(pixmap->devPrivate.ptr, 0, pixmap->devKind*height);
+		if (glyphs_to_mask_threaded(sna, screen, mask_image, format,
+					    x, y, width, height,
+					    nlist, list, glyphs)) {
+			DBG(("%s: glyphs rendered to mask by threads\n",
+			     __FUNCTION__));
+		} else
 #if HAS_PIXMAN_GLYPHS
 		if (__global_glyph_cache) {
 			pixman_glyph_t stack_glyphs[N_STACK_GLYPHS];
@@ -1339,6 +2303,8 @@ next_image:
 	} else {
 		struct sna_composite_op tmp;
 		PicturePtr glyph_atlas = NO_ATLAS;
+		uint32_t record;
+		int16_t x0, y0;
 
 		pixmap = screen->CreatePixmap(screen,
 					      width, height, format->depth,
@@ -1358,6 +2324,14 @@ next_image:
 		if (!clear_pixmap(sna, pixmap))
 			goto err_mask;
 
+		if (glyph_run_can_replay(&sna->render, run)) {
+			if (!glyph_run_to_mask(sna, run, mask, x, y))
+				goto err_mask;
+			goto composite;
+		}
+
+		record = glyph_run_record_begin(&sna->render, run);
+		x0 = x; y0 = y;
 		do {
 			int n = list->len;
 			x += list->xOff;
@@ -1379,8 +2353,10 @@ next_image:
 					}
 
 					if (unlikely(p->atlas == NULL)) {
-						if (!glyph_cache(screen, &sna->render, glyph))
+						if (!glyph_cache(screen, &sna->render, glyph)) {
+							record = 0;
 							goto next_glyph;
+						}
 					}
 
 					DBG(("%s: atlas format=%08x, mask format=%08x\n",
@@ -1411,6 +2387,9 @@ next_image:
 
 					glyph_atlas = p->atlas;
 				}
+				glyph_touch(&sna->render, p);
+				if (record)
+					glyph_run_record(run, p, glyph, x - x0, y - y0);
 
 				DBG(("%s: blt glyph origin (%d, %d), offset (%d, %d), src (%d, %d), size (%d, %d)\n",
 				     __FUNCTION__,
@@ -1433,8 +2412,11 @@ next_glyph:
 		} while (--nlist);
 		if (glyph_atlas != NO_ATLAS)
 			tmp.done(sna, &tmp);
+
+		glyph_run_record_end(&sna->render, run, record);
 	}
 
+composite:
 	sna_composite(op,
 		      src, mask, dst,
 		      src_x, src_y,
@@ -1571,7 +2553,23 @@ out:
 	return format;
 }
 
+static PictFormatPtr
+glyph_run_format(struct sna_glyph_run *run,
+		 int nlist, GlyphListPtr list, GlyphPtr *glyphs)
+{
+	if (run == NULL)
+		return glyphs_format(nlist, list, glyphs);
+
+	if (!run->has_format) {
+		run->format = glyphs_format(nlist, list, glyphs);
+		run->has_format = true;
+	}
+
+	return run->format;
+}
+
 static bool can_discard_mask(uint8_t op, PicturePtr src, PictFormatPtr mask,
+			     struct sna_glyph_run *run,
 			     int nlist, GlyphListPtr list, GlyphPtr *glyphs)
 {
 	PictFormatPtr g;
@@ -1599,7 +2597,7 @@ static bool can_discard_mask(uint8_t op, PicturePtr src, PictFormatPtr mask,
 	}
 
 	/* No glyphs overlap and we are not performing a mask conversion. */
-	g = glyphs_format(nlist, list, glyphs);
+	g = glyph_run_format(run, nlist, list, glyphs);
 	if (mask == g) {
 		DBG(("%s: mask matches glyphs format, no conversion, so discard mask\n",
 		     __FUNCTION__));
@@ -1656,6 +2654,135 @@ static uint32_t pixman_format(PictFormatPtr short_format)
 	return bpp << 24 | short_format->format;
 }
 
+static bool
+glyphs_fallback_threaded(struct sna *sna,
+			 CARD8 op,
+			 PicturePtr src,
+			 PicturePtr dst,
+			 PictFormatPtr mask_format,
+			 int src_x, int src_y,
+			 const BoxRec *extents,
+			 int nlist, GlyphListPtr list, GlyphPtr *glyphs)
+{
+	struct sna_glyph_item stack_items[N_STACK_GLYPHS], *items = stack_items;
+	pixman_image_t *src_image, *dst_image, *mask_image;
+	BoxRec box = *extents, clip;
+	int num_threads, count;
+	int x, y, src_dx, src_dy;
+	bool ret = false;
+
+	if (NO_GLYPH_THREADS)
+		return false;
+
+	num_threads = sna_use_threads(box.x2 - box.x1, box.y2 - box.y1,
+				      GLYPH_THREAD_THRESHOLD);
+	if (num_threads <= 1)
+		return false;
+
+	count = glyph_count(nlist, list);
+	if (count < GLYPH_THREAD_MIN_GLYPHS)
+		return false;
+
+	if (count > N_STACK_GLYPHS) {
+		items = malloc(count * sizeof(*items));
+		if (items == NULL)
+			return false;
+	}
+
+	dst_image = image_from_pict(dst, TRUE, &x, &y);
+	if (dst_image == NULL)
+		goto out;
+
+	box.x1 += x;
+	box.x2 += x;
+	box.y1 += y;
+	box.y2 += y;
+
+	if (mask_format) {
+		x -= box.x1;
+		y -= box.y1;
+
+		clip.x1 = clip.y1 = 0;
+		clip.x2 = box.x2 - box.x1;
+		clip.y2 = box.y2 - box.y1;
+	} else
+		clip = box;
+
+	count = glyph_items(dst->pDrawable->pScreen, mask_format,
+			    x, y, &clip,
+			    nlist, list, glyphs, items);
+	if (!glyph_items_use_threads(items, count))
+		goto out_dst;
+
+	src_image = image_from_pict(src, FALSE, &src_dx, &src_dy);
+	if (src_image == NULL)
+		goto out_dst;
+
+	src_x += src_dx - list->xOff;
+	src_y += src_dy - list->yOff;
+
+	if (mask_format) {
+		mask_image =
+			pixman_image_create_bits(pixman_format(mask_format),
+						 box.x2 - box.x1,
+						 box.y2 - box.y1,
+						 NULL, 0);
+		if (mask_image == NULL)
+			goto out_src;
+		if (NeedsComponent(mask_format->format))
+			pixman_image_set_component_alpha(mask_image, TRUE);
+	} else {
+		mask_image = NULL;
+		src_x -= x - dst->pDrawable->x;
+		src_y -= y - dst->pDrawable->y;
+	}
+
+	DBG(("%s: using %d threads for %d glyphs, extents (%d, %d), (%d, %d), mask? %d\n",
+	     __FUNCTION__, num_threads, count,
+	     box.x1, box.y1, box.x2, box.y2, mask_format != NULL));
+
+	ret = true;
+	if (sigtrap_get() == 0) {
+		if (mask_image)
+			ret = sna_image_composite_glyphs(num_threads,
+							 PIXMAN_OP_ADD,
+							 NULL, 0, 0,
+							 sna->render.white_image,
+							 mask_image,
+							 clip.y1, clip.y2,
+							 items, count);
+		else
+			ret = sna_image_composite_glyphs(num_threads,
+							 op,
+							 src_image, src_x, src_y,
+							 sna->render.white_image,
+							 dst_image,
+							 clip.y1, clip.y2,
+							 items, count);
+		sigtrap_put();
+	}
+
+	if (mask_image) {
+		if (ret)
+			sna_image_composite(op, src_image, mask_image, dst_image,
+					    src_x, src_y,
+					    0, 0,
+					    box.x1, box.y1,
+					    box.x2 - box.x1,
+					    box.y2 - box.y1);
+		pixman_image_unref(mask_image);
+	}
+
+out_src:
+	free_pixman_pict(src, src_image);
+out_dst:
+	free_pixman_pict(dst, dst_image);
+out:
+	if (items != stack_items)
+		free(items);
+	return ret;
+}
+
 static void
 glyphs_fallback(CARD8 op,
 		PicturePtr src,
@@ -1712,11 +2839,16 @@ glyphs_fallback(CARD8 op,
 	RegionTranslate(&region, -dst->pDrawable->x, -dst->pDrawable->y);
 
 	if (mask_format &&
-	    can_discard_mask(op, src, mask_format, nlist, list, glyphs)) {
+	    can_discard_mask(op, src, mask_format, NULL, nlist, list, glyphs)) {
 		DBG(("%s: discarding mask\n", __FUNCTION__));
 		mask_format = NULL;
 	}
 
+	if (glyphs_fallback_threaded(sna, op, src, dst, mask_format,
+				     src_x, src_y, &region.extents,
+				     nlist, list, glyphs))
+		goto cleanup_region;
+
 #if HAS_PIXMAN_GLYPHS
 	if (__global_glyph_cache) {
 		pixman_glyph_t stack_glyphs[N_STACK_GLYPHS];
@@ -1992,6 +3124,7 @@ sna_glyphs(CARD8 op,
 {
 	PixmapPtr pixmap = get_drawable_pixmap(dst->pDrawable);
 	struct sna *sna = to_sna_from_pixmap(pixmap);
+	struct sna_glyph_run *run;
 	struct sna_pixmap *priv;
 
 	DBG(("%s(op=%d, nlist=%d, src=(%d, %d))\n",
@@ -2025,37 +3158,39 @@ sna_glyphs(CARD8 op,
 		goto fallback;
 	}
 
+	run = glyph_run_lookup(&sna->render, nlist, list, glyphs);
+
 	/* Try to discard the mask for non-overlapping glyphs */
 	if (FORCE_GLYPHS_TO_DST ||
 	    mask == NULL ||
 	    (dst->pCompositeClip->data == NULL &&
-	     can_discard_mask(op, src, mask, nlist, list, glyphs))) {
+	     can_discard_mask(op, src, mask, run, nlist, list, glyphs))) {
 		DBG(("%s: discarding mask\n", __FUNCTION__));
 		if (can_use_glyph0()) {
 			if (glyphs0_to_dst(sna, op,
 					   src, dst,
 					   src_x, src_y,
-					   nlist, list, glyphs))
+					   run, nlist, list, glyphs))
 				return;
 		} else {
 			if (glyphs_to_dst(sna, op,
 					  src, dst,
 					  src_x, src_y,
-					  nlist, list, glyphs))
+					  run, nlist, list, glyphs))
 				return;
 		}
 	}
 
 	/* Otherwise see if we can substitute a mask */
 	if (!mask) {
-		mask = glyphs_format(nlist, list, glyphs);
+		mask = glyph_run_format(run, nlist, list, glyphs);
 		DBG(("%s: substituting mask? %d\n", __FUNCTION__, mask!=NULL));
 	}
 	if (mask) {
 		if (glyphs_via_mask(sna, op,
 				    src, dst, mask,
 				    src_x, src_y,
-				    nlist, list, glyphs))
+				    run, nlist, list, glyphs))
 			return;
 	} else {
 		if (glyphs_slow(sna, op,
@@ -2148,6 +3283,12 @@ glyphs_via_image(struct sna *sna,
 	}
 
 	memset(pixmap->devPrivate.ptr, 0, pixmap->devKind*height);
+	if (glyphs_to_mask_threaded(sna, screen, mask_image, format,
+				    x, y, width, height,
+				    nlist, list, glyphs)) {
+		DBG(("%s: glyphs rendered to mask by threads\n",
+		     __FUNCTION__));
+	} else
 #if HAS_PIXMAN_GLYPHS
 	if (__global_glyph_cache) {
 		pixman_glyph_t stack_glyphs[N_STACK_GLYPHS];
@@ -2368,6 +3509,7 @@ fallback:
 void
 sna_glyph_unrealize(ScreenPtr screen, GlyphPtr glyph)
 {
+	struct sna *sna = to_sna_from_screen(screen);
 	struct sna_glyph *p = sna_glyph(glyph);
 
 	DBG(("%s: screen=%d, glyph=%p (image?=%d, atlas?=%d)\n",
@@ -2387,14 +3529,22 @@ sna_glyph_unrealize(ScreenPtr screen, GlyphPtr glyph)
 		p->image = NULL;
 	}
 
+	/* The GlyphPtr may be reused, so forget every run keyed on it */
+	glyph_runs_flush(&sna->render);
+
 	if (p->atlas && p->atlas != GetGlyphPicture(glyph, screen)) {
-		struct sna *sna = to_sna_from_screen(screen);
-		struct sna_glyph_cache *cache = &sna->render.glyph[p->pos&1];
-		DBG(("%s: releasing glyph pos %d from cache %d\n",
-		     __FUNCTION__, p->pos >> 1, p->pos & 1));
-		assert(cache->glyphs[p->pos >> 1] == p);
-		cache->glyphs[p->pos >> 1] = NULL;
-		p->atlas = NULL;
+		if (p->size > GLYPH_MAX_SIZE) {
+			DBG(("%s: releasing glyph pos %d from large atlas %d\n",
+			     __FUNCTION__, p->pos >> 1, p->pos & 1));
+			glyph_atlas_remove(&sna->render.large[p->pos&1], p);
+		} else {
+			struct sna_glyph_cache *cache = &sna->render.glyph[p->pos&1];
+			DBG(("%s: releasing glyph pos %d from cache %d\n",
+			     __FUNCTION__, p->pos >> 1, p->pos & 1));
+			assert(cache->glyphs[p->pos >> 1] == p);
+			cache->glyphs[p->pos >> 1] = NULL;
+			p->atlas = NULL;
+		}
 	}
 
 #if HAS_PIXMAN_GLYPHS
@@ -31,6 +31,7 @@
 
 #include "sna.h"
 #include "sna_render.h"
+#include "sna_render_inline.h"
 #include "sna_reg.h"
 
 #include <sys/mman.h>
@@ -38,6 +39,7 @@
 #define PITCH(x, y) ALIGN((x)*(y), 4)
 
 #define FORCE_INPLACE 0 /* 1 upload directly, -1 force indirect */
+#define THREAD_COPY_ROWS 256 /* rows per thread for inplace copies */
 
 /* XXX Need to avoid using GTT fenced access for I915_TILING_Y on 855GM */
 
@@ -53,6 +55,16 @@ static inline bool must_tile(struct sna *sna, int width, int height)
 		upload_too_large(sna, width, height));
 }
 
+static int copy_use_threads(const BoxRec *box, int n)
+{
+	BoxRec extents;
+
+	boxes_extents(box, n, &extents);
+	return sna_use_threads(extents.x2 - extents.x1,
+			       extents.y2 - extents.y1,
+			       THREAD_COPY_ROWS);
+}
+
 static bool download_inplace__cpu(struct kgem *kgem,
 				  PixmapPtr p, struct kgem_bo *bo,
 				  const BoxRec *box, int nbox)
@@ -60,6 +72,10 @@ static bool download_inplace__cpu(struct kgem *kgem,
 	BoxRec extents;
 
 	switch (bo->tiling) {
+	case I915_TILING_Y:
+		if (!kgem->memcpy_from_tiled_y)
+			return false;
+		break;
 	case I915_TILING_X:
 		if (!kgem->memcpy_from_tiled_x)
 			return false;
@@ -101,13 +117,11 @@ read_boxes_inplace__cpu(struct kgem *kgem,
 	void *src, *dst = pixmap->devPrivate.ptr;
 	int src_pitch = bo->pitch;
 	int dst_pitch = pixmap->devKind;
+	memcpy_box_func func;
 
 	if (!download_inplace__cpu(kgem, dst, bo, box, n))
 		return false;
 
-	if (bo->tiling == I915_TILING_Y)
-		return false;
-
 	assert(kgem_bo_can_map__cpu(kgem, bo, false));
 
 	src = kgem_bo_map__cpu(kgem, bo);
@@ -121,23 +135,23 @@ read_boxes_inplace__cpu(struct kgem *kgem,
 
 	DBG(("%s x %d\n", __FUNCTION__, n));
 
-	if (bo->tiling == I915_TILING_X) {
-		do {
-			memcpy_from_tiled_x(kgem, src, dst, bpp, src_pitch, dst_pitch,
-					    box->x1, box->y1,
-					    box->x1, box->y1,
-					    box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
-	} else {
-		do {
-			memcpy_blt(src, dst, bpp, src_pitch, dst_pitch,
-				   box->x1, box->y1,
-				   box->x1, box->y1,
-				   box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
+	switch (bo->tiling) {
+	case I915_TILING_Y:
+		func = kgem->memcpy_from_tiled_y;
+		break;
+	case I915_TILING_X:
+		func = kgem->memcpy_from_tiled_x;
+		break;
+	default:
+		func = memcpy_blt;
+		break;
 	}
+	assert(func);
+
+	sna_memcpy_boxes(copy_use_threads(box, n), func,
+			 src, dst, bpp, src_pitch, dst_pitch,
+			 0, 0, 0, 0,
+			 box, n);
 
 	sigtrap_put();
 	return true;
@@ -492,7 +506,7 @@ fallback:
 			rem = kgem_batch_space(kgem);
 			if (10*nbox_this_time > rem)
 				nbox_this_time = rem / 10;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc) / 2;
 			assert(nbox_this_time);
 			tmp_nbox -= nbox_this_time;
@@ -553,7 +567,7 @@ fallback:
 			rem = kgem_batch_space(kgem);
 			if (8*nbox_this_time > rem)
 				nbox_this_time = rem / 8;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc) / 2;
 			assert(nbox_this_time);
 			tmp_nbox -= nbox_this_time;
@@ -648,7 +662,9 @@ static bool upload_inplace__tiled(struct kgem *kgem, struct kgem_bo *bo)
 	DBG(("%s: tiling=%d\n", __FUNCTION__, bo->tiling));
 	switch (bo->tiling) {
 	case I915_TILING_Y:
-		return false;
+		if (!kgem->memcpy_to_tiled_y)
+			return false;
+		break;
 	case I915_TILING_X:
 		if (!kgem->memcpy_to_tiled_x)
 			return false;
@@ -668,11 +684,9 @@ write_boxes_inplace__tiled(struct kgem *kgem,
                            struct kgem_bo *bo, int16_t dst_dx, int16_t dst_dy,
                            const BoxRec *box, int n)
 {
+	memcpy_box_func func;
 	uint8_t *dst;
 
-	if (bo->tiling == I915_TILING_Y)
-		return false;
-
 	assert(kgem->has_wc_mmap || kgem_bo_can_map__cpu(kgem, bo, true));
 
 	if (kgem_bo_can_map__cpu(kgem, bo, true)) {
@@ -692,23 +706,23 @@ write_boxes_inplace__tiled(struct kgem *kgem,
 	if (sigtrap_get())
 		return false;
 
-	if (bo->tiling) {
-		do {
-			memcpy_to_tiled_x(kgem, src, dst, bpp, stride, bo->pitch,
-					  box->x1 + src_dx, box->y1 + src_dy,
-					  box->x1 + dst_dx, box->y1 + dst_dy,
-					  box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
-	} else {
-		do {
-			memcpy_blt(src, dst, bpp, stride, bo->pitch,
-				   box->x1 + src_dx, box->y1 + src_dy,
-				   box->x1 + dst_dx, box->y1 + dst_dy,
-				   box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
+	switch (bo->tiling) {
+	case I915_TILING_Y:
+		func = kgem->memcpy_to_tiled_y;
+		break;
+	case I915_TILING_X:
+		func = kgem->memcpy_to_tiled_x;
+		break;
+	default:
+		func = memcpy_blt;
+		break;
 	}
+	assert(func);
+
+	sna_memcpy_boxes(copy_use_threads(box, n), func,
+			 src, dst, bpp, stride, bo->pitch,
+			 src_dx, src_dy, dst_dx, dst_dy,
+			 box, n);
 
 	sigtrap_put();
 	return true;
@@ -829,6 +843,7 @@ bool sna_write_boxes(struct sna *sna, PixmapPtr dst,
 {
 	struct kgem *kgem = &sna->kgem;
 	struct kgem_bo *src_bo;
+	memcpy_box_func upload;
 	BoxRec extents;
 	void *ptr;
 	int offset;
@@ -937,6 +952,7 @@ tile:
 						goto fallback;
 					}
 
+					upload = memcpy_upload(kgem, tmp.height * src_bo->pitch);
 					if (sigtrap_get() == 0) {
 						BoxRec *c = clipped;
 						for (n = 0; n < nbox; n++) {
@@ -951,14 +967,14 @@ tile:
 							     src_dx, src_dy,
 							     c->x1 - tile.x1,
 							     c->y1 - tile.y1));
-							memcpy_blt(src, ptr, tmp.bitsPerPixel,
-								   stride, src_bo->pitch,
-								   c->x1 + src_dx,
-								   c->y1 + src_dy,
-								   c->x1 - tile.x1,
-								   c->y1 - tile.y1,
-								   c->x2 - c->x1,
-								   c->y2 - c->y1);
+							upload(src, ptr, tmp.bitsPerPixel,
+							       stride, src_bo->pitch,
+							       c->x1 + src_dx,
+							       c->y1 + src_dy,
+							       c->x1 - tile.x1,
+							       c->y1 - tile.y1,
+							       c->x2 - c->x1,
+							       c->y2 - c->y1);
 							c++;
 						}
 
@@ -995,6 +1011,7 @@ tile:
 			if (!src_bo)
 				goto fallback;
 
+			upload = memcpy_upload(kgem, tmp.height * src_bo->pitch);
 			if (sigtrap_get() == 0) {
 				for (n = 0; n < nbox; n++) {
 					DBG(("%s: box(%d, %d), (%d, %d), src=(%d, %d), dst=(%d, %d)\n",
@@ -1004,14 +1021,14 @@ tile:
 					     src_dx, src_dy,
 					     box[n].x1 - extents.x1,
 					     box[n].y1 - extents.y1));
-					memcpy_blt(src, ptr, tmp.bitsPerPixel,
-						   stride, src_bo->pitch,
-						   box[n].x1 + src_dx,
-						   box[n].y1 + src_dy,
-						   box[n].x1 - extents.x1,
-						   box[n].y1 - extents.y1,
-						   box[n].x2 - box[n].x1,
-						   box[n].y2 - box[n].y1);
+					upload(src, ptr, tmp.bitsPerPixel,
+					       stride, src_bo->pitch,
+					       box[n].x1 + src_dx,
+					       box[n].y1 + src_dy,
+					       box[n].x1 - extents.x1,
+					       box[n].y1 - extents.y1,
+					       box[n].x2 - box[n].x1,
+					       box[n].y2 - box[n].y1);
 				}
 
 				n = sna->render.copy_boxes(sna, GXcopy,
@@ -1062,7 +1079,7 @@ tile:
 			rem = kgem_batch_space(kgem);
 			if (10*nbox_this_time > rem)
 				nbox_this_time = rem / 10;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc) / 2;
 			assert(nbox_this_time);
 			nbox -= nbox_this_time;
@@ -1083,6 +1100,7 @@ tile:
 			if (!src_bo)
 				break;
 
+			upload = memcpy_upload(kgem, offset);
 			if (sigtrap_get() == 0) {
 				offset = 0;
 				do {
@@ -1105,12 +1123,12 @@ tile:
 					assert(box->x1 + dst_dx >= 0);
 					assert(box->y1 + dst_dy >= 0);
 
-					memcpy_blt(src, (char *)ptr + offset,
-						   dst->drawable.bitsPerPixel,
-						   stride, pitch,
-						   box->x1 + src_dx, box->y1 + src_dy,
-						   0, 0,
-						   width, height);
+					upload(src, (char *)ptr + offset,
+					       dst->drawable.bitsPerPixel,
+					       stride, pitch,
+					       box->x1 + src_dx, box->y1 + src_dy,
+					       0, 0,
+					       width, height);
 
 					assert(kgem->mode == KGEM_BLT);
 					b = kgem->batch + kgem->nbatch;
@@ -1157,7 +1175,7 @@ tile:
 			rem = kgem_batch_space(kgem);
 			if (8*nbox_this_time > rem)
 				nbox_this_time = rem / 8;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc) / 2;
 			assert(nbox_this_time);
 			nbox -= nbox_this_time;
@@ -1178,6 +1196,7 @@ tile:
 			if (!src_bo)
 				break;
 
+			upload = memcpy_upload(kgem, offset);
 			if (sigtrap_get()) {
 				kgem_bo_destroy(kgem, src_bo);
 				goto fallback;
@@ -1204,12 +1223,12 @@ tile:
 				assert(box->x1 + dst_dx >= 0);
 				assert(box->y1 + dst_dy >= 0);
 
-				memcpy_blt(src, (char *)ptr + offset,
-					   dst->drawable.bitsPerPixel,
-					   stride, pitch,
-					   box->x1 + src_dx, box->y1 + src_dy,
-					   0, 0,
-					   width, height);
+				upload(src, (char *)ptr + offset,
+				       dst->drawable.bitsPerPixel,
+				       stride, pitch,
+				       box->x1 + src_dx, box->y1 + src_dy,
+				       0, 0,
+				       width, height);
 
 				assert(kgem->mode == KGEM_BLT);
 				b = kgem->batch + kgem->nbatch;
@@ -1564,7 +1583,7 @@ tile:
 			rem = kgem_batch_space(kgem);
 			if (10*nbox_this_time > rem)
 				nbox_this_time = rem / 10;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc) / 2;
 			assert(nbox_this_time);
 			nbox -= nbox_this_time;
@@ -1663,7 +1682,7 @@ tile:
 			rem = kgem_batch_space(kgem);
 			if (8*nbox_this_time > rem)
 				nbox_this_time = rem / 8;
-			if (2*nbox_this_time > KGEM_RELOC_SIZE(kgem) - kgem->nreloc)
+			if (2*nbox_this_time > kgem_reloc_space(kgem, 2*nbox_this_time))
 				nbox_this_time = (KGEM_RELOC_SIZE(kgem) - kgem->nreloc) / 2;
 			assert(nbox_this_time);
 			nbox -= nbox_this_time;
@@ -330,9 +330,28 @@ struct sna_render {
 	struct sna_glyph_cache{
 		PicturePtr picture;
 		struct sna_glyph **glyphs;
+		uint32_t count;
+		uint32_t evict;
+		uint32_t evicted;
+		uint16_t size;
+	} glyph[2];
+	struct sna_glyph_atlas {
+		PicturePtr picture;
+		struct sna_glyph **glyphs;
+		struct sna_glyph_shelf {
+			uint16_t y, height, x;
+		} *shelf;
+		uint16_t size;
 		uint16_t count;
+		uint16_t nshelf;
 		uint16_t evict;
-	} glyph[2];
+	} large[2];
+	struct sna_glyph_run **glyph_run;
+	uint32_t glyph_generation;
+	struct {
+		unsigned long lookup, miss, evict, grow;
+		unsigned long run_hit, run_miss;
+	} glyph_stats;
 	pixman_image_t *white_image;
 	PicturePtr white_picture;
 
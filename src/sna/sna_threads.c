@@ -25,6 +25,10 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for sched_getaffinity() and friends */
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -32,8 +36,13 @@
 #include "sna.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <pthread.h>
 #include <signal.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #ifdef HAVE_VALGRIND
 #include <valgrind.h>
@@ -42,21 +51,235 @@ static inline bool valgrind_active(void) { return RUNNING_ON_VALGRIND; }
 static inline bool valgrind_active(void) { return false; }
 #endif
 
+/* The pool is a set of workers that steal tasks from each other. Every
+ * thread (including the main thread as threads[0]) owns a Chase-Lev
+ * deque: the owner pushes and pops at the bottom, everyone else steals
+ * from the top. Only the main thread submits work, so in practice the
+ * workers feed off threads[0] while the main thread helps out whilst
+ * waiting for its tasks to complete.
+ *
+ * Idle workers spin briefly looking for work before parking on the
+ * epoch futex, which is bumped whenever new work is queued.
+ */
+#define TASK_QUEUE_SIZE 256
+#define TASK_SPIN 64
+
+#define ARENA_MIN (64 << 10)
+#define ARENA_MAX (4 << 20)
+
+#define GLYPH_BAND_MIN 32 /* rows, so that a line of text is rarely split */
+
+/* A scratch bump allocator, one per thread, reused between calls */
+struct sna_arena {
+	char *base;
+	size_t size, used;
+	int count;
+};
+
+struct sna_task_group {
+	int pending;
+	int failed;
+};
+
+struct sna_task {
+	void (*func)(void *arg, int n);
+	void *arg;
+	int n;
+	struct sna_task_group *group;
+};
+
 static int max_threads = -1;
 
 static struct thread {
-    pthread_t thread;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+	pthread_t thread;
 
-    void (*func)(void *arg);
-    void *arg;
+	/* sna_threads_run() slot */
+	void (*func)(void *arg);
+	void *arg;
+	struct sna_task task;
+
+	struct sna_task *current;
+	struct sna_arena arena;
+
+	long top __attribute__((aligned(64)));
+	long bottom __attribute__((aligned(64)));
+	struct sna_task *queue[TASK_QUEUE_SIZE];
 } *threads;
 
+static struct sna_task_group default_group, *parallel_group;
+static struct sna_task *parallel_tasks, *parallel_stale;
+static struct sna_arena main_arena;
+static int epoch, sleepers, quit;
+
+static inline void futex_wait(int *addr, int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(int *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static bool queue_push(struct thread *t, struct sna_task *task)
+{
+	long bottom = __atomic_load_n(&t->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&t->top, __ATOMIC_ACQUIRE);
+
+	if (bottom - top >= TASK_QUEUE_SIZE)
+		return false;
+
+	__atomic_store_n(&t->queue[bottom & (TASK_QUEUE_SIZE - 1)], task,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&t->bottom, bottom + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static struct sna_task *queue_pop(struct thread *t)
+{
+	long bottom = __atomic_load_n(&t->bottom, __ATOMIC_RELAXED) - 1;
+	struct sna_task *task;
+	long top;
+
+	__atomic_store_n(&t->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&t->top, __ATOMIC_RELAXED);
+	if (top > bottom) {
+		__atomic_store_n(&t->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	task = __atomic_load_n(&t->queue[bottom & (TASK_QUEUE_SIZE - 1)],
+			       __ATOMIC_RELAXED);
+	if (top == bottom) {
+		/* Racing against the thieves for the last task */
+		if (!__atomic_compare_exchange_n(&t->top, &top, top + 1, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			task = NULL;
+		__atomic_store_n(&t->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+
+	return task;
+}
+
+static struct sna_task *queue_steal(struct thread *t)
+{
+	struct sna_task *task;
+	long top, bottom;
+
+	top = __atomic_load_n(&t->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&t->bottom, __ATOMIC_ACQUIRE);
+	if (top >= bottom)
+		return NULL;
+
+	task = __atomic_load_n(&t->queue[top & (TASK_QUEUE_SIZE - 1)],
+			       __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&t->top, &top, top + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+
+	return task;
+}
+
+static struct sna_task *find_task(struct thread *t)
+{
+	struct sna_task *task;
+	int n, i;
+
+	task = queue_pop(t);
+	if (task)
+		return task;
+
+	n = t - threads;
+	for (i = 1; i < max_threads; i++) {
+		if (++n == max_threads)
+			n = 0;
+
+		task = queue_steal(&threads[n]);
+		if (task)
+			return task;
+	}
+
+	return NULL;
+}
+
+static bool has_tasks(void)
+{
+	int n;
+
+	for (n = 0; n < max_threads; n++) {
+		if (__atomic_load_n(&threads[n].top, __ATOMIC_ACQUIRE) <
+		    __atomic_load_n(&threads[n].bottom, __ATOMIC_ACQUIRE))
+			return true;
+	}
+
+	return false;
+}
+
+static void wake_workers(void)
+{
+	__atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST))
+		futex_wake(&epoch, INT_MAX);
+}
+
+static void task_done(struct sna_task_group *group)
+{
+	if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		futex_wake(&group->pending, INT_MAX);
+}
+
+static void task_run(struct thread *t, struct sna_task *task)
+{
+	t->current = task;
+	task->func(task->arg, task->n);
+	t->current = NULL;
+
+	task_done(task->group);
+}
+
+static void task_submit(struct sna_task *task)
+{
+	struct thread *t = &threads[0];
+
+	/* Make room by executing the most recent task ourselves */
+	while (!queue_push(t, task)) {
+		struct sna_task *local = queue_pop(t);
+		if (local)
+			task_run(t, local);
+	}
+}
+
+static void group_wait(struct sna_task_group *group)
+{
+	struct thread *t = &threads[0];
+	int pending;
+
+	while ((pending = __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE))) {
+		struct sna_task *task = find_task(t);
+		if (task)
+			task_run(t, task);
+		else
+			futex_wait(&group->pending, pending);
+	}
+}
+
 static void *__run__(void *arg)
 {
 	struct thread *t = arg;
 	sigset_t signals;
+	int spin = 0;
 
 	/* Disable all signals in the slave threads as X uses them for IO */
 	sigfillset(&signals);
@@ -64,76 +287,245 @@ static void *__run__(void *arg)
 	sigdelset(&signals, SIGSEGV);
 	pthread_sigmask(SIG_SETMASK, &signals, NULL);
 
-	pthread_mutex_lock(&t->mutex);
-	while (1) {
-		while (t->func == NULL)
-			pthread_cond_wait(&t->cond, &t->mutex);
-		pthread_mutex_unlock(&t->mutex);
+	while (!__atomic_load_n(&quit, __ATOMIC_ACQUIRE)) {
+		struct sna_task *task;
+		int seqno;
 
-		assert(t->func);
-		t->func(t->arg);
+		task = find_task(t);
+		if (task) {
+			task_run(t, task);
+			spin = 0;
+			continue;
+		}
 
-		pthread_mutex_lock(&t->mutex);
-		t->arg = NULL;
-		t->func = NULL;
-		pthread_cond_signal(&t->cond);
+		if (++spin < TASK_SPIN) {
+			cpu_relax();
+			continue;
+		}
+
+		/* Announce ourselves before the final check for work, so
+		 * that either we see the new task or the submitter sees
+		 * us asleep and bumps the epoch to wake us.
+		 */
+		seqno = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+		if (!has_tasks() && !__atomic_load_n(&quit, __ATOMIC_SEQ_CST))
+			futex_wait(&epoch, seqno);
+		__atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+		spin = 0;
 	}
-	pthread_mutex_unlock(&t->mutex);
 
 	return NULL;
 }
 
-#if defined(__GNUC__)
-#define popcount(x) __builtin_popcount(x)
-#else
-static int popcount(unsigned int x)
+static struct sna_threads_info info;
+
+static int read_file(const char *path, char *buf, int len)
+{
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret <= 0)
+		return 0;
+
+	buf[ret] = '\0';
+	return ret;
+}
+
+/* Parse a sysfs cpu list, e.g. "0-3,8-11" */
+static bool parse_cpu_list(const char *str, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	while (*str && *str != '\n') {
+		long first, last;
+		char *end;
+
+		first = last = strtol(str, &end, 10);
+		if (end == str)
+			return false;
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str)
+				return false;
+		}
+
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+
+		str = end;
+		if (*str == ',')
+			str++;
+	}
+
+	return true;
+}
+
+static bool read_cpu_list(const char *path, cpu_set_t *set)
 {
-	int count = 0;
+	char buf[1024];
 
-	while (x) {
-		count += x&1;
-		x >>= 1;
+	return read_file(path, buf, sizeof(buf)) && parse_cpu_list(buf, set);
+}
+
+static int first_cpu(const cpu_set_t *set)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, set))
+			return cpu;
+
+	return -1;
+}
+
+/* Count each physical core once, by its first hardware thread that we
+ * are allowed to run upon. Hybrid layouts fall out naturally, as the
+ * small cores simply have no SMT siblings.
+ */
+static int count_cores(const cpu_set_t *cpus, cpu_set_t *cores)
+{
+	char path[128];
+	int cpu, count = 0;
+
+	CPU_ZERO(cores);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		cpu_set_t siblings;
+
+		if (!CPU_ISSET(cpu, cpus))
+			continue;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+			 cpu);
+		if (!read_cpu_list(path, &siblings))
+			return 0;
+
+		CPU_AND(&siblings, &siblings, cpus);
+		if (first_cpu(&siblings) == cpu) {
+			CPU_SET(cpu, cores);
+			count++;
+		}
 	}
 
+	DBG(("%s: %d cores across %d cpus\n",
+	     __FUNCTION__, count, CPU_COUNT(cpus)));
 	return count;
 }
-#endif
 
-static int
-num_cores(void)
-{
-	FILE *file = fopen("/proc/cpuinfo", "r");
-	int count = 0;
-	if (file) {
-		size_t len = 0;
-		char *line = NULL;
-		uint32_t processors = 0, cores = 0;
-		while (getline(&line, &len, file) != -1) {
-			int id;
-			if (sscanf(line, "physical id : %d", &id) == 1) {
-				if (id >= 32)
-					continue;
-				processors |= 1 << id;
-			} else if (sscanf(line, "core id : %d", &id) == 1) {
-				if (id >= 32)
-					continue;
-				cores |= 1 << id;
-			}
+/* Find the set of cpus sharing the last level cache with cpu */
+static bool llc_cpus(int cpu, cpu_set_t *set)
+{
+	char path[128], buf[16];
+	int index, level, best = 0;
+
+	for (index = 0; index < 8; index++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+			 cpu, index);
+		if (!read_file(path, buf, sizeof(buf)))
+			break;
+
+		level = atoi(buf);
+		if (level <= best)
+			continue;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+			 cpu, index);
+		if (read_cpu_list(path, set))
+			best = level;
+	}
+
+	return best;
+}
+
+/* The cgroup v2 cpu.max quota, rounded up to whole cpus. Every
+ * ancestor may impose its own limit, so walk back up to the root
+ * keeping the tightest.
+ */
+static int cgroup_cpus(void)
+{
+	char buf[4096], path[4096 + 32], max[64];
+	char *cg, *end;
+	int limit = 0;
+
+	if (!read_file("/proc/self/cgroup", buf, sizeof(buf)))
+		return 0;
+
+	if (strncmp(buf, "0::", 3) == 0)
+		cg = buf + 3;
+	else if ((cg = strstr(buf, "\n0::")))
+		cg += 4;
+	else
+		return 0;
+
+	end = strchr(cg, '\n');
+	if (end)
+		*end = '\0';
+	if (*cg != '/')
+		return 0;
+
+	for (;;) {
+		long long quota, period;
+
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cg);
+		if (read_file(path, max, sizeof(max)) &&
+		    sscanf(max, "%lld %lld", &quota, &period) == 2 &&
+		    quota > 0 && period > 0) {
+			int n = (quota + period - 1) / period;
+			DBG(("%s: %s limited to %d cpus\n", __FUNCTION__, cg, n));
+			if (limit == 0 || n < limit)
+				limit = n;
 		}
-		free(line);
-		fclose(file);
 
-		DBG(("%s: processors=0x%08x, cores=0x%08x\n",
-		     __FUNCTION__, processors, cores));
+		end = strrchr(cg, '/');
+		if (end == cg) {
+			if (cg[1] == '\0')
+				break;
+			cg[1] = '\0';
+		} else
+			*end = '\0';
+	}
 
-		count = popcount(processors) * popcount(cores);
+	return limit;
+}
+
+/* Choose the cores for the pool. threads[0] is the main thread, which
+ * we leave unpinned, and each worker gets its own physical core, all
+ * sharing the same LLC as where the main thread is currently running.
+ */
+static int pin_cores(const cpu_set_t *cores, int *cpu)
+{
+	cpu_set_t llc;
+	int main_cpu, count, n;
+
+	main_cpu = sched_getcpu();
+	if (main_cpu < 0 || !llc_cpus(main_cpu, &llc))
+		return 0;
+
+	CPU_AND(&llc, &llc, cores);
+	count = 0;
+	for (n = 0; n < CPU_SETSIZE; n++) {
+		if (CPU_ISSET(n, &llc) && n != main_cpu)
+			cpu[++count] = n;
 	}
-	return count;
+	cpu[0] = main_cpu;
+
+	return count + 1;
 }
 
-void sna_threads_init(void)
+void sna_threads_init(int num_threads, bool pin)
 {
-	int n;
+	cpu_set_t cpus, cores;
+	int cpu[CPU_SETSIZE];
+	int n, num_pinned = 0;
 
 	if (max_threads != -1)
 		return;
@@ -141,37 +533,99 @@ void sna_threads_init(void)
 	if (valgrind_active())
 		goto bail;
 
-	max_threads = num_cores();
-	if (max_threads == 0)
-		max_threads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus)) {
+		int count = sysconf(_SC_NPROCESSORS_ONLN);
+
+		CPU_ZERO(&cpus);
+		for (n = 0; n < count && n < CPU_SETSIZE; n++)
+			CPU_SET(n, &cpus);
+	}
+
+	info.cpus = CPU_COUNT(&cpus);
+	info.cores = count_cores(&cpus, &cores);
+	if (info.cores == 0) {
+		/* No topology, assume hyperthreading as before */
+		info.cores = (info.cpus + 1) / 2;
+		pin = false;
+	}
+	info.quota = cgroup_cpus();
+
+	max_threads = info.cores;
+	if (info.quota && info.quota < max_threads)
+		max_threads = info.quota;
+
+	if (num_threads > 0)
+		max_threads = num_threads;
+	if (max_threads > info.cpus)
+		max_threads = info.cpus;
+
+	if (pin) {
+		num_pinned = pin_cores(&cores, cpu);
+		if (num_pinned > 1) {
+			if (max_threads > num_pinned)
+				max_threads = num_pinned;
+			info.pinned = true;
+		}
+	}
+
+	info.threads = max_threads;
 	if (max_threads <= 1)
 		goto bail;
 
-	DBG(("%s: creating a thread pool of %d threads\n",
-	     __func__, max_threads));
+	DBG(("%s: creating a thread pool of %d threads (cpus=%d, cores=%d, quota=%d, pinned? %d)\n",
+	     __func__, max_threads, info.cpus, info.cores, info.quota, info.pinned));
 
-	threads = malloc (sizeof(threads[0])*max_threads);
-	if (threads == NULL)
+	if (posix_memalign((void **)&threads, 64,
+			   sizeof(threads[0])*max_threads))
 		goto bail;
 
+	memset(threads, 0, sizeof(threads[0])*max_threads);
+	threads[0].thread = pthread_self();
+
 	for (n = 1; n < max_threads; n++) {
-		pthread_mutex_init(&threads[n].mutex, NULL);
-		pthread_cond_init(&threads[n].cond, NULL);
+		pthread_attr_t attr;
+		int ret;
 
-		threads[n].func = NULL;
-		threads[n].arg = NULL;
-		if (pthread_create(&threads[n].thread, NULL,
-				   __run__, &threads[n]))
+		pthread_attr_init(&attr);
+		if (info.pinned) {
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			CPU_SET(cpu[n], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+
+		ret = pthread_create(&threads[n].thread, &attr,
+				     __run__, &threads[n]);
+		pthread_attr_destroy(&attr);
+		if (ret)
 			goto bail;
 	}
 
-	threads[0].thread = pthread_self();
 	return;
 
 bail:
+	info.threads = 1;
+	info.pinned = false;
 	max_threads = 0;
 }
 
+void sna_threads_get_info(struct sna_threads_info *out)
+{
+	*out = info;
+}
+
+static void thread_run(void *arg, int n)
+{
+	struct thread *t = arg;
+	void (*func)(void *arg) = t->func;
+
+	func(t->arg);
+
+	t->arg = NULL;
+	t->func = NULL;
+}
+
 void sna_threads_run(int id, void (*func)(void *arg), void *arg)
 {
 	assert(max_threads > 0);
@@ -180,58 +634,138 @@ void sna_threads_run(int id, void (*func)(void *arg), void *arg)
 
 	assert(threads[id].func == NULL);
 
-	pthread_mutex_lock(&threads[id].mutex);
 	threads[id].func = func;
 	threads[id].arg = arg;
-	pthread_cond_signal(&threads[id].cond);
-	pthread_mutex_unlock(&threads[id].mutex);
+
+	threads[id].task.func = thread_run;
+	threads[id].task.arg = &threads[id];
+	threads[id].task.n = id;
+	threads[id].task.group = &default_group;
+
+	__atomic_add_fetch(&default_group.pending, 1, __ATOMIC_RELAXED);
+	task_submit(&threads[id].task);
+	wake_workers();
+}
+
+/* Whatever was carved out of the arena by the frames we are about to
+ * unwind will never be returned, and whilst the count stays raised the
+ * arena can neither be rewound nor grown. Converters set up outside the
+ * sigtrap are torn down immediately after it, before anything else is
+ * allocated, so their late release into the rewound arena is harmless.
+ */
+static void arena_trap(struct sna_arena *a)
+{
+	DBG(("%s: abandoning %d allocations, %ld bytes\n",
+	     __FUNCTION__, a->count, (long)a->used));
+	a->count = 0;
+	a->used = 0;
+}
+
+/* A cancelled sna_threads_run() never reaches thread_run(), so release
+ * its slot for the next submission here instead.
+ */
+static void task_cancel(struct sna_task *task)
+{
+	if (task->func == thread_run) {
+		struct thread *t = task->arg;
+
+		t->func = NULL;
+		t->arg = NULL;
+	}
+
+	task_done(task->group);
+}
+
+/* The main thread is about to longjmp out of its sigtrap, discarding
+ * the stack of whoever queued the outstanding tasks. Cancel everything
+ * still in our queue, abandon the task that faulted and wait for the
+ * workers to finish what they have already started, so that no task
+ * outlives its group or arguments. Nothing is run here, as a second
+ * fault inside the handler would be fatal.
+ */
+static void main_trap(int sig)
+{
+	struct thread *t = &threads[0];
+	struct sna_task_group *group = parallel_group;
+	struct sna_task *task;
+	int pending;
+
+	task = t->current;
+	if (task) {
+		t->current = NULL;
+		task_cancel(task);
+	}
+
+	while ((task = queue_pop(t)))
+		task_cancel(task);
+
+	while ((pending = __atomic_load_n(&default_group.pending, __ATOMIC_ACQUIRE)))
+		futex_wait(&default_group.pending, pending);
+
+	if (group) {
+		while ((pending = __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE)))
+			futex_wait(&group->pending, pending);
+
+		/* Leave a dead worker to be reaped by the next wait */
+		if (group->failed)
+			default_group.failed = group->failed;
+		parallel_group = NULL;
+
+		/* and free any task array once we are out of the handler */
+		parallel_stale = parallel_tasks;
+		parallel_tasks = NULL;
+	}
 }
 
 void sna_threads_trap(int sig)
 {
 	pthread_t t = pthread_self();
+	struct sna_task *task;
 	int n;
 
-	if (max_threads == 0)
+	if (max_threads <= 0) {
+		arena_trap(&main_arena);
 		return;
+	}
 
-	if (t == threads[0].thread)
+	if (t == threads[0].thread) {
+		main_trap(sig);
+		arena_trap(&main_arena);
 		return;
+	}
 
 	for (n = 1; threads[n].thread != t; n++)
 		;
 
 	ERR(("%s: thread[%d] caught signal %d\n", __func__, n, sig));
 
-	pthread_mutex_lock(&threads[n].mutex);
-	threads[n].arg = (void *)(intptr_t)sig;
-	threads[n].func = NULL;
-	pthread_cond_signal(&threads[n].cond);
-	pthread_mutex_unlock(&threads[n].mutex);
+	/* Report the failure to whoever is waiting upon the task and
+	 * let the remaining workers drain the queues.
+	 */
+	task = threads[n].current;
+	if (task) {
+		threads[n].current = NULL;
+		__atomic_store_n(&task->group->failed, sig, __ATOMIC_RELAXED);
+		task_done(task->group);
+	}
 
 	pthread_exit(&sig);
 }
 
 void sna_threads_wait(void)
 {
-	int n;
+	int sig;
 
 	assert(max_threads > 0);
 	assert(pthread_self() == threads[0].thread);
 
-	for (n = 1; n < max_threads; n++) {
-		if (threads[n].func != NULL) {
-			pthread_mutex_lock(&threads[n].mutex);
-			while (threads[n].func)
-				pthread_cond_wait(&threads[n].cond, &threads[n].mutex);
-			pthread_mutex_unlock(&threads[n].mutex);
-		}
+	group_wait(&default_group);
 
-		if (threads[n].arg != NULL) {
-			DBG(("%s: thread[%d] died from signal %d\n", __func__, n, (int)(intptr_t)threads[n].arg));
-			sna_threads_kill();
-			return;
-		}
+	sig = default_group.failed;
+	if (sig) {
+		DBG(("%s: thread died from signal %d\n", __func__, sig));
+		default_group.failed = 0;
+		sna_threads_kill();
 	}
 }
 
@@ -243,15 +777,215 @@ void sna_threads_kill(void)
 	assert(max_threads > 0);
 	assert(pthread_self() == threads[0].thread);
 
-	for (n = 1; n < max_threads; n++)
-		pthread_cancel(threads[n].thread);
+	__atomic_store_n(&quit, 1, __ATOMIC_SEQ_CST);
+	wake_workers();
 
-	for (n = 1; n < max_threads; n++)
+	for (n = 1; n < max_threads; n++) {
 		pthread_join(threads[n].thread, NULL);
+		free(threads[n].arena.base);
+	}
 
 	max_threads = 0;
 }
 
+static struct sna_arena *current_arena(void)
+{
+	pthread_t t;
+	int n;
+
+	if (max_threads <= 0)
+		return &main_arena;
+
+	t = pthread_self();
+	for (n = 1; n < max_threads; n++)
+		if (threads[n].thread == t)
+			return &threads[n].arena;
+
+	return &main_arena;
+}
+
+/* Scratch memory for the rasterisers. Each thread carves allocations
+ * out of its own arena, which is rewound once everything handed out has
+ * been returned, so a converter that is set up and torn down for every
+ * request no longer hits malloc (and its locks) each time. Requests
+ * that do not fit whilst the arena is in use, or that are simply too
+ * large, fall back to malloc. Memory must be released by the same
+ * thread that allocated it.
+ */
+void *sna_scratch_alloc(size_t size)
+{
+	struct sna_arena *a = current_arena();
+	void *ptr;
+
+	size = ALIGN(size, 64);
+	if (a->used + size > a->size) {
+		size_t new_size;
+
+		if (a->count || size > ARENA_MAX)
+			return malloc(size);
+
+		new_size = a->size ? a->size : ARENA_MIN;
+		while (new_size < size)
+			new_size *= 2;
+
+		DBG(("%s: growing arena from %ld to %ld bytes\n",
+		     __FUNCTION__, (long)a->size, (long)new_size));
+
+		free(a->base);
+		a->size = 0;
+		if (posix_memalign((void **)&a->base, 64, new_size)) {
+			a->base = NULL;
+			return malloc(size);
+		}
+		a->size = new_size;
+	}
+
+	ptr = a->base + a->used;
+	a->used += size;
+	a->count++;
+	return ptr;
+}
+
+void sna_scratch_free(void *ptr)
+{
+	struct sna_arena *a = current_arena();
+
+	if ((char *)ptr >= a->base && (char *)ptr < a->base + a->size) {
+		/* already rewound by sna_threads_trap()? */
+		if (a->count && --a->count == 0)
+			a->used = 0;
+	} else
+		free(ptr);
+}
+
+/* Run func(arg, n) for every n in [0, count), spreading the calls across
+ * the pool. Any number of tasks may be queued; idle threads steal them
+ * as they become free, so there is no need to match count to the
+ * number of threads. The caller is expected to hold the sigtrap; should
+ * it fire, sna_threads_trap() waits for the outstanding tasks before
+ * we are unwound.
+ */
+void sna_threads_parallel_for(int count,
+			      void (*func)(void *arg, int n),
+			      void *arg)
+{
+	struct sna_task_group group;
+	struct sna_task stack[64], *tasks = stack;
+	int n;
+
+	if (count <= 0)
+		return;
+
+	if (max_threads <= 1 || count == 1)
+		goto serial;
+
+	assert(pthread_self() == threads[0].thread);
+	assert(parallel_group == NULL);
+
+	free(parallel_stale);
+	parallel_stale = NULL;
+
+	if (count > (int)ARRAY_SIZE(stack)) {
+		tasks = malloc(sizeof(*tasks) * count);
+		if (tasks == NULL)
+			goto serial;
+		parallel_tasks = tasks;
+	}
+
+	DBG(("%s: queuing %d tasks\n", __FUNCTION__, count));
+
+	/* Only count the tasks once they are queued, so that should we be
+	 * trapped whilst making room in the queue, sna_threads_trap()
+	 * does not wait for those we never submitted. A worker may finish
+	 * a task before we count it, but nobody waits upon the group until
+	 * the count is complete.
+	 */
+	group.pending = 0;
+	group.failed = 0;
+	parallel_group = &group;
+
+	for (n = 0; n < count; n++) {
+		tasks[n].func = func;
+		tasks[n].arg = arg;
+		tasks[n].n = n;
+		tasks[n].group = &group;
+
+		task_submit(&tasks[n]);
+		__atomic_add_fetch(&group.pending, 1, __ATOMIC_RELAXED);
+		if (n == 0)
+			wake_workers();
+	}
+	wake_workers();
+
+	group_wait(&group);
+	parallel_group = NULL;
+	parallel_tasks = NULL;
+
+	if (tasks != stack)
+		free(tasks);
+
+	if (group.failed) {
+		DBG(("%s: thread died from signal %d\n",
+		     __FUNCTION__, group.failed));
+		sna_threads_kill();
+	}
+	return;
+
+serial:
+	for (n = 0; n < count; n++)
+		func(arg, n);
+}
+
+struct threads_box {
+	void (*func)(void *arg, const BoxRec *box);
+	void *arg;
+	BoxRec extents;
+	int tile_width, tile_height;
+	int num_x;
+};
+
+static void threads_box(void *arg, int n)
+{
+	struct threads_box *t = arg;
+	BoxRec box;
+
+	box.x1 = t->extents.x1 + (n % t->num_x) * t->tile_width;
+	box.y1 = t->extents.y1 + (n / t->num_x) * t->tile_height;
+	box.x2 = box.x1 + t->tile_width;
+	box.y2 = box.y1 + t->tile_height;
+	if (box.x2 > t->extents.x2)
+		box.x2 = t->extents.x2;
+	if (box.y2 > t->extents.y2)
+		box.y2 = t->extents.y2;
+
+	t->func(t->arg, &box);
+}
+
+/* Cut the extents into tiles of tile_width x tile_height and call
+ * func(arg, tile) upon each in parallel.
+ */
+void sna_threads_for_each_box(const BoxRec *extents,
+			      int tile_width, int tile_height,
+			      void (*func)(void *arg, const BoxRec *box),
+			      void *arg)
+{
+	struct threads_box data;
+	int num_y;
+
+	assert(extents->x2 > extents->x1 && extents->y2 > extents->y1);
+	assert(tile_width > 0 && tile_height > 0);
+
+	data.func = func;
+	data.arg = arg;
+	data.extents = *extents;
+	data.tile_width = tile_width;
+	data.tile_height = tile_height;
+	data.num_x = (extents->x2 - extents->x1 + tile_width - 1) / tile_width;
+	num_y = (extents->y2 - extents->y1 + tile_height - 1) / tile_height;
+
+	sna_threads_parallel_for(data.num_x * num_y, threads_box, &data);
+}
+
 int sna_use_threads(int width, int height, int threshold)
 {
 	int num_threads;
@@ -286,14 +1020,16 @@ struct thread_composite {
 	uint16_t width, height;
 };
 
-static void thread_composite(void *arg)
+static void thread_composite(void *arg, const BoxRec *box)
 {
 	struct thread_composite *t = arg;
 	pixman_image_composite(t->op, t->src, t->mask, t->dst,
-			       t->src_x, t->src_y,
-			       t->mask_x, t->mask_y,
-			       t->dst_x, t->dst_y,
-			       t->width, t->height);
+			       t->src_x + box->x1 - t->dst_x,
+			       t->src_y + box->y1 - t->dst_y,
+			       t->mask_x + box->x1 - t->dst_x,
+			       t->mask_y + box->y1 - t->dst_y,
+			       box->x1, box->y1,
+			       box->x2 - box->x1, box->y2 - box->y1);
 }
 
 void sna_image_composite(pixman_op_t        op,
@@ -322,54 +1058,295 @@ void sna_image_composite(pixman_op_t        op,
 			sigtrap_put();
 		}
 	} else {
-		struct thread_composite data[num_threads];
-		int y, dy, n;
+		struct thread_composite data;
+		BoxRec extents;
+		int dy;
+
+		/* Hand out several bands per thread so that a slow band
+		 * can be balanced by the others stealing the remainder.
+		 */
+		dy = (height + 4*num_threads - 1) / (4*num_threads);
+
+		DBG(("%s: using %d threads for compositing %dx%d in bands of %d rows\n",
+		     __FUNCTION__, num_threads, width, height, dy));
+
+		data.op = op;
+		data.src = src;
+		data.mask = mask;
+		data.dst = dst;
+		data.src_x = src_x;
+		data.src_y = src_y;
+		data.mask_x = mask_x;
+		data.mask_y = mask_y;
+		data.dst_x = dst_x;
+		data.dst_y = dst_y;
+		data.width = width;
+		data.height = height;
+
+		extents.x1 = dst_x;
+		extents.y1 = dst_y;
+		extents.x2 = dst_x + width;
+		extents.y2 = dst_y + height;
 
-		DBG(("%s: using %d threads for compositing %dx%d\n",
-		     __FUNCTION__, num_threads, width, height));
+		if (sigtrap_get() == 0) {
+			sna_threads_for_each_box(&extents, width, dy,
+						 thread_composite, &data);
+			sigtrap_put();
+		} else
+			sna_threads_kill();
+	}
+}
 
-		y = dst_y;
-		dy = (height + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * dy >= height;
+struct thread_memcpy_boxes {
+	memcpy_box_func func;
+	const void *src;
+	void *dst;
+	int bpp;
+	int32_t src_stride, dst_stride;
+	int16_t src_dx, src_dy;
+	int16_t dst_dx, dst_dy;
+	const BoxRec *box;
+	int n;
+	int16_t y1, y2;
+};
 
-		data[0].op = op;
+static void thread_memcpy_boxes(void *arg)
+{
+	struct thread_memcpy_boxes *t = arg;
+	const BoxRec *box = t->box;
+	int n = t->n;
+
+	do {
+		int16_t y1 = box->y1 > t->y1 ? box->y1 : t->y1;
+		int16_t y2 = box->y2 < t->y2 ? box->y2 : t->y2;
+
+		if (y2 > y1)
+			t->func(t->src, t->dst, t->bpp,
+				t->src_stride, t->dst_stride,
+				box->x1 + t->src_dx, y1 + t->src_dy,
+				box->x1 + t->dst_dx, y1 + t->dst_dy,
+				box->x2 - box->x1, y2 - y1);
+		box++;
+	} while (--n);
+}
+
+/* Split the boxes into horizontal bands and copy each band on its own
+ * thread. The bands start on a destination tile row and their height
+ * is rounded up to a multiple of 32 rows, the height of a Y tile, so
+ * that neighbouring threads do not write into the same tile rows. The
+ * caller is expected to hold the sigtrap.
+ */
+void sna_memcpy_boxes(int num_threads, memcpy_box_func func,
+		      const void *src, void *dst, int bpp,
+		      int32_t src_stride, int32_t dst_stride,
+		      int16_t src_dx, int16_t src_dy,
+		      int16_t dst_dx, int16_t dst_dy,
+		      const BoxRec *box, int n)
+{
+	int y1, y2, y, dy, i;
+
+	assert(n > 0);
+
+	if (num_threads > max_threads)
+		num_threads = max_threads;
+	if (num_threads < 1)
+		num_threads = 1;
+
+	y1 = box[0].y1;
+	y2 = box[0].y2;
+	for (i = 1; i < n; i++) {
+		if (box[i].y1 < y1)
+			y1 = box[i].y1;
+		if (box[i].y2 > y2)
+			y2 = box[i].y2;
+	}
+
+	/* Align the first band to the tile row containing it */
+	y1 = ((y1 + dst_dy) & ~31) - dst_dy;
+
+	dy = ALIGN((y2 - y1 + num_threads - 1) / num_threads, 32);
+	if (num_threads <= 1 || dy >= y2 - y1) {
+		do {
+			func(src, dst, bpp,
+			     src_stride, dst_stride,
+			     box->x1 + src_dx, box->y1 + src_dy,
+			     box->x1 + dst_dx, box->y1 + dst_dy,
+			     box->x2 - box->x1, box->y2 - box->y1);
+			box++;
+		} while (--n);
+	} else {
+		struct thread_memcpy_boxes data[num_threads];
+
+		num_threads = (y2 - y1 + dy - 1) / dy;
+		DBG(("%s: using %d threads for copying %d boxes, %d rows\n",
+		     __FUNCTION__, num_threads, n, y2 - y1));
+
+		data[0].func = func;
 		data[0].src = src;
-		data[0].mask = mask;
 		data[0].dst = dst;
-		data[0].src_x = src_x;
-		data[0].src_y = src_y;
-		data[0].mask_x = mask_x;
-		data[0].mask_y = mask_y;
-		data[0].dst_x = dst_x;
-		data[0].dst_y = y;
-		data[0].width = width;
-		data[0].height = dy;
+		data[0].bpp = bpp;
+		data[0].src_stride = src_stride;
+		data[0].dst_stride = dst_stride;
+		data[0].src_dx = src_dx;
+		data[0].src_dy = src_dy;
+		data[0].dst_dx = dst_dx;
+		data[0].dst_dy = dst_dy;
+		data[0].box = box;
+		data[0].n = n;
+
+		y = y1;
+		for (i = 1; i < num_threads; i++) {
+			data[i] = data[0];
+			data[i].y1 = y;
+			data[i].y2 = y + dy;
+			y += dy;
+
+			sna_threads_run(i, thread_memcpy_boxes, &data[i]);
+		}
 
-		if (sigtrap_get() == 0) {
-			for (n = 1; n < num_threads; n++) {
-				data[n] = data[0];
-				data[n].src_y += y - dst_y;
-				data[n].mask_y += y - dst_y;
-				data[n].dst_y = y;
-				y += dy;
+		assert(y < y2);
+		data[0].y1 = y;
+		data[0].y2 = y2;
+		thread_memcpy_boxes(&data[0]);
 
-				sna_threads_run(n, thread_composite, &data[n]);
-			}
+		sna_threads_wait();
+	}
+}
 
-			assert(y < dst_y + height);
-			if (y + dy > dst_y + height)
-				dy = dst_y + height - y;
+struct thread_glyphs {
+	pixman_op_t op;
+	pixman_image_t *src; /* NULL when adding the glyphs into a mask */
+	pixman_image_t *white;
+	pixman_image_t *dst;
+	int16_t src_x, src_y;
 
-			data[0].src_y += y - dst_y;
-			data[0].mask_y += y - dst_y;
-			data[0].dst_y = y;
-			data[0].height = dy;
+	const struct sna_glyph_item *items;
+	int *index, *start;
+	int y1, y2, band_height;
+};
 
-			thread_composite(&data[0]);
+static void thread_glyphs(void *arg, int n)
+{
+	const struct thread_glyphs *b = arg;
+	int y1 = b->y1 + n * b->band_height;
+	int y2 = MIN(y1 + b->band_height, b->y2);
+	int i;
+
+	for (i = b->start[n]; i < b->start[n+1]; i++) {
+		const struct sna_glyph_item *g = &b->items[b->index[i]];
+		int gy1 = MAX(g->y, y1);
+		int gy2 = MIN(g->y + g->height, y2);
+		int dy = gy1 - g->y;
+
+		assert(gy2 > gy1);
+		if (b->src)
+			pixman_image_composite(b->op,
+					       b->src, g->image, b->dst,
+					       b->src_x + g->x, b->src_y + gy1,
+					       0, dy,
+					       g->x, gy1,
+					       g->width, gy2 - gy1);
+		else if (g->convert)
+			pixman_image_composite(PIXMAN_OP_ADD,
+					       b->white, g->image, b->dst,
+					       0, 0,
+					       0, dy,
+					       g->x, gy1,
+					       g->width, gy2 - gy1);
+		else
+			pixman_image_composite(PIXMAN_OP_ADD,
+					       g->image, NULL, b->dst,
+					       0, dy,
+					       0, 0,
+					       g->x, gy1,
+					       g->width, gy2 - gy1);
+	}
+}
 
-			sna_threads_wait();
-			sigtrap_put();
-		} else
-			sna_threads_kill();
+/* Composite the glyphs in horizontal bands of [y1, y2), one band per
+ * task, keeping their original order within each band so that the
+ * result is identical to the serial loop. A glyph straddling a band
+ * boundary costs an extra composite, so the bands are kept at least
+ * GLYPH_BAND_MIN rows tall. Without a src, the glyphs are added into
+ * dst, a mask, using white for those of a different format. Returns
+ * false if the caller should use its serial path instead. The caller
+ * is expected to hold the sigtrap.
+ */
+bool sna_image_composite_glyphs(int num_threads,
+				pixman_op_t op,
+				pixman_image_t *src,
+				int16_t src_x, int16_t src_y,
+				pixman_image_t *white,
+				pixman_image_t *dst,
+				int y1, int y2,
+				const struct sna_glyph_item *items,
+				int count)
+{
+	struct thread_glyphs b;
+	int nband, total, i, k;
+
+	assert(count > 0);
+	assert(y2 > y1);
+
+	b.op = op;
+	b.src = src;
+	b.src_x = src_x;
+	b.src_y = src_y;
+	b.white = white;
+	b.dst = dst;
+	b.items = items;
+	b.y1 = y1;
+	b.y2 = y2;
+
+	nband = 4 * num_threads;
+	b.band_height = (y2 - y1 + nband - 1) / nband;
+	if (b.band_height < GLYPH_BAND_MIN)
+		b.band_height = GLYPH_BAND_MIN;
+	nband = (y2 - y1 + b.band_height - 1) / b.band_height;
+	if (nband < 2)
+		return false;
+
+	b.start = calloc(nband + 1, sizeof(int));
+	if (b.start == NULL)
+		return false;
+
+	total = 0;
+	for (i = 0; i < count; i++) {
+		const struct sna_glyph_item *g = &items[i];
+		int first = MAX(g->y - y1, 0) / b.band_height;
+		int last = MIN(g->y + g->height - y1, y2 - y1);
+		last = (last - 1) / b.band_height;
+		for (k = first; k <= last; k++)
+			b.start[k+1]++;
+		total += last - first + 1;
+	}
+
+	b.index = malloc(total * sizeof(int));
+	if (b.index == NULL) {
+		free(b.start);
+		return false;
+	}
+
+	for (k = 0; k < nband; k++)
+		b.start[k+1] += b.start[k];
+	for (i = 0; i < count; i++) {
+		const struct sna_glyph_item *g = &items[i];
+		int first = MAX(g->y - y1, 0) / b.band_height;
+		int last = MIN(g->y + g->height - y1, y2 - y1);
+		last = (last - 1) / b.band_height;
+		for (k = first; k <= last; k++)
+			b.index[b.start[k]++] = i;
 	}
+	for (k = nband; k > 0; k--)
+		b.start[k] = b.start[k-1];
+	b.start[0] = 0;
+
+	DBG(("%s: %d glyphs (%d placements) in %d bands of %d rows\n",
+	     __FUNCTION__, count, total, nband, b.band_height));
+
+	sna_threads_parallel_for(nband, thread_glyphs, &b);
+
+	free(b.index);
+	free(b.start);
+	return true;
 }
@@ -140,6 +140,176 @@ bool trapezoids_bounds(int n, const xTrapezoid *t, BoxPtr box)
 	return box->x2 > box->x1 && box->y2 > box->y1;
 }
 
+/*
+ * Dense rows for the precise and imprecise scan converters. The row is
+ * held as two arrays of int16, covered_height and uncovered_area, and the
+ * coverage of pixel x is the running sum of covered_height up to and
+ * including x (scaled to the grid width) less its own uncovered_area.
+ * The running sum is a prefix scan, so a register of 8 or 16 cells is
+ * resolved in log2 shifted adds.
+ */
+static void
+cell_row_coverage__generic(int16_t *covered_height, int16_t *uncovered_area,
+			   int width, int cover, int scale)
+{
+	while (width--) {
+		cover += *covered_height * scale;
+		*covered_height++ = 0;
+		*uncovered_area = cover - *uncovered_area;
+		uncovered_area++;
+	}
+}
+
+#if defined(sse2)
+#pragma GCC push_options
+#pragma GCC target("sse2,fpmath=sse")
+#include <emmintrin.h>
+
+static force_inline __m128i prefix_sum_epi16(__m128i v)
+{
+	v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+	v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+	return _mm_add_epi16(v, _mm_slli_si128(v, 8));
+}
+
+static force_inline __m128i broadcast_last_epi16(__m128i v)
+{
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+	return _mm_unpackhi_epi64(v, v);
+}
+
+static void
+cell_row_coverage__sse2(int16_t *covered_height, int16_t *uncovered_area,
+			int width, int cover, int scale)
+{
+	const __m128i s = _mm_set1_epi16(scale);
+	__m128i c = _mm_set1_epi16(cover);
+
+	while (width >= 8) {
+		__m128i h = _mm_loadu_si128((__m128i *)covered_height);
+		__m128i a = _mm_loadu_si128((__m128i *)uncovered_area);
+
+		h = _mm_add_epi16(prefix_sum_epi16(_mm_mullo_epi16(h, s)), c);
+		_mm_storeu_si128((__m128i *)uncovered_area, _mm_sub_epi16(h, a));
+		_mm_storeu_si128((__m128i *)covered_height, _mm_setzero_si128());
+		c = broadcast_last_epi16(h);
+
+		covered_height += 8;
+		uncovered_area += 8;
+		width -= 8;
+	}
+
+	if (width)
+		cell_row_coverage__generic(covered_height, uncovered_area, width,
+					   (int16_t)_mm_cvtsi128_si32(c), scale);
+}
+
+#if defined(avx2)
+#include <immintrin.h>
+
+avx2 static void
+cell_row_coverage__avx2(int16_t *covered_height, int16_t *uncovered_area,
+			int width, int cover, int scale)
+{
+	const __m256i s = _mm256_set1_epi16(scale);
+	__m256i c = _mm256_set1_epi16(cover);
+
+	while (width >= 16) {
+		__m256i h = _mm256_loadu_si256((__m256i *)covered_height);
+		__m256i a = _mm256_loadu_si256((__m256i *)uncovered_area);
+		__m256i t;
+
+		/* scan each 128-bit lane, then carry the low lane into the high */
+		h = _mm256_mullo_epi16(h, s);
+		h = _mm256_add_epi16(h, _mm256_slli_si256(h, 2));
+		h = _mm256_add_epi16(h, _mm256_slli_si256(h, 4));
+		h = _mm256_add_epi16(h, _mm256_slli_si256(h, 8));
+		t = _mm256_shufflehi_epi16(h, _MM_SHUFFLE(3, 3, 3, 3));
+		t = _mm256_unpackhi_epi64(t, t);
+		h = _mm256_add_epi16(h, _mm256_permute2x128_si256(t, t, 0x08));
+		h = _mm256_add_epi16(h, c);
+
+		_mm256_storeu_si256((__m256i *)uncovered_area, _mm256_sub_epi16(h, a));
+		_mm256_storeu_si256((__m256i *)covered_height, _mm256_setzero_si256());
+
+		t = _mm256_shufflehi_epi16(h, _MM_SHUFFLE(3, 3, 3, 3));
+		t = _mm256_unpackhi_epi64(t, t);
+		c = _mm256_permute2x128_si256(t, t, 0x11);
+
+		covered_height += 16;
+		uncovered_area += 16;
+		width -= 16;
+	}
+
+	if (width)
+		cell_row_coverage__sse2(covered_height, uncovered_area, width,
+					(int16_t)_mm256_extract_epi16(c, 0), scale);
+}
+#endif
+
+#pragma GCC pop_options
+#endif
+
+cell_row_coverage_func sna_cell_row_coverage = cell_row_coverage__generic;
+
+static cell_row_coverage_func choose_cell_row_coverage(unsigned cpu)
+{
+#if defined(avx2)
+	if ((cpu & (SSE2 | AVX2)) == (SSE2 | AVX2))
+		return cell_row_coverage__avx2;
+#endif
+#if defined(sse2)
+	if (cpu & SSE2)
+		return cell_row_coverage__sse2;
+#endif
+	return cell_row_coverage__generic;
+}
+
+void sna_trapezoids_choose_kernels(unsigned cpu)
+{
+	sna_cell_row_coverage = choose_cell_row_coverage(cpu);
+}
+
+#if HAS_DEBUG_FULL && TEST_TRAPEZOIDS
+static void st_cell_row_coverage(void)
+{
+	cell_row_coverage_func k;
+	int pass;
+
+	k = choose_cell_row_coverage(sna_cpu_detect());
+	for (pass = 0; pass < 65536; pass++) {
+		int16_t h[2][259], a[2][259];
+		int width = rand() % 259;
+		int scale = 1 + rand() % 64;
+		int cover = rand() % 512 - 256;
+		int i;
+
+		for (i = 0; i < width; i++) {
+			h[0][i] = h[1][i] = rand() % 31 - 15;
+			a[0][i] = a[1][i] = rand() % 1024 - 512;
+		}
+
+		cell_row_coverage__generic(h[0], a[0], width, cover, scale);
+		k(h[1], a[1], width, cover, scale);
+		if (memcmp(a[0], a[1], width * sizeof(int16_t)) ||
+		    memcmp(h[0], h[1], width * sizeof(int16_t)))
+			FatalError("%s: coverage mismatch, width=%d\n",
+				   __FUNCTION__, width);
+		for (i = 0; i < width; i++)
+			if (h[1][i])
+				FatalError("%s: covered_height not cleared, width=%d\n",
+					   __FUNCTION__, width);
+	}
+}
+
+void sna_trapezoids_selftest(void)
+{
+	st_cell_row_coverage();
+	precise_trapezoids_selftest();
+	imprecise_trapezoids_selftest();
+}
+#endif
+
 static bool
 trapezoids_inplace_fallback(struct sna *sna,
 			    CARD8 op,
@@ -12,6 +12,7 @@
 
 #define NO_IMPRECISE 0
 #define NO_PRECISE 0
+#define NO_DENSE_ROWS 0
 
 #if 0
 #define __DBG DBG
@@ -113,6 +114,23 @@ precise_trapezoid_span_fallback(CARD8 op, PicturePtr src, PicturePtr dst,
 				INT16 src_x, INT16 src_y,
 				int ntrap, xTrapezoid *traps);
 
+#if SNA_BENCHMARK
+/* Rasterise straight into an a8 buffer whose origin is extents->x1,y1,
+ * bypassing the Picture machinery. Only built into the CPU benchmarks.
+ */
+bool
+mono_trapezoids_mask(int ntrap, const xTrapezoid *traps,
+		     const BoxRec *extents, uint8_t *ptr, int stride);
+
+bool
+imprecise_trapezoids_mask(int ntrap, const xTrapezoid *traps,
+			  const BoxRec *extents, uint8_t *ptr, int stride);
+
+bool
+precise_trapezoids_mask(int ntrap, const xTrapezoid *traps,
+			const BoxRec *extents, uint8_t *ptr, int stride);
+#endif
+
 static inline bool is_mono(PicturePtr dst, PictFormatPtr mask)
 {
 	return mask ? mask->depth < 8 : dst->polyEdge==PolyEdgeSharp;
@@ -395,4 +413,21 @@ bool trapezoids_bounds(int n, const xTrapezoid *t, BoxPtr box);
 
 #define TOR_INPLACE_SIZE 128
 
+/* Rows touching more than 1 in 1<<CELL_DENSE_SHIFT of their pixels are
+ * accumulated densely instead of into the sparse cell list, see
+ * sna_cell_row_coverage().
+ */
+#define CELL_DENSE_MIN_WIDTH 64
+#define CELL_DENSE_SHIFT 3
+
+typedef void (*cell_row_coverage_func)(int16_t *covered_height,
+				       int16_t *uncovered_area,
+				       int width, int cover, int scale);
+extern cell_row_coverage_func sna_cell_row_coverage;
+
+#if HAS_DEBUG_FULL && TEST_TRAPEZOIDS
+void precise_trapezoids_selftest(void);
+void imprecise_trapezoids_selftest(void);
+#endif
+
 #endif /* SNA_TRAPEZOIDS_H */
@@ -155,7 +155,7 @@ mono_polygon_init(struct mono_polygon *polygon, BoxPtr box, int num_edges)
 
 	polygon->y_buckets = polygon->y_buckets_embedded;
 	if (h > ARRAY_SIZE (polygon->y_buckets_embedded)) {
-		polygon->y_buckets = malloc (h * sizeof (struct mono_edge *));
+		polygon->y_buckets = sna_scratch_alloc(h * sizeof (struct mono_edge *));
 		if (unlikely (NULL == polygon->y_buckets))
 			return false;
 	}
@@ -163,10 +163,10 @@ mono_polygon_init(struct mono_polygon *polygon, BoxPtr box, int num_edges)
 	polygon->num_edges = 0;
 	polygon->edges = polygon->edges_embedded;
 	if (num_edges > (int)ARRAY_SIZE (polygon->edges_embedded)) {
-		polygon->edges = malloc (num_edges * sizeof (struct mono_edge));
+		polygon->edges = sna_scratch_alloc(num_edges * sizeof (struct mono_edge));
 		if (unlikely (polygon->edges == NULL)) {
 			if (polygon->y_buckets != polygon->y_buckets_embedded)
-				free(polygon->y_buckets);
+				sna_scratch_free(polygon->y_buckets);
 			return false;
 		}
 	}
@@ -179,10 +179,10 @@ static void
 mono_polygon_fini(struct mono_polygon *polygon)
 {
 	if (polygon->y_buckets != polygon->y_buckets_embedded)
-		free(polygon->y_buckets);
+		sna_scratch_free(polygon->y_buckets);
 
 	if (polygon->edges != polygon->edges_embedded)
-		free(polygon->edges);
+		sna_scratch_free(polygon->edges);
 }
 
 static void
@@ -1292,6 +1292,67 @@ unbounded_pass:
 	return true;
 }
 
+#if SNA_BENCHMARK
+bool
+mono_trapezoids_mask(int ntrap, const xTrapezoid *traps,
+		     const BoxRec *extents, uint8_t *ptr, int stride)
+{
+	struct mono_inplace_fill fill;
+	struct mono mono;
+	int n;
+
+	assert((stride & 3) == 0);
+
+	mono.clip.extents.x1 = mono.clip.extents.y1 = 0;
+	mono.clip.extents.x2 = extents->x2 - extents->x1;
+	mono.clip.extents.y2 = extents->y2 - extents->y1;
+	mono.clip.data = NULL;
+
+	DBG(("%s: ntrap=%d, mask (%dx%d), stride %d\n",
+	     __FUNCTION__, ntrap,
+	     mono.clip.extents.x2, mono.clip.extents.y2, stride));
+
+	mono.sna = NULL;
+	if (!mono_init(&mono, 2*ntrap))
+		return false;
+
+	for (n = 0; n < ntrap; n++) {
+		if (!xTrapezoidValid(&traps[n]))
+			continue;
+
+		if (pixman_fixed_to_int(traps[n].top) - extents->y1 >= mono.clip.extents.y2 ||
+		    pixman_fixed_to_int(traps[n].bottom) - extents->y1 < 0)
+			continue;
+
+		mono_add_line(&mono, -extents->x1, -extents->y1,
+			      traps[n].top, traps[n].bottom,
+			      &traps[n].left.p1, &traps[n].left.p2, 1);
+		mono_add_line(&mono, -extents->x1, -extents->y1,
+			      traps[n].top, traps[n].bottom,
+			      &traps[n].right.p1, &traps[n].right.p2, -1);
+	}
+
+	fill.data = (uint32_t *)ptr;
+	fill.stride = stride / sizeof(uint32_t);
+	fill.bpp = 8;
+	fill.color = 0xff;
+
+	mono.op.damage = NULL;
+	mono.op.priv = &fill;
+	mono.op.box = mono_inplace_fill_box;
+	mono.op.boxes = mono_inplace_fill_boxes;
+	mono.span = mono_span__fast;
+
+	if (sigtrap_get() == 0) {
+		mono_render(&mono);
+		sigtrap_put();
+	}
+	mono_fini(&mono);
+
+	return true;
+}
+#endif
+
 bool
 mono_trap_span_converter(struct sna *sna,
 			 PicturePtr dst,
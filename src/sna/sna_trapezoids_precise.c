@@ -248,6 +248,14 @@ struct cell_list {
 	int16_t count, size;
 	struct cell *cells;
 	struct cell embedded[256];
+
+	/* Busy rows are instead accumulated directly into arrays indexed
+	 * by x - x1, and the cells are only used for the left edge.
+	 */
+	bool dense;
+	int16_t dense_enter, dense_leave;
+	int16_t *covered_height;
+	int16_t *uncovered_area;
 };
 
 /* The active list contains edges in the current scan line ordered by
@@ -288,7 +296,16 @@ cell_list_init(struct cell_list *cells, int x1, int x2)
 	cells->size = x2 - x1 + 1;
 	cells->cells = cells->embedded;
 	if (cells->size > ARRAY_SIZE(cells->embedded))
-		cells->cells = malloc(cells->size * sizeof(struct cell));
+		cells->cells = sna_scratch_alloc(cells->size * sizeof(struct cell));
+	cells->dense = false;
+	cells->dense_enter = INT16_MAX;
+	cells->dense_leave = 0;
+	if (!NO_DENSE_ROWS && cells->size > CELL_DENSE_MIN_WIDTH) {
+		cells->dense_enter = cells->size >> CELL_DENSE_SHIFT;
+		cells->dense_leave = cells->size >> (CELL_DENSE_SHIFT + 1);
+	}
+	cells->covered_height = NULL;
+	cells->uncovered_area = NULL;
 	return cells->cells != NULL;
 }
 
@@ -296,15 +313,44 @@ static void
 cell_list_fini(struct cell_list *cells)
 {
 	if (cells->cells != cells->embedded)
-		free(cells->cells);
+		sna_scratch_free(cells->cells);
+	if (cells->covered_height)
+		sna_scratch_free(cells->covered_height);
+}
+
+static bool
+cell_list_alloc_dense(struct cell_list *cells)
+{
+	int width = cells->x2 - cells->x1;
+
+	if (cells->covered_height)
+		return true;
+
+	cells->covered_height = sna_scratch_alloc(2 * width * sizeof(int16_t));
+	if (cells->covered_height == NULL)
+		return false;
+
+	memset(cells->covered_height, 0, 2 * width * sizeof(int16_t));
+	cells->uncovered_area = cells->covered_height + width;
+	return true;
 }
 
+/* Pick the representation of the next row from the density of the
+ * last: switch to the dense row once more than 1 in 1<<CELL_DENSE_SHIFT
+ * pixels carried a cell, and back to the cell list once that halves.
+ */
 inline static void
 cell_list_reset(struct cell_list *cells)
 {
 	cell_list_rewind(cells);
 	cells->head.next = &cells->tail;
 	cells->head.covered_height = 0;
+
+	if (cells->dense)
+		cells->dense = cells->count > cells->dense_leave;
+	else if (cells->count > cells->dense_enter)
+		cells->dense = cell_list_alloc_dense(cells);
+
 	cells->count = 0;
 }
 
@@ -367,6 +413,23 @@ cell_list_find(struct cell_list *cells, int x)
 	return cells->cursor = tail;
 }
 
+inline static void
+cell_list_add_dense(struct cell_list *cells, int x,
+		    int covered_height, int uncovered_area)
+{
+	if (x >= cells->x2)
+		return;
+
+	if (x < cells->x1) {
+		cells->head.covered_height += covered_height;
+		return;
+	}
+
+	x -= cells->x1;
+	cells->covered_height[x] += covered_height;
+	cells->uncovered_area[x] += uncovered_area;
+}
+
 /* Add a subpixel span covering [x1, x2) to the coverage cells. */
 inline static void
 cell_list_add_subspan(struct cell_list *cells, int x1, int x2)
@@ -384,6 +447,15 @@ cell_list_add_subspan(struct cell_list *cells, int x1, int x2)
 	__DBG(("%s: x1=%d (%d+%d), x2=%d (%d+%d)\n", __FUNCTION__,
 	       x1, ix1, fx1, x2, ix2, fx2));
 
+	if (cells->dense) {
+		if (ix1 != ix2) {
+			cell_list_add_dense(cells, ix1, 1, 2*fx1);
+			cell_list_add_dense(cells, ix2, -1, -2*fx2);
+		} else
+			cell_list_add_dense(cells, ix1, 0, 2*(fx1-fx2));
+		return;
+	}
+
 	cell = cell_list_find(cells, ix1);
 	if (ix1 != ix2) {
 		cell->uncovered_area += 2*fx1;
@@ -409,6 +481,18 @@ cell_list_add_span(struct cell_list *cells, int x1, int x2)
 	__DBG(("%s: x1=%d (%d+%d), x2=%d (%d+%d)\n", __FUNCTION__,
 	       x1, ix1, fx1, x2, ix2, fx2));
 
+	if (cells->dense) {
+		if (ix1 != ix2) {
+			cell_list_add_dense(cells, ix1,
+					    SAMPLES_Y, 2*fx1*SAMPLES_Y);
+			cell_list_add_dense(cells, ix2,
+					    -SAMPLES_Y, -2*fx2*SAMPLES_Y);
+		} else
+			cell_list_add_dense(cells, ix1,
+					    0, 2*(fx1-fx2)*SAMPLES_Y);
+		return;
+	}
+
 	cell = cell_list_find(cells, ix1);
 	if (ix1 != ix2) {
 		cell->uncovered_area += 2*fx1*SAMPLES_Y;
@@ -425,10 +509,10 @@ static void
 polygon_fini(struct polygon *polygon)
 {
 	if (polygon->y_buckets != polygon->y_buckets_embedded)
-		free(polygon->y_buckets);
+		sna_scratch_free(polygon->y_buckets);
 
 	if (polygon->edges != polygon->edges_embedded)
-		free(polygon->edges);
+		sna_scratch_free(polygon->edges);
 }
 
 static bool
@@ -444,13 +528,13 @@ polygon_init(struct polygon *polygon, int num_edges, int ymin, int ymax)
 
 	polygon->num_edges = 0;
 	if (num_edges > (int)ARRAY_SIZE(polygon->edges_embedded)) {
-		polygon->edges = malloc(sizeof(struct edge)*num_edges);
+		polygon->edges = sna_scratch_alloc(sizeof(struct edge)*num_edges);
 		if (unlikely(NULL == polygon->edges))
 			goto bail_no_mem;
 	}
 
 	if (num_buckets >= ARRAY_SIZE(polygon->y_buckets_embedded)) {
-		polygon->y_buckets = malloc((1+num_buckets)*sizeof(struct edge *));
+		polygon->y_buckets = sna_scratch_alloc((1+num_buckets)*sizeof(struct edge *));
 		if (unlikely(NULL == polygon->y_buckets))
 			goto bail_no_mem;
 	}
@@ -1103,6 +1187,64 @@ tor_blt_span_clipped(struct sna *sna,
 	pixman_region_fini(&region);
 }
 
+/* Resolve the dense row into the coverage of every pixel and emit a
+ * span for each run of equal coverage.
+ */
+static void
+tor_blt_dense(struct sna *sna,
+	      struct tor *converter,
+	      struct sna_composite_spans_op *op,
+	      pixman_region16_t *clip,
+	      void (*span)(struct sna *sna,
+			   struct sna_composite_spans_op *op,
+			   pixman_region16_t *clip,
+			   const BoxRec *box,
+			   int coverage),
+	      int y, int height,
+	      int unbounded)
+{
+	struct cell_list *cells = converter->coverages;
+	int16_t *coverage = cells->uncovered_area;
+	int width = cells->x2 - cells->x1;
+	int x, count = 0;
+	BoxRec box;
+
+	assert(cells->x1 == converter->extents.x1);
+	assert(cells->x2 == converter->extents.x2);
+	assert(cells->head.covered_height >= 0);
+
+	sna_cell_row_coverage(cells->covered_height, coverage, width,
+			      cells->head.covered_height*SAMPLES_X*2,
+			      SAMPLES_X*2);
+
+	box.y1 = y + converter->extents.y1;
+	box.y2 = box.y1 + height;
+	assert(box.y2 <= converter->extents.y2);
+
+	for (x = 0; x < width; ) {
+		int cover = coverage[x];
+
+		box.x1 = cells->x1 + x;
+		while (++x < width && coverage[x] == cover)
+			;
+		box.x2 = cells->x1 + x;
+
+		assert(cover >= 0);
+		if (unbounded || cover) {
+			__DBG(("%s: span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
+			       box.x1, box.y1,
+			       box.x2 - box.x1,
+			       box.y2 - box.y1,
+			       cover));
+			span(sna, op, clip, &box, cover);
+		}
+		count++;
+	}
+
+	memset(coverage, 0, width * sizeof(int16_t));
+	cells->count = count;
+}
+
 static void
 tor_blt(struct sna *sna,
 	struct tor *converter,
@@ -1121,6 +1263,12 @@ tor_blt(struct sna *sna,
 	BoxRec box;
 	int cover;
 
+	if (cells->dense) {
+		tor_blt_dense(sna, converter, op, clip, span,
+			      y, height, unbounded);
+		return;
+	}
+
 	box.y1 = y + converter->extents.y1;
 	box.y2 = box.y1 + height;
 	assert(box.y2 <= converter->extents.y2);
@@ -2206,6 +2354,57 @@ precise_trapezoid_mask_converter(CARD8 op, PicturePtr src, PicturePtr dst,
 	return true;
 }
 
+#if SNA_BENCHMARK
+bool
+precise_trapezoids_mask(int ntrap, const xTrapezoid *traps,
+			const BoxRec *extents, uint8_t *ptr, int stride)
+{
+	PixmapRec scratch;
+	struct tor tor;
+	BoxRec box;
+	int n;
+
+	box.x1 = box.y1 = 0;
+	box.x2 = extents->x2 - extents->x1;
+	box.y2 = extents->y2 - extents->y1;
+
+	DBG(("%s: ntrap=%d, mask (%dx%d), stride %d\n",
+	     __FUNCTION__, ntrap, box.x2, box.y2, stride));
+
+	if (!tor_init(&tor, &box, 2*ntrap))
+		return false;
+
+	for (n = 0; n < ntrap; n++) {
+		if (pixman_fixed_to_int(traps[n].top) - extents->y1 >= box.y2 ||
+		    pixman_fixed_to_int(traps[n].bottom) - extents->y1 < 0)
+			continue;
+
+		tor_add_trapezoid(&tor, &traps[n],
+				  -extents->x1 * SAMPLES_X,
+				  -extents->y1 * SAMPLES_Y);
+	}
+
+	if (box.x2 <= TOR_INPLACE_SIZE) {
+		memset(&scratch, 0, sizeof(scratch));
+		scratch.drawable.width = box.x2;
+		scratch.drawable.height = box.y2;
+		scratch.drawable.depth = 8;
+		scratch.drawable.bitsPerPixel = 8;
+		scratch.devKind = stride;
+		scratch.devPrivate.ptr = ptr;
+		tor_inplace(&tor, &scratch);
+	} else {
+		tor_render(NULL, &tor,
+			   (void *)ptr, (void *)(intptr_t)stride,
+			   tor_blt_mask,
+			   true);
+	}
+	tor_fini(&tor);
+
+	return true;
+}
+#endif
+
 struct inplace {
 	uint8_t *ptr;
 	uint32_t stride;
@@ -3574,3 +3773,92 @@ skip:
 	tmp.done(sna, &tmp);
 	return true;
 }
+
+#if HAS_DEBUG_FULL && TEST_TRAPEZOIDS
+static void st_random_trapezoid(xTrapezoid *t, int width, int height)
+{
+	int x = rand() % (width + 16) - 8;
+	int w = rand() % (width + 16);
+
+	t->top = pixman_int_to_fixed(rand() % (height + 8) - 4) + rand() % 65536;
+	t->bottom = t->top + pixman_int_to_fixed(rand() % (height + 4)) + rand() % 65536;
+
+	t->left.p1.x = pixman_int_to_fixed(x) + rand() % 65536;
+	t->left.p1.y = t->top - rand() % 65536;
+	t->left.p2.x = pixman_int_to_fixed(x + rand() % 32 - 16) + rand() % 65536;
+	t->left.p2.y = t->bottom + rand() % 65536;
+
+	t->right.p1.x = t->left.p1.x + pixman_int_to_fixed(w) + rand() % 65536;
+	t->right.p1.y = t->left.p1.y;
+	t->right.p2.x = t->left.p2.x + pixman_int_to_fixed(w + rand() % 32 - 16);
+	t->right.p2.y = t->left.p2.y;
+}
+
+/* mode: <0 cells only, 0 adaptive, >0 dense rows only */
+static void st_render_mask(uint8_t *mask, int stride, int width, int height,
+			   const xTrapezoid *traps, int ntrap,
+			   int mode, bool unbounded)
+{
+	struct tor tor;
+	BoxRec extents;
+	int n;
+
+	extents.x1 = extents.y1 = 0;
+	extents.x2 = width;
+	extents.y2 = height;
+
+	if (!tor_init(&tor, &extents, 2*ntrap))
+		FatalError("%s: allocation failed\n", __FUNCTION__);
+
+	for (n = 0; n < ntrap; n++)
+		tor_add_trapezoid(&tor, &traps[n], 0, 0);
+
+	if (mode < 0) {
+		tor.coverages->dense_enter = INT16_MAX;
+	} else if (mode > 0) {
+		tor.coverages->dense_enter = tor.coverages->dense_leave = -1;
+		tor.coverages->dense = cell_list_alloc_dense(tor.coverages);
+	}
+
+	memset(mask, 0, stride * height);
+	tor_render(NULL, &tor, (void *)mask, (void *)(intptr_t)stride,
+		   tor_blt_mask, unbounded);
+	tor_fini(&tor);
+}
+
+void precise_trapezoids_selftest(void)
+{
+	xTrapezoid traps[32];
+	int pass;
+
+	for (pass = 0; pass < 4096; pass++) {
+		int width = 1 + rand() % 600;
+		int height = 1 + rand() % 64;
+		int stride = ALIGN(width, 4);
+		int ntrap = 1 + rand() % ARRAY_SIZE(traps);
+		bool unbounded = pass & 1;
+		uint8_t *ref, *mask;
+		int n, mode;
+
+		for (n = 0; n < ntrap; n++)
+			st_random_trapezoid(&traps[n], width, height);
+
+		ref = malloc(2 * stride * height);
+		if (ref == NULL)
+			continue;
+		mask = ref + stride * height;
+
+		st_render_mask(ref, stride, width, height,
+			       traps, ntrap, -1, unbounded);
+		for (mode = 0; mode <= 1; mode++) {
+			st_render_mask(mask, stride, width, height,
+				       traps, ntrap, mode, unbounded);
+			if (memcmp(ref, mask, stride * height))
+				FatalError("%s: dense rows (mode=%d) differ from cells, %dx%d, %d traps\n",
+					   __FUNCTION__, mode, width, height, ntrap);
+		}
+
+		free(ref);
+	}
+}
+#endif
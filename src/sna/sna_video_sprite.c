@@ -111,6 +111,7 @@ static int sna_video_sprite_stop(ddStopVideo_ARGS)
 
 		memset(&s, 0, sizeof(s));
 		s.plane_id = sna_crtc_to_sprite(crtc, video->idx);
+		kgem_pipeline_sync(&video->sna->kgem);
 		if (drmIoctl(video->sna->kgem.fd, LOCAL_IOCTL_MODE_SETPLANE, &s))
 			xf86DrvMsg(video->sna->scrn->scrnIndex, X_ERROR,
 				   "failed to disable plane\n");
@@ -328,6 +329,7 @@ sna_video_sprite_show(struct sna *sna,
 			s.plane_id = sna_crtc_to_sprite(crtc, video->idx);
 
 			/* try to disable the plane first */
+			kgem_pipeline_sync(&video->sna->kgem);
 			if (drmIoctl(video->sna->kgem.fd, LOCAL_IOCTL_MODE_SETPLANE, &s))
 				xf86DrvMsg(video->sna->scrn->scrnIndex, X_ERROR,
 					   "failed to disable plane\n");
@@ -466,6 +468,7 @@ sna_video_sprite_show(struct sna *sna,
 	     s.crtc_x, s.crtc_y, s.crtc_w, s.crtc_h,
 	     s.src_x >> 16, s.src_y >> 16, s.src_w >> 16, s.src_h >> 16));
 
+	kgem_pipeline_sync(&sna->kgem);
 	if (drmIoctl(sna->kgem.fd, LOCAL_IOCTL_MODE_SETPLANE, &s)) {
 		DBG(("SET_PLANE failed: ret=%d\n", errno));
 		if (video->bo[pipe]) {
@@ -552,6 +555,7 @@ off:
 				struct local_mode_set_plane s;
 				memset(&s, 0, sizeof(s));
 				s.plane_id = sna_crtc_to_sprite(crtc, video->idx);
+				kgem_pipeline_sync(&video->sna->kgem);
 				if (drmIoctl(video->sna->kgem.fd, LOCAL_IOCTL_MODE_SETPLANE, &s))
 					xf86DrvMsg(video->sna->scrn->scrnIndex, X_ERROR,
 						   "failed to disable plane\n");